@@ -0,0 +1,1842 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_client.h>
+/* Benchmarks also time internals of the library */
+#include <fs_internal.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Each measure is repeated for at least this long (in ms) */
+#define BENCH_MIN_MS 200
+
+#define fs_bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+
+struct thread_arg {
+	int argc;
+	char **argv;
+};
+
+static double now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* Throughput in MB/s of bytes processed in ms */
+static double mb_per_s(double bytes, double ms)
+{
+	return bytes / (1024.0 * 1024.0) / (ms / 1000.0);
+}
+
+/* Map a host file in memory */
+static char *map_host_file(const char *filename, size_t *len)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode) || st.st_size == 0)
+		die("Not a non-empty regular file: %s", filename);
+
+	buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+	close(fd);
+
+	*len = st.st_size;
+	return buf;
+}
+
+/* Number of free data blocks on the mounted disk */
+static int free_blocks(void)
+{
+	struct fs_frag_report report;
+
+	if (fs_frag_report(&report))
+		die("Cannot get fragmentation report");
+	return report.num_free_blocks;
+}
+
+/* Time reading a whole file of the mounted disk, in MB/s */
+static double bench_fs_read(const char *filename, size_t len)
+{
+	char *buf = malloc(len);
+	double start, elapsed;
+	size_t total = 0;
+	int fd;
+
+	if (!buf)
+		die_perror("malloc");
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file");
+
+	start = now_ms();
+	do {
+		fs_lseek(fd, 0);
+		if (fs_read(fd, buf, len) != (int)len)
+			die("Cannot read file");
+		total += len;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+
+	fs_close(fd);
+	free(buf);
+	return mb_per_s(total, elapsed);
+}
+
+/*
+ * Compress host files with the codec used for compressed files, a chunk at a
+ * time, and report the ratio and the compression and decompression throughput.
+ * Each file is then stored on the disk plainly and compressed, and the blocks
+ * it takes and the fs_read() throughput are reported for both.
+ */
+void bench_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>...");
+
+	diskname = t_arg->argv[0];
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	for (int i = 1; i < t_arg->argc; i++) {
+		char *filename = t_arg->argv[i];
+		size_t len, num_chunks, stored = 0, total = 0;
+		char *data = map_host_file(filename, &len);
+		char *stream, *plain;
+		size_t *chunk_stored;
+		double start, compress_ms, decompress_ms;
+
+		num_chunks = (len + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+		stream = malloc(num_chunks * COMPRESS_CHUNK);
+		plain = malloc(COMPRESS_CHUNK);
+		chunk_stored = malloc(num_chunks * sizeof(size_t));
+		if (!stream || !plain || !chunk_stored)
+			die_perror("malloc");
+
+		/* Compression (chunks that do not shrink are kept as is) */
+		start = now_ms();
+		do {
+			stored = 0;
+			for (size_t c = 0; c < num_chunks; c++) {
+				size_t chunk_len = len - c * COMPRESS_CHUNK;
+				if (chunk_len > COMPRESS_CHUNK)
+					chunk_len = COMPRESS_CHUNK;
+				chunk_stored[c] = lz_compress(data + c * COMPRESS_CHUNK, chunk_len,
+						stream + c * COMPRESS_CHUNK, chunk_len - 1);
+				stored += chunk_stored[c] ? chunk_stored[c] : chunk_len;
+			}
+			total += len;
+			compress_ms = now_ms() - start;
+		} while (compress_ms < BENCH_MIN_MS);
+		double compress_rate = mb_per_s(total, compress_ms);
+
+		/* Decompression, checking the result once */
+		total = 0;
+		start = now_ms();
+		do {
+			for (size_t c = 0; c < num_chunks; c++) {
+				size_t chunk_len = len - c * COMPRESS_CHUNK;
+				if (chunk_len > COMPRESS_CHUNK)
+					chunk_len = COMPRESS_CHUNK;
+				if (!chunk_stored[c])
+					continue;
+				if (lz_decompress(stream + c * COMPRESS_CHUNK, chunk_stored[c], plain,
+						chunk_len) != (long)chunk_len)
+					die("Decompression failed");
+				if (total == 0 && memcmp(plain, data + c * COMPRESS_CHUNK, chunk_len))
+					die("Decompressed data differs");
+			}
+			total += len;
+			decompress_ms = now_ms() - start;
+		} while (decompress_ms < BENCH_MIN_MS);
+
+		printf("file: %s, size: %zu\n", filename, len);
+		printf("codec: ratio=%.2f compress=%.1fMB/s decompress=%.1fMB/s\n",
+				(double)len / stored, compress_rate, mb_per_s(total, decompress_ms));
+
+		/* Same file on the disk, plain then compressed */
+		const char *fs_filename = "bench-file";
+		int free_before = free_blocks();
+		int fd;
+		if (fs_create(fs_filename))
+			die("Cannot create file");
+		fd = fs_open(fs_filename);
+		if (fd < 0 || fs_write(fd, data, len) != (int)len)
+			die("Cannot write file");
+		fs_close(fd);
+
+		int plain_blocks = free_before - free_blocks();
+		double plain_rate = bench_fs_read(fs_filename, len);
+		if (fs_set_compression(fs_filename, 1))
+			die("Cannot compress file");
+		int compressed_blocks = free_before - free_blocks();
+		double compressed_rate = bench_fs_read(fs_filename, len);
+		fs_delete(fs_filename);
+
+		printf("disk: plain_blk=%d compressed_blk=%d read_plain=%.1fMB/s read_compressed=%.1fMB/s\n",
+				plain_blocks, compressed_blocks, plain_rate, compressed_rate);
+
+		munmap(data, len);
+		free(stream);
+		free(plain);
+		free(chunk_stored);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Time a CRC32C function over a buffer, in MB/s */
+static double bench_crc32c(uint32_t (*func)(uint32_t, const void *, size_t),
+		const char *buf, size_t len)
+{
+	double start, elapsed;
+	size_t total = 0;
+	volatile uint32_t crc = 0;
+
+	start = now_ms();
+	do {
+		/* Block by block, the way blocks are verified */
+		for (size_t off = 0; off < len; off += BLOCK_SIZE)
+			crc = func(crc, buf + off, len - off < BLOCK_SIZE ? len - off : BLOCK_SIZE);
+		total += len;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+
+	return mb_per_s(total, elapsed);
+}
+
+/*
+ * Report the CRC32C throughput of the implementation in use and of the software
+ * fallback, then the fs_read() throughput of a host file stored on the disk
+ * without and with block checksums. Checksums are turned on for good, so the
+ * disk should be a scratch one.
+ */
+void bench_csum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	const char *fs_filename = "bench-file";
+	double plain_rate = 0, csum_rate;
+	size_t len;
+	char *data;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	data = map_host_file(filename, &len);
+
+	printf("file: %s, size: %zu\n", filename, len);
+	printf("crc32c: %s=%.1fMB/s software=%.1fMB/s\n", crc32c_impl_name(),
+			bench_crc32c(crc32c, data, len), bench_crc32c(crc32c_sw, data, len));
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_create(fs_filename))
+		die("Cannot create file");
+	fd = fs_open(fs_filename);
+	if (fd < 0 || fs_write(fd, data, len) != (int)len)
+		die("Cannot write file");
+	fs_close(fd);
+
+	if (!(superblk.features & FS_FEATURE_CSUM)) {
+		plain_rate = bench_fs_read(fs_filename, len);
+		if (fs_enable(FS_FEATURE_CSUM))
+			die("Cannot enable checksums");
+	}
+	csum_rate = bench_fs_read(fs_filename, len);
+	fs_delete(fs_filename);
+
+	if (plain_rate > 0)
+		printf("disk: read_plain=%.1fMB/s read_csum=%.1fMB/s overhead=%.1f%%\n",
+				plain_rate, csum_rate, (plain_rate / csum_rate - 1) * 100);
+	else
+		printf("disk: read_csum=%.1fMB/s (checksums were already on)\n", csum_rate);
+
+	munmap(data, len);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Time writing copies of a buffer to new files of the mounted disk, in MB/s */
+static double bench_write_copies(const char *data, size_t len, int copies)
+{
+	char fs_filename[FS_FILENAME_LEN];
+	double start, elapsed;
+	int fd;
+
+	start = now_ms();
+	for (int i = 0; i < copies; i++) {
+		snprintf(fs_filename, sizeof(fs_filename), "bench-%u", (unsigned char)i);
+		if (fs_create(fs_filename))
+			die("Cannot create file");
+		fd = fs_open(fs_filename);
+		if (fd < 0 || fs_write(fd, (void *)data, len) != (int)len)
+			die("Cannot write file");
+		/* Files are deduplicated when closed */
+		fs_close(fd);
+	}
+	elapsed = now_ms() - start;
+
+	return mb_per_s((double)len * copies, elapsed);
+}
+
+/* Delete the copies written by bench_write_copies() */
+static void delete_copies(int copies)
+{
+	char fs_filename[FS_FILENAME_LEN];
+
+	for (int i = 0; i < copies; i++) {
+		snprintf(fs_filename, sizeof(fs_filename), "bench-%u", (unsigned char)i);
+		fs_delete(fs_filename);
+	}
+}
+
+/*
+ * Write copies of a host file to the disk without and with deduplication, and
+ * report the blocks they take, the dedup ratio and the write throughput (which
+ * includes closing the files). Deduplication is turned on for good, so the disk
+ * should be a scratch one.
+ */
+void bench_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int copies = 8, free_before, plain_blocks = 0, dedup_blocks;
+	double plain_rate = 0, dedup_rate;
+	size_t len;
+	char *data;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [<copies>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		copies = atoi(t_arg->argv[2]);
+	if (copies < 1 || copies > FS_FILE_MAX_COUNT)
+		die("Invalid number of copies");
+	data = map_host_file(filename, &len);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	free_before = free_blocks();
+	if (!(superblk.features & FS_FEATURE_DEDUP)) {
+		plain_rate = bench_write_copies(data, len, copies);
+		plain_blocks = free_before - free_blocks();
+		delete_copies(copies);
+		if (fs_enable(FS_FEATURE_DEDUP))
+			die("Cannot enable deduplication");
+		free_before = free_blocks();
+	}
+	dedup_rate = bench_write_copies(data, len, copies);
+	dedup_blocks = free_before - free_blocks();
+	delete_copies(copies);
+
+	printf("file: %s, size: %zu, copies: %d\n", filename, len, copies);
+	if (plain_rate > 0)
+		printf("disk: plain_blk=%d dedup_blk=%d ratio=%.2f write_plain=%.1fMB/s write_dedup=%.1fMB/s overhead=%.1f%%\n",
+				plain_blocks, dedup_blocks, (double)plain_blocks / dedup_blocks,
+				plain_rate, dedup_rate, (plain_rate / dedup_rate - 1) * 100);
+	else
+		printf("disk: dedup_blk=%d write_dedup=%.1fMB/s (deduplication was already on)\n",
+				dedup_blocks, dedup_rate);
+
+	munmap(data, len);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/*
+ * Export a host file stored on the disk to a temporary host file, through
+ * fs_read() and write() then with fs_sendfile(), and compare with reading the
+ * disk file sequentially.
+ */
+void bench_sendfile(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	const char *fs_filename = "bench-file";
+	double start, elapsed, raw_rate, copy_rate, sendfile_rate;
+	size_t len, total;
+	char *data, *buf;
+	int fd, out_fd;
+	FILE *out;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	data = map_host_file(filename, &len);
+	buf = malloc(len + BLOCK_SIZE);
+	out = tmpfile();
+	if (!buf || !out)
+		die_perror("malloc");
+	out_fd = fileno(out);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_create(fs_filename))
+		die("Cannot create file");
+	fd = fs_open(fs_filename);
+	if (fd < 0 || fs_write(fd, data, len) != (int)len)
+		die("Cannot write file");
+
+	/* The same number of blocks read straight from the disk file */
+	size_t num_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (num_blocks > (size_t)superblk.num_data_blocks)
+		num_blocks = superblk.num_data_blocks;
+	total = 0;
+	start = now_ms();
+	do {
+		if (block_read_many(superblk.data_block_start_index, num_blocks, buf))
+			die("Cannot read disk");
+		total += num_blocks * BLOCK_SIZE;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	raw_rate = mb_per_s(total, elapsed);
+
+	/* Through user memory */
+	total = 0;
+	start = now_ms();
+	do {
+		if (ftruncate(out_fd, 0) || lseek(out_fd, 0, SEEK_SET) < 0)
+			die_perror("ftruncate");
+		fs_lseek(fd, 0);
+		if (fs_read(fd, buf, len) != (int)len || write(out_fd, buf, len) != (ssize_t)len)
+			die("Cannot copy file");
+		total += len;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	copy_rate = mb_per_s(total, elapsed);
+
+	/* Kernel to kernel */
+	total = 0;
+	start = now_ms();
+	do {
+		if (ftruncate(out_fd, 0) || lseek(out_fd, 0, SEEK_SET) < 0)
+			die_perror("ftruncate");
+		if (fs_sendfile(fd, out_fd, 0, len) != (int)len)
+			die("Cannot send file");
+		total += len;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	sendfile_rate = mb_per_s(total, elapsed);
+
+	if (pread(out_fd, buf, len, 0) != (ssize_t)len || memcmp(buf, data, len))
+		die("Exported data differs");
+
+	fs_close(fd);
+	fs_delete(fs_filename);
+
+	printf("file: %s, size: %zu\n", filename, len);
+	printf("export: disk_read=%.1fMB/s read_write=%.1fMB/s sendfile=%.1fMB/s\n",
+			raw_rate, copy_rate, sendfile_rate);
+
+	fclose(out);
+	free(buf);
+	munmap(data, len);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Time mounting, importing one host file with fs_write() and unmounting, for each file, in MB/s */
+static double bench_add_each(const char *diskname, char **paths, int copies, size_t len)
+{
+	double start, elapsed;
+	size_t map_len;
+	char *data;
+	int fd;
+
+	start = now_ms();
+	for (int i = 0; i < copies; i++) {
+		data = map_host_file(paths[i], &map_len);
+		if (fs_mount(diskname))
+			die("Cannot mount diskname");
+		if (fs_create(strrchr(paths[i], '/') + 1))
+			die("Cannot create file");
+		fd = fs_open(strrchr(paths[i], '/') + 1);
+		if (fd < 0 || fs_write(fd, data, map_len) != (int)map_len)
+			die("Cannot write file");
+		fs_close(fd);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		munmap(data, map_len);
+	}
+	elapsed = now_ms() - start;
+
+	return mb_per_s((double)len * copies, elapsed);
+}
+
+/*
+ * Import copies of a host file to the disk one mount per file, the way
+ * `test_fs.x add` does, then all at once with fs_import(), and compare with
+ * writing the same number of blocks straight to the disk file. The free data
+ * blocks of the disk are overwritten.
+ */
+void bench_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	char dirname[] = "/tmp/fs_bench-XXXXXX";
+	char *paths[FS_FILE_MAX_COUNT];
+	int copies = 16, num_blocks, out_fd;
+	double start, elapsed, add_rate, import_rate, raw_rate;
+	size_t len;
+	char *data, *buf;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [<copies>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		copies = atoi(t_arg->argv[2]);
+	if (copies < 1 || copies > FS_FILE_MAX_COUNT)
+		die("Invalid number of copies");
+	data = map_host_file(filename, &len);
+
+	/* Host files to import, each with a name of its own */
+	if (!mkdtemp(dirname))
+		die_perror("mkdtemp");
+	for (int i = 0; i < copies; i++) {
+		paths[i] = malloc(sizeof(dirname) + FS_FILENAME_LEN);
+		if (!paths[i])
+			die_perror("malloc");
+		snprintf(paths[i], sizeof(dirname) + FS_FILENAME_LEN, "%s/bench-%u", dirname, (unsigned char)i);
+		out_fd = open(paths[i], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (out_fd < 0 || write(out_fd, data, len) != (ssize_t)len)
+			die_perror("write");
+		close(out_fd);
+	}
+
+	add_rate = bench_add_each(diskname, paths, copies, len);
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	delete_copies(copies);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	start = now_ms();
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_import((const char **)paths, copies) != copies)
+		die("Cannot import files");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	import_rate = mb_per_s((double)len * copies, now_ms() - start);
+
+	/* The blocks the files took, written sequentially and flushed */
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	delete_copies(copies);
+	num_blocks = (len + BLOCK_SIZE - 1) / BLOCK_SIZE * copies;
+	buf = calloc(num_blocks, BLOCK_SIZE);
+	if (!buf)
+		die_perror("calloc");
+	start = now_ms();
+	if (block_write_many(superblk.data_block_start_index + 1, num_blocks, buf) || block_disk_sync())
+		die("Cannot write disk");
+	elapsed = now_ms() - start;
+	raw_rate = mb_per_s((double)num_blocks * BLOCK_SIZE, elapsed);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("file: %s, size: %zu, copies: %d\n", filename, len, copies);
+	printf("import: add_each=%.1fMB/s import=%.1fMB/s disk_write=%.1fMB/s\n",
+			add_rate, import_rate, raw_rate);
+
+	for (int i = 0; i < copies; i++) {
+		unlink(paths[i]);
+		free(paths[i]);
+	}
+	rmdir(dirname);
+	free(buf);
+	munmap(data, len);
+}
+
+/*
+ * List the sizes of files of the disk by opening, stating and closing each of
+ * them, with fs_readdir() and with fs_stat_many(). Files are added to the disk
+ * so that it holds the given number of them, and removed afterwards.
+ */
+void bench_stat(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct fs_dirent entries[FS_FILE_MAX_COUNT], entry;
+	int files = FS_FILE_MAX_COUNT, num_files, added = 0, cursor, fd;
+	double start, elapsed, open_rate, readdir_rate, many_rate;
+	size_t total, listings;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<files>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		files = atoi(t_arg->argv[1]);
+	if (files < 1 || files > FS_FILE_MAX_COUNT)
+		die("Invalid number of files");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	num_files = fs_stat_many(entries, FS_FILE_MAX_COUNT);
+	while (num_files + added < files) {
+		char fs_filename[FS_FILENAME_LEN];
+		snprintf(fs_filename, sizeof(fs_filename), "bench-%u", (unsigned char)added);
+		if (fs_create(fs_filename))
+			die("Cannot create file");
+		added++;
+	}
+	num_files += added;
+
+	/* One descriptor per file */
+	listings = 0;
+	start = now_ms();
+	do {
+		total = 0;
+		num_files = fs_stat_many(entries, FS_FILE_MAX_COUNT);
+		for (int i = 0; i < num_files; i++) {
+			fd = fs_open(entries[i].filename);
+			total += fs_stat(fd);
+			fs_close(fd);
+		}
+		listings++;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	open_rate = listings / (elapsed / 1000.0);
+
+	/* Iterator */
+	listings = 0;
+	start = now_ms();
+	do {
+		total = 0;
+		cursor = 0;
+		while (fs_readdir(&cursor, &entry) == 1)
+			total += entry.size;
+		listings++;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	readdir_rate = listings / (elapsed / 1000.0);
+
+	/* Single pass */
+	listings = 0;
+	start = now_ms();
+	do {
+		total = 0;
+		num_files = fs_stat_many(entries, FS_FILE_MAX_COUNT);
+		for (int i = 0; i < num_files; i++)
+			total += entries[i].size;
+		listings++;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	many_rate = listings / (elapsed / 1000.0);
+
+	delete_copies(added);
+
+	printf("files: %d, bytes: %zu\n", num_files, total);
+	printf("listings: open_stat_close=%.0f/s readdir=%.0f/s stat_many=%.0f/s\n",
+			open_rate, readdir_rate, many_rate);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Drop the pages of a host file from the page cache */
+static void drop_host_cache(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		die_perror("open");
+	if (fdatasync(fd) || posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED))
+		die_perror("posix_fadvise");
+	close(fd);
+}
+
+/* Percentage of the pages of a host file held by the page cache */
+static double host_cached_percent(const char *filename)
+{
+	size_t len, num_pages, cached = 0;
+	long page_size = sysconf(_SC_PAGESIZE);
+	unsigned char *vec;
+	char *map;
+
+	map = map_host_file(filename, &len);
+	num_pages = (len + page_size - 1) / page_size;
+	vec = malloc(num_pages);
+	if (!vec)
+		die_perror("malloc");
+	if (mincore(map, len, vec))
+		die_perror("mincore");
+	for (size_t i = 0; i < num_pages; i++)
+		cached += vec[i] & 1;
+	free(vec);
+	munmap(map, len);
+	return 100.0 * cached / num_pages;
+}
+
+/*
+ * Write a file over and over and read it back, on a disk mounted normally and
+ * then with direct I/O, from buffers given by fs_buffer_alloc(). The page cache
+ * is emptied of the disk file before each mount, and the share of the disk file
+ * it holds afterwards is reported along with throughput.
+ */
+void bench_direct(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const unsigned int modes[] = { 0, FS_MOUNT_DIRECT };
+	char *diskname, *filename, *data, *buf, *host_data;
+	const char *fs_filename = "bench-direct";
+	double start, elapsed, write_rate, read_rate;
+	size_t len, total;
+	int fd;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	host_data = map_host_file(filename, &len);
+	data = fs_buffer_alloc(len);
+	buf = fs_buffer_alloc(len);
+	if (!data || !buf)
+		die_perror("fs_buffer_alloc");
+	memcpy(data, host_data, len);
+	munmap(host_data, len);
+
+	printf("file: %s, size: %zu\n", filename, len);
+	for (size_t i = 0; i < ARRAY_SIZE(modes); i++) {
+		drop_host_cache(diskname);
+		if (fs_mount_flags(diskname, modes[i]))
+			die("Cannot mount diskname");
+		if (fs_create(fs_filename))
+			die("Cannot create file");
+		fd = fs_open(fs_filename);
+
+		total = 0;
+		start = now_ms();
+		do {
+			fs_lseek(fd, 0);
+			if (fs_write(fd, data, len) != (int)len)
+				die("Cannot write file");
+			total += len;
+			elapsed = now_ms() - start;
+		} while (elapsed < BENCH_MIN_MS);
+		write_rate = mb_per_s(total, elapsed);
+
+		total = 0;
+		start = now_ms();
+		do {
+			fs_lseek(fd, 0);
+			if (fs_read(fd, buf, len) != (int)len)
+				die("Cannot read file");
+			total += len;
+			elapsed = now_ms() - start;
+		} while (elapsed < BENCH_MIN_MS);
+		read_rate = mb_per_s(total, elapsed);
+
+		if (memcmp(buf, data, len))
+			die("Read data differs");
+		fs_close(fd);
+		fs_delete(fs_filename);
+		if (fs_umount())
+			die("Cannot unmount diskname");
+
+		printf("%s: write=%.1fMB/s read=%.1fMB/s disk_cached=%.0f%%\n",
+				modes[i] ? "direct" : "buffered", write_rate, read_rate,
+				host_cached_percent(diskname));
+	}
+
+	free(data);
+	free(buf);
+}
+
+/* Time (in ns) of a one-block fs_read() of the file open as fd */
+static double bench_small_reads(int fd, char *buf)
+{
+	double start, elapsed;
+	size_t reads = 0;
+
+	start = now_ms();
+	do {
+		for (int i = 0; i < 1000; i++) {
+			fs_lseek(fd, 0);
+			if (fs_read(fd, buf, BLOCK_SIZE) != BLOCK_SIZE)
+				die("Cannot read file");
+		}
+		reads += 1000;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	return elapsed * 1000000.0 / reads;
+}
+
+/*
+ * Cost of tracepoints on one-block fs_read() calls, each after an fs_lseek()
+ * (8 events per read when on: both calls, the chain walk and the block read),
+ * with tracepoints off and on, and time to dump the events to a file.
+ */
+void bench_tracepoints(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, buf[BLOCK_SIZE];
+	const char *filename = "bench-tp";
+	double off_ns, on_ns, start, dump_ms;
+	int fd, num_events;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(filename))
+		die("Cannot create file");
+	fd = fs_open(filename);
+	memset(buf, 'a', sizeof(buf));
+	if (fs_write(fd, buf, sizeof(buf)) != sizeof(buf))
+		die("Cannot write file");
+
+	if (fs_tracepoints_enable(0))
+		die("Library built without tracepoints");
+	off_ns = bench_small_reads(fd, buf);
+	fs_tracepoints_enable(1);
+	on_ns = bench_small_reads(fd, buf);
+	fs_tracepoints_enable(0);
+
+	start = now_ms();
+	num_events = fs_tracepoints_dump("/dev/null");
+	dump_ms = now_ms() - start;
+
+	fs_close(fd);
+	fs_delete(filename);
+
+	printf("fs_read: off=%.0fns on=%.0fns (+%.0fns per call)\n",
+			off_ns, on_ns, on_ns - off_ns);
+	printf("dump: %d events in %.1fms\n", num_events, dump_ms);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Time (in ns) of an fs_open() and fs_close() pair, and of an fs_delete() refused because the file is open */
+static void bench_fd_ops(const char *filename, double *open_close_ns, double *delete_ns)
+{
+	double start, elapsed;
+	size_t ops = 0;
+
+	start = now_ms();
+	do {
+		for (int i = 0; i < 1000; i++)
+			fs_close(fs_open(filename));
+		ops += 1000;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	*open_close_ns = elapsed * 1000000.0 / ops;
+
+	ops = 0;
+	start = now_ms();
+	do {
+		for (int i = 0; i < 1000; i++)
+			if (!fs_delete(filename))
+				die("Deleted an open file");
+		ops += 1000;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	*delete_ns = elapsed * 1000000.0 / ops;
+}
+
+/*
+ * Cost of fs_open() with fs_close(), and of fs_delete() on an open file, with
+ * a few file descriptors open and with many (10000 by default).
+ */
+void bench_fds(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const char *filename = "bench-fds";
+	double few_open_ns, few_delete_ns, many_open_ns, many_delete_ns;
+	int num_fds = 10000, *fds;
+	char *diskname;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<descriptors>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		num_fds = atoi(t_arg->argv[1]);
+	if (num_fds < 32 || num_fds > FS_OPEN_MAX_COUNT - 1)
+		die("Invalid number of descriptors");
+	fds = malloc(num_fds * sizeof(int));
+	if (!fds)
+		die_perror("malloc");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(filename))
+		die("Cannot create file");
+
+	for (int i = 0; i < num_fds; i++) {
+		fds[i] = fs_open(filename);
+		if (fds[i] < 0)
+			die("Cannot open file");
+		if (i == 31)
+			bench_fd_ops(filename, &few_open_ns, &few_delete_ns);
+	}
+	bench_fd_ops(filename, &many_open_ns, &many_delete_ns);
+
+	for (int i = 0; i < num_fds; i++)
+		fs_close(fds[i]);
+	if (fs_delete(filename))
+		die("Cannot delete file");
+
+	printf("open_close: fds=32 %.0fns fds=%d %.0fns\n", few_open_ns, num_fds, many_open_ns);
+	printf("delete_open_file: fds=32 %.0fns fds=%d %.0fns\n", few_delete_ns, num_fds, many_delete_ns);
+
+	free(fds);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/*
+ * Read a file a block at a time through several descriptors taking turns, the
+ * way workers sharing a hot file read it, against a single descriptor reading
+ * it whole.
+ */
+void bench_shared(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	const char *fs_filename = "bench-shared";
+	int num_fds = 8, *fds;
+	char *diskname, *filename, *data, buf[BLOCK_SIZE];
+	double start, elapsed, whole_rate, shared_rate;
+	size_t len, total;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [<descriptors>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		num_fds = atoi(t_arg->argv[2]);
+	if (num_fds < 1)
+		die("Invalid number of descriptors");
+	fds = malloc(num_fds * sizeof(int));
+	if (!fds)
+		die_perror("malloc");
+	data = map_host_file(filename, &len);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(fs_filename))
+		die("Cannot create file");
+	fds[0] = fs_open(fs_filename);
+	if (fds[0] < 0 || fs_write(fds[0], data, len) != (int)len)
+		die("Cannot write file");
+	fs_close(fds[0]);
+
+	whole_rate = bench_fs_read(fs_filename, len);
+
+	for (int i = 0; i < num_fds; i++)
+		fds[i] = fs_open(fs_filename);
+	total = 0;
+	start = now_ms();
+	do {
+		for (int i = 0; i < num_fds; i++)
+			fs_lseek(fds[i], 0);
+		for (size_t offset = 0; offset < len; offset += BLOCK_SIZE) {
+			for (int i = 0; i < num_fds; i++) {
+				int count = fs_read(fds[i], buf, BLOCK_SIZE);
+				if (count < 0 || memcmp(buf, data + offset, count))
+					die("Read data differs");
+				total += count;
+			}
+		}
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	shared_rate = mb_per_s(total, elapsed);
+	for (int i = 0; i < num_fds; i++)
+		fs_close(fds[i]);
+	fs_delete(fs_filename);
+
+	printf("file: %s, size: %zu, descriptors: %d\n", filename, len, num_fds);
+	printf("read: whole=%.1fMB/s block_by_block_shared=%.1fMB/s\n", whole_rate, shared_rate);
+
+	free(fds);
+	munmap(data, len);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Run a program with its output discarded, returns its exit status */
+static int run_quiet(char *const argv[], int wait)
+{
+	pid_t pid = fork();
+	int status;
+
+	if (pid < 0)
+		die_perror("fork");
+	if (pid == 0) {
+		int null_fd = open("/dev/null", O_WRONLY);
+		dup2(null_fd, STDOUT_FILENO);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	if (!wait)
+		return 0;
+	if (waitpid(pid, &status, 0) < 0)
+		die_perror("waitpid");
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/* Average time in us of running a command line to completion */
+static double bench_command(char *const argv[])
+{
+	double start, elapsed;
+	int runs = 0;
+
+	start = now_ms();
+	do {
+		if (run_quiet(argv, 1))
+			die("%s failed", argv[0]);
+		runs++;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	return elapsed * 1000.0 / runs;
+}
+
+/*
+ * Latency of stat-ing a file with the one-shot test_fs.x, which mounts the
+ * disk for every command, against fs_server.x serving a warm mount: through
+ * fs_client.x, through the client library waiting for every response, and
+ * through the client library pipelining requests.
+ */
+void bench_server(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static char socket_path[] = "fs_bench.sock";
+	char *diskname, *filename, *data;
+	double start, elapsed, oneshot_us, cli_us, sync_us, pipelined_us;
+	struct fs_client *client = NULL;
+	size_t len, ops;
+	int fd, batch = 64;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host filename> [<pipeline depth>]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2)
+		batch = atoi(t_arg->argv[2]);
+	if (batch < 1)
+		die("Invalid pipeline depth");
+	data = map_host_file(filename, &len);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(filename))
+		die("Cannot create file");
+	fd = fs_open(filename);
+	if (fd < 0 || fs_write(fd, data, len) != (int)len)
+		die("Cannot write file");
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	char *oneshot_argv[] = { "./test_fs.x", "stat", diskname, filename, NULL };
+	oneshot_us = bench_command(oneshot_argv);
+
+	char *server_argv[] = { "./fs_server.x", diskname, socket_path, NULL };
+	unlink(socket_path);
+	run_quiet(server_argv, 0);
+	for (int i = 0; i < 100 && !client; i++) {
+		if (access(socket_path, F_OK) == 0)
+			client = fs_client_connect(socket_path);
+		if (!client)
+			usleep(10000);
+	}
+	if (!client)
+		die("Cannot connect to server");
+
+	char *cli_argv[] = { "./fs_client.x", socket_path, "stat", filename, NULL };
+	cli_us = bench_command(cli_argv);
+
+	/* open, stat and close, as the commands do */
+	ops = 0;
+	start = now_ms();
+	do {
+		for (int i = 0; i < 100; i++) {
+			fd = fs_client_open(client, filename);
+			if (fs_client_stat(client, fd) != (int)len)
+				die("Wrong file size");
+			fs_client_close(client, fd);
+		}
+		ops += 100;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	sync_us = elapsed * 1000.0 / ops;
+
+	ops = 0;
+	fd = fs_client_open(client, filename);
+	start = now_ms();
+	do {
+		for (int i = 0; i < batch; i++)
+			if (fs_client_submit(client, FS_OP_STAT, fd, 0, NULL, 0))
+				die("Cannot submit request");
+		for (int i = 0; i < batch; i++)
+			if (fs_client_receive(client, NULL, 0) != (int)len)
+				die("Wrong file size");
+		ops += batch;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	pipelined_us = elapsed * 1000.0 / ops;
+	fs_client_close(client, fd);
+
+	if (fs_client_delete(client, filename) || fs_client_shutdown(client))
+		die("Cannot shut down server");
+	fs_client_disconnect(client);
+	while (wait(NULL) > 0)
+		;
+
+	printf("file: %s, size: %zu\n", filename, len);
+	printf("stat: test_fs=%.1fus fs_client=%.1fus\n", oneshot_us, cli_us);
+	printf("warm: open_stat_close=%.2fus stat_pipelined=%.2fus (depth %d)\n",
+	       sync_us, pipelined_us, batch);
+
+	munmap(data, len);
+}
+
+/* Average time in us of 1 MiB fs_read() calls spread over a file open as fd */
+static double bench_large_reads(int fd, char *buf, const char *data, size_t len)
+{
+	const size_t read_len = 1024 * 1024;
+	double start, elapsed;
+	size_t reads = 0;
+
+	/* Every mode must read back the same data */
+	fs_lseek(fd, 0);
+	if (fs_read(fd, buf, read_len) != (int)read_len || memcmp(buf, data, read_len))
+		die("Read data differs");
+
+	start = now_ms();
+	do {
+		fs_lseek(fd, reads % (len / read_len) * read_len);
+		if (fs_read(fd, buf, read_len) != (int)read_len)
+			die("Cannot read file");
+		reads++;
+		elapsed = now_ms() - start;
+	} while (elapsed < BENCH_MIN_MS);
+	return elapsed * 1000.0 / reads;
+}
+
+/*
+ * Latency of 1 MiB reads, with blocks read one at a time, with the blocks of
+ * the read fetched in runs by the calling thread, and fetched in parallel, on
+ * a file laid out in one run and on a file interleaved block by block with
+ * another, with and without direct I/O.
+ */
+void bench_fetch(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const unsigned int mounts[] = { 0, FS_MOUNT_DIRECT };
+	static const char *files[] = { "bench-contig", "bench-frag" };
+	static const int modes[] = { 0, 1, -1 };
+	double us[ARRAY_SIZE(modes)];
+	char *diskname, *data, *buf;
+	size_t len = 8;
+	int fd, pad_fd, max_blocks;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<MiB>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		len = atoi(t_arg->argv[1]);
+	if (len < 1)
+		die("Invalid file size");
+	len *= 1024 * 1024;
+	data = fs_buffer_alloc(len);
+	buf = fs_buffer_alloc(len);
+	if (!data || !buf)
+		die_perror("fs_buffer_alloc");
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		data[i] = rand();
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_create(files[0]) || fs_create(files[1]) || fs_create("bench-pad"))
+		die("Cannot create file");
+	fd = fs_open(files[0]);
+	if (fs_write(fd, data, len) != (int)len)
+		die("Cannot write file");
+	fs_close(fd);
+	/* Blocks are given right away, for the two files to interleave */
+	max_blocks = delalloc_max_blocks;
+	delalloc_max_blocks = 0;
+	fd = fs_open(files[1]);
+	pad_fd = fs_open("bench-pad");
+	for (size_t offset = 0; offset < len; offset += BLOCK_SIZE) {
+		if (fs_write(fd, data + offset, BLOCK_SIZE) != BLOCK_SIZE
+		    || fs_write(pad_fd, data, BLOCK_SIZE) != BLOCK_SIZE)
+			die("Cannot write file");
+	}
+	fs_close(fd);
+	fs_close(pad_fd);
+	delalloc_max_blocks = max_blocks;
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("file size: %zuMiB, read size: 1MiB\n", len / (1024 * 1024));
+	for (size_t i = 0; i < ARRAY_SIZE(mounts); i++) {
+		drop_host_cache(diskname);
+		if (fs_mount_flags(diskname, mounts[i]))
+			die("Cannot mount diskname");
+		for (size_t j = 0; j < ARRAY_SIZE(files); j++) {
+			fd = fs_open(files[j]);
+			for (size_t k = 0; k < ARRAY_SIZE(modes); k++) {
+				fetch_threads = modes[k];
+				us[k] = bench_large_reads(fd, buf, data, len);
+			}
+			fs_close(fd);
+			printf("%s %s: block_at_a_time=%.0fus runs=%.0fus parallel=%.0fus\n",
+			       mounts[i] ? "direct" : "buffered", files[j] + strlen("bench-"),
+			       us[0], us[1], us[2]);
+		}
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(files[0]);
+	fs_delete(files[1]);
+	fs_delete("bench-pad");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	free(data);
+	free(buf);
+}
+
+/* Append len bytes to each of the files in turns, writes of write_len bytes */
+static void append_in_turns(int *fds, int num_files, const char *data, size_t len, size_t write_len)
+{
+	for (size_t offset = 0; offset < len; offset += write_len) {
+		size_t count = (len - offset < write_len) ? len - offset : write_len;
+		for (int i = 0; i < num_files; i++)
+			if (fs_write(fds[i], (char *)data + offset, count) != (int)count)
+				die("Cannot write file");
+	}
+}
+
+/*
+ * Files appended to in turns by small writes, the way several logs are, with
+ * blocks allocated by every write and with delayed allocation: layout of the
+ * files, time to write them (until closed) and to read them back.
+ */
+void bench_delalloc(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const char *modes[] = { "immediate", "delayed" };
+	int max_blocks = delalloc_max_blocks;
+	int num_files = 4, fds[FS_FILE_MAX_COUNT];
+	char *diskname, *data, filename[FS_FILENAME_LEN];
+	size_t len = 1024 * 1024, write_len = 1024;
+	struct fs_frag_report report;
+	double start, elapsed, write_rate, read_rate;
+	int rounds;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<files>] [<KiB per file>] [<bytes per write>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		num_files = atoi(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		len = atoi(t_arg->argv[2]) * 1024;
+	if (t_arg->argc > 3)
+		write_len = atoi(t_arg->argv[3]);
+	if (num_files < 1 || num_files > FS_FILE_MAX_COUNT || len < 1 || write_len < 1)
+		die("Invalid arguments");
+	data = malloc(len);
+	if (!data)
+		die_perror("malloc");
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		data[i] = rand();
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	printf("files: %d, size: %zu, write size: %zu\n", num_files, len, write_len);
+	for (size_t k = 0; k < ARRAY_SIZE(modes); k++) {
+		delalloc_max_blocks = k ? max_blocks : 0;
+		rounds = 0;
+		start = now_ms();
+		do {
+			if (rounds > 0)
+				for (int i = 0; i < num_files; i++) {
+					snprintf(filename, sizeof(filename), "bench-log%d", i);
+					fs_delete(filename);
+				}
+			for (int i = 0; i < num_files; i++) {
+				snprintf(filename, sizeof(filename), "bench-log%d", i);
+				if (fs_create(filename))
+					die("Cannot create file");
+				fds[i] = fs_open(filename);
+			}
+			append_in_turns(fds, num_files, data, len, write_len);
+			for (int i = 0; i < num_files; i++)
+				fs_close(fds[i]);
+			rounds++;
+			elapsed = now_ms() - start;
+		} while (elapsed < BENCH_MIN_MS);
+		write_rate = mb_per_s((double)rounds * num_files * len, elapsed);
+
+		if (fs_frag_report(&report))
+			die("Cannot get fragmentation report");
+		read_rate = bench_fs_read("bench-log0", len);
+		for (int i = 0; i < num_files; i++) {
+			snprintf(filename, sizeof(filename), "bench-log%d", i);
+			fs_delete(filename);
+		}
+		printf("%s: fragmented=%d extents=%d write=%.1fMB/s read=%.1fMB/s\n",
+		       modes[k], report.num_fragmented_files, report.num_file_extents,
+		       write_rate, read_rate);
+	}
+	delalloc_max_blocks = max_blocks;
+
+	free(data);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Anonymous memory of the process, pages shared with others counted in
+   proportion, in KiB */
+static long pss_anon_kb(void)
+{
+	char line[256];
+	long kb = -1;
+	FILE *f = fopen("/proc/self/smaps_rollup", "r");
+
+	if (!f)
+		die_perror("fopen");
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Pss_Anon: %ld kB", &kb) == 1)
+			break;
+	fclose(f);
+	return kb;
+}
+
+/*
+ * Mount a disk holding a file many times over, read-write then read-only, and
+ * report the time of a mount followed by an unmount. Reader processes then
+ * mount the disk together, read the file whole and report the anonymous
+ * memory their mount and read took: a read-write mount loads its own copy of the
+ * FAT and other tables, a read-only mount uses them in place in the shared
+ * mapping of the disk file.
+ */
+void bench_rdonly(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const char *modes[] = { "read-write", "read-only" };
+	static const unsigned int flags[] = { 0, FS_MOUNT_RDONLY };
+	const char *filename = "bench-rdonly";
+	int num_readers = 8, fd, rounds, ready[2], go[2];
+	size_t len = 1024 * 1024;
+	double start, elapsed, mount_us;
+	char *diskname, *buf, c;
+	long anon_kb;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<readers>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		num_readers = atoi(t_arg->argv[1]);
+	if (num_readers < 1)
+		die("Invalid arguments");
+	buf = malloc(len);
+	if (!buf)
+		die_perror("malloc");
+	memset(buf, 'r', len);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(filename);
+	if (fs_create(filename))
+		die("Cannot create file");
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file");
+	len = fs_write(fd, buf, len);
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	printf("file: %s, size: %zu, readers: %d\n", filename, len, num_readers);
+
+	for (size_t k = 0; k < ARRAY_SIZE(modes); k++) {
+		rounds = 0;
+		start = now_ms();
+		do {
+			if (fs_mount_flags(diskname, flags[k]))
+				die("Cannot mount diskname");
+			if (fs_umount())
+				die("Cannot unmount diskname");
+			rounds++;
+			elapsed = now_ms() - start;
+		} while (elapsed < BENCH_MIN_MS);
+		mount_us = elapsed * 1000.0 / rounds;
+
+		/* Readers hold their mount until all of them have reported */
+		if (pipe(ready) || pipe(go))
+			die_perror("pipe");
+		for (int i = 0; i < num_readers; i++) {
+			pid_t pid = fork();
+			if (pid < 0)
+				die_perror("fork");
+			if (pid > 0)
+				continue;
+			close(go[1]);
+			/* Neither the buffer read into nor the stacks of fetch threads
+			   are part of the cost of a mount */
+			memset(buf, 0, len);
+			fetch_threads = 1;
+			anon_kb = pss_anon_kb();
+			if (fs_mount_flags(diskname, flags[k]))
+				_exit(1);
+			fd = fs_open(filename);
+			if (fd < 0 || fs_read(fd, buf, len) != (int)len)
+				_exit(1);
+			anon_kb = pss_anon_kb() - anon_kb;
+			if (write(ready[1], &anon_kb, sizeof(anon_kb)) != sizeof(anon_kb))
+				_exit(1);
+			if (read(go[0], &c, 1) < 0)
+				_exit(1);
+			fs_close(fd);
+			_exit(fs_umount() ? 1 : 0);
+		}
+		close(ready[1]);
+		close(go[0]);
+		long total_kb = 0;
+		for (int i = 0; i < num_readers; i++) {
+			if (read(ready[0], &anon_kb, sizeof(anon_kb)) != sizeof(anon_kb))
+				die("Reader failed");
+			total_kb += anon_kb;
+		}
+		close(go[1]);
+		close(ready[0]);
+		for (int i = 0; i < num_readers; i++) {
+			int status;
+			if (wait(&status) < 0)
+				die_perror("wait");
+			if (!WIFEXITED(status) || WEXITSTATUS(status))
+				die("Reader failed");
+		}
+
+		printf("%s: mount+umount=%.1fus anon_per_reader=%ldKB\n",
+		       modes[k], mount_us, total_kb / num_readers);
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	fs_delete(filename);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(buf);
+}
+
+/* Space the host allocates to a file, in KiB */
+static long allocated_kb(const char *filename)
+{
+	struct stat st;
+
+	if (stat(filename, &st))
+		die_perror("stat");
+	return st.st_blocks / 2;
+}
+
+/*
+ * Fill a disk with files and delete all of them but the first, mounted plainly
+ * then with freed blocks discarded. Report the time of the deletions and the
+ * unmount, the space the disk file then takes on the host, and the time of a
+ * copy of the disk file skipping its holes.
+ */
+void bench_discard(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const char *modes[] = { "keep", "discard" };
+	static const unsigned int flags[] = { 0, FS_MOUNT_DISCARD };
+	int num_files = 16, fd;
+	size_t len = 256 * 1024;
+	char *diskname, *data, filename[FS_FILENAME_LEN], copy_name[PATH_MAX];
+	double start, delete_ms, copy_ms;
+	long kb;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<files>] [<KiB per file>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		num_files = atoi(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		len = atoi(t_arg->argv[2]) * 1024;
+	if (num_files < 1 || num_files > FS_FILE_MAX_COUNT || len < 1)
+		die("Invalid arguments");
+	snprintf(copy_name, sizeof(copy_name), "%s.copy", diskname);
+	data = malloc(len);
+	if (!data)
+		die_perror("malloc");
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		data[i] = rand();
+
+	printf("files: %d, size: %zu\n", num_files, len);
+	for (size_t k = 0; k < ARRAY_SIZE(modes); k++) {
+		/* Both modes start from a disk file holding no free block */
+		if (fs_mount(diskname))
+			die("Cannot mount diskname");
+		if (fs_discard() < 0)
+			die("Cannot discard free blocks");
+		for (int i = 0; i < num_files; i++) {
+			snprintf(filename, sizeof(filename), "bench-dsc%d", i);
+			if (fs_create(filename))
+				die("Cannot create file");
+			fd = fs_open(filename);
+			if (fd < 0)
+				die("Cannot open file");
+			if (fs_write(fd, data, len) != (int)len)
+				die("Cannot write file");
+			fs_close(fd);
+		}
+		if (fs_umount())
+			die("Cannot unmount diskname");
+
+		if (fs_mount_flags(diskname, flags[k]))
+			die("Cannot mount diskname");
+		start = now_ms();
+		for (int i = 1; i < num_files; i++) {
+			snprintf(filename, sizeof(filename), "bench-dsc%d", i);
+			if (fs_delete(filename))
+				die("Cannot delete file");
+		}
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		delete_ms = now_ms() - start;
+		kb = allocated_kb(diskname);
+
+		start = now_ms();
+		if (fs_copy_disk(diskname, copy_name) < 0)
+			die("Cannot copy diskname");
+		copy_ms = now_ms() - start;
+		unlink(copy_name);
+
+		printf("%s: delete+umount=%.2fms allocated=%ldKB copy=%.2fms\n",
+		       modes[k], delete_ms, kb, copy_ms);
+
+		if (fs_mount(diskname))
+			die("Cannot mount diskname");
+		fs_delete("bench-dsc0");
+		if (fs_umount())
+			die("Cannot unmount diskname");
+	}
+
+	free(data);
+}
+
+/* Delete a striped disk: the disk file and its other backing files */
+static void unlink_striped(const char *diskname, int num_stripes)
+{
+	char name[PATH_MAX + 16];
+
+	unlink(diskname);
+	for (int i = 1; i < num_stripes; i++) {
+		snprintf(name, sizeof(name), "%s.%d", diskname, i);
+		unlink(name);
+	}
+}
+
+/*
+ * Copy a disk striped over 1, 2 and 4 backing files (put next to the disk file)
+ * and, mounted with direct I/O so that every transfer goes to the backing
+ * files, write a file over and over and read it back in large calls. Report
+ * the throughput at each stripe width.
+ */
+void bench_stripe(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const int widths[] = { 1, 2, 4 };
+	const char *fs_filename = "bench-stripe";
+	char *diskname, *data, *buf, striped_name[PATH_MAX];
+	double start, elapsed, write_rate, read_rate;
+	size_t len = 16, total;
+	int stripe_unit = 16, fd;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<MiB>] [<stripe unit>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		len = atoi(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		stripe_unit = atoi(t_arg->argv[2]);
+	if (len < 1 || stripe_unit < 1)
+		die("Invalid arguments");
+	len *= 1024 * 1024;
+	snprintf(striped_name, sizeof(striped_name), "%s.striped", diskname);
+	data = fs_buffer_alloc(len);
+	buf = fs_buffer_alloc(len);
+	if (!data || !buf)
+		die_perror("fs_buffer_alloc");
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		data[i] = rand();
+
+	printf("size: %zu, stripe unit: %d blocks\n", len, stripe_unit);
+	for (size_t i = 0; i < ARRAY_SIZE(widths); i++) {
+		if (fs_stripe(diskname, striped_name, widths[i], stripe_unit) < 0)
+			die("Cannot stripe diskname");
+		if (fs_mount_flags(striped_name, FS_MOUNT_DIRECT))
+			die("Cannot mount striped diskname");
+		if (fs_create(fs_filename))
+			die("Cannot create file");
+		fd = fs_open(fs_filename);
+		if (fs_write(fd, data, len) != (int)len || fs_sync())
+			die("Cannot write file");
+
+		total = 0;
+		start = now_ms();
+		do {
+			fs_lseek(fd, 0);
+			if (fs_write(fd, data, len) != (int)len)
+				die("Cannot write file");
+			total += len;
+			elapsed = now_ms() - start;
+		} while (elapsed < BENCH_MIN_MS);
+		write_rate = mb_per_s(total, elapsed);
+
+		total = 0;
+		start = now_ms();
+		do {
+			fs_lseek(fd, 0);
+			if (fs_read(fd, buf, len) != (int)len)
+				die("Cannot read file");
+			total += len;
+			elapsed = now_ms() - start;
+		} while (elapsed < BENCH_MIN_MS);
+		read_rate = mb_per_s(total, elapsed);
+
+		if (memcmp(buf, data, len))
+			die("Read data differs");
+		fs_close(fd);
+		if (fs_umount())
+			die("Cannot unmount striped diskname");
+		unlink_striped(striped_name, widths[i]);
+
+		printf("stripes=%d: write=%.1fMB/s read=%.1fMB/s\n",
+		       widths[i], write_rate, read_rate);
+	}
+
+	free(data);
+	free(buf);
+}
+
+/*
+ * Create files, write them, sync, read them back and delete them, on a disk
+ * mounted plainly and then mounted in memory. Report the time of the work
+ * until the disk is unmounted, the time the disk in memory then takes to be
+ * persisted to a file, and the time to mount.
+ */
+void bench_ram(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	static const char *modes[] = { "file", "ram" };
+	static const unsigned int flags[] = { 0, FS_MOUNT_RAM };
+	int num_files = 64, fd;
+	size_t len = 64 * 1024;
+	char *diskname, *data, *buf, filename[FS_FILENAME_LEN], image_name[PATH_MAX];
+	double start, mount_ms, work_ms, persist_ms;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<files>] [<KiB per file>]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		num_files = atoi(t_arg->argv[1]);
+	if (t_arg->argc > 2)
+		len = atoi(t_arg->argv[2]) * 1024;
+	if (num_files < 1 || num_files > FS_FILE_MAX_COUNT || len < 1)
+		die("Invalid arguments");
+	snprintf(image_name, sizeof(image_name), "%s.image", diskname);
+	data = malloc(len);
+	buf = malloc(len);
+	if (!data || !buf)
+		die_perror("malloc");
+	srand(1);
+	for (size_t i = 0; i < len; i++)
+		data[i] = rand();
+
+	printf("files: %d, size: %zu\n", num_files, len);
+	for (size_t k = 0; k < ARRAY_SIZE(modes); k++) {
+		start = now_ms();
+		if (fs_mount_flags(diskname, flags[k]))
+			die("Cannot mount diskname");
+		mount_ms = now_ms() - start;
+
+		start = now_ms();
+		for (int i = 0; i < num_files; i++) {
+			snprintf(filename, sizeof(filename), "bench-ram%d", i);
+			if (fs_create(filename))
+				die("Cannot create file");
+			fd = fs_open(filename);
+			if (fd < 0 || fs_write(fd, data, len) != (int)len)
+				die("Cannot write file");
+			fs_close(fd);
+			if (fs_sync())
+				die("Cannot sync");
+		}
+		for (int i = 0; i < num_files; i++) {
+			snprintf(filename, sizeof(filename), "bench-ram%d", i);
+			fd = fs_open(filename);
+			if (fd < 0 || fs_read(fd, buf, len) != (int)len || memcmp(buf, data, len))
+				die("Cannot read file");
+			fs_close(fd);
+		}
+		for (int i = 1; i < num_files; i++) {
+			snprintf(filename, sizeof(filename), "bench-ram%d", i);
+			if (fs_delete(filename))
+				die("Cannot delete file");
+		}
+		if (fs_sync())
+			die("Cannot sync");
+		work_ms = now_ms() - start;
+
+		/* The disk in memory is saved to another file, the disk file
+		 * stays as it was */
+		persist_ms = 0;
+		if (flags[k] & FS_MOUNT_RAM) {
+			start = now_ms();
+			if (fs_persist(image_name))
+				die("Cannot persist diskname");
+			persist_ms = now_ms() - start;
+		}
+		if (fs_delete("bench-ram0") || fs_umount())
+			die("Cannot unmount diskname");
+
+		printf("%s: mount=%.2fms work=%.2fms persist=%.2fms\n",
+		       modes[k], mount_ms, work_ms, persist_ms);
+	}
+	unlink(image_name);
+
+	free(data);
+	free(buf);
+}
+
+static struct {
+	const char *name;
+	void(*func)(void *);
+} benches[] = {
+	{ "compress",	bench_compress },
+	{ "csum",		bench_csum },
+	{ "dedup",		bench_dedup },
+	{ "sendfile",	bench_sendfile },
+	{ "import",		bench_import },
+	{ "stat",		bench_stat },
+	{ "tracepoints",	bench_tracepoints },
+	{ "direct",		bench_direct },
+	{ "fds",		bench_fds },
+	{ "shared",		bench_shared },
+	{ "server",		bench_server },
+	{ "fetch",		bench_fetch },
+	{ "delalloc",	bench_delalloc },
+	{ "rdonly",		bench_rdonly },
+	{ "discard",	bench_discard },
+	{ "stripe",		bench_stripe },
+	{ "ram",		bench_ram },
+};
+
+void usage(char *program)
+{
+	size_t i;
+	fprintf(stderr, "Usage: %s <benchmark> [<arg>]\n", program);
+	fprintf(stderr, "Possible benchmarks are:\n");
+	for (i = 0; i < ARRAY_SIZE(benches); i++)
+		fprintf(stderr, "\t%s\n", benches[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	size_t i;
+	char *program;
+	char *cmd;
+	struct thread_arg arg;
+
+	program = argv[0];
+
+	if (argc == 1)
+		usage(program);
+
+	/* Skip argv[0] */
+	argc--;
+	argv++;
+
+	cmd = argv[0];
+	arg.argc = --argc;
+	arg.argv = &argv[1];
+
+	for (i = 0; i < ARRAY_SIZE(benches); i++) {
+		if (!strcmp(cmd, benches[i].name)) {
+			benches[i].func(&arg);
+			break;
+		}
+	}
+	if (i == ARRAY_SIZE(benches)) {
+		fs_bench_error("invalid benchmark '%s'", cmd);
+		usage(program);
+	}
+
+	return 0;
+}
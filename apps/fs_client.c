@@ -0,0 +1,233 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fs_client.h>
+
+/*
+ * Command line client of fs_server.x. Commands mirror those of test_fs.x and
+ * print the same output, but run on the disk the server keeps mounted, so
+ * scripts issuing many commands do not mount the disk for each of them.
+ */
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+#define fs_client_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_client_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+static void client_dir(struct fs_client *client, int argc, char **argv)
+{
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+	int num_files;
+	size_t total = 0;
+
+	(void)argc;
+	(void)argv;
+
+	num_files = fs_client_stat_many(client, entries, FS_FILE_MAX_COUNT);
+	if (num_files < 0)
+		die("Cannot list files");
+
+	for (int i = 0; i < num_files; i++) {
+		printf("slot: %d, file: %s, size: %zu, data_blk: %d\n",
+		       entries[i].slot, entries[i].filename, entries[i].size,
+		       entries[i].first_data_block);
+		total += entries[i].size;
+	}
+	printf("%d files, %zu bytes\n", num_files, total);
+}
+
+static void client_add(struct fs_client *client, int argc, char **argv)
+{
+	char *filename, *buf;
+	struct stat st;
+	int fd, fs_fd, written;
+
+	if (argc < 1)
+		die("Usage: <host filename>");
+	filename = argv[0];
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if (!S_ISREG(st.st_mode))
+		die("Not a regular file: %s\n", filename);
+	buf = mmap(NULL, st.st_size ? st.st_size : 1, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		die_perror("mmap");
+
+	if (fs_client_create(client, filename))
+		die("Cannot create file");
+	fs_fd = fs_client_open(client, filename);
+	if (fs_fd < 0)
+		die("Cannot open file");
+	written = fs_client_write(client, fs_fd, buf, st.st_size);
+	if (fs_client_close(client, fs_fd))
+		die("Cannot close file");
+
+	printf("Wrote file '%s' (%d/%zu bytes)\n", filename, written,
+	       st.st_size);
+
+	munmap(buf, st.st_size ? st.st_size : 1);
+	close(fd);
+}
+
+static void client_cat(struct fs_client *client, int argc, char **argv)
+{
+	char *buf;
+	int fs_fd, stat, read;
+
+	if (argc < 1)
+		die("Usage: <filename>");
+
+	fs_fd = fs_client_open(client, argv[0]);
+	if (fs_fd < 0)
+		die("Cannot open file");
+	stat = fs_client_stat(client, fs_fd);
+	if (stat < 0)
+		die("Cannot stat file");
+	if (!stat) {
+		/* Nothing to read, file is empty */
+		printf("Empty file\n");
+		return;
+	}
+	buf = malloc(stat);
+	if (!buf)
+		die_perror("malloc");
+	read = fs_client_read(client, fs_fd, buf, stat);
+	if (fs_client_close(client, fs_fd))
+		die("Cannot close file");
+
+	printf("Read file '%s' (%d/%d bytes)\n", argv[0], read, stat);
+	printf("Content of the file:\n");
+	fwrite(buf, 1, read, stdout);
+	printf("\n");
+	free(buf);
+}
+
+static void client_stat(struct fs_client *client, int argc, char **argv)
+{
+	int fs_fd, stat;
+
+	if (argc < 1)
+		die("Usage: <filename>");
+
+	fs_fd = fs_client_open(client, argv[0]);
+	if (fs_fd < 0)
+		die("Cannot open file");
+	stat = fs_client_stat(client, fs_fd);
+	if (stat < 0)
+		die("Cannot stat file");
+	if (fs_client_close(client, fs_fd))
+		die("Cannot close file");
+	if (!stat) {
+		printf("Empty file\n");
+		return;
+	}
+
+	printf("Size of file '%s' is %d bytes\n", argv[0], stat);
+}
+
+static void client_rm(struct fs_client *client, int argc, char **argv)
+{
+	if (argc < 1)
+		die("Usage: <filename>");
+	if (fs_client_delete(client, argv[0]))
+		die("Cannot delete file");
+	printf("Removed file '%s'\n", argv[0]);
+}
+
+static void client_clone(struct fs_client *client, int argc, char **argv)
+{
+	if (argc < 2)
+		die("Usage: <filename> <new filename>");
+	if (fs_client_clone(client, argv[0], argv[1]))
+		die("Cannot clone file");
+	printf("Cloned file '%s' as '%s'\n", argv[0], argv[1]);
+}
+
+static void client_sync(struct fs_client *client, int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	if (fs_client_sync(client))
+		die("Cannot sync disk");
+	printf("Synced disk\n");
+}
+
+static void client_shutdown(struct fs_client *client, int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	if (fs_client_shutdown(client))
+		die("Cannot shut down server");
+	printf("Shut down server\n");
+}
+
+static struct {
+	const char *name;
+	void (*func)(struct fs_client *, int, char **);
+} commands[] = {
+	{ "dir",	client_dir },
+	{ "add",	client_add },
+	{ "cat",	client_cat },
+	{ "stat",	client_stat },
+	{ "rm",		client_rm },
+	{ "clone",	client_clone },
+	{ "sync",	client_sync },
+	{ "shutdown",	client_shutdown }
+};
+
+static void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s <socket path> <command> [<arg>]\n", program);
+	fprintf(stderr, "Possible commands are:\n");
+	for (size_t i = 0; i < ARRAY_SIZE(commands); i++)
+		fprintf(stderr, "\t%s\n", commands[i].name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct fs_client *client;
+	size_t i;
+
+	if (argc < 3)
+		usage(argv[0]);
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		if (!strcmp(argv[2], commands[i].name))
+			break;
+	if (i == ARRAY_SIZE(commands)) {
+		fs_client_error("invalid command '%s'", argv[2]);
+		usage(argv[0]);
+	}
+
+	client = fs_client_connect(argv[1]);
+	if (!client)
+		die("Cannot connect to %s", argv[1]);
+	commands[i].func(client, argc - 3, argv + 3);
+	fs_client_disconnect(client);
+
+	return 0;
+}
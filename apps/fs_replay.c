@@ -0,0 +1,559 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+/*
+ * Replay of a trace recorded through fs_trace.h against a disk.
+ *
+ * Calls are replayed in the order of the trace, as fast as possible or at the
+ * pace they were recorded (-p). With -t, every thread of the trace is replayed
+ * by a thread of its own. The calls of a thread keep their order, and a call
+ * waits for every call that had returned when it was recorded, in any thread
+ * (which includes the call that opened its file descriptor). Calls into the
+ * library are serialized, so the latency of a call includes the time spent
+ * waiting for the others. MOUNT calls mount the disk given on the command line
+ * whatever disk was recorded, with the flags recorded, and data sent by
+ * SENDFILE goes to /dev/null. Calls naming host files (COPY_DISK, STRIPE,
+ * IMPORT, TRACEPOINTS_DUMP and PERSIST to another file) are not replayed: they
+ * keep their recorded result.
+ */
+
+#define fs_replay_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_replay_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+enum op_type {
+	OP_MOUNT,
+	OP_UMOUNT,
+	OP_SYNC,
+	OP_CREATE,
+	OP_DELETE,
+	OP_CLONE,
+	OP_OPEN,
+	OP_CLOSE,
+	OP_STAT,
+	OP_SEEK,
+	OP_WRITE,
+	OP_READ,
+	OP_BUFFER_ALLOC,
+	OP_INFO,
+	OP_ENABLE,
+	OP_PERSIST,
+	OP_DISCARD,
+	OP_COPY_DISK,
+	OP_STRIPE,
+	OP_FRAG_REPORT,
+	OP_DEFRAG,
+	OP_CHECK,
+	OP_SET_COMPRESSION,
+	OP_IMPORT,
+	OP_LS,
+	OP_READDIR,
+	OP_STAT_MANY,
+	OP_SENDFILE,
+	OP_TRACEPOINTS_ENABLE,
+	OP_TRACEPOINTS_DUMP,
+	NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+	"MOUNT", "UMOUNT", "SYNC", "CREATE", "DELETE", "CLONE",
+	"OPEN", "CLOSE", "STAT", "SEEK", "WRITE", "READ", "BUFFER_ALLOC",
+	"INFO", "ENABLE", "PERSIST", "DISCARD", "COPY_DISK", "STRIPE",
+	"FRAG_REPORT", "DEFRAG", "CHECK", "SET_COMPRESSION", "IMPORT", "LS",
+	"READDIR", "STAT_MANY", "SENDFILE", "TRACEPOINTS_ENABLE",
+	"TRACEPOINTS_DUMP"
+};
+
+struct op {
+	/* As recorded */
+	long start_us, end_us;
+	int thread;
+	int ret;
+	enum op_type type;
+	char *name, *name2;
+	/* Size or count, and file offset */
+	size_t num, offset;
+	/* Flags or other integer argument */
+	long arg;
+	/* Calls naming host files are not replayed, their result is kept */
+	int skipped;
+	/* Call that opened the file descriptor used (-1 if none) */
+	int opener;
+	/* Number of calls of the trace, from the first one, that returned before this one started */
+	int after;
+	/* As replayed */
+	int replay_ret;
+	long latency_ns;
+	int done;
+};
+
+static struct {
+	struct op *ops;
+	int num_ops;
+	char *diskname;
+	int paced;
+	struct timespec start;
+	/* Library calls are serialized */
+	pthread_mutex_t fs_lock;
+	/* Number of calls of the trace, from the first one, that are done */
+	int num_done;
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	char *write_buf;
+	size_t max_read, max_write;
+	/* Where data sent by SENDFILE goes */
+	int null_fd;
+} replay = {
+	.fs_lock = PTHREAD_MUTEX_INITIALIZER,
+	.done_lock = PTHREAD_MUTEX_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static long elapsed_ns(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000000L + (now.tv_nsec - start->tv_nsec);
+}
+
+/* Parse a trace file into replay.ops */
+static void load_trace(const char *trace_filename)
+{
+	char line[1024];
+	int cap = 0, max_fd = -1, version, num_returned = 0;
+	int *fd_opener = NULL;
+	FILE *f;
+
+	f = fopen(trace_filename, "r");
+	if (!f)
+		die_perror("fopen");
+	if (!fgets(line, sizeof(line), f) || sscanf(line, "# fs trace %d", &version) != 1 || version != 1)
+		die("Not a trace file: %s", trace_filename);
+
+	while (fgets(line, sizeof(line), f)) {
+		char *fields[10];
+		int num_fields = 0;
+		struct op *op;
+
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '#' || line[0] == '\0')
+			continue;
+		for (char *tok = strtok(line, "\t"); tok && num_fields < 10; tok = strtok(NULL, "\t"))
+			fields[num_fields++] = tok;
+		if (num_fields < 5)
+			die("Invalid trace line %d", replay.num_ops + 2);
+
+		if (replay.num_ops == cap) {
+			cap = cap ? cap * 2 : 256;
+			replay.ops = realloc(replay.ops, cap * sizeof(struct op));
+			if (!replay.ops)
+				die_perror("realloc");
+		}
+		op = &replay.ops[replay.num_ops];
+		memset(op, 0, sizeof(*op));
+		op->start_us = atol(fields[0]);
+		op->thread = atoi(fields[1]);
+		/* Calls are recorded in the order they returned */
+		op->end_us = op->start_us + atol(fields[2]);
+		while (num_returned < replay.num_ops && replay.ops[num_returned].end_us <= op->start_us)
+			num_returned++;
+		op->after = num_returned;
+		op->ret = atoi(fields[3]);
+		op->opener = -1;
+		for (op->type = 0; op->type < NUM_OPS; op->type++)
+			if (!strcmp(fields[4], op_names[op->type]))
+				break;
+		if (op->type == NUM_OPS)
+			die("Unknown operation '%s'", fields[4]);
+
+		switch (op->type) {
+		case OP_MOUNT:
+			/* Flags of fs_mount_flags() */
+			if (num_fields > 6)
+				op->arg = strtol(fields[6], NULL, 0);
+			break;
+		case OP_BUFFER_ALLOC:
+			if (num_fields > 5)
+				op->num = strtoul(fields[5], NULL, 10);
+			break;
+		case OP_ENABLE:
+		case OP_DEFRAG:
+		case OP_CHECK:
+		case OP_READDIR:
+		case OP_STAT_MANY:
+		case OP_TRACEPOINTS_ENABLE:
+			if (num_fields > 5)
+				op->arg = strtol(fields[5], NULL, 0);
+			break;
+		case OP_PERSIST:
+			/* Only saving the mounted disk is replayed */
+			op->skipped = (num_fields > 5);
+			break;
+		case OP_COPY_DISK:
+		case OP_STRIPE:
+		case OP_IMPORT:
+		case OP_TRACEPOINTS_DUMP:
+			op->skipped = 1;
+			break;
+		case OP_SET_COMPRESSION:
+			op->name = strdup(num_fields > 5 ? fields[5] : "");
+			if (num_fields > 6)
+				op->arg = strtol(fields[6], NULL, 0);
+			break;
+		case OP_CREATE:
+		case OP_DELETE:
+		case OP_OPEN:
+			op->name = strdup(num_fields > 5 ? fields[5] : "");
+			break;
+		case OP_CLONE:
+			op->name = strdup(num_fields > 5 ? fields[5] : "");
+			op->name2 = strdup(num_fields > 6 ? fields[6] : "");
+			break;
+		case OP_CLOSE:
+		case OP_STAT:
+		case OP_SEEK:
+		case OP_WRITE:
+		case OP_READ:
+		case OP_SENDFILE:
+			if (num_fields < 6)
+				die("Missing file descriptor on trace line %d", replay.num_ops + 2);
+			/* Find the call that returned this descriptor */
+			int fd = atoi(fields[5]);
+			if (fd >= 0 && fd <= max_fd)
+				op->opener = fd_opener[fd];
+			if (num_fields > 6)
+				op->num = strtoul(fields[6], NULL, 10);
+			if (num_fields > 7)
+				op->offset = strtoul(fields[7], NULL, 10);
+			break;
+		default:
+			break;
+		}
+
+		if (op->type == OP_OPEN && op->ret >= 0) {
+			if (op->ret > max_fd) {
+				fd_opener = realloc(fd_opener, (op->ret + 1) * sizeof(int));
+				if (!fd_opener)
+					die_perror("realloc");
+				for (int i = max_fd + 1; i <= op->ret; i++)
+					fd_opener[i] = -1;
+				max_fd = op->ret;
+			}
+			fd_opener[op->ret] = replay.num_ops;
+		}
+		if (op->type == OP_WRITE && op->num > replay.max_write)
+			replay.max_write = op->num;
+		if (op->type == OP_READ && op->num > replay.max_read)
+			replay.max_read = op->num;
+		replay.num_ops++;
+	}
+
+	free(fd_opener);
+	fclose(f);
+}
+
+/* Replay one call, with its read buffer */
+static void replay_op(struct op *op, char *read_buf)
+{
+	struct fs_frag_report frag_report;
+	struct fs_check_report check_report;
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+	struct timespec start;
+	int fd = -1, cursor;
+	void *buf;
+
+	/* Wait for the calls this one came after */
+	pthread_mutex_lock(&replay.done_lock);
+	while (replay.num_done < op->after)
+		pthread_cond_wait(&replay.done_cond, &replay.done_lock);
+	pthread_mutex_unlock(&replay.done_lock);
+	if (op->opener != -1)
+		fd = replay.ops[op->opener].replay_ret;
+
+	if (replay.paced) {
+		struct timespec when = replay.start;
+		when.tv_sec += op->start_us / 1000000;
+		when.tv_nsec += (op->start_us % 1000000) * 1000;
+		if (when.tv_nsec >= 1000000000) {
+			when.tv_sec++;
+			when.tv_nsec -= 1000000000;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pthread_mutex_lock(&replay.fs_lock);
+	switch (op->type) {
+	case OP_MOUNT:
+		if (op->arg)
+			op->replay_ret = fs_mount_flags(replay.diskname, op->arg);
+		else
+			op->replay_ret = fs_mount(replay.diskname);
+		break;
+	case OP_UMOUNT:
+		op->replay_ret = fs_umount();
+		break;
+	case OP_SYNC:
+		op->replay_ret = fs_sync();
+		break;
+	case OP_CREATE:
+		op->replay_ret = fs_create(op->name);
+		break;
+	case OP_DELETE:
+		op->replay_ret = fs_delete(op->name);
+		break;
+	case OP_CLONE:
+		op->replay_ret = fs_clone(op->name, op->name2);
+		break;
+	case OP_OPEN:
+		op->replay_ret = fs_open(op->name);
+		break;
+	case OP_CLOSE:
+		op->replay_ret = fs_close(fd);
+		break;
+	case OP_STAT:
+		op->replay_ret = fs_stat(fd);
+		break;
+	case OP_SEEK:
+		op->replay_ret = fs_lseek(fd, op->num);
+		break;
+	case OP_WRITE:
+		op->replay_ret = fs_write(fd, replay.write_buf, op->num);
+		break;
+	case OP_READ:
+		op->replay_ret = fs_read(fd, read_buf, op->num);
+		break;
+	case OP_BUFFER_ALLOC:
+		buf = fs_buffer_alloc(op->num);
+		op->replay_ret = buf ? 0 : -1;
+		free(buf);
+		break;
+	case OP_INFO:
+		op->replay_ret = fs_info();
+		break;
+	case OP_ENABLE:
+		op->replay_ret = fs_enable(op->arg);
+		break;
+	case OP_PERSIST:
+		op->replay_ret = op->skipped ? op->ret : fs_persist(NULL);
+		break;
+	case OP_DISCARD:
+		op->replay_ret = fs_discard();
+		break;
+	case OP_FRAG_REPORT:
+		op->replay_ret = fs_frag_report(&frag_report);
+		break;
+	case OP_DEFRAG:
+		op->replay_ret = fs_defrag(op->arg);
+		break;
+	case OP_CHECK:
+		op->replay_ret = fs_check(op->arg, &check_report);
+		break;
+	case OP_SET_COMPRESSION:
+		op->replay_ret = fs_set_compression(op->name, op->arg);
+		break;
+	case OP_LS:
+		op->replay_ret = fs_ls();
+		break;
+	case OP_READDIR:
+		cursor = op->arg;
+		op->replay_ret = fs_readdir(op->arg < 0 ? NULL : &cursor, &entries[0]);
+		break;
+	case OP_STAT_MANY:
+		op->replay_ret = fs_stat_many(entries, op->arg < FS_FILE_MAX_COUNT ? op->arg : FS_FILE_MAX_COUNT);
+		break;
+	case OP_SENDFILE:
+		op->replay_ret = fs_sendfile(fd, replay.null_fd, op->offset, op->num);
+		break;
+	case OP_TRACEPOINTS_ENABLE:
+		op->replay_ret = fs_tracepoints_enable(op->arg);
+		break;
+	default:
+		/* Calls naming host files */
+		op->replay_ret = op->ret;
+		break;
+	}
+	pthread_mutex_unlock(&replay.fs_lock);
+	op->latency_ns = elapsed_ns(&start);
+
+	pthread_mutex_lock(&replay.done_lock);
+	op->done = 1;
+	while (replay.num_done < replay.num_ops && replay.ops[replay.num_done].done)
+		replay.num_done++;
+	pthread_cond_broadcast(&replay.done_cond);
+	pthread_mutex_unlock(&replay.done_lock);
+}
+
+/* Replay the calls of one thread of the trace (0 for all of them) */
+static void *replay_thread(void *arg)
+{
+	int thread = *(int *)arg;
+	char *read_buf = malloc(replay.max_read + 1);
+
+	if (!read_buf)
+		die_perror("malloc");
+	for (int i = 0; i < replay.num_ops; i++)
+		if (thread == 0 || replay.ops[i].thread == thread)
+			replay_op(&replay.ops[i], read_buf);
+	free(read_buf);
+	return NULL;
+}
+
+static int cmp_long(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+	return (x > y) - (x < y);
+}
+
+/* Print latency percentiles of every operation, and throughput */
+static void report(long total_ns, int num_threads)
+{
+	long *latencies = malloc((replay.num_ops + 1) * sizeof(long));
+	size_t bytes_read = 0, bytes_written = 0;
+	int mismatches = 0;
+
+	if (!latencies)
+		die_perror("malloc");
+	for (int i = 0; i < replay.num_ops; i++) {
+		struct op *op = &replay.ops[i];
+		if (op->replay_ret != op->ret)
+			mismatches++;
+		if ((op->type == OP_READ || op->type == OP_SENDFILE) && op->replay_ret > 0)
+			bytes_read += op->replay_ret;
+		if (op->type == OP_WRITE && op->replay_ret > 0)
+			bytes_written += op->replay_ret;
+	}
+
+	printf("ops: %d, threads: %d, mismatches: %d\n", replay.num_ops, num_threads, mismatches);
+	for (int type = 0; type < NUM_OPS; type++) {
+		int count = 0, skipped = 0;
+		for (int i = 0; i < replay.num_ops; i++) {
+			if (replay.ops[i].type != (enum op_type)type)
+				continue;
+			if (replay.ops[i].skipped)
+				skipped++;
+			else
+				latencies[count++] = replay.ops[i].latency_ns;
+		}
+		if (skipped)
+			printf("%s: count=%d not replayed\n", op_names[type], skipped);
+		if (!count)
+			continue;
+		/* Nearest rank */
+		qsort(latencies, count, sizeof(long), cmp_long);
+		printf("%s: count=%d p50=%.1fus p90=%.1fus p99=%.1fus max=%.1fus\n",
+		       op_names[type], count,
+		       latencies[(count * 50 + 99) / 100 - 1] / 1000.0,
+		       latencies[(count * 90 + 99) / 100 - 1] / 1000.0,
+		       latencies[(count * 99 + 99) / 100 - 1] / 1000.0,
+		       latencies[count - 1] / 1000.0);
+	}
+	printf("time: %.1fms (recorded %.1fms), %.0f ops/s, read %.1fMB/s, write %.1fMB/s\n",
+	       total_ns / 1e6,
+	       replay.num_ops ? replay.ops[replay.num_ops - 1].start_us / 1e3 : 0.0,
+	       replay.num_ops / (total_ns / 1e9),
+	       bytes_read / (1024.0 * 1024.0) / (total_ns / 1e9),
+	       bytes_written / (1024.0 * 1024.0) / (total_ns / 1e9));
+
+	free(latencies);
+}
+
+void usage(char *program)
+{
+	fprintf(stderr, "Usage: %s [-p] [-t] <diskname> <trace file>\n", program);
+	fprintf(stderr, "\t-p\treplay at the pace of the recording\n");
+	fprintf(stderr, "\t-t\treplay every thread of the trace on a thread of its own\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int threaded = 0, opt, num_threads = 1;
+	int *thread_ids;
+	pthread_t *threads;
+
+	while ((opt = getopt(argc, argv, "pt")) != -1) {
+		if (opt == 'p')
+			replay.paced = 1;
+		else if (opt == 't')
+			threaded = 1;
+		else
+			usage(argv[0]);
+	}
+	if (argc - optind < 2)
+		usage(argv[0]);
+	replay.diskname = argv[optind];
+	load_trace(argv[optind + 1]);
+
+	/* Threads of the trace, or a single thread taking every call */
+	thread_ids = calloc(replay.num_ops + 1, sizeof(int));
+	if (!thread_ids)
+		die_perror("calloc");
+	if (threaded) {
+		num_threads = 0;
+		for (int i = 0; i < replay.num_ops; i++) {
+			int known = 0;
+			for (int j = 0; j < num_threads && !known; j++)
+				known = (thread_ids[j] == replay.ops[i].thread);
+			if (!known)
+				thread_ids[num_threads++] = replay.ops[i].thread;
+		}
+	}
+	threads = calloc(num_threads + 1, sizeof(pthread_t));
+	if (!threads)
+		die_perror("calloc");
+
+	/* Data written by the replay */
+	replay.write_buf = malloc(replay.max_write + 1);
+	if (!replay.write_buf)
+		die_perror("malloc");
+	for (size_t i = 0; i < replay.max_write; i++)
+		replay.write_buf[i] = 'a' + i % 26;
+	replay.null_fd = open("/dev/null", O_WRONLY);
+	if (replay.null_fd < 0)
+		die_perror("open");
+
+	clock_gettime(CLOCK_MONOTONIC, &replay.start);
+	if (!threaded) {
+		replay_thread(&thread_ids[0]);
+	} else {
+		for (int i = 0; i < num_threads; i++)
+			if (pthread_create(&threads[i], NULL, replay_thread, &thread_ids[i]))
+				die_perror("pthread_create");
+		for (int i = 0; i < num_threads; i++)
+			pthread_join(threads[i], NULL);
+	}
+	report(elapsed_ns(&replay.start), num_threads);
+
+	/* Leave the disk unmounted if the trace did not */
+	fs_umount();
+
+	for (int i = 0; i < replay.num_ops; i++) {
+		free(replay.ops[i].name);
+		free(replay.ops[i].name2);
+	}
+	free(replay.ops);
+	free(replay.write_buf);
+	close(replay.null_fd);
+	free(thread_ids);
+	free(threads);
+	return 0;
+}
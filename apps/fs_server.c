@@ -0,0 +1,455 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <fs.h>
+#include <fs_proto.h>
+
+/*
+ * File system server: keeps a disk mounted and serves the calls of fs.h to
+ * the clients of fs_client.h over a Unix domain socket (protocol in
+ * fs_proto.h), so that a sequence of commands pays for mounting the disk once
+ * instead of once per command.
+ *
+ * A single thread polls the listening socket and every client. Whatever a
+ * client sent is buffered, every complete request in it is executed in order,
+ * and the responses are queued in the client's output buffer, so pipelined
+ * requests are answered with as few system calls as the data allows. A client
+ * with a full queue of requests or of responses is not read from until the
+ * queue drains, so a client sending faster than it receives cannot make the
+ * server buffer without bound. Calls
+ * run one at a time on the mounted disk, as the library expects. File
+ * descriptors belong to the client that opened them and are closed when it
+ * disconnects.
+ *
+ * The server stops on FS_OP_SHUTDOWN, SIGINT or SIGTERM, unmounting the disk
+ * and removing the socket.
+ */
+
+#define fs_server_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_server_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Bytes read from a client at once */
+#define READ_CHUNK (64 * 1024)
+
+/*
+ * Bytes of requests, or of responses, queued for a client past which it is
+ * not read from (a full queue of requests holds at least a whole request)
+ */
+#define QUEUE_MAX (sizeof(struct fs_proto_request) + FS_PROTO_MAX_DATA)
+
+struct buffer {
+	char *data;
+	size_t start;
+	size_t len;
+	size_t cap;
+};
+
+struct client {
+	int sock;
+	/* Requests received but not executed yet */
+	struct buffer in;
+	/* Responses not sent yet */
+	struct buffer out;
+};
+
+static struct client **clients;
+static struct pollfd *pollfds;
+static int num_clients, max_clients;
+
+/* Client owning each file descriptor of the server, NULL if none */
+static struct client **fd_owner;
+static int fd_owner_len;
+
+static volatile sig_atomic_t stop;
+static int shutdown_requested;
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+/* Make room for len more bytes at the end of a buffer */
+static char *buffer_reserve(struct buffer *buf, size_t len)
+{
+	/* Move pending bytes to the front before growing */
+	if (buf->start > 0) {
+		memmove(buf->data, buf->data + buf->start, buf->len);
+		buf->start = 0;
+	}
+	if (buf->len + len > buf->cap) {
+		size_t cap = buf->cap ? buf->cap : READ_CHUNK;
+		while (cap < buf->len + len)
+			cap *= 2;
+		buf->data = realloc(buf->data, cap);
+		if (!buf->data)
+			die_perror("realloc");
+		buf->cap = cap;
+	}
+	return buf->data + buf->len;
+}
+
+static void set_fd_owner(int fd, struct client *client)
+{
+	if (fd >= fd_owner_len) {
+		int len = fd_owner_len ? fd_owner_len : 64;
+		while (len <= fd)
+			len *= 2;
+		fd_owner = realloc(fd_owner, len * sizeof(*fd_owner));
+		if (!fd_owner)
+			die_perror("realloc");
+		memset(fd_owner + fd_owner_len, 0,
+		       (len - fd_owner_len) * sizeof(*fd_owner));
+		fd_owner_len = len;
+	}
+	fd_owner[fd] = client;
+}
+
+static int owns_fd(struct client *client, int fd)
+{
+	return fd >= 0 && fd < fd_owner_len && fd_owner[fd] == client;
+}
+
+/* Name carried by a request, NULL if the data is not a valid name */
+static const char *request_name(const char *data, uint32_t len, uint32_t *used)
+{
+	const char *nul = memchr(data, '\0', len);
+
+	if (!nul || nul == data)
+		return NULL;
+	*used = nul - data + 1;
+	return data;
+}
+
+/* Execute a request and queue its response */
+static void execute(struct client *client, const struct fs_proto_request *req,
+		    const char *data)
+{
+	struct fs_proto_response *resp;
+	size_t resp_off, max_len = 0;
+	const char *name, *dst;
+	uint32_t used;
+	int max_entries = 0;
+	int ret = -1;
+
+	/* Room for the largest data the response can carry */
+	if (req->op == FS_OP_READ) {
+		max_len = req->arg < FS_PROTO_MAX_DATA ? req->arg : FS_PROTO_MAX_DATA;
+	} else if (req->op == FS_OP_STAT_MANY) {
+		max_entries = req->arg < FS_FILE_MAX_COUNT ? req->arg : FS_FILE_MAX_COUNT;
+		max_len = max_entries * sizeof(struct fs_dirent);
+	}
+	buffer_reserve(&client->out, sizeof(*resp) + max_len);
+	resp_off = client->out.len;
+	client->out.len += sizeof(*resp);
+
+	switch (req->op) {
+	case FS_OP_HELLO:
+		ret = FS_PROTO_VERSION;
+		break;
+	case FS_OP_CREATE:
+	case FS_OP_DELETE:
+	case FS_OP_OPEN:
+		name = request_name(data, req->data_len, &used);
+		if (!name)
+			break;
+		if (req->op == FS_OP_CREATE) {
+			ret = fs_create(name);
+		} else if (req->op == FS_OP_DELETE) {
+			ret = fs_delete(name);
+		} else {
+			ret = fs_open(name);
+			if (ret >= 0)
+				set_fd_owner(ret, client);
+		}
+		break;
+	case FS_OP_CLONE:
+		name = request_name(data, req->data_len, &used);
+		if (!name)
+			break;
+		dst = request_name(data + used, req->data_len - used, &used);
+		if (dst)
+			ret = fs_clone(name, dst);
+		break;
+	case FS_OP_CLOSE:
+		if (!owns_fd(client, req->fd))
+			break;
+		ret = fs_close(req->fd);
+		if (!ret)
+			fd_owner[req->fd] = NULL;
+		break;
+	case FS_OP_STAT:
+		if (owns_fd(client, req->fd))
+			ret = fs_stat(req->fd);
+		break;
+	case FS_OP_LSEEK:
+		if (owns_fd(client, req->fd))
+			ret = fs_lseek(req->fd, req->arg);
+		break;
+	case FS_OP_WRITE:
+		if (owns_fd(client, req->fd))
+			ret = fs_write(req->fd, (void *)data, req->data_len);
+		break;
+	case FS_OP_READ:
+		if (!owns_fd(client, req->fd))
+			break;
+		ret = fs_read(req->fd, client->out.data + client->out.len, max_len);
+		if (ret > 0)
+			client->out.len += ret;
+		break;
+	case FS_OP_SYNC:
+		ret = fs_sync();
+		break;
+	case FS_OP_STAT_MANY:
+		ret = fs_stat_many((struct fs_dirent *)(client->out.data + client->out.len),
+				   max_entries);
+		/* Only the entries that fit are sent */
+		if (ret > 0)
+			client->out.len += (ret < max_entries ? ret : max_entries)
+					   * sizeof(struct fs_dirent);
+		break;
+	case FS_OP_SHUTDOWN:
+		shutdown_requested = 1;
+		ret = 0;
+		break;
+	}
+
+	resp = (struct fs_proto_response *)(client->out.data + resp_off);
+	resp->id = req->id;
+	resp->ret = ret;
+	resp->data_len = client->out.len - resp_off - sizeof(*resp);
+}
+
+/* Execute every complete request received, returns -1 on a bad request */
+static int execute_requests(struct client *client)
+{
+	struct buffer *in = &client->in;
+
+	/* Requests following a shutdown are left unanswered */
+	while (!shutdown_requested && in->len >= sizeof(struct fs_proto_request)
+	       && client->out.len < QUEUE_MAX) {
+		struct fs_proto_request req;
+
+		memcpy(&req, in->data + in->start, sizeof(req));
+		if (req.data_len > FS_PROTO_MAX_DATA || req.op >= FS_OP_COUNT)
+			return -1;
+		if (in->len < sizeof(req) + req.data_len)
+			break;
+		execute(client, &req, in->data + in->start + sizeof(req));
+		in->start += sizeof(req) + req.data_len;
+		in->len -= sizeof(req) + req.data_len;
+	}
+	return 0;
+}
+
+/* Send queued responses, returns -1 if the client is gone */
+static int flush_responses(struct client *client)
+{
+	struct buffer *out = &client->out;
+
+	while (out->len > 0) {
+		ssize_t ret = write(client->sock, out->data + out->start, out->len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (ret < 0)
+			return -1;
+		out->start += ret;
+		out->len -= ret;
+	}
+	if (out->len == 0)
+		out->start = 0;
+	return 0;
+}
+
+/* Receive what a client sent, returns -1 if the client is gone */
+static int receive_requests(struct client *client)
+{
+	while (client->in.len < QUEUE_MAX) {
+		char *dst = buffer_reserve(&client->in, READ_CHUNK);
+		ssize_t ret = read(client->sock, dst, READ_CHUNK);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (ret <= 0)
+			return -1;
+		client->in.len += ret;
+	}
+	return 0;
+}
+
+static void grow_clients(void)
+{
+	max_clients = max_clients ? 2 * max_clients : 16;
+	clients = realloc(clients, max_clients * sizeof(*clients));
+	/* Slot 0 of pollfds is the listening socket */
+	pollfds = realloc(pollfds, (max_clients + 1) * sizeof(*pollfds));
+	if (!clients || !pollfds)
+		die_perror("realloc");
+}
+
+static void add_client(int sock)
+{
+	struct client *client;
+
+	if (num_clients == max_clients)
+		grow_clients();
+	client = calloc(1, sizeof(*client));
+	if (!client)
+		die_perror("calloc");
+	client->sock = sock;
+	clients[num_clients++] = client;
+}
+
+/* Disconnect a client, closing the file descriptors it left open */
+static void remove_client(int index)
+{
+	struct client *client = clients[index];
+
+	for (int fd = 0; fd < fd_owner_len; fd++) {
+		if (fd_owner[fd] == client) {
+			fs_close(fd);
+			fd_owner[fd] = NULL;
+		}
+	}
+	close(client->sock);
+	free(client->in.data);
+	free(client->out.data);
+	free(client);
+	clients[index] = clients[--num_clients];
+}
+
+static int listen_on(const char *socket_path)
+{
+	struct sockaddr_un addr;
+	int sock;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path))
+		die("socket path too long: %s", socket_path);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)))
+		die_perror("bind");
+	if (listen(sock, SOMAXCONN))
+		die_perror("listen");
+	return sock;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fs_server.x <diskname> <socket path>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sigaction sa;
+	int listen_sock;
+
+	if (argc != 3)
+		usage();
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+
+	/* Interrupt poll() rather than restarting it */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	listen_sock = listen_on(argv[2]);
+	grow_clients();
+	printf("Serving '%s' on '%s'\n", argv[1], argv[2]);
+	fflush(stdout);
+
+	while (!stop && !shutdown_requested) {
+		int num_polled = num_clients;
+
+		pollfds[0].fd = listen_sock;
+		pollfds[0].events = POLLIN;
+		for (int i = 0; i < num_polled; i++) {
+			pollfds[i + 1].fd = clients[i]->sock;
+			pollfds[i + 1].events = 0;
+			if (clients[i]->in.len < QUEUE_MAX
+			    && clients[i]->out.len < QUEUE_MAX)
+				pollfds[i + 1].events |= POLLIN;
+			if (clients[i]->out.len > 0)
+				pollfds[i + 1].events |= POLLOUT;
+		}
+		if (poll(pollfds, num_polled + 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+
+		/* Walk backwards, as removing a client moves the last one */
+		for (int i = num_polled - 1; i >= 0; i--) {
+			struct client *client = clients[i];
+			short revents = pollfds[i + 1].revents;
+			int gone = 0;
+
+			if (!revents)
+				continue;
+			if (revents & (POLLIN | POLLHUP | POLLERR))
+				gone = receive_requests(client);
+			if (execute_requests(client))
+				gone = 1;
+			if (flush_responses(client))
+				gone = 1;
+			if (gone)
+				remove_client(i);
+		}
+
+		if (pollfds[0].revents & POLLIN) {
+			int sock;
+			while ((sock = accept4(listen_sock, NULL, NULL,
+					       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+				add_client(sock);
+		}
+	}
+
+	/* Deliver the responses still queued, such as that to the shutdown */
+	while (num_clients > 0) {
+		struct client *client = clients[num_clients - 1];
+
+		fcntl(client->sock, F_SETFL, 0);
+		flush_responses(client);
+		remove_client(num_clients - 1);
+	}
+	close(listen_sock);
+	unlink(argv[2]);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	printf("Unmounted '%s'\n", argv[1]);
+	return 0;
+}
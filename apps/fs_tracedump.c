@@ -0,0 +1,139 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tracepoint.h>
+
+/*
+ * Conversion of the events saved by fs_tracepoints_dump() to Chrome trace JSON,
+ * which chrome://tracing and ui.perfetto.dev load as a timeline with a track
+ * per thread.
+ *
+ * Every event becomes a duration event ("B" or "E"), timed in microseconds
+ * from the first event of the dump, with the file descriptor, offset or block,
+ * and count as arguments. Exit events whose entry was overwritten in the ring
+ * buffer are left out, so that calls stay nested.
+ */
+
+#define fs_tracedump_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fs_tracedump_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Category of an event on the timeline */
+static const char *event_category(unsigned int id)
+{
+	if (id >= TP_BLOCK_READ && id <= TP_BLOCK_WRITE_MANY)
+		return "block";
+	if (id >= TP_FIND_EMPTY_ENTRY)
+		return "internal";
+	return "fs";
+}
+
+/* Name of the argument of an event */
+static const char *event_arg_name(unsigned int id)
+{
+	if (id >= TP_BLOCK_READ && id <= TP_BLOCK_WRITE_MANY)
+		return "block";
+	if (id == TP_CHAIN_SEEK || id == TP_CHAIN_SEEK_FOR_WRITE)
+		return "file_block";
+	if (id == TP_FS_READDIR)
+		return "cursor";
+	return "offset";
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: fs_tracedump.x <dump file> <json file>\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	FILE *in, *out;
+	struct tp_dump_header header;
+	struct tp_dump_event *events;
+	int *depth;
+	int calls[TP_NUM_EVENTS] = { 0 };
+	uint64_t first_ns = UINT64_MAX;
+	int num_written = 0;
+
+	if (argc != 3)
+		usage();
+
+	in = fopen(argv[1], "r");
+	if (!in)
+		die_perror("fopen");
+	if (fread(&header, sizeof(header), 1, in) != 1
+	    || memcmp(header.magic, TP_DUMP_MAGIC, sizeof(header.magic)))
+		die("%s is not a tracepoint dump", argv[1]);
+	if (header.version != TP_DUMP_VERSION)
+		die("unsupported dump version %u", header.version);
+
+	events = malloc((header.num_events + 1) * sizeof(struct tp_dump_event));
+	depth = calloc(header.num_threads + 1, sizeof(int));
+	if (!events || !depth)
+		die_perror("malloc");
+	if (fread(events, sizeof(struct tp_dump_event), header.num_events, in) != header.num_events)
+		die("%s is truncated", argv[1]);
+	fclose(in);
+
+	for (uint32_t i = 0; i < header.num_events; i++)
+		if (events[i].event.time_ns < first_ns)
+			first_ns = events[i].event.time_ns;
+
+	out = fopen(argv[2], "w");
+	if (!out)
+		die_perror("fopen");
+	fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	for (uint32_t i = 0; i < header.num_events; i++) {
+		struct tp_event *event = &events[i].event;
+		uint32_t thread = events[i].thread;
+		const char *name = tp_event_name(event->id);
+
+		if (!name || thread > header.num_threads)
+			die("corrupted event %u", i);
+		if (event->phase == TP_PHASE_BEGIN) {
+			depth[thread]++;
+			calls[event->id]++;
+		} else {
+			if (depth[thread] == 0)
+				continue;
+			depth[thread]--;
+		}
+
+		fprintf(out, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":1,\"tid\":%" PRIu32 ",\"args\":{",
+			num_written ? "," : "", name, event_category(event->id), event->phase,
+			(event->time_ns - first_ns) / 1000.0, thread);
+		/* Offsets only mean something for calls on a file descriptor */
+		if (event->fd >= 0)
+			fprintf(out, "\"fd\":%" PRId32 ",", event->fd);
+		if (event->fd >= 0 || strcmp(event_arg_name(event->id), "offset"))
+			fprintf(out, "\"%s\":%" PRId64 ",", event_arg_name(event->id), event->arg);
+		fprintf(out, "\"count\":%" PRId64 "}}", event->count);
+		num_written++;
+	}
+	fprintf(out, "\n]}\n");
+	if (fclose(out))
+		die_perror("fclose");
+
+	printf("events: %d, threads: %u\n", num_written, header.num_threads);
+	for (int id = 0; id < TP_NUM_EVENTS; id++)
+		if (calls[id])
+			printf("%s: calls=%d\n", tp_event_name(id), calls[id]);
+
+	free(events);
+	free(depth);
+	return 0;
+}
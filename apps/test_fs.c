@@ -1,4 +1,5 @@
 #include <assert.h>
+#include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <stdio.h>
@@ -9,7 +10,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-#include <fs.h>
+/* Calls can be recorded for fs_replay.x by setting FS_TRACE */
+#include <fs_trace.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -87,7 +89,16 @@ void thread_fs_script(void *arg)
 			break;
 
 		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
+			unsigned int flags = 0;
+			if (command_args[1] && strcmp(command_args[1], "DIRECT") == 0)
+				flags |= FS_MOUNT_DIRECT;
+			if (command_args[1] && strcmp(command_args[1], "RDONLY") == 0)
+				flags |= FS_MOUNT_RDONLY;
+			if (command_args[1] && strcmp(command_args[1], "DISCARD") == 0)
+				flags |= FS_MOUNT_DISCARD;
+			if (command_args[1] && strcmp(command_args[1], "RAM") == 0)
+				flags |= FS_MOUNT_RAM;
+			if (flags ? fs_mount_flags(diskname, flags) : fs_mount(diskname))
 				die("Cannot mount disk");
 			else {
 				printf("MOUNT successful.\n");
@@ -102,6 +113,29 @@ void thread_fs_script(void *arg)
 				mounted = 0;
 			}
 
+		} else if (strcmp(command, "SYNC") == 0) {
+			if (fs_sync()) {
+				fs_umount();
+				die("Cannot sync");
+			}
+
+			printf("SYNC successful.\n");
+
+		} else if (strcmp(command, "PERSIST") == 0) {
+			/* Saved to the disk file unless another one is given */
+			if (fs_persist(command_args[1])) {
+				fs_umount();
+				die("Cannot persist");
+			}
+
+			printf("PERSIST successful.\n");
+
+		} else if (strcmp(command, "ABORT") == 0) {
+			/* Stop without unmounting, as if the program crashed */
+			printf("ABORT\n");
+			fflush(stdout);
+			_exit(0);
+
 		} else if (strcmp(command, "CREATE") == 0) {
 			fs_filename = command_args[1];
 
@@ -374,6 +408,54 @@ void thread_fs_cat(void *arg)
 	free(buf);
 }
 
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename, *host_filename;
+	int fs_fd, host_fd;
+	int stat, sent;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <host filename>");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	host_filename = t_arg->argv[2];
+
+	host_fd = open(host_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (host_fd < 0)
+		die_perror("open");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	fs_fd = fs_open(filename);
+	if (fs_fd < 0) {
+		fs_umount();
+		die("Cannot open file");
+	}
+
+	stat = fs_stat(fs_fd);
+	if (stat < 0) {
+		fs_umount();
+		die("Cannot stat file");
+	}
+
+	/* Data goes from the disk to the host file without passing through here */
+	sent = fs_sendfile(fs_fd, host_fd, 0, stat);
+
+	if (fs_close(fs_fd)) {
+		fs_umount();
+		die("Cannot close file");
+	}
+
+	if (fs_umount())
+		die("cannot unmount diskname");
+
+	close(host_fd);
+	printf("Exported file '%s' (%d/%d bytes)\n", filename, sent, stat);
+}
+
 void thread_fs_rm(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -462,6 +544,70 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/* Keep the regular files of a directory listing */
+static int is_host_file(const struct dirent *entry)
+{
+	return entry->d_type == DT_REG;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	const char **host_filenames;
+	struct dirent **entries = NULL;
+	struct stat st;
+	int num_files, imported;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory | host filename...>");
+
+	diskname = t_arg->argv[0];
+
+	/* A single directory stands for the regular files it holds */
+	if (t_arg->argc == 2 && !stat(t_arg->argv[1], &st) && S_ISDIR(st.st_mode)) {
+		num_files = scandir(t_arg->argv[1], &entries, is_host_file, alphasort);
+		if (num_files < 0)
+			die_perror("scandir");
+		host_filenames = calloc(num_files + 1, sizeof(char *));
+		if (!host_filenames)
+			die_perror("calloc");
+		for (int i = 0; i < num_files; i++) {
+			char *path = malloc(strlen(t_arg->argv[1]) + strlen(entries[i]->d_name) + 2);
+			if (!path)
+				die_perror("malloc");
+			sprintf(path, "%s/%s", t_arg->argv[1], entries[i]->d_name);
+			host_filenames[i] = path;
+		}
+	} else {
+		num_files = t_arg->argc - 1;
+		host_filenames = (const char **)&t_arg->argv[1];
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	imported = fs_import(host_filenames, num_files);
+	if (imported < 0) {
+		fs_umount();
+		die("Cannot import files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Imported %d/%d files\n", imported, num_files);
+
+	if (entries) {
+		for (int i = 0; i < num_files; i++) {
+			free((char *)host_filenames[i]);
+			free(entries[i]);
+		}
+		free(host_filenames);
+		free(entries);
+	}
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -481,6 +627,41 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_dir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	struct fs_dirent entries[FS_FILE_MAX_COUNT];
+	int num_files;
+	size_t total = 0;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	/* Every file with its metadata, without opening any of them */
+	num_files = fs_stat_many(entries, FS_FILE_MAX_COUNT);
+	if (num_files < 0) {
+		fs_umount();
+		die("Cannot list files");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	for (int i = 0; i < num_files; i++) {
+		printf("slot: %d, file: %s, size: %zu, data_blk: %d\n",
+		       entries[i].slot, entries[i].filename, entries[i].size,
+		       entries[i].first_data_block);
+		total += entries[i].size;
+	}
+	printf("%d files, %zu bytes\n", num_files, total);
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -500,6 +681,103 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' as '%s'\n", src, dst);
+}
+
+void thread_fs_compress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *filename;
+	int on = 1;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <filename> [off]");
+
+	diskname = t_arg->argv[0];
+	filename = t_arg->argv[1];
+	if (t_arg->argc > 2 && !strcmp(t_arg->argv[2], "off"))
+		on = 0;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_set_compression(filename, on)) {
+		fs_umount();
+		die("Cannot change compression of file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Compression %s for file '%s'\n", on ? "on" : "off", filename);
+}
+
+void thread_fs_enable(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *feature_name;
+	unsigned int feature;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <feature>");
+
+	diskname = t_arg->argv[0];
+	feature_name = t_arg->argv[1];
+
+	if (!strcmp(feature_name, "journal"))
+		feature = FS_FEATURE_JOURNAL;
+	else if (!strcmp(feature_name, "clone"))
+		feature = FS_FEATURE_CLONE;
+	else if (!strcmp(feature_name, "sparse"))
+		feature = FS_FEATURE_SPARSE;
+	else if (!strcmp(feature_name, "tail"))
+		feature = FS_FEATURE_TAIL;
+	else if (!strcmp(feature_name, "inline"))
+		feature = FS_FEATURE_INLINE;
+	else if (!strcmp(feature_name, "csum"))
+		feature = FS_FEATURE_CSUM;
+	else if (!strcmp(feature_name, "dedup"))
+		feature = FS_FEATURE_DEDUP;
+	else
+		die("Unknown feature '%s'", feature_name);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_enable(feature)) {
+		fs_umount();
+		die("Cannot enable feature '%s'", feature_name);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Enabled feature '%s'\n", feature_name);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -508,16 +786,160 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+static void print_frag_report(const char *when)
+{
+	struct fs_frag_report report;
+
+	if (fs_frag_report(&report))
+		die("Cannot measure fragmentation");
+
+	printf("%s: files=%d fragmented=%d extents=%d free_blk=%d free_extents=%d largest_free=%d\n",
+	       when, report.num_files, report.num_fragmented_files,
+	       report.num_file_extents, report.num_free_blocks,
+	       report.num_free_extents, report.largest_free_extent);
+}
+
+void thread_fs_defrag(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	unsigned int time_budget_ms = 0;
+	int moved;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [time budget (ms)]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1)
+		time_budget_ms = get_argv(t_arg->argv[1]);
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	print_frag_report("Before");
+	moved = fs_defrag(time_budget_ms);
+	if (moved < 0) {
+		fs_umount();
+		die("Cannot defragment diskname");
+	}
+	printf("Moved %d blocks\n", moved);
+	print_frag_report("After");
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_check(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	unsigned int flags = 0;
+	int ret;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [repair]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 1) {
+		if (strcmp(t_arg->argv[1], "repair"))
+			die("Unknown option '%s'", t_arg->argv[1]);
+		flags |= FS_CHECK_REPAIR;
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	ret = fs_check(flags, NULL);
+	if (ret < 0) {
+		fs_umount();
+		die("Cannot check diskname");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (ret > 0)
+		exit(1);
+}
+
+void thread_fs_discard(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int punched;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname>");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	punched = fs_discard();
+	if (punched < 0) {
+		fs_umount();
+		die("Cannot discard free blocks");
+	}
+	printf("Discarded %d free blocks\n", punched);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_copy(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	int copied;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <copy diskname>");
+
+	copied = fs_copy_disk(t_arg->argv[0], t_arg->argv[1]);
+	if (copied < 0)
+		die("Cannot copy diskname");
+	printf("Copied disk '%s' to '%s' (%d blocks of data)\n",
+	       t_arg->argv[0], t_arg->argv[1], copied);
+}
+
+void thread_fs_stripe(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	int num_stripes, stripe_unit, copied;
+
+	if (t_arg->argc < 4)
+		die("Usage: <diskname> <striped diskname> <stripes> <stripe unit>");
+
+	num_stripes = atoi(t_arg->argv[2]);
+	stripe_unit = atoi(t_arg->argv[3]);
+	copied = fs_stripe(t_arg->argv[0], t_arg->argv[1], num_stripes, stripe_unit);
+	if (copied < 0)
+		die("Cannot stripe diskname");
+	printf("Striped disk '%s' as '%s' over %d files (%d blocks of data)\n",
+	       t_arg->argv[0], t_arg->argv[1], num_stripes, copied);
+}
+
 static struct {
 	const char *name;
 	void(*func)(void *);
 } commands[] = {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
+	{ "dir",	thread_fs_dir },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
 	{ "rm",		thread_fs_rm },
 	{ "cat",	thread_fs_cat },
+	{ "export",	thread_fs_export },
 	{ "stat",	thread_fs_stat },
+	{ "clone",	thread_fs_clone },
+	{ "compress",	thread_fs_compress },
+	{ "enable",	thread_fs_enable },
+	{ "defrag",	thread_fs_defrag },
+	{ "check",	thread_fs_check },
+	{ "discard",	thread_fs_discard },
+	{ "copy",	thread_fs_copy },
+	{ "stripe",	thread_fs_stripe },
 	{ "script",	thread_fs_script }
 };
 
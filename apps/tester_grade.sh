@@ -543,7 +543,1014 @@ write_past_file_2() {
     log "Score: ${score}"
 }
 
+#
+# Journal
+#
+
+# commit a file to the journal, crash before unmounting, replay at next mount
+journal_replay() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs journal
+	run_tool ./test_fs.x script test.fs scripts/journal_replay.script
+
+	run_test ./test_fs.x ls test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("file: jfile, size: 13, data_blk: 1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# delete a file, write another one and crash before the delete is committed:
+# the deleted file comes back intact, its block was not reused meanwhile
+journal_reuse() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs journal
+	run_tool ./test_fs.x script test.fs scripts/journal_reuse.script
+
+	run_test ./test_fs.x cat test.fs old
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	local corr_array=()
+	corr_array+=("kept until the delete commits")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Clones
+#
+
+# clone a file, overwrite the first block of the clone, original is untouched
+clone_cow() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./fs_ref.x add test.fs test-file-1.txt
+	run_tool ./test_fs.x clone test.fs test-file-1.txt test-copy
+
+	run_test ./test_fs.x script test.fs scripts/clone_write.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "6")")
+	line_array+=("$(select_line "${STDOUT}" "10")")
+	local corr_array=()
+	corr_array+=("Read 4096 bytes from file. Compared 4096 correct.")
+	corr_array+=("shared_blk_count=8")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+
+#
+# Sparse files
+#
+
+# write far past the end of an empty file, the gap reads back as zeros without
+# taking any data block
+sparse_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/zero of=test-zero.txt bs=4096 count=2
+
+	run_test ./test_fs.x script test.fs scripts/sparse_write.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+
+	rm -f test.fs test-zero.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "7")")
+	line_array+=("$(select_line "${script_out}" "9")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	local corr_array=()
+	corr_array+=("Read 8192 bytes from file. Compared 8192 correct.")
+	corr_array+=("Read 5 bytes from file. Compared 5 correct.")
+	corr_array+=("file: sparse, size: 200005, data_blk: 1")
+	corr_array+=("fat_free_ratio=97/100")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Defragmentation
+#
+
+# two files written in turns end up interleaved, defrag makes both contiguous
+defrag_interleaved() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool dd if=/dev/urandom of=test-blk-a.txt bs=4096 count=1
+	run_tool dd if=/dev/urandom of=test-blk-b.txt bs=4096 count=1
+	cat test-blk-a.txt test-blk-a.txt > test-file-a.txt
+	cat test-blk-b.txt test-blk-b.txt > test-file-b.txt
+	run_tool ./test_fs.x script test.fs scripts/defrag_setup.script
+
+	run_test ./test_fs.x defrag test.fs
+	local defrag_out="${STDOUT}"
+	run_test ./test_fs.x script test.fs scripts/defrag_read.script
+
+	rm -f test.fs test-blk-a.txt test-blk-b.txt test-file-a.txt test-file-b.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${defrag_out}" "1")")
+	line_array+=("$(select_line "${defrag_out}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "3")")
+	line_array+=("$(select_line "${STDOUT}" "6")")
+	local corr_array=()
+	corr_array+=("Before: files=2 fragmented=2 extents=4 free_blk=95 free_extents=1 largest_free=95")
+	corr_array+=("After: files=2 fragmented=0 extents=2 free_blk=95 free_extents=1 largest_free=95")
+	corr_array+=("Read 8192 bytes from file. Compared 8192 correct.")
+	corr_array+=("Read 8192 bytes from file. Compared 8192 correct.")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Consistency check
+#
+
+# corrupt the FAT with a loop and a leaked block, check finds both and repairs them
+check_repair() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./fs_ref.x add test.fs test-file-1.txt
+	# Last block of the file links back to its fifth block, block 50 is allocated
+	printf '\x05\x00' | dd of=test.fs bs=1 seek=$((4096 + 2 * 9)) conv=notrunc 2> /dev/null
+	printf '\xff\xff' | dd of=test.fs bs=1 seek=$((4096 + 2 * 50)) conv=notrunc 2> /dev/null
+
+	run_test ./test_fs.x check test.fs repair
+	local repair_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${repair_out}" "2")")
+	line_array+=("$(select_line "${repair_out}" "3")")
+	line_array+=("$(select_line "${repair_out}" "5")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("file 'test-file-1.txt': chain loops back to block 5")
+	corr_array+=("block 50: allocated (entry 65535) but not part of any file")
+	corr_array+=("repaired_count=2")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Tail packing
+#
+
+# small files and the tails of larger ones share packed blocks, and read back intact
+tail_pack() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs tail
+	run_tool ./test_fs.x add test.fs test-r2.txt
+	run_tool ./test_fs.x add test.fs test-r3.txt
+	run_tool ./test_fs.x add test.fs test-w2.txt
+	run_tool ./test_fs.x add test.fs test-r5.txt
+
+	run_test ./test_fs.x script test.fs scripts/tail_read.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "3")")
+	line_array+=("$(select_line "${script_out}" "6")")
+	line_array+=("$(select_line "${script_out}" "9")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	local corr_array=()
+	corr_array+=("Read 40 bytes from file. Compared 40 correct.")
+	corr_array+=("Read 5000 bytes from file. Compared 5000 correct.")
+	corr_array+=("Read 30000 bytes from file. Compared 30000 correct.")
+	corr_array+=("fat_free_ratio=88/100")
+	corr_array+=("tail_blk_count=2")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+
+#
+# Inline data
+#
+
+# tiny files live in the root directory and move to a data block once they grow
+inline_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs inline
+	run_tool ./test_fs.x add test.fs test-r2.txt
+
+	run_test ./test_fs.x info test.fs
+	local info_before="${STDOUT}"
+	run_test ./test_fs.x script test.fs scripts/inline_write.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${info_before}" "7")")
+	line_array+=("$(select_line "${script_out}" "6")")
+	line_array+=("$(select_line "${script_out}" "9")")
+	line_array+=("$(select_line "${script_out}" "15")")
+	line_array+=("$(select_line "${STDOUT}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "11")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=96/100")
+	corr_array+=("Read 5 bytes from file. Compared 5 correct.")
+	corr_array+=("Read 40 bytes from file. Compared 40 correct.")
+	corr_array+=("Read 5 bytes from file. Compared 5 correct.")
+	corr_array+=("fat_free_ratio=94/100")
+	corr_array+=("inline_file_count=1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Compression
+#
+
+# a compressed file takes fewer blocks, reads back intact, and is compressed
+# again after being written to
+compress_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x add test.fs test-w5.txt
+	run_tool ./test_fs.x compress test.fs test-w5.txt
+
+	run_test ./test_fs.x info test.fs
+	local info_before="${STDOUT}"
+	run_test ./test_fs.x script test.fs scripts/compress_rw.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${info_before}" "7")")
+	line_array+=("$(select_line "${info_before}" "9")")
+	line_array+=("$(select_line "${script_out}" "3")")
+	line_array+=("$(select_line "${script_out}" "8")")
+	line_array+=("$(select_line "${STDOUT}" "9")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=98/100")
+	corr_array+=("compressed_file_count=1")
+	corr_array+=("Read 120000 bytes from file. Compared 120000 correct.")
+	corr_array+=("Read 10000 bytes from file. Compared 10000 correct.")
+	corr_array+=("compressed_file_count=1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Block checksums
+#
+
+# a corrupted data block fails to read and is reported, then repaired, by check
+csum_verify() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs csum
+	run_tool ./test_fs.x add test.fs test-file-1.txt
+	# Overwrite a byte of the first block of the file behind the file system
+	printf 'X' | dd of=test.fs bs=1 seek=$((4 * 4096 + 10)) conv=notrunc 2> /dev/null
+
+	run_test ./test_fs.x cat test.fs test-file-1.txt
+	local cat_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs repair
+	local repair_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${cat_out}" "1")")
+	line_array+=("$(select_line "${repair_out}" "2")")
+	line_array+=("$(select_line "${repair_out}" "4")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("Read file 'test-file-1.txt' (-1/36864 bytes)")
+	corr_array+=("block 1: checksum mismatch")
+	corr_array+=("repaired_count=1")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Deduplication
+#
+
+# a copy of a file shares all of its blocks, and gets its own again when written to
+dedup_copy() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs dedup
+	run_tool cp test-file-1.txt dup-file-1.txt
+	run_tool ./test_fs.x add test.fs test-file-1.txt
+	run_tool ./test_fs.x add test.fs dup-file-1.txt
+
+	run_test ./test_fs.x info test.fs
+	local info_shared="${STDOUT}"
+	run_test ./test_fs.x script test.fs scripts/dedup_cow.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x info test.fs
+	local info_after="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+
+	rm -f test.fs dup-file-1.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${info_shared}" "7")")
+	line_array+=("$(select_line "${info_shared}" "11")")
+	line_array+=("$(select_line "${script_out}" "6")")
+	line_array+=("$(select_line "${script_out}" "9")")
+	line_array+=("$(select_line "${info_after}" "7")")
+	line_array+=("$(select_line "${STDOUT}" "2")")
+	local corr_array=()
+	corr_array+=("fat_free_ratio=89/100")
+	corr_array+=("dedup_ratio=2.00")
+	corr_array+=("Read 36864 bytes from file. Compared 36864 correct.")
+	corr_array+=("Read 3 bytes from file. Compared 3 correct.")
+	corr_array+=("fat_free_ratio=88/100")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Export
+#
+
+# files exported with fs_sendfile match the host files they came from, packed
+# tail included
+export_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs tail
+	run_tool ./test_fs.x add test.fs test-file-1.txt
+	run_tool ./test_fs.x add test.fs test-w2.txt
+
+	run_test ./test_fs.x export test.fs test-file-1.txt exported-1.txt
+	local export_out="${STDOUT}"
+	run_test ./test_fs.x export test.fs test-w2.txt exported-2.txt
+	local export_tail_out="${STDOUT}"
+	local exported_sum="$(cat exported-1.txt exported-2.txt | md5sum)"
+
+	rm -f test.fs exported-1.txt exported-2.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${export_out}" "1")")
+	line_array+=("$(select_line "${export_tail_out}" "1")")
+	line_array+=("${exported_sum}")
+	local corr_array=()
+	corr_array+=("Exported file 'test-file-1.txt' (36864/36864 bytes)")
+	corr_array+=("Exported file 'test-w2.txt' (5000/5000 bytes)")
+	corr_array+=("$(cat test-file-1.txt test-w2.txt | md5sum)")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Bulk import
+#
+
+# Import several files with a single mount, then read them back
+import_files() {
+    log "\n--- Running ${FUNCNAME} ---"
 
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x add test.fs test-w1.txt
+
+	run_test ./test_fs.x import test.fs test-file-1.txt test-w1.txt test-w5.txt test-r2.txt
+	local import_out="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+	run_tool ./test_fs.x export test.fs test-w5.txt exported-5.txt
+	run_tool ./test_fs.x export test.fs test-r2.txt exported-2.txt
+	local imported_sum="$(cat exported-5.txt exported-2.txt | md5sum)"
+	run_test ./test_fs.x check test.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs exported-5.txt exported-2.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${import_out}" "1")")
+	line_array+=("$(select_line "${ls_out}" "3")")
+	line_array+=("$(select_line "${ls_out}" "4")")
+	line_array+=("$(select_line "${ls_out}" "5")")
+	line_array+=("${imported_sum}")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("Imported 3/4 files")
+	corr_array+=("file: test-file-1.txt, size: 36864, data_blk: 2")
+	corr_array+=("file: test-w5.txt, size: 120000, data_blk: 11")
+	corr_array+=("file: test-r2.txt, size: 40, data_blk: 41")
+	corr_array+=("$(cat test-w5.txt test-r2.txt | md5sum)")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Directory listing
+#
+
+# List files with their metadata, skipping free slots and inline files having no block
+dir_list() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x add test.fs test-w1.txt
+	run_tool ./test_fs.x add test.fs test-w2.txt
+	run_tool ./test_fs.x add test.fs test-w4.txt
+	run_tool ./test_fs.x rm test.fs test-w1.txt
+	run_tool ./test_fs.x enable test.fs inline
+	run_tool ./test_fs.x add test.fs test-r2.txt
+	run_tool ./test_fs.x rm test.fs test-w2.txt
+
+	run_test ./test_fs.x dir test.fs
+	local dir_out="${STDOUT}"
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${dir_out}" "1")")
+	line_array+=("$(select_line "${dir_out}" "2")")
+	line_array+=("$(select_line "${dir_out}" "3")")
+	local corr_array=()
+	corr_array+=("slot: 0, file: test-r2.txt, size: 40, data_blk: -1")
+	corr_array+=("slot: 2, file: test-w4.txt, size: 10000, data_blk: 4")
+	corr_array+=("2 files, 10040 bytes")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Trace replay
+#
+
+# Record the calls of a script, then replay them on a fresh disk
+trace_replay() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	FS_TRACE=trace.txt run_tool ./test_fs.x script test.fs scripts/replay_record.script
+	run_tool ./fs_make.x test.fs 100
+
+	run_test ./fs_replay.x test.fs trace.txt
+	local replay_out="${STDOUT}"
+	run_test ./fs_replay.x -t test.fs trace.txt
+	local replay_again_out="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+
+	rm -f test.fs trace.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${replay_out}" "1")")
+	line_array+=("$(echo "${replay_out}" | grep WRITE | cut -d' ' -f1-2)")
+	line_array+=("$(echo "${replay_out}" | grep READ | cut -d' ' -f1-2)")
+	line_array+=("$(select_line "${replay_again_out}" "1")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	local corr_array=()
+	corr_array+=("ops: 10, threads: 1, mismatches: 0")
+	corr_array+=("WRITE: count=2")
+	corr_array+=("READ: count=1")
+	corr_array+=("ops: 10, threads: 1, mismatches: 1")
+	corr_array+=("file: replay-file, size: 120000, data_blk: 1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+# Record a script mounting the disk in memory, the replay mounts it the same way
+# and leaves the disk untouched
+trace_replay_flags() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	FS_TRACE=trace.txt run_tool ./test_fs.x script test.fs scripts/replay_flags.script
+	run_tool ./fs_make.x test.fs 100
+
+	run_test ./fs_replay.x test.fs trace.txt
+	local replay_out="${STDOUT}"
+	local mount_line="$(grep MOUNT trace.txt | head -1 | cut -f5,7)"
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+
+	rm -f test.fs trace.txt
+
+	local line_array=()
+	line_array+=("${mount_line}")
+	line_array+=("$(select_line "${replay_out}" "1")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	local corr_array=()
+	corr_array+=("$(printf 'MOUNT\t0x8')")
+	corr_array+=("ops: 6, threads: 1, mismatches: 0")
+	corr_array+=("")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Tracepoints
+#
+
+# Record tracepoints while reading a file, then convert them to Chrome trace JSON
+tracepoints() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x add test.fs test-file-1.txt
+	FS_TRACEPOINTS=tp.bin run_tool ./test_fs.x cat test.fs test-file-1.txt
+
+	run_test ./fs_tracedump.x tp.bin tp.json
+	local dump_out="${STDOUT}"
+	local begin_count=$(grep -c '"ph":"B"' tp.json)
+	local end_count=$(grep -c '"ph":"E"' tp.json)
+	local read_args=$(grep -m1 '"name":"fs_read"' tp.json | sed 's/.*"args"://')
+
+	rm -f test.fs tp.bin tp.json
+
+	local line_array=()
+	line_array+=("$(select_line "${dump_out}" "1")")
+	line_array+=("$(echo "${dump_out}" | grep fs_read)")
+	line_array+=("$(echo "${dump_out}" | grep 'block_read:')")
+	line_array+=("$(echo "${dump_out}" | grep 'block_read_many:')")
+	line_array+=("${begin_count} ${end_count}")
+	line_array+=("${read_args}")
+	local corr_array=()
+	corr_array+=("events: 28, threads: 1")
+	corr_array+=("fs_read: calls=1")
+	corr_array+=("block_read: calls=3")
+	corr_array+=("block_read_many: calls=1")
+	corr_array+=("14 14")
+	corr_array+=('{"fd":0,"offset":0,"count":36864}},')
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Direct I/O
+#
+
+# Write and read a file on a disk mounted with direct I/O, then read it back normally
+direct_io() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x enable test.fs journal
+	run_test ./test_fs.x script test.fs scripts/direct_rw.script
+	local script_out="${STDOUT}"
+	run_tool ./test_fs.x export test.fs direct-file direct-out.txt
+	local expected_md5=$( (head -c 5000 test-w5.txt; printf abcdefghij; tail -c +5011 test-w5.txt) | md5sum | cut -d' ' -f1)
+	local export_md5=$(md5sum direct-out.txt | cut -d' ' -f1)
+	run_test ./test_fs.x check test.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs direct-out.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "1")")
+	line_array+=("$(select_line "${script_out}" "6")")
+	line_array+=("$(select_line "${script_out}" "10")")
+	line_array+=("${export_md5}")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("MOUNT successful.")
+	corr_array+=("Read 120000 bytes from file. Compared 120000 correct.")
+	corr_array+=("Read 10 bytes from file. Compared 10 correct.")
+	corr_array+=("${expected_md5}")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# File descriptor table
+#
+
+# Keep thousands of descriptors open on a file, which cannot be deleted meanwhile
+fd_table_grow() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./fs_bench.x fds test.fs 5000
+	local bench_out="${STDOUT}"
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(echo "${bench_out}" | grep open_close | awk '{print $1, $2, $4}')")
+	line_array+=("$(echo "${bench_out}" | grep delete_open_file | awk '{print $1, $2, $4}')")
+	line_array+=("$(echo "${ls_out}" | wc -l)")
+	local corr_array=()
+	corr_array+=("open_close: fds=32 fds=5000")
+	corr_array+=("delete_open_file: fds=32 fds=5000")
+	corr_array+=("1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Shared open files
+#
+
+# Read a file a block at a time through descriptors taking turns, sharing the file's chain position
+shared_open_file() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./fs_bench.x shared test.fs test-w5.txt 4
+	local bench_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${bench_out}" "1")")
+	line_array+=("$(select_line "${bench_out}" "2" | cut -d' ' -f1)")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("file: test-w5.txt, size: 120000, descriptors: 4")
+	corr_array+=("read:")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# File system server
+#
+
+# Add a file through the server, then check it on the unmounted disk
+fs_server() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	local server_log=$(mktemp)
+	rm -f test.sock
+	timeout 5 ./fs_server.x test.fs test.sock >${server_log} 2>&1 &
+	local server_pid=$!
+	local i
+	for i in $(seq 50); do
+		[[ -S test.sock ]] && break
+		sleep 0.1
+	done
+	run_test ./fs_client.x test.sock add test-w5.txt
+	local add_out="${STDOUT}"
+	run_test ./fs_client.x test.sock stat test-w5.txt
+	local stat_out="${STDOUT}"
+	run_test ./fs_client.x test.sock shutdown
+	local shutdown_out="${STDOUT}"
+	wait ${server_pid}
+	local server_out=$(cat "${server_log}")
+	run_test ./test_fs.x ls test.fs
+	local ls_out="${STDOUT}"
+
+	rm -f test.fs test.sock "${server_log}"
+
+	local line_array=()
+	line_array+=("$(select_line "${add_out}" "1")")
+	line_array+=("$(select_line "${stat_out}" "1")")
+	line_array+=("$(select_line "${shutdown_out}" "1")")
+	line_array+=("$(select_line "${server_out}" "2")")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	local corr_array=()
+	corr_array+=("Wrote file 'test-w5.txt' (120000/120000 bytes)")
+	corr_array+=("Size of file 'test-w5.txt' is 120000 bytes")
+	corr_array+=("Shut down server")
+	corr_array+=("Unmounted 'test.fs'")
+	corr_array+=("file: test-w5.txt, size: 120000, data_blk: 1")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Parallel fetch
+#
+
+# Read a file of two runs of blocks in one go on a disk with checksums, mounted with direct I/O
+parallel_read() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 1000
+	run_tool ./test_fs.x enable test.fs csum
+	head -c 524288 /dev/urandom > fetch-in.bin
+	cat fetch-in.bin fetch-in.bin > fetch-out.bin
+	FS_TRACEPOINTS=tp.bin run_test ./test_fs.x script test.fs scripts/parallel_read.script
+	local script_out="${STDOUT}"
+	run_test ./fs_tracedump.x tp.bin tp.json
+	local dump_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs tp.bin tp.json fetch-in.bin fetch-out.bin
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "14")")
+	line_array+=("$(select_line "${dump_out}" "1" | cut -d' ' -f4)")
+	line_array+=("$(echo "${dump_out}" | grep 'block_read_many:')")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("Read 1048576 bytes from file. Compared 1048576 correct.")
+	corr_array+=("8")
+	corr_array+=("block_read_many: calls=9")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Delayed allocation
+#
+
+# Append to two files in turns, which interleave unless their blocks are given when they are closed
+delayed_alloc() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./fs_bench.x delalloc test.fs 2 16 100
+	local bench_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${bench_out}" "1")")
+	line_array+=("$(select_line "${bench_out}" "2" | cut -d' ' -f1-3)")
+	line_array+=("$(select_line "${bench_out}" "3" | cut -d' ' -f1-3)")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("files: 2, size: 16384, write size: 100")
+	corr_array+=("immediate: fragmented=2 extents=8")
+	corr_array+=("delayed: fragmented=0 extents=2")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Read-only mounts
+#
+
+# Read a file on a read-only mount, which cannot create files and leaves the disk untouched, then mount it from reader processes at once
+rdonly_mount() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 512
+	run_tool ./test_fs.x enable test.fs csum
+	run_tool ./test_fs.x add test.fs test-w5.txt
+	local before_md5=$(md5sum test.fs | cut -d' ' -f1)
+	run_test ./test_fs.x script test.fs scripts/rdonly_read.script
+	local script_out="${STDOUT}"
+	local script_err="${STDERR}"
+	local after_md5=$(md5sum test.fs | cut -d' ' -f1)
+	run_test ./fs_bench.x rdonly test.fs 4
+	local bench_out="${STDOUT}"
+	run_test ./test_fs.x check test.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "1")")
+	line_array+=("$(select_line "${script_out}" "3")")
+	line_array+=("$(select_line "${script_err}" "1")")
+	line_array+=("${after_md5}")
+	line_array+=("$(select_line "${bench_out}" "1")")
+	line_array+=("$(select_line "${bench_out}" "3" | cut -d' ' -f1)")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("MOUNT successful.")
+	corr_array+=("Read 120000 bytes from file. Compared 120000 correct.")
+	corr_array+=("thread_fs_script: Cannot create file")
+	corr_array+=("${before_md5}")
+	corr_array+=("file: bench-rdonly, size: 1048576, readers: 4")
+	corr_array+=("read-only:")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Discard
+#
+
+# Delete a file on a disk mounted with discard, whose blocks are punched out of the disk file and skipped by a copy of it
+discard_blocks() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_test ./test_fs.x script test.fs scripts/discard_delete.script
+	local script_out="${STDOUT}"
+	run_test ./test_fs.x copy test.fs copy.fs
+	local copy_out="${STDOUT}"
+	run_test ./test_fs.x discard test.fs
+	local discard_out="${STDOUT}"
+	run_tool ./test_fs.x export copy.fs discard-small discard-out.txt
+	local expected_md5=$(md5sum test-w4.txt | cut -d' ' -f1)
+	local export_md5=$(md5sum discard-out.txt | cut -d' ' -f1)
+	run_test ./test_fs.x check copy.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs copy.fs discard-out.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "10")")
+	line_array+=("$(select_line "${copy_out}" "1")")
+	line_array+=("$(select_line "${discard_out}" "1")")
+	line_array+=("${export_md5}")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("DELETE successful.")
+	corr_array+=("Copied disk 'test.fs' to 'copy.fs' (6 blocks of data)")
+	corr_array+=("Discarded 96 free blocks")
+	corr_array+=("${expected_md5}")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# Striping
+#
+
+# Stripe a disk over three backing files, write to it and read its files back, then copy it back to a single file
+stripe_disk() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	run_tool ./test_fs.x add test.fs test-w5.txt
+	run_test ./test_fs.x stripe test.fs striped.fs 3 2
+	local stripe_out="${STDOUT}"
+	local member_size=$(stat -c %s striped.fs.2)
+	run_test ./test_fs.x add striped.fs test-w4.txt
+	local add_out="${STDOUT}"
+	run_tool ./test_fs.x export striped.fs test-w5.txt stripe-out.txt
+	local w5_md5=$(md5sum stripe-out.txt | cut -d' ' -f1)
+	run_test ./test_fs.x stripe striped.fs back.fs 1 1
+	local back_out="${STDOUT}"
+	run_tool ./test_fs.x export back.fs test-w4.txt stripe-out.txt
+	local w4_md5=$(md5sum stripe-out.txt | cut -d' ' -f1)
+	run_test ./test_fs.x check back.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs striped.fs striped.fs.1 striped.fs.2 back.fs stripe-out.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${stripe_out}" "1")")
+	line_array+=("${member_size}")
+	line_array+=("$(select_line "${add_out}" "1")")
+	line_array+=("${w5_md5}")
+	line_array+=("$(select_line "${back_out}" "1")")
+	line_array+=("${w4_md5}")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("Striped disk 'test.fs' as 'striped.fs' over 3 files (33 blocks of data)")
+	corr_array+=("139264")
+	corr_array+=("Wrote file 'test-w4.txt' (10000/10000 bytes)")
+	corr_array+=("$(md5sum test-w5.txt | cut -d' ' -f1)")
+	corr_array+=("Striped disk 'striped.fs' as 'back.fs' over 1 files (36 blocks of data)")
+	corr_array+=("$(md5sum test-w4.txt | cut -d' ' -f1)")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
+
+#
+# RAM disks
+#
+
+# Write a file on a disk mounted in memory and persist it to another disk file, leaving the mounted disk file untouched and later changes unsaved
+ram_disk() {
+    log "\n--- Running ${FUNCNAME} ---"
+
+	run_tool ./fs_make.x test.fs 100
+	local before_md5=$(md5sum test.fs | cut -d' ' -f1)
+	run_test ./test_fs.x script test.fs scripts/ram_persist.script
+	local script_out="${STDOUT}"
+	local after_md5=$(md5sum test.fs | cut -d' ' -f1)
+	run_test ./test_fs.x ls ram-saved.fs
+	local ls_out="${STDOUT}"
+	run_tool ./test_fs.x export ram-saved.fs ram-temp ram-out.txt
+	local export_md5=$(md5sum ram-out.txt | cut -d' ' -f1)
+	run_test ./test_fs.x check ram-saved.fs
+	local check_out="${STDOUT}"
+
+	rm -f test.fs ram-saved.fs ram-out.txt
+
+	local line_array=()
+	line_array+=("$(select_line "${script_out}" "6")")
+	line_array+=("$(select_line "${script_out}" "8")")
+	line_array+=("${after_md5}")
+	line_array+=("$(select_line "${ls_out}" "2")")
+	line_array+=("$(echo "${ls_out}" | wc -l)")
+	line_array+=("${export_md5}")
+	line_array+=("$(select_line "${check_out}" "2")")
+	local corr_array=()
+	corr_array+=("PERSIST successful.")
+	corr_array+=("UMOUNT successful.")
+	corr_array+=("${before_md5}")
+	corr_array+=("file: ram-temp, size: 120000, data_blk: 1")
+	corr_array+=("2")
+	corr_array+=("$(md5sum test-w5.txt | cut -d' ' -f1)")
+	corr_array+=("error_count=0")
+
+    local score
+    compare_lines line_array[@] corr_array[@] score
+    log "Score: ${score}"
+}
 
 #
 # Run tests
@@ -569,6 +1576,58 @@ run_tests() {
     write_block_2
     write_block_3
     write_past_file_2
+    # Journal
+    journal_replay
+    journal_reuse
+    # Clones
+    clone_cow
+    # Sparse files
+    sparse_file
+    # Defragmentation
+    defrag_interleaved
+    # Consistency check
+    check_repair
+    # Tail packing
+    tail_pack
+    # Inline data
+    inline_file
+    # Compression
+    compress_file
+    # Block checksums
+    csum_verify
+    # Deduplication
+    dedup_copy
+    # Export
+    export_file
+    # Bulk import
+    import_files
+    # Directory listing
+    dir_list
+    # Trace replay
+    trace_replay
+    trace_replay_flags
+    # Tracepoints
+    tracepoints
+    # Direct I/O
+    direct_io
+    # File descriptor table
+    fd_table_grow
+    # Shared open files
+    shared_open_file
+    # File system server
+    fs_server
+    # Parallel fetch
+    parallel_read
+    # Delayed allocation
+    delayed_alloc
+    # Read-only mounts
+    rdonly_mount
+    # Discard
+    discard_blocks
+    # Striping
+    stripe_disk
+    # RAM disks
+    ram_disk
 }
 
 make_fs() {
@@ -0,0 +1,634 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Consistency checker.
+ *
+ * fs_check() first validates the geometry in the superblock, then walks the
+ * FAT chain of every file. Walks only read the FAT, so they are spread over a
+ * few threads taking files in turn, each thread with its own visited array to
+ * spot a chain running into itself. A chain ends early at a loop or at an
+ * invalid link (a link to a free block, to a reserved area or out of range);
+ * every block reached is counted in a per-block number of referencing files.
+ * Packed tails are checked against their packed block and against each other
+ * beforehand, and so are the contents of blocks in use against their checksums.
+ * Blocks are then classified in parallel against those counts: an allocated
+ * block reached by no file is leaked, and a block reached by more files than
+ * its reference count allows is cross-linked.
+ *
+ * Repairs are done by the calling thread only. Chains are cut before a loop
+ * or an invalid link and walked again, file sizes are made to match their
+ * chains or inline data, leaked blocks are freed, cross-linked blocks become
+ * shared copy-on-write, the way fs_clone() shares them, and blocks not matching
+ * their checksum take the checksum of their current content.
+ */
+
+#define CHECK_MAX_THREADS 8
+
+// Why a chain ends early
+#define CHECK_CHAIN_OK 0
+#define CHECK_CHAIN_LOOP 1
+#define CHECK_CHAIN_BAD_LINK 2
+
+// Outcome of the walk of one file
+struct file_walk {
+	int problem;
+	// Block where the problem was found
+	int bad_blk;
+	// Last valid block of the chain (-1 if there is none) and its number
+	int last_blk;
+	int last_num;
+};
+
+static struct {
+	struct file_walk walks[FS_FILE_MAX_COUNT];
+	// Number of files reaching each data block
+	uint32_t *refs;
+	// Next file (or first block of the next range) for a worker to take
+	int next_item;
+	// Result of the classification of each data block
+	uint8_t *status;
+	struct fs_check_report report;
+} check;
+
+// What is wrong with a data block
+#define CHECK_BLK_OK 0
+#define CHECK_BLK_LEAKED 1
+#define CHECK_BLK_UNRESERVED 2
+#define CHECK_BLK_CROSS_LINKED 3
+#define CHECK_BLK_BAD_REFCNT 4
+
+// Blocks classified by a worker at a time
+#define CHECK_BLK_RANGE 1024
+// Blocks read at a time when verifying checksums
+#define CHECK_CSUM_BLOCKS 32
+
+static bool in_area(int data_blk, int start, int num_blocks) {
+	return data_blk >= start && data_blk < start + num_blocks;
+}
+
+// returns true if data_blk belongs to an area reserved by an optional feature
+static bool data_blk_reserved_area(int data_blk) {
+	if ((superblk.features & FS_FEATURE_JOURNAL) && in_area(data_blk, superblk.journal_start, superblk.journal_blocks)) {
+		return true;
+	}
+	if ((superblk.features & FS_FEATURE_CLONE) && in_area(data_blk, superblk.refcnt_start, superblk.refcnt_blocks)) {
+		return true;
+	}
+	if ((superblk.features & FS_FEATURE_SPARSE) && in_area(data_blk, superblk.hole_start, superblk.hole_blocks)) {
+		return true;
+	}
+	if ((superblk.features & FS_FEATURE_INLINE) && in_area(data_blk, superblk.rdir_ext_start, superblk.rdir_ext_blocks)) {
+		return true;
+	}
+	if ((superblk.features & FS_FEATURE_CSUM) && in_area(data_blk, superblk.csum_start, superblk.csum_blocks)) {
+		return true;
+	}
+	return false;
+}
+
+// returns true if data_blk can be part of a chain
+static bool valid_chain_blk(int data_blk) {
+	if (data_blk < 1 || data_blk >= superblk.num_data_blocks || data_blk_reserved_area(data_blk)) {
+		return false;
+	}
+	uint16_t entry = get_FAT_entry(data_blk);
+	return entry != 0 && entry != FAT_RESERVED && entry != FAT_TAIL;
+}
+
+// prints a problem and counts it
+static void __attribute__ ((format (printf, 1, 2))) report_error(const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+	check.report.num_errors++;
+}
+
+// returns the number of problems found in the superblock
+static int check_superblock(void) {
+	int num_errors = 0;
+	int expected_FAT = (superblk.num_data_blocks * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	if (superblk.num_data_blocks < 1 || superblk.num_blocks_FAT != expected_FAT) {
+		printf("superblock: %d FAT blocks for %d data blocks\n", superblk.num_blocks_FAT, superblk.num_data_blocks);
+		num_errors++;
+	}
+	if (superblk.root_block_index != superblk.num_blocks_FAT + 1
+			|| superblk.data_block_start_index != superblk.root_block_index + 1) {
+		printf("superblock: root directory at block %d, data at block %d\n",
+				superblk.root_block_index, superblk.data_block_start_index);
+		num_errors++;
+	}
+	if (superblk.num_blocks_on_disk != superblk.data_block_start_index + superblk.num_data_blocks
+			|| superblk.num_blocks_on_disk != block_disk_count()) {
+		printf("superblock: %d blocks on a disk of %d blocks\n", superblk.num_blocks_on_disk, block_disk_count());
+		num_errors++;
+	}
+
+	// Reserved areas must lie within the data blocks
+	int areas[][3] = {
+		{ FS_FEATURE_JOURNAL, superblk.journal_start, superblk.journal_blocks },
+		{ FS_FEATURE_CLONE, superblk.refcnt_start, superblk.refcnt_blocks },
+		{ FS_FEATURE_SPARSE, superblk.hole_start, superblk.hole_blocks },
+		{ FS_FEATURE_INLINE, superblk.rdir_ext_start, superblk.rdir_ext_blocks },
+		{ FS_FEATURE_CSUM, superblk.csum_start, superblk.csum_blocks },
+	};
+	for (size_t i = 0; i < sizeof(areas) / sizeof(areas[0]); i++) {
+		if ((superblk.features & areas[i][0])
+				&& (areas[i][1] < 1 || areas[i][2] < 1 || areas[i][1] + areas[i][2] > superblk.num_data_blocks)) {
+			printf("superblock: reserved area of %d blocks at data block %d\n", areas[i][2], areas[i][1]);
+			num_errors++;
+		}
+	}
+
+	if (get_FAT_entry(0) != FAT_EOC) {
+		printf("FAT: entry 0 is %d\n", get_FAT_entry(0));
+		num_errors++;
+	}
+	return num_errors;
+}
+
+// walks the chain of a file, stamp holding the files that visited each block
+static void walk_file(int rootdir_idx, int *stamp) {
+	struct file_walk *walk = &check.walks[rootdir_idx];
+	walk->problem = CHECK_CHAIN_OK;
+	walk->last_blk = -1;
+	walk->last_num = -1;
+
+	int data_blk = rootdir_arr[rootdir_idx].first_data_block_index;
+	int blk_num = rootdir_arr[rootdir_idx].lead_hole;
+	while (data_blk != FAT_EOC) {
+		if (!valid_chain_blk(data_blk) || stamp[data_blk] == rootdir_idx + 1) {
+			walk->problem = valid_chain_blk(data_blk) ? CHECK_CHAIN_LOOP : CHECK_CHAIN_BAD_LINK;
+			walk->bad_blk = data_blk;
+			break;
+		}
+		stamp[data_blk] = rootdir_idx + 1;
+		walk->last_blk = data_blk;
+		walk->last_num = blk_num;
+
+		uint16_t entry = get_FAT_entry(data_blk);
+		if (entry == FAT_EOC) {
+			break;
+		}
+		if (!FAT_IS_LINK(entry) || (FAT_IS_HOLE(entry) && hole_get(data_blk) == 0)) {
+			walk->problem = CHECK_CHAIN_BAD_LINK;
+			walk->bad_blk = data_blk;
+			break;
+		}
+		blk_num += 1 + (FAT_IS_HOLE(entry) ? hole_get(data_blk) : 0);
+		data_blk = FAT_NEXT(entry);
+	}
+
+	// Count the files reaching each block of the valid part of the chain
+	if (walk->last_blk == -1) {
+		return;
+	}
+	data_blk = rootdir_arr[rootdir_idx].first_data_block_index;
+	while (1) {
+		__atomic_fetch_add(&check.refs[data_blk], 1, __ATOMIC_RELAXED);
+		if (data_blk == walk->last_blk) {
+			break;
+		}
+		data_blk = FAT_NEXT(get_FAT_entry(data_blk));
+	}
+}
+
+static void *walk_worker(void *arg) {
+	int *stamp = arg;
+	while (1) {
+		int rootdir_idx = __atomic_fetch_add(&check.next_item, 1, __ATOMIC_RELAXED);
+		if (rootdir_idx >= FS_FILE_MAX_COUNT) {
+			return NULL;
+		}
+		if (rootdir_arr[rootdir_idx].filename[0] != '\0') {
+			walk_file(rootdir_idx, stamp);
+		}
+	}
+}
+
+static void classify_blk(int data_blk) {
+	uint16_t entry = get_FAT_entry(data_blk);
+	uint32_t refs = check.refs[data_blk];
+	uint8_t status = CHECK_BLK_OK;
+
+	if (data_blk_reserved_area(data_blk)) {
+		if (entry != FAT_RESERVED) {
+			status = CHECK_BLK_UNRESERVED;
+		}
+	} else if (entry == FAT_TAIL) {
+		status = CHECK_BLK_LEAKED;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (rootdir_arr[i].filename[0] != '\0' && rootdir_arr[i].tail_block == data_blk) {
+				status = CHECK_BLK_OK;
+				break;
+			}
+		}
+	} else if (refs == 0) {
+		if (entry != 0) {
+			status = CHECK_BLK_LEAKED;
+		} else if (refcnt_get(data_blk) > 0) {
+			status = CHECK_BLK_BAD_REFCNT;
+		}
+	} else if (refs - 1 > refcnt_get(data_blk)) {
+		status = CHECK_BLK_CROSS_LINKED;
+	} else if (refs - 1 < refcnt_get(data_blk)) {
+		status = CHECK_BLK_BAD_REFCNT;
+	}
+	check.status[data_blk] = status;
+}
+
+static void *classify_worker(void *arg) {
+	(void)arg;
+	while (1) {
+		int start = __atomic_fetch_add(&check.next_item, CHECK_BLK_RANGE, __ATOMIC_RELAXED);
+		if (start >= superblk.num_data_blocks) {
+			return NULL;
+		}
+		for (int i = start; i < start + CHECK_BLK_RANGE && i < superblk.num_data_blocks; i++) {
+			if (i > 0) {
+				classify_blk(i);
+			}
+		}
+	}
+}
+
+// returns -1 if the per-thread state could not be allocated
+// otherwise, runs worker on a few threads (with a visited array each if
+// with_stamp) until it runs out of work
+static int run_workers(void *(*worker)(void *), bool with_stamp) {
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1) {
+		num_threads = 1;
+	} else if (num_threads > CHECK_MAX_THREADS) {
+		num_threads = CHECK_MAX_THREADS;
+	}
+
+	pthread_t threads[CHECK_MAX_THREADS];
+	int *stamps[CHECK_MAX_THREADS] = { NULL };
+	bool started[CHECK_MAX_THREADS] = { false };
+	int ret = 0;
+
+	check.next_item = 0;
+	for (long i = 0; i < num_threads; i++) {
+		if (with_stamp) {
+			stamps[i] = calloc(superblk.num_data_blocks, sizeof(int));
+			if (stamps[i] == NULL) {
+				fprintf(stderr, "Malloc failed");
+				ret = -1;
+				break;
+			}
+		}
+		started[i] = (pthread_create(&threads[i], NULL, worker, stamps[i]) == 0);
+	}
+	for (long i = 0; i < num_threads; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	// Finish the work inline if no thread could be started
+	if (ret == 0 && !started[0]) {
+		worker(stamps[0]);
+	}
+	for (long i = 0; i < num_threads; i++) {
+		free(stamps[i]);
+	}
+	return ret;
+}
+
+// returns -1 if the chains could not be walked
+// otherwise, walks every chain and returns the number of chains ending early
+static int walk_all(void) {
+	memset(check.refs, 0, superblk.num_data_blocks * sizeof(uint32_t));
+	if (run_workers(walk_worker, true) == -1) {
+		return -1;
+	}
+	int num_bad = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0' && check.walks[i].problem != CHECK_CHAIN_OK) {
+			num_bad++;
+		}
+	}
+	return num_bad;
+}
+
+// reports chains ending early, and cuts them if repair is set
+static void check_chains(bool repair) {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct file_walk *walk = &check.walks[i];
+		if (rootdir_arr[i].filename[0] == '\0' || walk->problem == CHECK_CHAIN_OK) {
+			continue;
+		}
+		if (walk->problem == CHECK_CHAIN_LOOP) {
+			report_error("file '%s': chain loops back to block %d\n", (char*)rootdir_arr[i].filename, walk->bad_blk);
+			check.report.num_loops++;
+		} else {
+			report_error("file '%s': invalid link at block %d\n", (char*)rootdir_arr[i].filename, walk->bad_blk);
+			check.report.num_bad_links++;
+		}
+		if (!repair) {
+			continue;
+		}
+
+		if (walk->last_blk == -1) {
+			rootdir_arr[i].first_data_block_index = FAT_EOC;
+			rootdir_arr[i].lead_hole = 0;
+			dirent_changed(i);
+		} else {
+			set_FAT_entry(walk->last_blk, FAT_EOC);
+		}
+		check.report.num_repaired++;
+	}
+}
+
+// returns -1 if the disk could not be read
+// otherwise, reports blocks in use whose content does not match their checksum,
+// and checksums their current content if repair is set
+static int check_csums(bool repair) {
+	if (!(superblk.features & FS_FEATURE_CSUM)) {
+		return 0;
+	}
+	char *buf = block_alloc(CHECK_CSUM_BLOCKS);
+	if (buf == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	for (int i = 1; i < superblk.num_data_blocks; i += CHECK_CSUM_BLOCKS) {
+		int count = superblk.num_data_blocks - i;
+		if (count > CHECK_CSUM_BLOCKS) {
+			count = CHECK_CSUM_BLOCKS;
+		}
+		// Read around the checksums, which read_data_block() would verify
+		if (block_read_many(superblk.data_block_start_index + i, count, buf) == -1) {
+			fprintf(stderr, "Could not read from disk (checksums)\n");
+			free(buf);
+			return -1;
+		}
+		for (int j = 0; j < count; j++) {
+			int data_blk = i + j;
+			uint16_t entry = get_FAT_entry(data_blk);
+			if (entry == 0 || entry == FAT_RESERVED || data_blk_reserved_area(data_blk)) {
+				continue;
+			}
+			uint32_t crc = crc32c(0, buf + j * BLOCK_SIZE, BLOCK_SIZE);
+			if (csum_match(data_blk, crc)) {
+				continue;
+			}
+			report_error("block %d: checksum mismatch\n", data_blk);
+			check.report.num_bad_csums++;
+			if (repair) {
+				csum_set(data_blk, crc);
+				check.report.num_repaired++;
+			}
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+// reports packed tails pointing outside a packed block or overlapping other
+// tails, and repairs them if repair is set (dropping the tail in the first case)
+static void check_tails(bool repair) {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		int data_blk = rootdir_arr[i].tail_block;
+		if (rootdir_arr[i].filename[0] == '\0' || data_blk == 0) {
+			continue;
+		}
+		uint32_t len = rootdir_arr[i].file_size % BLOCK_SIZE;
+		if (data_blk >= superblk.num_data_blocks || get_FAT_entry(data_blk) != FAT_TAIL
+				|| len == 0 || rootdir_arr[i].tail_offset + len > BLOCK_SIZE) {
+			report_error("file '%s': invalid packed tail in block %d\n", (char*)rootdir_arr[i].filename, data_blk);
+			check.report.num_bad_links++;
+			if (repair) {
+				rootdir_arr[i].tail_block = 0;
+				rootdir_arr[i].tail_offset = 0;
+				rootdir_arr[i].file_size -= len;
+				dirent_changed(i);
+				check.report.num_repaired++;
+			}
+			continue;
+		}
+
+		// Clones may point at the very same tail, anything else must not overlap
+		for (int j = 0; j < i; j++) {
+			if (rootdir_arr[j].filename[0] == '\0' || rootdir_arr[j].tail_block != data_blk) {
+				continue;
+			}
+			uint32_t start = rootdir_arr[j].tail_offset;
+			uint32_t end = start + rootdir_arr[j].file_size % BLOCK_SIZE;
+			bool same = (start == rootdir_arr[i].tail_offset && end == rootdir_arr[i].tail_offset + len);
+			if (same || end <= rootdir_arr[i].tail_offset || start >= rootdir_arr[i].tail_offset + len) {
+				continue;
+			}
+			report_error("file '%s': packed tail overlaps the tail of '%s'\n",
+					(char*)rootdir_arr[i].filename, (char*)rootdir_arr[j].filename);
+			check.report.num_cross_linked++;
+			if (repair && tail_unpack(i) == 0) {
+				check.report.num_repaired++;
+			}
+			break;
+		}
+	}
+}
+
+// reports files whose size does not match their chain, and fixes the size if
+// repair is set
+static void check_sizes(bool repair) {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] == '\0') {
+			continue;
+		}
+		uint32_t size = rootdir_arr[i].file_size;
+		uint32_t num_blocks = check.walks[i].last_num + 1;
+		bool empty_chain = (rootdir_arr[i].first_data_block_index == FAT_EOC);
+		bool size_ok;
+		if (file_is_inline(i)) {
+			// Contents are all in the inline data
+			size_ok = empty_chain && !file_has_tail(i) && size <= INLINE_MAX;
+		} else if (file_is_compressed(i)) {
+			// Chain holds the compressed stream, whose header gives its length
+			int num_stored = compress_stored_blocks(i);
+			size_ok = num_stored != -1 && (uint32_t)num_stored == num_blocks && !file_has_tail(i);
+		} else if (file_has_tail(i)) {
+			// Chain stops before the block of the packed tail
+			size_ok = num_blocks <= size / BLOCK_SIZE;
+		} else {
+			size_ok = ((uint64_t)size + BLOCK_SIZE - 1) / BLOCK_SIZE == num_blocks;
+		}
+		if (size_ok && (!empty_chain || rootdir_arr[i].lead_hole == 0)) {
+			continue;
+		}
+
+		report_error("file '%s': size %u for %u blocks\n", (char*)rootdir_arr[i].filename, size, num_blocks);
+		check.report.num_bad_sizes++;
+		if (!repair) {
+			continue;
+		}
+
+		if (empty_chain) {
+			rootdir_arr[i].lead_hole = 0;
+		}
+		if (file_is_inline(i) && empty_chain && !file_has_tail(i)) {
+			rootdir_arr[i].file_size = INLINE_MAX;
+			dirent_changed(i);
+			check.report.num_repaired++;
+			continue;
+		}
+		// A chain wins over inline data, and is taken as plain data
+		inline_set(i, false);
+		rootdir_arr[i].flags &= ~DIRENT_COMPRESSED;
+		compress_forget(i);
+		tail_release(i);
+		rootdir_arr[i].file_size = num_blocks * BLOCK_SIZE;
+		dirent_changed(i);
+		check.report.num_repaired++;
+	}
+}
+
+// reports leaked, cross-linked and misreserved blocks, and fixes them if
+// repair is set
+static void check_blocks(bool repair) {
+	for (int i = 1; i < superblk.num_data_blocks; i++) {
+		uint8_t status = check.status[i];
+		if (status == CHECK_BLK_OK) {
+			continue;
+		}
+
+		if (status == CHECK_BLK_LEAKED) {
+			report_error("block %d: allocated (entry %d) but not part of any file\n", i, get_FAT_entry(i));
+			check.report.num_leaked++;
+			if (repair) {
+				if (FAT_IS_HOLE(get_FAT_entry(i))) {
+					hole_set(i, 0);
+				}
+				tail_forget(i);
+				set_FAT_entry(i, 0);
+				if (refcnt_get(i) > 0) {
+					refcnt_set(i, 0);
+				}
+				check.report.num_repaired++;
+			}
+		} else if (status == CHECK_BLK_UNRESERVED) {
+			report_error("block %d: part of a reserved area but not reserved (entry %d)\n", i, get_FAT_entry(i));
+			if (repair) {
+				set_FAT_entry(i, FAT_RESERVED);
+				check.report.num_repaired++;
+			}
+		} else if (status == CHECK_BLK_BAD_REFCNT) {
+			report_error("block %d: reference count %d for %d files\n", i, refcnt_get(i), check.refs[i]);
+			if (repair) {
+				refcnt_set(i, check.refs[i] > 0 ? check.refs[i] - 1 : 0);
+				check.report.num_repaired++;
+			}
+		}
+	}
+
+	// Cross-linked blocks become shared, once leaked blocks are free again to
+	// make room for the reference count table
+	for (int i = 1; i < superblk.num_data_blocks; i++) {
+		if (check.status[i] != CHECK_BLK_CROSS_LINKED) {
+			continue;
+		}
+		report_error("block %d: reached by %d files\n", i, check.refs[i]);
+		check.report.num_cross_linked++;
+		if (!repair || check.refs[i] - 1 > UINT8_MAX) {
+			continue;
+		}
+		if (!(superblk.features & FS_FEATURE_CLONE) && fs_enable(FS_FEATURE_CLONE) == -1) {
+			continue;
+		}
+		refcnt_set(i, check.refs[i] - 1);
+		check.report.num_repaired++;
+	}
+}
+
+int fs_check(unsigned int flags, struct fs_check_report *report) {
+	TP_SCOPE(TP_FS_CHECK, -1, 0, 0);
+	// Check if no FS is mounted, if flags are unknown, or if repairs are asked of a read-only mount
+	if (!FS_mounted || (flags & ~FS_CHECK_REPAIR) || (FS_rdonly && (flags & FS_CHECK_REPAIR))) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+	bool repair = flags & FS_CHECK_REPAIR;
+	memset(&check.report, 0, sizeof(check.report));
+
+	printf("FS Check:\n");
+
+	// Nothing else can be trusted with a broken geometry
+	int num_errors = check_superblock();
+	if (num_errors > 0) {
+		check.report.num_errors = num_errors;
+		if (report != NULL) {
+			*report = check.report;
+		}
+		printf("error_count=%d\nrepaired_count=0\n", num_errors);
+		return num_errors;
+	}
+
+	check.refs = malloc(superblk.num_data_blocks * sizeof(uint32_t));
+	check.status = malloc(superblk.num_data_blocks * sizeof(uint8_t));
+	if (check.refs == NULL || check.status == NULL) {
+		fprintf(stderr, "Malloc failed");
+		free(check.refs);
+		free(check.status);
+		return -1;
+	}
+
+	int ret = check_csums(repair);
+	if (ret == -1) {
+		free(check.refs);
+		free(check.status);
+		return -1;
+	}
+	check_tails(repair);
+	ret = walk_all();
+	if (ret > 0) {
+		check_chains(repair);
+		// Cutting a chain shared with other files changes their walk too
+		for (int pass = 0; repair && ret > 0 && pass < FS_FILE_MAX_COUNT; pass++) {
+			ret = walk_all();
+			if (ret > 0) {
+				check_chains(repair);
+			}
+		}
+	}
+	if (ret != -1) {
+		check_sizes(repair);
+		ret = run_workers(classify_worker, false);
+	}
+	if (ret != -1) {
+		check_blocks(repair);
+	}
+
+	free(check.refs);
+	free(check.status);
+	if (ret == -1) {
+		return -1;
+	}
+	if (repair && check.report.num_repaired > 0) {
+		journal_maybe_commit();
+	}
+
+	printf("error_count=%d\n", check.report.num_errors);
+	printf("repaired_count=%d\n", check.report.num_repaired);
+	if (report != NULL) {
+		*report = check.report;
+	}
+	return check.report.num_errors - check.report.num_repaired;
+}
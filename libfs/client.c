@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "fs_client.h"
+
+/*
+ * Client side of the protocol of fs_proto.h.
+ *
+ * Requests are numbered in the order they are submitted, and responses are
+ * checked to come back in that order. Synchronous calls are a submit followed
+ * by a receive, so they must not be mixed with requests whose responses have
+ * not been received yet.
+ */
+
+struct fs_client {
+	int sock;
+	// Identifier of the next request to submit, and of the next response due
+	uint32_t next_id;
+	uint32_t next_response;
+};
+
+// returns -1 if the whole of iov could not be sent (without raising SIGPIPE in
+// the program if the server is gone)
+static int send_all(int sock, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t ret = sendmsg(sock, &msg, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			perror("sendmsg");
+			return -1;
+		}
+		// Skip what was sent
+		while (iovcnt > 0 && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
+		}
+	}
+	return 0;
+}
+
+// returns -1 if len bytes could not be received (NULL buf discards them)
+static int recv_all(int sock, void *buf, size_t len) {
+	char discard[4096];
+	while (len > 0) {
+		void *dst = (buf != NULL) ? buf : discard;
+		size_t chunk = (buf != NULL || len < sizeof(discard)) ? len : sizeof(discard);
+		ssize_t ret = read(sock, dst, chunk);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			if (ret < 0) {
+				perror("read");
+			}
+			return -1;
+		}
+		if (buf != NULL) {
+			buf = (char *)buf + ret;
+		}
+		len -= ret;
+	}
+	return 0;
+}
+
+struct fs_client *fs_client_connect(const char *socket_path) {
+	struct sockaddr_un addr;
+	if (socket_path == NULL || strlen(socket_path) >= sizeof(addr.sun_path)) {
+		return NULL;
+	}
+	struct fs_client *client = calloc(1, sizeof(struct fs_client));
+	if (client == NULL) {
+		return NULL;
+	}
+	client->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (client->sock < 0) {
+		perror("socket");
+		free(client);
+		return NULL;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+	if (connect(client->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		fs_client_disconnect(client);
+		return NULL;
+	}
+
+	if (fs_client_submit(client, FS_OP_HELLO, -1, 0, NULL, 0) == -1
+			|| fs_client_receive(client, NULL, 0) != FS_PROTO_VERSION) {
+		fprintf(stderr, "fs_client_connect: server speaks another protocol\n");
+		fs_client_disconnect(client);
+		return NULL;
+	}
+	return client;
+}
+
+void fs_client_disconnect(struct fs_client *client) {
+	if (client == NULL) {
+		return;
+	}
+	close(client->sock);
+	free(client);
+}
+
+int fs_client_submit(struct fs_client *client, int op, int fd, size_t arg, const void *data, size_t data_len) {
+	if (client == NULL || data_len > FS_PROTO_MAX_DATA) {
+		return -1;
+	}
+	struct fs_proto_request request = {
+		.id = client->next_id,
+		.op = op,
+		.fd = fd,
+		.arg = arg,
+		.data_len = data_len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &request, .iov_len = sizeof(request) },
+		{ .iov_base = (void *)data, .iov_len = data_len },
+	};
+	if (send_all(client->sock, iov, (data_len > 0) ? 2 : 1) == -1) {
+		return -1;
+	}
+	client->next_id++;
+	return 0;
+}
+
+int fs_client_receive(struct fs_client *client, void *buf, size_t buf_len) {
+	struct fs_proto_response response;
+	if (client == NULL || client->next_response == client->next_id) {
+		return -1;
+	}
+	if (recv_all(client->sock, &response, sizeof(response)) == -1) {
+		return -1;
+	}
+	if (response.id != client->next_response) {
+		fprintf(stderr, "fs_client_receive: response %u out of order\n", response.id);
+		return -1;
+	}
+	client->next_response++;
+	if (response.data_len > buf_len || buf == NULL) {
+		// Keep the stream in step even if the data is dropped
+		if (recv_all(client->sock, NULL, response.data_len) == -1 || response.data_len > 0) {
+			return -1;
+		}
+		return response.ret;
+	}
+	if (recv_all(client->sock, buf, response.data_len) == -1) {
+		return -1;
+	}
+	return response.ret;
+}
+
+// returns the result of a request, sent and answered right away
+static int client_call(struct fs_client *client, int op, int fd, size_t arg, const void *data, size_t data_len,
+		void *buf, size_t buf_len) {
+	if (fs_client_submit(client, op, fd, arg, data, data_len) == -1) {
+		return -1;
+	}
+	return fs_client_receive(client, buf, buf_len);
+}
+
+// returns the result of a request taking a file name
+static int client_call_name(struct fs_client *client, int op, const char *filename) {
+	if (filename == NULL) {
+		return -1;
+	}
+	return client_call(client, op, -1, 0, filename, strlen(filename) + 1, NULL, 0);
+}
+
+int fs_client_create(struct fs_client *client, const char *filename) {
+	return client_call_name(client, FS_OP_CREATE, filename);
+}
+
+int fs_client_delete(struct fs_client *client, const char *filename) {
+	return client_call_name(client, FS_OP_DELETE, filename);
+}
+
+int fs_client_clone(struct fs_client *client, const char *src, const char *dst) {
+	if (src == NULL || dst == NULL) {
+		return -1;
+	}
+	size_t src_len = strlen(src) + 1, dst_len = strlen(dst) + 1;
+	char names[2 * FS_FILENAME_LEN];
+	if (src_len > FS_FILENAME_LEN || dst_len > FS_FILENAME_LEN) {
+		return -1;
+	}
+	memcpy(names, src, src_len);
+	memcpy(names + src_len, dst, dst_len);
+	return client_call(client, FS_OP_CLONE, -1, 0, names, src_len + dst_len, NULL, 0);
+}
+
+int fs_client_open(struct fs_client *client, const char *filename) {
+	return client_call_name(client, FS_OP_OPEN, filename);
+}
+
+int fs_client_close(struct fs_client *client, int fd) {
+	return client_call(client, FS_OP_CLOSE, fd, 0, NULL, 0, NULL, 0);
+}
+
+int fs_client_stat(struct fs_client *client, int fd) {
+	return client_call(client, FS_OP_STAT, fd, 0, NULL, 0, NULL, 0);
+}
+
+int fs_client_lseek(struct fs_client *client, int fd, size_t offset) {
+	return client_call(client, FS_OP_LSEEK, fd, offset, NULL, 0, NULL, 0);
+}
+
+int fs_client_write(struct fs_client *client, int fd, const void *buf, size_t count) {
+	if (buf == NULL) {
+		return -1;
+	}
+	// Large writes go in several requests
+	size_t total = 0;
+	while (total < count) {
+		size_t chunk = (count - total < FS_PROTO_MAX_DATA) ? count - total : FS_PROTO_MAX_DATA;
+		int ret = client_call(client, FS_OP_WRITE, fd, 0, (const char *)buf + total, chunk, NULL, 0);
+		if (ret < 0) {
+			return (total > 0) ? (int)total : -1;
+		}
+		total += ret;
+		if ((size_t)ret < chunk) {
+			break;
+		}
+	}
+	return total;
+}
+
+int fs_client_read(struct fs_client *client, int fd, void *buf, size_t count) {
+	if (buf == NULL) {
+		return -1;
+	}
+	size_t total = 0;
+	while (total < count) {
+		size_t chunk = (count - total < FS_PROTO_MAX_DATA) ? count - total : FS_PROTO_MAX_DATA;
+		int ret = client_call(client, FS_OP_READ, fd, chunk, NULL, 0, (char *)buf + total, chunk);
+		if (ret < 0) {
+			return (total > 0) ? (int)total : -1;
+		}
+		total += ret;
+		if ((size_t)ret < chunk) {
+			break;
+		}
+	}
+	return total;
+}
+
+int fs_client_sync(struct fs_client *client) {
+	return client_call(client, FS_OP_SYNC, -1, 0, NULL, 0, NULL, 0);
+}
+
+int fs_client_stat_many(struct fs_client *client, struct fs_dirent *entries, int max_entries) {
+	if (entries == NULL || max_entries < 0) {
+		return -1;
+	}
+	return client_call(client, FS_OP_STAT_MANY, -1, max_entries, NULL, 0,
+			entries, (size_t)max_entries * sizeof(struct fs_dirent));
+}
+
+int fs_client_shutdown(struct fs_client *client) {
+	return client_call(client, FS_OP_SHUTDOWN, -1, 0, NULL, 0, NULL, 0);
+}
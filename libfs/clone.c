@@ -0,0 +1,163 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * File clones sharing data blocks.
+ *
+ * fs_clone() points a new file at the FAT chain of an existing one, so that no
+ * data block is read or written. A table reserved at the end of the disk holds,
+ * for each data block, the number of files referencing it besides the first
+ * one (0 for a block owned by a single file, which is the case of every block
+ * on disks without clones).
+ *
+ * Since a FAT entry both stands for a block of data and links to the next
+ * block of the file, sharing a block means sharing the rest of the chain as
+ * well. Before a file modifies a shared block, it gets its own copy of that
+ * block and of every shared block leading to it (see chain_prepare_write()),
+ * while the rest of the chain stays shared.
+ */
+
+// Reference counts (NULL if the disk has no table)
+static uint8_t *refcnt_table;
+
+int refcnt_format(void) {
+	int num_blocks = (superblk.num_data_blocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start = reserve_data_blocks(num_blocks);
+	if (start == -1) {
+		fprintf(stderr, "Not enough free space at the end of the disk for reference counts\n");
+		return -1;
+	}
+	superblk.refcnt_start = start;
+	superblk.refcnt_blocks = num_blocks;
+
+	refcnt_table = block_alloc(num_blocks);
+	if (refcnt_table == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	memset(refcnt_table, 0, (size_t)num_blocks * BLOCK_SIZE);
+	return refcnt_store();
+}
+
+int refcnt_load(void) {
+	refcnt_table = load_data_blocks(superblk.refcnt_start, superblk.refcnt_blocks);
+	if (refcnt_table == NULL) {
+		fprintf(stderr, "Could not read from disk (reference counts)\n");
+		return -1;
+	}
+	return 0;
+}
+
+int refcnt_store(void) {
+	if (refcnt_table == NULL) {
+		return 0;
+	}
+	if (store_data_blocks(superblk.refcnt_start, superblk.refcnt_blocks, refcnt_table) == -1) {
+		fprintf(stderr, "Could not write to disk (reference counts)\n");
+		return -1;
+	}
+	return 0;
+}
+
+void refcnt_unload(void) {
+	unload_data_blocks(refcnt_table);
+	refcnt_table = NULL;
+}
+
+uint8_t refcnt_get(int data_blk) {
+	if (refcnt_table == NULL || data_blk < 0 || data_blk >= superblk.num_data_blocks) {
+		return 0;
+	}
+	return refcnt_table[data_blk];
+}
+
+void refcnt_set(int data_blk, uint8_t value) {
+	refcnt_table[data_blk] = value;
+	journal_note_refcnt(data_blk);
+}
+
+bool data_blk_shared(int data_blk) {
+	return refcnt_get(data_blk) > 0;
+}
+
+// drops one of the extra references to a shared block
+void refcnt_put(int data_blk) {
+	refcnt_set(data_blk, refcnt_table[data_blk] - 1);
+}
+
+int fs_clone(const char *src, const char *dst) {
+	TP_SCOPE(TP_FS_CLONE, -1, 0, 0);
+	// Check if no FS is mounted (or mounted read-only) or if filenames are invalid
+	if (!FS_mounted || FS_rdonly || src == NULL || dst == NULL) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	// Check if file to clone exists in root directory
+	int src_idx = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0' && !(strcmp((char*)&rootdir_arr[i].filename, src))) {
+			src_idx = i;
+			break;
+		}
+	}
+	if (src_idx == -1) {
+		return -1;
+	}
+
+	// Reference counts are needed from the first clone on
+	if (!(superblk.features & FS_FEATURE_CLONE) && fs_enable(FS_FEATURE_CLONE) == -1) {
+		return -1;
+	}
+
+	// Make sure no block of the chain would overflow its reference count
+	uint16_t data_blk = rootdir_arr[src_idx].first_data_block_index;
+	for (int i = 0; FAT_IS_LINK(data_blk) && i < superblk.num_data_blocks; i++) {
+		if (refcnt_get(data_blk) == UINT8_MAX) {
+			return -1;
+		}
+		data_blk = FAT_NEXT(get_FAT_entry(data_blk));
+	}
+
+	if (fs_create(dst) == -1) {
+		return -1;
+	}
+	int dst_idx = 0;
+	while (strcmp((char*)&rootdir_arr[dst_idx].filename, dst)) {
+		dst_idx++;
+	}
+
+	// New file takes the whole chain of the source file
+	rootdir_arr[dst_idx].file_size = rootdir_arr[src_idx].file_size;
+	rootdir_arr[dst_idx].first_data_block_index = rootdir_arr[src_idx].first_data_block_index;
+	rootdir_arr[dst_idx].lead_hole = rootdir_arr[src_idx].lead_hole;
+	// A packed tail never changes in place, so both files can point at it
+	rootdir_arr[dst_idx].tail_block = rootdir_arr[src_idx].tail_block;
+	rootdir_arr[dst_idx].tail_offset = rootdir_arr[src_idx].tail_offset;
+	// Inline data is copied, it is too small to be worth sharing
+	rootdir_arr[dst_idx].flags = rootdir_arr[src_idx].flags;
+	if (file_is_inline(src_idx)) {
+		memcpy(inline_data(dst_idx), inline_data(src_idx), INLINE_MAX);
+	}
+	dirent_changed(dst_idx);
+
+	data_blk = rootdir_arr[src_idx].first_data_block_index;
+	for (int i = 0; FAT_IS_LINK(data_blk) && i < superblk.num_data_blocks; i++) {
+		refcnt_set(data_blk, refcnt_get(data_blk) + 1);
+		data_blk = FAT_NEXT(get_FAT_entry(data_blk));
+	}
+
+	journal_maybe_commit();
+	return 0;
+}
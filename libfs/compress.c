@@ -0,0 +1,459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Per-file compression.
+ *
+ * The data of a file with compression on is cut into chunks of COMPRESS_CHUNK
+ * bytes, each compressed on its own with the LZ codec of lz.c (or kept as is
+ * when it does not shrink). The FAT chain of a compressed file holds a stream
+ * made of a header, the chunk index (where each chunk ends in the stream) and
+ * the chunks one after the other. Reading from the file only reads and
+ * decompresses the chunks holding the requested bytes.
+ *
+ * Like tail packing, compression happens when the last descriptor of a file
+ * is closed, and the first write to a compressed file stores it plainly again.
+ * A file is only compressed when that saves at least one block.
+ *
+ * The chunk index of the last file read and its last decompressed chunk are
+ * cached, so that sequential reads decompress each chunk once.
+ */
+
+#define COMPRESS_MAGIC 0x535A4C46
+
+struct __attribute__ ((__packed__)) compress_header {
+	uint32_t magic;
+	uint32_t num_chunks;
+	// Length of the whole stream (header and chunk index included)
+	uint32_t stored_len;
+};
+
+// Chunk index and last chunk of the last compressed file read
+static struct {
+	// File the index belongs to (-1 if none)
+	int rootdir_idx;
+	uint32_t num_chunks;
+	// End of each chunk in the stream
+	uint32_t *chunk_end;
+	// Chunk held in data (-1 if none)
+	long chunk;
+	uint8_t data[COMPRESS_CHUNK];
+} comp_cache = { .rootdir_idx = -1 };
+
+bool file_is_compressed(int rootdir_idx) {
+	return rootdir_arr[rootdir_idx].flags & DIRENT_COMPRESSED;
+}
+
+void compress_forget(int rootdir_idx) {
+	if (comp_cache.rootdir_idx == rootdir_idx) {
+		compress_unload();
+	}
+}
+
+void compress_unload(void) {
+	free(comp_cache.chunk_end);
+	comp_cache.chunk_end = NULL;
+	comp_cache.rootdir_idx = -1;
+}
+
+// returns the number of chunks of a file of file_size bytes
+static uint32_t num_chunks_for(uint32_t file_size) {
+	return (file_size + COMPRESS_CHUNK - 1) / COMPRESS_CHUNK;
+}
+
+// returns the number of bytes of chunk number chunk of a file
+static uint32_t chunk_len(int rootdir_idx, uint32_t chunk) {
+	uint32_t len = rootdir_arr[rootdir_idx].file_size - chunk * COMPRESS_CHUNK;
+	return (len < COMPRESS_CHUNK) ? len : COMPRESS_CHUNK;
+}
+
+// returns -1 if the chain of a file ends before len bytes from start
+// otherwise, reads len bytes of the stream in the chain of a file from start
+static int stream_read(int rootdir_idx, uint32_t start, uint32_t len, void *buf) {
+	struct chain_pos pos;
+	uint32_t done = 0;
+
+	chain_seek(&pos, rootdir_idx, start / BLOCK_SIZE);
+	while (done < len) {
+		uint32_t offset = (start + done) % BLOCK_SIZE;
+		uint32_t num_bytes = BLOCK_SIZE - offset;
+		if (num_bytes > len - done) {
+			num_bytes = len - done;
+		}
+		if (pos.cur == FAT_EOC || pos.cur == FAT_HOLE) {
+			return -1;
+		}
+
+		if (num_bytes == BLOCK_SIZE) {
+			if (read_data_block(pos.cur, buf + done) == -1) {
+				return -1;
+			}
+		} else {
+			char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+			if (read_data_block(pos.cur, bounce_buf) == -1) {
+				return -1;
+			}
+			memcpy(buf + done, bounce_buf + offset, num_bytes);
+		}
+		done += num_bytes;
+		chain_advance(&pos);
+	}
+	return 0;
+}
+
+// returns -1 if the header of the stream of a file cannot be read or is invalid
+static int read_header(int rootdir_idx, struct compress_header *header) {
+	if (stream_read(rootdir_idx, 0, sizeof(*header), header) == -1
+			|| header->magic != COMPRESS_MAGIC
+			|| header->num_chunks != num_chunks_for(rootdir_arr[rootdir_idx].file_size)) {
+		return -1;
+	}
+	return 0;
+}
+
+int compress_stored_blocks(int rootdir_idx) {
+	struct compress_header header;
+	if (read_header(rootdir_idx, &header) == -1) {
+		return -1;
+	}
+	return (header.stored_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// returns -1 if the chunk index of a file cannot be read or is invalid
+// otherwise, makes it the cached index
+static int load_index(int rootdir_idx) {
+	if (comp_cache.rootdir_idx == rootdir_idx) {
+		return 0;
+	}
+	compress_unload();
+
+	struct compress_header header;
+	if (read_header(rootdir_idx, &header) == -1) {
+		fprintf(stderr, "Invalid compressed file header\n");
+		return -1;
+	}
+	uint32_t *chunk_end = malloc(header.num_chunks * sizeof(uint32_t));
+	if (chunk_end == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	if (stream_read(rootdir_idx, sizeof(header), header.num_chunks * sizeof(uint32_t), chunk_end) == -1) {
+		fprintf(stderr, "Could not read from disk (chunk index)\n");
+		free(chunk_end);
+		return -1;
+	}
+
+	// Chunks follow each other and stay within the stream
+	uint32_t start = sizeof(header) + header.num_chunks * sizeof(uint32_t);
+	for (uint32_t i = 0; i < header.num_chunks; i++) {
+		if (chunk_end[i] < start || chunk_end[i] - start > COMPRESS_CHUNK || chunk_end[i] > header.stored_len) {
+			fprintf(stderr, "Invalid chunk index\n");
+			free(chunk_end);
+			return -1;
+		}
+		start = chunk_end[i];
+	}
+
+	comp_cache.rootdir_idx = rootdir_idx;
+	comp_cache.num_chunks = header.num_chunks;
+	comp_cache.chunk_end = chunk_end;
+	comp_cache.chunk = -1;
+	return 0;
+}
+
+// returns NULL if a chunk of a file cannot be read or decompressed
+// otherwise, returns the data of the chunk
+static uint8_t *chunk_get(int rootdir_idx, uint32_t chunk) {
+	if (load_index(rootdir_idx) == -1) {
+		return NULL;
+	}
+	if (comp_cache.chunk == chunk) {
+		return comp_cache.data;
+	}
+
+	uint32_t start = (chunk == 0) ? sizeof(struct compress_header) + comp_cache.num_chunks * sizeof(uint32_t)
+			: comp_cache.chunk_end[chunk - 1];
+	uint32_t stored_len = comp_cache.chunk_end[chunk] - start;
+	uint32_t len = chunk_len(rootdir_idx, chunk);
+	uint8_t stored[COMPRESS_CHUNK];
+
+	comp_cache.chunk = -1;
+	if (stream_read(rootdir_idx, start, stored_len, stored) == -1) {
+		fprintf(stderr, "Could not read from disk (compressed chunk)\n");
+		return NULL;
+	}
+	// Chunks that did not shrink are stored as is
+	if (stored_len == len) {
+		memcpy(comp_cache.data, stored, len);
+	} else if (lz_decompress(stored, stored_len, comp_cache.data, len) != (long)len) {
+		fprintf(stderr, "Corrupt compressed chunk\n");
+		return NULL;
+	}
+	comp_cache.chunk = chunk;
+	return comp_cache.data;
+}
+
+int compress_read(int rootdir_idx, size_t offset, void *buf, size_t count) {
+	size_t total = 0;
+	while (total < count) {
+		uint32_t chunk = (offset + total) / COMPRESS_CHUNK;
+		size_t chunk_offset = (offset + total) % COMPRESS_CHUNK;
+		size_t num_bytes = chunk_len(rootdir_idx, chunk) - chunk_offset;
+		if (num_bytes > count - total) {
+			num_bytes = count - total;
+		}
+		uint8_t *data = chunk_get(rootdir_idx, chunk);
+		if (data == NULL) {
+			return -1;
+		}
+		memcpy(buf + total, data + chunk_offset, num_bytes);
+		total += num_bytes;
+	}
+	return 0;
+}
+
+// returns -1 if there are not enough free data blocks
+// otherwise, builds a new chain holding the len bytes at data, and returns its
+// first data block (FAT_EOC for no data)
+static int chain_build(const uint8_t *data, size_t len) {
+	int first = FAT_EOC;
+	int last = -1;
+	for (size_t done = 0; done < len; done += BLOCK_SIZE) {
+		int data_blk = find_next_empty_entry(superblk.num_data_blocks);
+		if (data_blk == -1) {
+			chain_free(first);
+			return -1;
+		}
+		set_FAT_entry(data_blk, FAT_EOC);
+		if (last == -1) {
+			first = data_blk;
+		} else {
+			set_FAT_entry(last, data_blk);
+		}
+		last = data_blk;
+
+		int writeret;
+		if (len - done >= BLOCK_SIZE) {
+			writeret = write_data_block(data_blk, data + done);
+		} else {
+			char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+			memset(bounce_buf, 0, BLOCK_SIZE);
+			memcpy(bounce_buf, data + done, len - done);
+			writeret = write_data_block(data_blk, bounce_buf);
+		}
+		if (writeret == -1) {
+			fprintf(stderr, "Could not write to disk (compressed file)\n");
+			chain_free(first);
+			return -1;
+		}
+	}
+	return first;
+}
+
+// makes the chain starting at first the chain of a file, in place of its
+// current chain and packed tail
+static void chain_replace(int rootdir_idx, int first, bool compressed) {
+	chain_free(rootdir_arr[rootdir_idx].first_data_block_index);
+	tail_release(rootdir_idx);
+	rootdir_arr[rootdir_idx].first_data_block_index = first;
+	rootdir_arr[rootdir_idx].flags &= ~DIRENT_COMPRESSED;
+	if (compressed) {
+		rootdir_arr[rootdir_idx].flags |= DIRENT_COMPRESSED;
+	}
+	dirent_changed(rootdir_idx);
+	compress_forget(rootdir_idx);
+}
+
+// returns -1 if the plain data of a file cannot be read, 1 if the file has holes
+// otherwise, reads the plain data of a file into data
+static int plain_read(int rootdir_idx, uint8_t *data) {
+	uint32_t file_size = rootdir_arr[rootdir_idx].file_size;
+	uint32_t num_blocks = (file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	struct chain_pos pos;
+
+	chain_start(&pos, rootdir_idx);
+	for (uint32_t i = 0; i < num_blocks; i++) {
+		uint32_t len = (i == num_blocks - 1 && file_size % BLOCK_SIZE) ? file_size % BLOCK_SIZE : BLOCK_SIZE;
+		if (pos.cur == FAT_EOC && file_has_tail(rootdir_idx) && i == file_size / BLOCK_SIZE) {
+			if (tail_read(rootdir_idx, 0, data + i * BLOCK_SIZE, len) == -1) {
+				return -1;
+			}
+		} else if (pos.cur == FAT_EOC || pos.cur == FAT_HOLE) {
+			return 1;
+		} else if (len == BLOCK_SIZE) {
+			if (read_data_block(pos.cur, data + i * BLOCK_SIZE) == -1) {
+				return -1;
+			}
+		} else {
+			char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+			if (read_data_block(pos.cur, bounce_buf) == -1) {
+				return -1;
+			}
+			memcpy(data + i * BLOCK_SIZE, bounce_buf, len);
+		}
+		chain_advance(&pos);
+	}
+	return 0;
+}
+
+int compress_pack(int rootdir_idx) {
+	struct root_directory *entry = &rootdir_arr[rootdir_idx];
+	if ((entry->flags & (DIRENT_COMPRESS | DIRENT_COMPRESSED)) != DIRENT_COMPRESS
+			|| file_is_inline(rootdir_idx) || entry->file_size == 0 || entry->lead_hole != 0) {
+		return 0;
+	}
+
+	// Blocks the file takes now, and the most its stream may take to be worth it
+	uint32_t num_blocks = entry->file_size / BLOCK_SIZE;
+	if (entry->file_size % BLOCK_SIZE && !file_has_tail(rootdir_idx)) {
+		num_blocks++;
+	}
+	if (num_blocks <= 1) {
+		return 0;
+	}
+	uint32_t num_chunks = num_chunks_for(entry->file_size);
+	size_t index_len = sizeof(struct compress_header) + num_chunks * sizeof(uint32_t);
+	size_t stream_cap = (size_t)(num_blocks - 1) * BLOCK_SIZE;
+	if (index_len >= stream_cap) {
+		return 0;
+	}
+
+	uint8_t *data = malloc((size_t)num_chunks * COMPRESS_CHUNK);
+	uint8_t *stream = malloc(stream_cap);
+	if (data == NULL || stream == NULL) {
+		fprintf(stderr, "Malloc failed");
+		free(data);
+		free(stream);
+		return -1;
+	}
+	int ret = plain_read(rootdir_idx, data);
+	if (ret != 0) {
+		// Holes are already free, files with holes stay plain
+		free(data);
+		free(stream);
+		return ret;
+	}
+
+	// Compress the chunks one after the other, giving up once the stream
+	// would not save a block
+	struct compress_header header;
+	uint32_t *chunk_end = (uint32_t *)(stream + sizeof(header));
+	size_t stored_len = index_len;
+	for (uint32_t i = 0; i < num_chunks && stored_len != 0; i++) {
+		uint32_t len = chunk_len(rootdir_idx, i);
+		size_t room = stream_cap - stored_len;
+		size_t chunk_stored = lz_compress(data + i * COMPRESS_CHUNK, len, stream + stored_len,
+				(room < len) ? room : len - 1);
+		if (chunk_stored == 0) {
+			if (room < len) {
+				stored_len = 0;
+				break;
+			}
+			// Chunk does not shrink, keep it as is
+			memcpy(stream + stored_len, data + i * COMPRESS_CHUNK, len);
+			chunk_stored = len;
+		}
+		stored_len += chunk_stored;
+		chunk_end[i] = stored_len;
+	}
+	free(data);
+	if (stored_len == 0) {
+		free(stream);
+		return 0;
+	}
+
+	header.magic = COMPRESS_MAGIC;
+	header.num_chunks = num_chunks;
+	header.stored_len = stored_len;
+	memcpy(stream, &header, sizeof(header));
+	int first = chain_build(stream, stored_len);
+	free(stream);
+	if (first == -1) {
+		return -1;
+	}
+	chain_replace(rootdir_idx, first, true);
+	return 0;
+}
+
+int compress_unpack(int rootdir_idx) {
+	if (!file_is_compressed(rootdir_idx)) {
+		return 0;
+	}
+
+	uint32_t file_size = rootdir_arr[rootdir_idx].file_size;
+	uint32_t num_chunks = num_chunks_for(file_size);
+	uint8_t *data = malloc((size_t)num_chunks * COMPRESS_CHUNK);
+	if (data == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	for (uint32_t i = 0; i < num_chunks; i++) {
+		uint8_t *chunk = chunk_get(rootdir_idx, i);
+		if (chunk == NULL) {
+			free(data);
+			return -1;
+		}
+		memcpy(data + i * COMPRESS_CHUNK, chunk, chunk_len(rootdir_idx, i));
+	}
+
+	int first = chain_build(data, file_size);
+	free(data);
+	if (first == -1) {
+		return -1;
+	}
+	chain_replace(rootdir_idx, first, false);
+	return 0;
+}
+
+int fs_set_compression(const char *filename, int on) {
+	TP_SCOPE(TP_FS_SET_COMPRESSION, -1, 0, 0);
+	// Check if no FS is mounted (or mounted read-only) or if filename is invalid
+	if (!FS_mounted || FS_rdonly || filename == NULL) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	// Check if file exists in root directory
+	int rootdir_idx = -1;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0' && !(strcmp((char*)&rootdir_arr[i].filename, filename))) {
+			rootdir_idx = i;
+			break;
+		}
+	}
+	if (rootdir_idx == -1) {
+		return -1;
+	}
+
+	if (on) {
+		// Older versions must not mount disks holding compressed files
+		if (!(superblk.features & FS_FEATURE_COMPRESS) && fs_enable(FS_FEATURE_COMPRESS) == -1) {
+			return -1;
+		}
+		rootdir_arr[rootdir_idx].flags |= DIRENT_COMPRESS;
+		dirent_changed(rootdir_idx);
+		if (!file_is_open(rootdir_idx) && compress_pack(rootdir_idx) == -1) {
+			return -1;
+		}
+	} else {
+		if (compress_unpack(rootdir_idx) == -1) {
+			return -1;
+		}
+		rootdir_arr[rootdir_idx].flags &= ~DIRENT_COMPRESS;
+		dirent_changed(rootdir_idx);
+	}
+
+	journal_maybe_commit();
+	return 0;
+}
@@ -0,0 +1,400 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Block checksums.
+ *
+ * A CRC32C of every block of the disk is kept in a table reserved at the end
+ * of the disk, indexed by block number. The checksums of data blocks are
+ * updated by every write_data_block() and verified by every read_data_block(),
+ * those of the FAT blocks and of the root directory block are verified when
+ * fs_mount() loads them. Reserved areas (journal, reference counts, hole
+ * lengths, inline data and the table itself) are not covered.
+ *
+ * The table is written along with the FAT, and changes to the checksums of
+ * data blocks are journaled like FAT entries. FAT and root directory blocks
+ * are written after their new checksums are durable, and the previous
+ * checksum of each of them is kept too, so that a crash in between leaves
+ * every block matching one of its two checksums. So are data blocks: one that
+ * committed metadata points to is only overwritten in place once its new and
+ * previous checksums are logged (by a journal transaction of their own), and
+ * newly allocated blocks are left free by a crash.
+ *
+ * CRC32C is computed with the SSE4.2 crc32 instruction when the processor has
+ * it, on three interleaved streams to hide the latency of the instruction, and
+ * with a slicing-by-8 table otherwise.
+ */
+
+#define CRC32C_POLY 0x82F63B78
+// Blocks before the data blocks (superblock, FAT, root directory) at most
+#define CSUM_META_MAX 8
+// Data blocks read at a time when checksumming the whole disk
+#define CSUM_READ_BLOCKS 32
+
+struct __attribute__ ((__packed__)) csum_table {
+	// Previous checksum of each block before the data blocks
+	uint32_t meta_prev[CSUM_META_MAX];
+	// Current checksum of each block of the disk, followed by the previous
+	// checksum of each data block
+	uint32_t csum[];
+};
+
+// Checksum table (NULL if the disk has none)
+static struct csum_table *csum_table;
+// Whether the table of the disk has room for the previous checksums of data blocks
+static bool csum_keeps_prev;
+
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t crc32c_slices[8][256];
+// x^(2^n) modulo the polynomial, to shift a CRC past runs of zeros
+static uint32_t crc32c_x2n[32];
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *buf, size_t len);
+
+// returns a(x) * b(x) modulo the polynomial (bit-reflected)
+static uint32_t crc32c_multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = 1u << 31;
+	uint32_t p = 0;
+	while (m != 0) {
+		if (a & m) {
+			p ^= b;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+// returns x^(8 * len) modulo the polynomial, to shift a CRC past len zero bytes
+static uint32_t crc32c_x8n(size_t len) {
+	uint32_t p = 1u << 31;
+	for (int k = 3; len != 0; len >>= 1, k++) {
+		if (len & 1) {
+			p = crc32c_multmodp(crc32c_x2n[k & 31], p);
+		}
+	}
+	return p;
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	crc = ~crc;
+	while (len >= 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = crc32c_slices[7][lo & 0xFF] ^ crc32c_slices[6][(lo >> 8) & 0xFF]
+			^ crc32c_slices[5][(lo >> 16) & 0xFF] ^ crc32c_slices[4][lo >> 24]
+			^ crc32c_slices[3][hi & 0xFF] ^ crc32c_slices[2][(hi >> 8) & 0xFF]
+			^ crc32c_slices[1][(hi >> 16) & 0xFF] ^ crc32c_slices[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = crc32c_slices[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+// Streams shorter than this are not worth interleaving
+#define CRC32C_LANE_MIN 256
+// Length of the streams of a block, whose shifts are computed once
+#define CRC32C_BLOCK_LANE ((BLOCK_SIZE / 3) & ~(size_t)7)
+
+static uint32_t crc32c_block_shift[2];
+
+__attribute__ ((target("sse4.2")))
+static uint64_t crc32c_hw_run(uint64_t crc, const uint8_t *p, size_t len) {
+	while (len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __builtin_ia32_crc32di(crc, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len-- > 0) {
+		crc = __builtin_ia32_crc32qi(crc, *p++);
+	}
+	return crc;
+}
+
+__attribute__ ((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+	const uint8_t *p = buf;
+	uint64_t crc0 = ~crc;
+
+	// Three independent streams keep the crc32 unit busy, and are combined by
+	// shifting the first ones past the bytes of the next ones
+	size_t lane = (len / 3) & ~(size_t)7;
+	if (lane >= CRC32C_LANE_MIN) {
+		uint64_t crc1 = 0;
+		uint64_t crc2 = 0;
+		for (size_t i = 0; i < lane; i += 8) {
+			uint64_t v0, v1, v2;
+			memcpy(&v0, p + i, 8);
+			memcpy(&v1, p + lane + i, 8);
+			memcpy(&v2, p + 2 * lane + i, 8);
+			crc0 = __builtin_ia32_crc32di(crc0, v0);
+			crc1 = __builtin_ia32_crc32di(crc1, v1);
+			crc2 = __builtin_ia32_crc32di(crc2, v2);
+		}
+		uint32_t shift1, shift2;
+		if (lane == CRC32C_BLOCK_LANE) {
+			shift1 = crc32c_block_shift[0];
+			shift2 = crc32c_block_shift[1];
+		} else {
+			shift1 = crc32c_x8n(lane);
+			shift2 = crc32c_x8n(2 * lane);
+		}
+		crc0 = crc32c_multmodp(shift2, crc0) ^ crc32c_multmodp(shift1, crc1) ^ crc2;
+		p += 3 * lane;
+		len -= 3 * lane;
+	}
+	return ~crc32c_hw_run(crc0, p, len);
+}
+#endif
+
+static void crc32c_init(void) {
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) {
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_slices[0][i] = crc;
+	}
+	for (int i = 0; i < 256; i++) {
+		for (int j = 1; j < 8; j++) {
+			crc32c_slices[j][i] = crc32c_slices[0][crc32c_slices[j - 1][i] & 0xFF] ^ (crc32c_slices[j - 1][i] >> 8);
+		}
+	}
+	crc32c_x2n[0] = 1u << 30;
+	for (int i = 1; i < 32; i++) {
+		crc32c_x2n[i] = crc32c_multmodp(crc32c_x2n[i - 1], crc32c_x2n[i - 1]);
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_impl = crc32c_hw;
+		crc32c_block_shift[0] = crc32c_x8n(CRC32C_BLOCK_LANE);
+		crc32c_block_shift[1] = crc32c_x8n(2 * CRC32C_BLOCK_LANE);
+	}
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
+
+const char *crc32c_impl_name(void) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return (crc32c_impl == crc32c_sw) ? "software" : "sse4.2";
+}
+
+// returns size in bytes of the checksum table
+static size_t csum_table_size(void) {
+	return sizeof(struct csum_table) + (superblk.num_blocks_on_disk + superblk.num_data_blocks) * sizeof(uint32_t);
+}
+
+// returns the index in the table of the previous checksum of a data block
+static int csum_prev_index(int data_blk) {
+	return superblk.num_blocks_on_disk + data_blk;
+}
+
+int csum_format(void) {
+	int num_blocks = (csum_table_size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start = reserve_data_blocks(num_blocks);
+	if (start == -1) {
+		fprintf(stderr, "Not enough free space at the end of the disk for checksums\n");
+		return -1;
+	}
+	superblk.csum_start = start;
+	superblk.csum_blocks = num_blocks;
+
+	csum_table = block_alloc(num_blocks);
+	if (csum_table == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	memset(csum_table, 0, (size_t)num_blocks * BLOCK_SIZE);
+
+	// Checksum the data blocks as they are (those before them are checksummed
+	// when the metadata is written)
+	char *buf = block_alloc(CSUM_READ_BLOCKS);
+	if (buf == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	for (int i = 0; i < superblk.num_data_blocks; i += CSUM_READ_BLOCKS) {
+		int count = superblk.num_data_blocks - i;
+		if (count > CSUM_READ_BLOCKS) {
+			count = CSUM_READ_BLOCKS;
+		}
+		if (block_read_many(superblk.data_block_start_index + i, count, buf) == -1) {
+			fprintf(stderr, "Could not read from disk (checksums)\n");
+			free(buf);
+			return -1;
+		}
+		for (int j = 0; j < count; j++) {
+			csum_table->csum[superblk.data_block_start_index + i + j] = crc32c(0, buf + j * BLOCK_SIZE, BLOCK_SIZE);
+		}
+	}
+	free(buf);
+	csum_keeps_prev = true;
+	for (int i = 0; i < superblk.num_data_blocks; i++) {
+		csum_table->csum[csum_prev_index(i)] = csum_table->csum[superblk.data_block_start_index + i];
+	}
+	return 0;
+}
+
+int csum_load(void) {
+	if (superblk.data_block_start_index > CSUM_META_MAX) {
+		return -1;
+	}
+	csum_table = load_data_blocks(superblk.csum_start, superblk.csum_blocks);
+	if (csum_table == NULL) {
+		fprintf(stderr, "Could not read from disk (checksums)\n");
+		return -1;
+	}
+	// Tables sized before previous checksums of data blocks were kept have none
+	csum_keeps_prev = ((size_t)superblk.csum_blocks * BLOCK_SIZE >= csum_table_size());
+	return 0;
+}
+
+void csum_unload(void) {
+	unload_data_blocks(csum_table);
+	csum_table = NULL;
+	csum_keeps_prev = false;
+}
+
+int csum_store_metadata(void) {
+	if (csum_table == NULL) {
+		return 0;
+	}
+
+	struct FAT_node* curr = FAT_nodes.start;
+	for (int i = 1; i <= superblk.num_blocks_FAT; i++) {
+		csum_table->meta_prev[i] = csum_table->csum[i];
+		csum_table->csum[i] = crc32c(0, curr->entries, BLOCK_SIZE);
+		curr = curr->next;
+	}
+	int root_blk = superblk.root_block_index;
+	csum_table->meta_prev[root_blk] = csum_table->csum[root_blk];
+	csum_table->csum[root_blk] = crc32c(0, rootdir_arr, BLOCK_SIZE);
+
+	if (store_data_blocks(superblk.csum_start, superblk.csum_blocks, csum_table) == -1
+			|| block_disk_sync() == -1) {
+		fprintf(stderr, "Could not write to disk (checksums)\n");
+		return -1;
+	}
+	return 0;
+}
+
+int csum_verify_metadata(int blk, const void *buf) {
+	if (csum_table == NULL) {
+		return 0;
+	}
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+	if (crc == csum_table->csum[blk]) {
+		return 0;
+	}
+	// Writing the block was cut short, it still holds its previous content
+	// (a read-only mount uses the table in place and leaves it as it is)
+	if (crc == csum_table->meta_prev[blk]) {
+		if (!FS_rdonly) {
+			csum_table->csum[blk] = crc;
+		}
+		return 0;
+	}
+	fprintf(stderr, "Checksum mismatch in block %d\n", blk);
+	return -1;
+}
+
+bool csum_match(int data_blk, uint32_t crc) {
+	if (crc == csum_get(data_blk)) {
+		return true;
+	}
+	// Overwriting the block was cut short, it still holds its previous content
+	if (csum_keeps_prev && crc == csum_table->csum[csum_prev_index(data_blk)]) {
+		if (!FS_rdonly) {
+			csum_set(data_blk, crc);
+		}
+		return true;
+	}
+	return false;
+}
+
+int csum_verify(int data_blk, const void *buf) {
+	if (csum_table == NULL) {
+		return 0;
+	}
+	if (!csum_match(data_blk, crc32c(0, buf, BLOCK_SIZE))) {
+		fprintf(stderr, "Checksum mismatch in data block %d\n", data_blk);
+		return -1;
+	}
+	return 0;
+}
+
+int csum_update(int data_blk, int count, const void *buf) {
+	if (csum_table == NULL) {
+		return 0;
+	}
+	bool overwrite = false;
+	for (int i = 0; i < count; i++) {
+		int blk = superblk.data_block_start_index + data_blk + i;
+		uint32_t crc = crc32c(0, (const char*)buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		if (crc == csum_table->csum[blk]) {
+			continue;
+		}
+		// Nothing committed points to a free or newly allocated block
+		if (csum_keeps_prev && get_FAT_entry(data_blk + i) != 0 && !journal_block_fresh(data_blk + i)) {
+			overwrite = true;
+		}
+		uint32_t prev = csum_table->csum[blk];
+		csum_set(data_blk + i, crc);
+		csum_set_prev(data_blk + i, prev);
+	}
+	// The new checksums are durable before the blocks are overwritten
+	return overwrite ? journal_log_csum(data_blk, count) : 0;
+}
+
+uint32_t csum_get(int data_blk) {
+	if (csum_table == NULL) {
+		return 0;
+	}
+	return csum_table->csum[superblk.data_block_start_index + data_blk];
+}
+
+void csum_set(int data_blk, uint32_t crc) {
+	int blk = superblk.data_block_start_index + data_blk;
+	if (csum_keeps_prev && csum_table->csum[csum_prev_index(data_blk)] != crc) {
+		csum_table->csum[csum_prev_index(data_blk)] = crc;
+		journal_note_csum(data_blk);
+	}
+	if (csum_table->csum[blk] == crc) {
+		return;
+	}
+	csum_table->csum[blk] = crc;
+	journal_note_csum(data_blk);
+}
+
+uint32_t csum_get_prev(int data_blk) {
+	return csum_keeps_prev ? csum_table->csum[csum_prev_index(data_blk)] : csum_get(data_blk);
+}
+
+void csum_set_prev(int data_blk, uint32_t crc) {
+	if (csum_keeps_prev && csum_table->csum[csum_prev_index(data_blk)] != crc) {
+		csum_table->csum[csum_prev_index(data_blk)] = crc;
+		journal_note_csum(data_blk);
+	}
+}
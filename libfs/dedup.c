@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Deduplication of identical data blocks.
+ *
+ * Since a FAT entry both stands for a block of data and links to the next
+ * block of the file, two files can only share a block if they share the rest
+ * of their chains as well, the way clones do. Deduplication therefore shares
+ * chain suffixes: once nobody has a file open, its chain is compared with the
+ * existing blocks from its last block backwards, a block being replaced by an
+ * existing one holding the same data and linking to the same next block. The
+ * matching suffix of the file is then freed, and the file links to the other
+ * chain instead, which gains a reference (see clone.c). Writes to a shared
+ * block copy it first, as with clones.
+ *
+ * Existing blocks are found through an in-memory hash index keyed by the
+ * CRC32C of their data and their FAT entry, each data block being in at most
+ * one bucket. The index is built the first time it is needed after mounting,
+ * from the checksum table if the disk has one and by reading every block of
+ * every file otherwise, and is kept up to date with the files deduplicated.
+ * Entries are hints only: a candidate is read back and compared before
+ * anything is shared.
+ */
+
+static struct {
+	// First data block of each bucket (NULL until built), 0 for none
+	uint16_t *buckets;
+	uint32_t mask;
+	// Per data block: next block in the same bucket, bucket (plus one, 0 when
+	// not indexed) and CRC of the data when indexed
+	uint16_t *next;
+	uint32_t *bucket_of;
+	uint32_t *crc;
+} dedup;
+
+// returns the bucket of the index for a block of data crc and FAT entry entry
+static uint32_t dedup_bucket(uint32_t crc, uint16_t entry) {
+	return (crc ^ (entry * 2654435761u)) & dedup.mask;
+}
+
+// takes a block out of its bucket
+static void dedup_unlink(int data_blk) {
+	if (dedup.bucket_of[data_blk] == 0) {
+		return;
+	}
+	uint16_t *link = &dedup.buckets[dedup.bucket_of[data_blk] - 1];
+	while (*link != data_blk) {
+		link = &dedup.next[*link];
+	}
+	*link = dedup.next[data_blk];
+	dedup.bucket_of[data_blk] = 0;
+}
+
+// returns -1 if the block could not be read
+// otherwise, adds a block to the index (its CRC comes from the checksum table
+// when the disk has one)
+static int dedup_index_blk(int data_blk) {
+	uint32_t crc;
+	if (superblk.features & FS_FEATURE_CSUM) {
+		crc = csum_get(data_blk);
+	} else {
+		char buf[BLOCK_SIZE] BLOCK_ALIGNED;
+		if (read_data_block(data_blk, buf) == -1) {
+			return -1;
+		}
+		crc = crc32c(0, buf, BLOCK_SIZE);
+	}
+	uint32_t bucket = dedup_bucket(crc, get_FAT_entry(data_blk));
+	dedup_unlink(data_blk);
+	dedup.next[data_blk] = dedup.buckets[bucket];
+	dedup.buckets[bucket] = data_blk;
+	dedup.bucket_of[data_blk] = bucket + 1;
+	dedup.crc[data_blk] = crc;
+	return 0;
+}
+
+// returns -1 if the index could not be built
+// otherwise, indexes the blocks of every file but the one being deduplicated
+static int dedup_build(int skip_idx) {
+	uint32_t num_slots = 1;
+	while (num_slots < (uint32_t)superblk.num_data_blocks) {
+		num_slots <<= 1;
+	}
+	dedup.buckets = calloc(num_slots, sizeof(uint16_t));
+	dedup.next = calloc(superblk.num_data_blocks, sizeof(uint16_t));
+	dedup.bucket_of = calloc(superblk.num_data_blocks, sizeof(uint32_t));
+	dedup.crc = calloc(superblk.num_data_blocks, sizeof(uint32_t));
+	if (dedup.buckets == NULL || dedup.next == NULL || dedup.bucket_of == NULL || dedup.crc == NULL) {
+		fprintf(stderr, "Malloc failed");
+		dedup_unload();
+		return -1;
+	}
+	dedup.mask = num_slots - 1;
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] == '\0' || i == skip_idx) {
+			continue;
+		}
+		uint16_t data_blk = rootdir_arr[i].first_data_block_index;
+		for (int j = 0; FAT_IS_LINK(data_blk) && j < superblk.num_data_blocks; j++) {
+			if (dedup_index_blk(data_blk) == -1) {
+				fprintf(stderr, "Could not read from disk (deduplication index)\n");
+				dedup_unload();
+				return -1;
+			}
+			data_blk = FAT_NEXT(get_FAT_entry(data_blk));
+		}
+	}
+	return 0;
+}
+
+// returns -1 if a candidate could not be read
+// otherwise, returns an existing block other than data_blk holding the data in
+// buf and whose FAT entry is entry (0 if there is none)
+static int dedup_find(int data_blk, const void *buf, uint16_t entry) {
+	uint32_t crc = crc32c(0, buf, BLOCK_SIZE);
+	char found_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+	for (int found = dedup.buckets[dedup_bucket(crc, entry)]; found != 0; found = dedup.next[found]) {
+		if (found == data_blk || dedup.crc[found] != crc
+				|| get_FAT_entry(found) != entry || refcnt_get(found) == UINT8_MAX) {
+			continue;
+		}
+		// The end of a file holding data past it is not shared (see delalloc.c)
+		if (entry == FAT_EOC && delalloc_holds_after(found)) {
+			continue;
+		}
+		if (read_data_block(found, found_buf) == -1) {
+			return -1;
+		}
+		if (!memcmp(buf, found_buf, BLOCK_SIZE)) {
+			return found;
+		}
+	}
+	return 0;
+}
+
+int dedup_pack(int rootdir_idx) {
+	struct root_directory *dirent = &rootdir_arr[rootdir_idx];
+	if (!(superblk.features & FS_FEATURE_DEDUP) || file_is_inline(rootdir_idx)
+			|| dirent->first_data_block_index == FAT_EOC || dirent->lead_hole != 0) {
+		return 0;
+	}
+	if (dedup.buckets == NULL && dedup_build(rootdir_idx) == -1) {
+		return -1;
+	}
+
+	// Files sharing blocks already or with holes are left alone
+	uint16_t *chain = malloc(superblk.num_data_blocks * sizeof(uint16_t));
+	if (chain == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	int num_blocks = 0;
+	uint16_t data_blk = dirent->first_data_block_index;
+	while (1) {
+		uint16_t entry = get_FAT_entry(data_blk);
+		if (data_blk_shared(data_blk) || FAT_IS_HOLE(entry) || num_blocks == superblk.num_data_blocks) {
+			free(chain);
+			return 0;
+		}
+		chain[num_blocks++] = data_blk;
+		if (!FAT_IS_LINK(entry)) {
+			break;
+		}
+		data_blk = FAT_NEXT(entry);
+	}
+
+	// Match blocks from the end of the chain, each linking to the previous match
+	char buf[BLOCK_SIZE] BLOCK_ALIGNED;
+	int first_match = num_blocks;
+	uint16_t next = FAT_EOC;
+	while (first_match > 0) {
+		if (read_data_block(chain[first_match - 1], buf) == -1) {
+			free(chain);
+			return -1;
+		}
+		int found = dedup_find(chain[first_match - 1], buf, next);
+		if (found == -1) {
+			free(chain);
+			return -1;
+		}
+		if (found == 0) {
+			break;
+		}
+		next = found;
+		first_match--;
+	}
+
+	// Every block of the shared chain gains a reference
+	for (data_blk = next; first_match < num_blocks && FAT_IS_LINK(data_blk); data_blk = FAT_NEXT(get_FAT_entry(data_blk))) {
+		if (refcnt_get(data_blk) == UINT8_MAX) {
+			first_match = num_blocks;
+		}
+	}
+	if (first_match < num_blocks) {
+		for (data_blk = next; FAT_IS_LINK(data_blk); data_blk = FAT_NEXT(get_FAT_entry(data_blk))) {
+			refcnt_set(data_blk, refcnt_get(data_blk) + 1);
+		}
+		if (first_match == 0) {
+			dirent->first_data_block_index = next;
+			dirent_changed(rootdir_idx);
+		} else {
+			set_FAT_entry(chain[first_match - 1], next);
+		}
+		for (int i = first_match; i < num_blocks; i++) {
+			set_FAT_entry(chain[i], 0);
+			dedup_unlink(chain[i]);
+		}
+	}
+
+	// Index the blocks the file keeps for itself
+	int ret = 0;
+	for (int i = 0; i < first_match && ret == 0; i++) {
+		ret = dedup_index_blk(chain[i]);
+	}
+	if (ret == 0 && first_match < num_blocks) {
+		// Freed blocks must not be reused while the journal still has the file
+		// pointing at them
+		ret = journal_commit();
+	}
+	free(chain);
+	return ret;
+}
+
+void dedup_unload(void) {
+	free(dedup.buckets);
+	free(dedup.next);
+	free(dedup.bucket_of);
+	free(dedup.crc);
+	memset(&dedup, 0, sizeof(dedup));
+}
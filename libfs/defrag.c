@@ -0,0 +1,313 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Online defragmentation.
+ *
+ * Files are laid out one after the other from the first data block on, in the
+ * order of their current first block, so that a disk that is already packed
+ * does not move at all. Blocks are walked in chain order and the position
+ * each one should take (the packing cursor) is compared with where it is:
+ * - a block already at the cursor stays there;
+ * - otherwise, if the cursor is taken by a block that is not placed yet, that
+ *   block is first evicted to the highest free block, out of the way;
+ * - the block is then moved to the cursor.
+ * A move copies the data, moves the FAT entry (with hole length and reference
+ * count) and makes whatever pointed to the old block point to the new one:
+ * a FAT entry, the root directory entry of a file, or those of the tails
+ * packed in the block.
+ *
+ * A block freed by a move, or by any change not committed yet, is only
+ * overwritten once the change is committed to the journal, so that a crash
+ * never leaves a committed chain pointing at a block holding other data.
+ *
+ * Blocks shared between clones are placed with the first file reaching them.
+ * No position is cached between file operations, so files can stay open.
+ */
+
+// What points to a data block: another data block (>= 0), nothing, several
+// things (blocks shared between clones), or a root directory entry
+#define DEFRAG_NO_REF -1
+#define DEFRAG_MULTI_REF -2
+#define DEFRAG_DIRENT_REF(rootdir_idx) (-3 - (rootdir_idx))
+
+static struct {
+	int *referrer;
+	bool *placed;
+	// Highest data block that may be free
+	int free_hint;
+	int num_moved;
+} defrag;
+
+// returns the data block following data_blk in its chain (FAT_EOC if none)
+static int next_data_blk(int data_blk) {
+	uint16_t entry = get_FAT_entry(data_blk);
+	return FAT_IS_LINK(entry) ? FAT_NEXT(entry) : FAT_EOC;
+}
+
+static void add_referrer(int data_blk, int ref) {
+	if (data_blk < 0 || data_blk >= superblk.num_data_blocks) {
+		return;
+	}
+	defrag.referrer[data_blk] = (defrag.referrer[data_blk] == DEFRAG_NO_REF) ? ref : DEFRAG_MULTI_REF;
+}
+
+// returns -1 if the referrer map cannot be allocated
+static int build_referrers(void) {
+	defrag.referrer = malloc(superblk.num_data_blocks * sizeof(int));
+	defrag.placed = calloc(superblk.num_data_blocks, sizeof(bool));
+	if (defrag.referrer == NULL || defrag.placed == NULL) {
+		fprintf(stderr, "Malloc failed");
+		free(defrag.referrer);
+		free(defrag.placed);
+		return -1;
+	}
+	for (int i = 0; i < superblk.num_data_blocks; i++) {
+		defrag.referrer[i] = DEFRAG_NO_REF;
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0' && rootdir_arr[i].first_data_block_index != FAT_EOC) {
+			add_referrer(rootdir_arr[i].first_data_block_index, DEFRAG_DIRENT_REF(i));
+		}
+	}
+	for (int i = 1; i < superblk.num_data_blocks; i++) {
+		uint16_t entry = get_FAT_entry(i);
+		if (FAT_IS_LINK(entry)) {
+			add_referrer(FAT_NEXT(entry), i);
+		}
+	}
+	defrag.free_hint = superblk.num_data_blocks - 1;
+	return 0;
+}
+
+// makes the FAT entries and root directory entries pointing at old_blk point
+// at new_blk
+static void redirect_refs(int old_blk, int new_blk) {
+	int ref = defrag.referrer[old_blk];
+	if (ref == DEFRAG_MULTI_REF) {
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (rootdir_arr[i].filename[0] != '\0' && rootdir_arr[i].first_data_block_index == old_blk) {
+				rootdir_arr[i].first_data_block_index = new_blk;
+				dirent_changed(i);
+			}
+		}
+		for (int i = 1; i < superblk.num_data_blocks; i++) {
+			uint16_t entry = get_FAT_entry(i);
+			if (FAT_IS_LINK(entry) && FAT_NEXT(entry) == old_blk) {
+				set_FAT_entry(i, (entry & FAT_HOLE) | new_blk);
+			}
+		}
+	} else if (ref >= 0) {
+		set_FAT_entry(ref, (get_FAT_entry(ref) & FAT_HOLE) | new_blk);
+	} else if (ref != DEFRAG_NO_REF) {
+		int rootdir_idx = DEFRAG_DIRENT_REF(0) - ref;
+		rootdir_arr[rootdir_idx].first_data_block_index = new_blk;
+		dirent_changed(rootdir_idx);
+	}
+	defrag.referrer[new_blk] = ref;
+	defrag.referrer[old_blk] = DEFRAG_NO_REF;
+}
+
+// returns -1 if the data block could not be copied
+// otherwise, moves data_blk to the free block dest_blk
+static int move_block(int data_blk, int dest_blk) {
+	if (journal_block_freed(dest_blk) && journal_commit_freed() == -1) {
+		return -1;
+	}
+
+	char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+	if (read_data_block(data_blk, bounce_buf) == -1 || write_data_block(dest_blk, bounce_buf) == -1) {
+		fprintf(stderr, "Could not move data block %d\n", data_blk);
+		return -1;
+	}
+
+	uint16_t entry = get_FAT_entry(data_blk);
+	if (FAT_IS_HOLE(entry)) {
+		hole_set(dest_blk, hole_get(data_blk));
+		hole_set(data_blk, 0);
+	}
+	if (entry == FAT_TAIL) {
+		// Packed blocks are reached from the root directory entries of their tails
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (rootdir_arr[i].filename[0] != '\0' && rootdir_arr[i].tail_block == data_blk) {
+				rootdir_arr[i].tail_block = dest_blk;
+				dirent_changed(i);
+			}
+		}
+		tail_forget(data_blk);
+	}
+	if (data_blk_shared(data_blk)) {
+		refcnt_set(dest_blk, refcnt_get(data_blk));
+		refcnt_set(data_blk, 0);
+	}
+	set_FAT_entry(dest_blk, entry);
+	redirect_refs(data_blk, dest_blk);
+	if (FAT_IS_LINK(entry) && defrag.referrer[FAT_NEXT(entry)] == data_blk) {
+		defrag.referrer[FAT_NEXT(entry)] = dest_blk;
+	}
+	set_FAT_entry(data_blk, 0);
+
+	defrag.placed[dest_blk] = defrag.placed[data_blk];
+	defrag.placed[data_blk] = false;
+	if (data_blk > defrag.free_hint) {
+		defrag.free_hint = data_blk;
+	}
+	defrag.num_moved++;
+	return 0;
+}
+
+// returns the highest free data block above data_blk (-1 if there is none)
+static int highest_free_blk(int data_blk) {
+	while (defrag.free_hint > data_blk && get_FAT_entry(defrag.free_hint) != 0) {
+		defrag.free_hint--;
+	}
+	return (defrag.free_hint > data_blk) ? defrag.free_hint : -1;
+}
+
+// returns -1 if a block could not be moved
+// otherwise, places the blocks of a file from *cursor on, and returns 1 if the
+// time budget ran out before all of them were placed
+static int place_file(int rootdir_idx, int *cursor, unsigned int time_budget_ms, const struct timespec *start) {
+	int data_blk = rootdir_arr[rootdir_idx].first_data_block_index;
+	for (int i = 0; data_blk != FAT_EOC && i < superblk.num_data_blocks; i++) {
+		// The rest of a chain shared with a file placed earlier is already in place
+		if (defrag.placed[data_blk]) {
+			break;
+		}
+		while (*cursor < superblk.num_data_blocks && get_FAT_entry(*cursor) == FAT_RESERVED) {
+			(*cursor)++;
+		}
+
+		if (data_blk != *cursor) {
+			// Make room at the cursor, then move the block there
+			if (get_FAT_entry(*cursor) != 0) {
+				int free_blk = highest_free_blk(*cursor);
+				if (free_blk == -1) {
+					fprintf(stderr, "No free data block left to move blocks around\n");
+					return -1;
+				}
+				if (move_block(*cursor, free_blk) == -1) {
+					return -1;
+				}
+			}
+			if (move_block(data_blk, *cursor) == -1) {
+				return -1;
+			}
+			data_blk = *cursor;
+		}
+		defrag.placed[data_blk] = true;
+		(*cursor)++;
+		data_blk = next_data_blk(data_blk);
+
+		journal_maybe_commit();
+		if (time_budget_ms > 0 && elapsed_ms(start) >= time_budget_ms) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int fs_defrag(unsigned int time_budget_ms) {
+	TP_SCOPE(TP_FS_DEFRAG, -1, 0, 0);
+	// Check if no FS is mounted or if it is mounted read-only
+	if (!FS_mounted || FS_rdonly) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (build_referrers() == -1) {
+		return -1;
+	}
+	defrag.num_moved = 0;
+
+	// Files are packed in the order of their first block
+	int order[FS_FILE_MAX_COUNT];
+	int num_files = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0' && rootdir_arr[i].first_data_block_index != FAT_EOC) {
+			int j = num_files++;
+			while (j > 0 && rootdir_arr[order[j - 1]].first_data_block_index > rootdir_arr[i].first_data_block_index) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = i;
+		}
+	}
+
+	int ret = 0;
+	int cursor = 1;
+	for (int i = 0; i < num_files && ret == 0; i++) {
+		ret = place_file(order[i], &cursor, time_budget_ms, &start);
+	}
+
+	free(defrag.referrer);
+	free(defrag.placed);
+	journal_maybe_commit();
+	return (ret == -1) ? -1 : defrag.num_moved;
+}
+
+int fs_frag_report(struct fs_frag_report *report) {
+	TP_SCOPE(TP_FS_FRAG_REPORT, -1, 0, 0);
+	// Check if no FS is mounted or if report is invalid
+	if (!FS_mounted || report == NULL) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+	memset(report, 0, sizeof(*report));
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] == '\0' || rootdir_arr[i].first_data_block_index == FAT_EOC) {
+			continue;
+		}
+		int num_extents = 0;
+		int prev_blk = -1;
+		int data_blk = rootdir_arr[i].first_data_block_index;
+		for (int j = 0; data_blk != FAT_EOC && j < superblk.num_data_blocks; j++) {
+			if (data_blk != prev_blk + 1) {
+				num_extents++;
+			}
+			prev_blk = data_blk;
+			data_blk = next_data_blk(data_blk);
+		}
+		report->num_files++;
+		report->num_file_extents += num_extents;
+		if (num_extents > 1) {
+			report->num_fragmented_files++;
+		}
+	}
+
+	int run = 0;
+	for (int i = 1; i <= superblk.num_data_blocks; i++) {
+		if (i < superblk.num_data_blocks && get_FAT_entry(i) == 0) {
+			report->num_free_blocks++;
+			run++;
+			continue;
+		}
+		if (run > 0) {
+			report->num_free_extents++;
+			if (run > report->largest_free_extent) {
+				report->largest_free_extent = run;
+			}
+		}
+		run = 0;
+	}
+	return 0;
+}
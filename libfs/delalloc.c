@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Delayed allocation of data blocks.
+ *
+ * fs_write() only writes to disk right away the data landing in blocks the file
+ * already has. Data appended past its last block is held in memory by the open
+ * file, with just enough free blocks reserved that it cannot run out of space
+ * later, and is given blocks when the file is flushed: by the last fs_close()
+ * of the file, by fs_sync(), by an fs_read() of the file, and by every call
+ * looking at more than one file (fs_ls(), fs_clone(), fs_check(), ...). By then
+ * the size of what was appended is known, so it is allocated a single run of
+ * free blocks, right after the last block of the file when there is room
+ * there, and files appended to in turn no longer interleave their blocks.
+ *
+ * Held data starts on a block boundary, in a buffer growing by doubling up to
+ * delalloc_max_blocks blocks. A file holding that much is flushed before more
+ * is held, and a single write of that much or more gets its blocks right away,
+ * in one run too. 0 turns delayed allocation off. Until it is flushed, held data
+ * only lives in memory.
+ */
+
+// Size of the buffer of held data when it is allocated
+#define DELALLOC_MIN_BLOCKS 4
+
+int delalloc_max_blocks = 256;
+int delalloc_reserved;
+
+// returns the number of blocks spanned by len bytes starting on a block boundary
+static int blocks_spanned(size_t len) {
+	return (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// returns true if the count data blocks from data_blk on are all free (and
+// can be given out before the next commit)
+static bool run_is_free(int data_blk, int count) {
+	if (data_blk < 1 || data_blk + count > superblk.num_data_blocks) {
+		return false;
+	}
+	for (int i = data_blk; i < data_blk + count; i++) {
+		if (get_FAT_entry(i) != 0 || journal_block_freed(i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// returns the first data block of a run of count free data blocks, the one
+// right after after_blk if there is room there, or 0 if there is no such run
+static int find_free_run(int after_blk, int count) {
+	if (after_blk > 0 && run_is_free(after_blk + 1, count)) {
+		return after_blk + 1;
+	}
+	int run_start = 1;
+	for (int i = 1; i < superblk.num_data_blocks; i++) {
+		if (get_FAT_entry(i) != 0 || journal_block_freed(i)) {
+			run_start = i + 1;
+		} else if (i - run_start + 1 == count) {
+			return run_start;
+		}
+	}
+	return 0;
+}
+
+// returns -1 if data could not be written to disk
+// otherwise, gives blocks to len bytes of data at offset (on a block boundary
+// past the last block of the file), writes them and returns how many were
+// written (fewer than len if space ran out)
+static int delalloc_commit(int rootdir_idx, size_t offset, const char *data, size_t len) {
+	TP_SCOPE(TP_DELALLOC_COMMIT, -1, offset, len);
+	int num_blks = blocks_spanned(len);
+	int num_full = len / BLOCK_SIZE;
+	struct chain_pos pos;
+
+	if (chain_seek_for_write(&pos, rootdir_idx, offset / BLOCK_SIZE) == -1) {
+		return 0;
+	}
+
+	// Allocation takes the blocks of the run one after another
+	alloc_hint = find_free_run(pos.prev, num_blks);
+
+	int done = 0;
+	while (done < num_blks) {
+		// Gather blocks allocated one after the other, to write them at once
+		int run_start = -1, run_len = 0;
+		bool fresh;
+		while (done + run_len < num_full) {
+			int data_blk = chain_prepare_write(&pos, false, &fresh);
+			if (data_blk == -1) {
+				break;
+			}
+			if (run_len > 0 && data_blk != run_start + run_len) {
+				// Starts the next run, the cursor stays on it
+				break;
+			}
+			if (run_len == 0) {
+				run_start = data_blk;
+			}
+			run_len++;
+			chain_advance(&pos);
+		}
+		if (run_len > 0) {
+			const char *src = data + (size_t)done * BLOCK_SIZE;
+			if (csum_update(run_start, run_len, src) == -1 || store_data_blocks(run_start, run_len, src) == -1) {
+				alloc_hint = 0;
+				return -1;
+			}
+			done += run_len;
+			continue;
+		}
+		if (done < num_full) {
+			// No space left on disk
+			break;
+		}
+
+		// Last partial block, padded with zeros
+		char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+		int data_blk = chain_prepare_write(&pos, false, &fresh);
+		if (data_blk == -1) {
+			break;
+		}
+		memset(bounce_buf, 0, BLOCK_SIZE);
+		memcpy(bounce_buf, data + (size_t)done * BLOCK_SIZE, len % BLOCK_SIZE);
+		if (write_data_block(data_blk, bounce_buf) == -1) {
+			alloc_hint = 0;
+			return -1;
+		}
+		done++;
+	}
+	alloc_hint = 0;
+
+	size_t written = (done == num_blks) ? len : (size_t)done * BLOCK_SIZE;
+	if (offset + written > rootdir_arr[rootdir_idx].file_size) {
+		rootdir_arr[rootdir_idx].file_size = offset + written;
+		dirent_changed(rootdir_idx);
+	}
+	return written;
+}
+
+// returns -1 if there is neither the memory nor the free space to hold the data
+// otherwise, copies len bytes of data at offset rel of the held data
+static int delalloc_hold(struct open_file *file, size_t rel, const void *data, size_t len) {
+	size_t new_len = (rel + len > file->da_len) ? rel + len : file->da_len;
+	int need = blocks_spanned(new_len);
+
+	// Reserve the blocks the held data will take
+	if (need > file->da_reserved && num_free_data_blocks - delalloc_reserved < need - file->da_reserved) {
+		return -1;
+	}
+
+	if (need > file->da_cap) {
+		int new_cap = (file->da_cap > 0) ? file->da_cap : DELALLOC_MIN_BLOCKS;
+		while (new_cap < need) {
+			new_cap *= 2;
+		}
+		if (new_cap > delalloc_max_blocks) {
+			new_cap = delalloc_max_blocks;
+		}
+		char *new_buf = block_alloc(new_cap);
+		if (new_buf == NULL) {
+			return -1;
+		}
+		// Data past what is held stays zero, to pad the last block
+		if (file->da_len) {
+			memcpy(new_buf, file->da_buf, file->da_len);
+		}
+		memset(new_buf + file->da_len, 0, (size_t)new_cap * BLOCK_SIZE - file->da_len);
+		free(file->da_buf);
+		file->da_buf = new_buf;
+		file->da_cap = new_cap;
+	}
+
+	if (need > file->da_reserved) {
+		delalloc_reserved += need - file->da_reserved;
+		file->da_reserved = need;
+	}
+	memcpy(file->da_buf + rel, data, len);
+	file->da_len = new_len;
+	return 0;
+}
+
+// returns -1 if data held by the file could not be flushed
+// otherwise, sets *count_now to the number of leading bytes of a write of count
+// bytes at offset to write to blocks right away, the rest going to
+// delalloc_write(). Held data is flushed first if the write does not follow it.
+int delalloc_prepare(struct open_file *file, size_t offset, size_t count, size_t *count_now) {
+	*count_now = count;
+
+	if (file->da_len > 0) {
+		// Writes extending or overwriting held data are held too
+		size_t start = (size_t)file->da_blk * BLOCK_SIZE;
+		if (offset >= start && offset <= start + file->da_len) {
+			*count_now = 0;
+			return 0;
+		}
+		if (delalloc_flush(file) == -1) {
+			return -1;
+		}
+	}
+	if (delalloc_max_blocks <= 0) {
+		return 0;
+	}
+
+	// Data up to the end of the last block of the file goes there, a gap past
+	// the end of the file is written as usual
+	size_t file_size = rootdir_arr[file->rootdir_idx].file_size;
+	size_t blocks_end = (size_t)blocks_spanned(file_size) * BLOCK_SIZE;
+	if (offset > file_size || offset + count <= blocks_end) {
+		return 0;
+	}
+	*count_now = (blocks_end > offset) ? blocks_end - offset : 0;
+	return 0;
+}
+
+// returns -1 if data could not be written to disk
+// otherwise, holds count bytes at offset (right after the blocks of the file
+// or within held data) and returns how many were taken, fewer than count if
+// there was neither the memory nor the free space to hold them all
+int delalloc_write(struct open_file *file, size_t offset, const void *buf, size_t count) {
+	size_t done = 0;
+	while (done < count) {
+		size_t pos = offset + done;
+		if (file->da_len == 0) {
+			// Held data starts here, on a block boundary
+			size_t max_len = (size_t)delalloc_max_blocks * BLOCK_SIZE;
+			if (count - done >= max_len) {
+				// Too much to hold, it gets its blocks right away
+				int ret = delalloc_commit(file->rootdir_idx, pos, (const char *)buf + done, count - done);
+				if (ret == -1) {
+					return -1;
+				}
+				return done + ret;
+			}
+
+			// Blocks before it must be of the file only when it is flushed, so that
+			// flushing needs no more blocks than those reserved
+			struct chain_pos chain_pos;
+			if (chain_seek_for_write(&chain_pos, file->rootdir_idx, pos / BLOCK_SIZE) == -1) {
+				return done;
+			}
+			file->da_blk = pos / BLOCK_SIZE;
+		}
+
+		size_t start = (size_t)file->da_blk * BLOCK_SIZE;
+		size_t limit = start + (size_t)delalloc_max_blocks * BLOCK_SIZE;
+		if (pos >= limit) {
+			if (delalloc_flush(file) == -1) {
+				return -1;
+			}
+			continue;
+		}
+		size_t chunk = (count - done < limit - pos) ? count - done : limit - pos;
+		if (delalloc_hold(file, pos - start, (const char *)buf + done, chunk) == -1) {
+			// Free the space reserved by every file, the rest is written as usual
+			if (delalloc_flush_all() == -1) {
+				return -1;
+			}
+			return done;
+		}
+		done += chunk;
+	}
+	return done;
+}
+
+// returns the size of a file, including the data it holds
+size_t delalloc_size(struct open_file *file) {
+	size_t file_size = rootdir_arr[file->rootdir_idx].file_size;
+	size_t held_end = (size_t)file->da_blk * BLOCK_SIZE + file->da_len;
+	return (file->da_len > 0 && held_end > file_size) ? held_end : file_size;
+}
+
+// returns -1 if data held by the file could not all be written to disk
+// otherwise, gives blocks to the data held by the file and writes it
+int delalloc_flush(struct open_file *file) {
+	if (file->da_len == 0) {
+		return 0;
+	}
+
+	// The reserved blocks are the ones allocated now
+	delalloc_reserved -= file->da_reserved;
+	file->da_reserved = 0;
+	size_t len = file->da_len;
+	int ret = delalloc_commit(file->rootdir_idx, (size_t)file->da_blk * BLOCK_SIZE, file->da_buf, len);
+	free(file->da_buf);
+	file->da_buf = NULL;
+	file->da_cap = 0;
+	file->da_len = 0;
+	if (ret == -1 || (size_t)ret != len) {
+		fprintf(stderr, "Could not flush delayed data\n");
+		return -1;
+	}
+
+	journal_maybe_commit();
+	return 0;
+}
+
+// returns true if data_blk is the last block of a file holding data, which must
+// not become shared: the blocks before held data are made the file's own when it
+// starts being held, so that flushing it needs no more than the reserved blocks
+bool delalloc_holds_after(int data_blk) {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		struct open_file *file = open_files[i];
+		if (file == NULL || file->da_len == 0) {
+			continue;
+		}
+		struct chain_pos pos;
+		chain_seek(&pos, i, file->da_blk);
+		if (pos.prev == data_blk) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// returns -1 if data held by some file could not all be written to disk
+int delalloc_flush_all(void) {
+	int ret = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (open_files[i] != NULL && delalloc_flush(open_files[i]) == -1) {
+			ret = -1;
+		}
+	}
+	return ret;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Discard of freed data blocks.
+ *
+ * Freeing a block only clears its FAT entry: its data stays in the disk file,
+ * which never shrinks on the host and is copied whole by backups. On a disk
+ * mounted with FS_MOUNT_DISCARD, every data block whose FAT entry becomes free
+ * (deleted files, blocks moved by fs_defrag(), chains given up to
+ * deduplication, repacked tails, ...) is noted by set_FAT_entry(), and noted
+ * blocks are punched out of the disk file in batches, each run of consecutive
+ * blocks with a single call: once discard_batch_blocks blocks are noted, and
+ * by fs_sync() and fs_umount(). 1 punches blocks at the end of the call that
+ * freed them.
+ *
+ * Blocks are only punched once the FAT changes freeing them are durable, i.e.
+ * once the journal has nothing left to commit, so that a crash never leaves a
+ * committed chain pointing at a block whose data is gone. Without a journal,
+ * the FAT on disk is only current after fs_sync() or fs_umount() anyway, as for
+ * freed blocks that other files reuse. Noted blocks that were allocated again
+ * in the meantime are left alone.
+ *
+ * fs_discard() punches every free data block, noted or not, e.g. to shrink a
+ * disk that was written without FS_MOUNT_DISCARD.
+ */
+
+int discard_batch_blocks = 64;
+
+static struct {
+	// Freed blocks to punch, one per data block (NULL when they are not punched)
+	bool *noted;
+	size_t num_blocks;
+	int num_noted;
+} discard;
+
+// returns -1 if the disk file cannot be punched
+// otherwise, punches the data blocks that are free among those for which
+// pick() is true and returns how many there were
+static int discard_punch(bool (*pick)(int data_blk)) {
+	int num_punched = 0;
+	int run_start = 0, run_len = 0;
+
+	// One more round past the last block ends the last run
+	for (int i = 1; i <= superblk.num_data_blocks; i++) {
+		if (i < superblk.num_data_blocks && pick(i) && get_FAT_entry(i) == 0) {
+			if (run_len == 0) {
+				run_start = i;
+			}
+			run_len++;
+			continue;
+		}
+		if (run_len == 0) {
+			continue;
+		}
+		if (block_discard(superblk.data_block_start_index + run_start, run_len) == -1) {
+			return -1;
+		}
+		num_punched += run_len;
+		run_len = 0;
+	}
+	return num_punched;
+}
+
+static bool is_noted(int data_blk) {
+	return discard.noted[data_blk];
+}
+
+static bool is_any(int data_blk) {
+	(void)data_blk;
+	return true;
+}
+
+// forgets the noted blocks
+static void discard_clear(void) {
+	if (discard.noted != NULL) {
+		memset(discard.noted, 0, discard.num_blocks * sizeof(bool));
+	}
+	discard.num_noted = 0;
+}
+
+// returns -1 if the noted blocks could not be punched (discard is turned off)
+// otherwise, punches the noted blocks that are still free
+int discard_flush(void) {
+	if (discard.num_noted == 0) {
+		return 0;
+	}
+	int ret = discard_punch(is_noted);
+	discard_clear();
+	if (ret == -1) {
+		// Freed blocks then just keep their data, as without FS_MOUNT_DISCARD
+		fprintf(stderr, "Could not discard freed blocks, discard turned off\n");
+		discard_unload();
+		return -1;
+	}
+	return 0;
+}
+
+// punches the noted blocks once there are enough of them, if the changes
+// that freed them are durable
+void discard_maybe_flush(void) {
+	if (discard.num_noted > 0 && discard.num_noted >= discard_batch_blocks) {
+		discard_flush();
+	}
+}
+
+// records that a data block was freed
+void discard_note_free(int data_blk) {
+	if (discard.noted == NULL || discard.noted[data_blk]) {
+		return;
+	}
+	discard.noted[data_blk] = true;
+	discard.num_noted++;
+}
+
+// returns -1 if the table of noted blocks cannot be allocated
+// otherwise, has freed blocks punched from now on
+int discard_load(void) {
+	discard.num_blocks = superblk.num_data_blocks;
+	discard.noted = calloc(discard.num_blocks, sizeof(bool));
+	if (discard.noted == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	discard.num_noted = 0;
+	return 0;
+}
+
+void discard_unload(void) {
+	free(discard.noted);
+	discard.noted = NULL;
+	discard.num_noted = 0;
+}
+
+int fs_discard(void) {
+	TP_SCOPE(TP_FS_DISCARD, -1, 0, 0);
+	if (!FS_mounted || FS_rdonly) {
+		return -1;
+	}
+
+	// Blocks are freed for good once the FAT changes are durable
+	if (fs_sync() == -1) {
+		return -1;
+	}
+	int ret = discard_punch(is_any);
+	if (ret == -1) {
+		return -1;
+	}
+	discard_clear();
+	return ret;
+}
+
+int fs_copy_disk(const char *diskname, const char *copy_name) {
+	TP_SCOPE(TP_FS_COPY_DISK, -1, 0, 0);
+	// A mounted disk is copied with its changes so far
+	if (FS_mounted && !FS_rdonly && fs_sync() == -1) {
+		return -1;
+	}
+
+	// The copy is laid out as the disk, over as many backing files
+	int num_stripes, stripe_unit;
+	if (stripe_layout(diskname, &num_stripes, &stripe_unit) == -1) {
+		return -1;
+	}
+	return block_disk_copy(diskname, num_stripes, stripe_unit, copy_name, num_stripes, stripe_unit);
+}
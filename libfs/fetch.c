@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Parallel fetch of data blocks.
+ *
+ * fs_read() resolves the data blocks of the whole blocks it is asked for before
+ * reading any of them, and hands the list to fetch_data_blocks(). The list is
+ * cut into pieces, each a run of at most FETCH_PIECE_BLOCKS consecutive
+ * blocks read with a single positional read straight into the caller's
+ * buffer, and checked against its checksums by the thread that read it. Lists
+ * of FETCH_PARALLEL_MIN_BLOCKS blocks or more are read by a pool of worker
+ * threads together with the calling thread, so that several reads are
+ * outstanding on the disk at once instead of one after another; shorter lists
+ * are read by the calling thread alone.
+ *
+ * Workers only read data blocks and the checksum table, never the FAT or the
+ * root directory. They are started by the first large read and stopped on
+ * unmount. fetch_threads sets the number of threads reading (the calling
+ * thread included) when workers are started. By default it is the number of
+ * CPUs, or FETCH_MAX_THREADS on a disk mounted with direct I/O, whose reads
+ * wait on the device rather than on a CPU. 1 reads every piece in the calling
+ * thread, and 0 turns fetching off, so that fs_read() reads one block at a
+ * time.
+ */
+
+#define FETCH_MAX_THREADS 8
+// Blocks in a single read
+#define FETCH_PIECE_BLOCKS 32
+// Smallest list of blocks read by several threads
+#define FETCH_PARALLEL_MIN_BLOCKS (2 * FETCH_PIECE_BLOCKS)
+
+// A run of consecutive blocks of the list, read at once
+struct fetch_piece {
+	int first;
+	int count;
+};
+
+int fetch_threads = -1;
+
+static struct {
+	pthread_mutex_t lock;
+	// Signaled when a list is handed to the workers, or when they must stop
+	pthread_cond_t work_cond;
+	// Signaled when the last piece of the list is read
+	pthread_cond_t done_cond;
+	pthread_t threads[FETCH_MAX_THREADS];
+	int num_workers;
+	bool stopping;
+	// List being read, and the next of its pieces for a thread to take
+	const uint16_t *blks;
+	char *buf;
+	struct fetch_piece *pieces;
+	int num_pieces;
+	int next_piece;
+	int pieces_done;
+	bool failed;
+} fetch = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.work_cond = PTHREAD_COND_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+// returns -1 if a piece could not be read or does not match its checksums
+static int fetch_piece_read(const uint16_t *blks, char *buf, const struct fetch_piece *piece) {
+	char *dst = buf + (size_t)piece->first * BLOCK_SIZE;
+	if (read_data_blocks(blks[piece->first], piece->count, dst) == -1) {
+		return -1;
+	}
+	for (int i = 0; i < piece->count; i++) {
+		if (csum_verify(blks[piece->first + i], dst + (size_t)i * BLOCK_SIZE) == -1) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// takes and reads pieces of the current list until there is none left
+// (called and returns with the lock held)
+static void fetch_take_pieces(void) {
+	while (fetch.next_piece < fetch.num_pieces) {
+		int i = fetch.next_piece++;
+		pthread_mutex_unlock(&fetch.lock);
+		int ret = fetch_piece_read(fetch.blks, fetch.buf, &fetch.pieces[i]);
+		pthread_mutex_lock(&fetch.lock);
+		if (ret == -1) {
+			fetch.failed = true;
+		}
+		if (++fetch.pieces_done == fetch.num_pieces) {
+			pthread_cond_signal(&fetch.done_cond);
+		}
+	}
+}
+
+static void *fetch_worker(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&fetch.lock);
+	while (!fetch.stopping) {
+		if (fetch.next_piece >= fetch.num_pieces) {
+			pthread_cond_wait(&fetch.work_cond, &fetch.lock);
+			continue;
+		}
+		fetch_take_pieces();
+	}
+	pthread_mutex_unlock(&fetch.lock);
+	return NULL;
+}
+
+// returns the number of threads reading large lists, starting the workers
+// the first time
+static int fetch_start(void) {
+	int num_threads = fetch_threads;
+	if (num_threads < 0) {
+		// Reads wait on the device with direct I/O, so more of them may be
+		// outstanding than there are CPUs to copy from the page cache
+		num_threads = (block_disk_direct() == 1) ? FETCH_MAX_THREADS : sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (num_threads <= 1) {
+		return 1;
+	}
+	if (num_threads > FETCH_MAX_THREADS) {
+		num_threads = FETCH_MAX_THREADS;
+	}
+	while (fetch.num_workers < num_threads - 1) {
+		if (pthread_create(&fetch.threads[fetch.num_workers], NULL, fetch_worker, NULL) != 0) {
+			break;
+		}
+		fetch.num_workers++;
+	}
+	return fetch.num_workers + 1;
+}
+
+// returns -1 if a block could not be read or does not match its checksum
+// otherwise, reads count data blocks (at most FETCH_BATCH_BLOCKS) into buf
+int fetch_data_blocks(const uint16_t *blks, int count, void *buf) {
+	struct fetch_piece pieces_buf[FETCH_BATCH_BLOCKS];
+	struct fetch_piece *pieces = pieces_buf;
+	int num_pieces = 0;
+
+	// Cut the list at every break between runs, and into pieces of a bounded size
+	for (int i = 0; i < count; i++) {
+		if (i > 0 && blks[i] == blks[i - 1] + 1 && pieces[num_pieces - 1].count < FETCH_PIECE_BLOCKS) {
+			pieces[num_pieces - 1].count++;
+			continue;
+		}
+		pieces[num_pieces].first = i;
+		pieces[num_pieces].count = 1;
+		num_pieces++;
+	}
+
+	if (count < FETCH_PARALLEL_MIN_BLOCKS || fetch_start() == 1) {
+		for (int i = 0; i < num_pieces; i++) {
+			if (fetch_piece_read(blks, buf, &pieces[i]) == -1) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	// Hand the list to the workers and read pieces alongside them
+	pthread_mutex_lock(&fetch.lock);
+	fetch.blks = blks;
+	fetch.buf = buf;
+	fetch.pieces = pieces;
+	fetch.num_pieces = num_pieces;
+	fetch.next_piece = 0;
+	fetch.pieces_done = 0;
+	fetch.failed = false;
+	pthread_cond_broadcast(&fetch.work_cond);
+	fetch_take_pieces();
+	while (fetch.pieces_done < fetch.num_pieces) {
+		pthread_cond_wait(&fetch.done_cond, &fetch.lock);
+	}
+	bool failed = fetch.failed;
+	fetch.num_pieces = 0;
+	fetch.next_piece = 0;
+	pthread_mutex_unlock(&fetch.lock);
+
+	return failed ? -1 : 0;
+}
+
+// stops the workers
+void fetch_unload(void) {
+	pthread_mutex_lock(&fetch.lock);
+	fetch.stopping = true;
+	pthread_cond_broadcast(&fetch.work_cond);
+	pthread_mutex_unlock(&fetch.lock);
+	for (int i = 0; i < fetch.num_workers; i++) {
+		pthread_join(fetch.threads[i], NULL);
+	}
+	fetch.num_workers = 0;
+	fetch.stopping = false;
+}
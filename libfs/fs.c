@@ -1,195 +1,514 @@
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "disk.h"
 #include "fs.h"
+#include "fs_internal.h"
 
-#define SB_PADDING_LEN 4079
-#define SB_EXPECTED_SIG 6000536558536704837
-#define FB_ENTRIES_PER_BLOCK 2048
-#define RD_PADDING_LEN 10
-#define FAT_EOC 0xFFFF
-
-struct __attribute__ ((__packed__)) superblock {
-	int64_t signature;
-	int16_t num_blocks_on_disk;
-	int16_t root_block_index;
-	int16_t data_block_start_index;
-	int16_t num_data_blocks;
-	int8_t num_blocks_FAT;
-	int8_t padding[SB_PADDING_LEN];
-};
-
-struct __attribute__ ((__packed__)) FAT_node {
-	uint16_t entries[FB_ENTRIES_PER_BLOCK];
-	struct FAT_node* next;
-};
-
-struct __attribute__ ((__packed__)) FAT_section {
-	struct FAT_node* start;
-	struct FAT_node* end;
-};
-
-struct __attribute__ ((__packed__)) root_directory {
-	int8_t filename[FS_FILENAME_LEN];
-	uint32_t file_size;
-	uint16_t first_data_block_index;
-	int8_t padding[RD_PADDING_LEN];
-};
-
-struct __attribute__ ((__packed__)) fd_entry {
-	int used;
-	int root_dir_index;
-	size_t offset;
-};
-
-struct superblock superblk;
+struct superblock superblk BLOCK_ALIGNED;
 struct FAT_section FAT_nodes;
-struct root_directory rootdir_arr[FS_FILE_MAX_COUNT];
-struct fd_entry fd_table[FS_OPEN_MAX_COUNT];
+struct root_directory rootdir_arr[FS_FILE_MAX_COUNT] BLOCK_ALIGNED;
+struct fd_entry *fd_table;
+int fd_table_size;
 bool FS_mounted = false;
+bool FS_rdonly = false;
+uint32_t chain_gen;
+struct open_file *open_files[FS_FILE_MAX_COUNT];
+int num_free_data_blocks;
+int alloc_hint;
+
+// Size of the fd table when the first file is opened
+#define FD_TABLE_MIN_SIZE 32
+
+// Free entries of the fd table, as a stack linked through next_free, and number
+// of entries in use
+static int fd_free_head = -1;
+static int fd_num_used;
 
 // returns -1 if there is no empty entry accessible
 // otherwise, returns the next empty FAT entry
 int find_next_empty_entry(int num_data_blocks) {
-	struct FAT_node* curr = FAT_nodes.start;
-	uint16_t curr_fat_blk_idx = 1;
-	size_t next_data_blk_idx;
+	TP_SCOPE(TP_FIND_EMPTY_ENTRY, -1, 0, 0);
+	// Blocks reserved for data held in memory are not given out
+	if (num_free_data_blocks <= delalloc_reserved) {
+		return -1;
+	}
 
-	// Go through entries of FAT block to find next empty entry
-	for (int i = 0; i < num_data_blocks; i++) {
-		next_data_blk_idx = curr->entries[curr_fat_blk_idx % FB_ENTRIES_PER_BLOCK];
-		if ((next_data_blk_idx != 0) && (i == superblk.num_data_blocks - 1)) {
-			return -1;
-		} else if (next_data_blk_idx == 0) {
-			curr->entries[curr_fat_blk_idx % FB_ENTRIES_PER_BLOCK] = FAT_EOC;
-			return curr_fat_blk_idx;
+	// Go through entries of FAT to find next empty entry, from the allocation hint
+	// on if there is one (entry 0 is never used). Blocks freed by uncommitted
+	// changes are only taken once nothing else is left, after a commit.
+	int start = (alloc_hint > 0 && alloc_hint < num_data_blocks) ? alloc_hint : 1;
+	int freed = -1;
+	for (int n = 0; n < num_data_blocks - 1; n++) {
+		int i = 1 + (start - 1 + n) % (num_data_blocks - 1);
+		if (get_FAT_entry(i) == 0) {
+			if (journal_block_freed(i)) {
+				if (freed == -1) {
+					freed = i;
+				}
+				continue;
+			}
+			set_FAT_entry(i, FAT_EOC);
+			return i;
 		}
+	}
+	if (freed != -1 && journal_commit_freed() == 0) {
+		set_FAT_entry(freed, FAT_EOC);
+		return freed;
+	}
+
+	return -1;
+}
+
+// returns FAT node pointer indicaing location of specified data block
+struct FAT_node* traverse_FAT_until_data_blk(int data_blk) {
+	int node_num = data_blk / FB_ENTRIES_PER_BLOCK;
+	struct FAT_node* curr = FAT_nodes.start;
+	for (int i = 0; i < node_num; i++) {
+		curr = curr->next;
+	}
+	return curr;
+}
+
+// returns contents of FAT entry for specified data block
+uint16_t get_FAT_entry(int data_blk) {
+	return traverse_FAT_until_data_blk(data_blk)->entries[data_blk % FB_ENTRIES_PER_BLOCK];
+}
+
+// updates FAT entry for specified data block (all FAT changes must go through here)
+void set_FAT_entry(int data_blk, uint16_t value) {
+	struct FAT_node *node = traverse_FAT_until_data_blk(data_blk);
+	if (value == 0 && node->entries[data_blk % FB_ENTRIES_PER_BLOCK] != 0) {
+		discard_note_free(data_blk);
+		journal_note_free(data_blk);
+	} else if (value != 0 && node->entries[data_blk % FB_ENTRIES_PER_BLOCK] == 0) {
+		journal_note_alloc(data_blk);
+	}
+	num_free_data_blocks += (node->entries[data_blk % FB_ENTRIES_PER_BLOCK] != 0) - (value != 0);
+	node->entries[data_blk % FB_ENTRIES_PER_BLOCK] = value;
+	journal_note_FAT(data_blk);
+	chain_gen++;
+}
+
+// reads data block (indexed by FAT table index, not overall block index)
+int read_data_block(int data_blk, void *buf) {
+	if (block_read(superblk.data_block_start_index + data_blk, buf) == -1) {
+		return -1;
+	}
+	return csum_verify(data_blk, buf);
+}
+
+// writes data block (indexed by FAT table index, not overall block index)
+int write_data_block(int data_blk, const void *buf) {
+	if (csum_update(data_blk, 1, buf) == -1) {
+		return -1;
+	}
+	return block_write(superblk.data_block_start_index + data_blk, buf);
+}
+
+// returns buffer holding num_blocks consecutive data blocks read from disk
+// (NULL if reading failed), to be released with unload_data_blocks(). On a
+// read-only mount, the blocks are used in place in the disk mapping.
+void *load_data_blocks(int data_blk, int num_blocks) {
+	if (FS_rdonly) {
+		return (void *)block_map(superblk.data_block_start_index + data_blk, num_blocks);
+	}
+	void *buf = block_alloc(num_blocks);
+	if (buf == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return NULL;
+	}
+	if (read_data_blocks(data_blk, num_blocks, buf) == -1) {
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+// releases a buffer returned by load_data_blocks()
+void unload_data_blocks(void *buf) {
+	if (!FS_rdonly) {
+		free(buf);
+	}
+}
+
+// returns -1 if num_blocks consecutive data blocks could not be read from disk
+int read_data_blocks(int data_blk, int num_blocks, void *buf) {
+	return block_read_many(superblk.data_block_start_index + data_blk, num_blocks, buf);
+}
+
+// returns -1 if num_blocks consecutive data blocks could not be written to disk
+int store_data_blocks(int data_blk, int num_blocks, const void *buf) {
+	return block_write_many(superblk.data_block_start_index + data_blk, num_blocks, buf);
+}
+
+// sets cur according to the block number the cursor is on
+static void chain_locate(struct chain_pos *pos) {
+	if (pos->next == FAT_EOC) {
+		pos->cur = FAT_EOC;
+	} else if (pos->next_num == pos->blk_num) {
+		pos->cur = pos->next;
+	} else {
+		pos->cur = FAT_HOLE;
+	}
+}
+
+// moves next to the following allocated block of the chain
+static void chain_step(struct chain_pos *pos) {
+	uint16_t entry = get_FAT_entry(pos->next);
+	pos->prev = pos->next;
+	pos->prev_num = pos->next_num;
+	if (!FAT_IS_LINK(entry)) {
+		pos->next = FAT_EOC;
+		return;
+	}
+	pos->next = FAT_NEXT(entry);
+	pos->next_num = pos->prev_num + 1 + (FAT_IS_HOLE(entry) ? hole_get(pos->prev) : 0);
+}
+
+// positions cursor on the first block of a file
+void chain_start(struct chain_pos *pos, int rootdir_idx) {
+	pos->rootdir_idx = rootdir_idx;
+	pos->blk_num = 0;
+	pos->prev = -1;
+	pos->prev_num = -1;
+	pos->next = rootdir_arr[rootdir_idx].first_data_block_index;
+	pos->next_num = rootdir_arr[rootdir_idx].lead_hole;
+	chain_locate(pos);
+}
+
+// moves cursor to the next block of the file
+void chain_advance(struct chain_pos *pos) {
+	pos->blk_num++;
+	if (pos->next != FAT_EOC && pos->next_num < pos->blk_num) {
+		chain_step(pos);
+	}
+	chain_locate(pos);
+}
+
+// positions cursor on block blk_num of a file, resuming from the last position
+// reached along the file when the file is open and its chain did not change
+void chain_seek(struct chain_pos *pos, int rootdir_idx, int blk_num) {
+	TP_SCOPE(TP_CHAIN_SEEK, -1, blk_num, 0);
+	struct open_file *file = open_files[rootdir_idx];
+	struct root_directory *dirent = &rootdir_arr[rootdir_idx];
+	if (file != NULL && file->seek_valid && file->seek_gen == chain_gen && file->seek_pos.blk_num <= blk_num
+			&& file->seek_first == dirent->first_data_block_index && file->seek_lead_hole == dirent->lead_hole) {
+		*pos = file->seek_pos;
+	} else {
+		chain_start(pos, rootdir_idx);
+	}
+	while (pos->next != FAT_EOC && pos->next_num < blk_num) {
+		chain_step(pos);
+	}
+	pos->blk_num = blk_num;
+	chain_locate(pos);
+
+	if (file != NULL) {
+		file->seek_pos = *pos;
+		file->seek_valid = true;
+		file->seek_gen = chain_gen;
+		file->seek_first = dirent->first_data_block_index;
+		file->seek_lead_hole = dirent->lead_hole;
+	}
+}
 
-		if (curr_fat_blk_idx % FB_ENTRIES_PER_BLOCK > next_data_blk_idx % FB_ENTRIES_PER_BLOCK) {
-			// Another entry is reachable - advance to it
-			curr = curr->next;
+// returns -1 if there is no space left on disk
+// otherwise, positions cursor on block blk_num of a file, after making sure every
+// block before it belongs to this file only (the FAT entries leading to a block
+// that is going to be modified cannot be shared with a clone)
+int chain_seek_for_write(struct chain_pos *pos, int rootdir_idx, int blk_num) {
+	TP_SCOPE(TP_CHAIN_SEEK_FOR_WRITE, -1, blk_num, 0);
+	chain_start(pos, rootdir_idx);
+	while (pos->next != FAT_EOC && pos->next_num < blk_num) {
+		if (data_blk_shared(pos->next)) {
+			bool fresh;
+			pos->blk_num = pos->next_num;
+			chain_locate(pos);
+			if (chain_prepare_write(pos, true, &fresh) == -1) {
+				return -1;
+			}
 		}
-		curr_fat_blk_idx++;
+		chain_step(pos);
 	}
-	
-	return curr_fat_blk_idx;
+	pos->blk_num = blk_num;
+	chain_locate(pos);
+	return 0;
 }
 
-// returns index of data block where offset of fd is located (indexed by FAT table index, not overall block index)
-size_t return_data_block(int fd, size_t count) {
-	int root_dir_idx = fd_table[fd].root_dir_index;
-	//how many data blocks past the first one 
-	int num_iterations = fd_table[fd].offset / BLOCK_SIZE;
-	size_t curr_data_blk_idx = rootdir_arr[root_dir_idx].first_data_block_index; 
-	size_t next_data_blk_idx;
+// makes the allocated block before the cursor (or the root directory entry) point
+// to data_blk, with a hole for the unallocated blocks in between
+static void chain_link(struct chain_pos *pos, int data_blk) {
+	int gap = pos->blk_num - pos->prev_num - 1;
+	if (pos->prev == -1) {
+		rootdir_arr[pos->rootdir_idx].first_data_block_index = data_blk;
+		rootdir_arr[pos->rootdir_idx].lead_hole = gap;
+		dirent_changed(pos->rootdir_idx);
+	} else if (gap > 0) {
+		hole_set(pos->prev, gap);
+		set_FAT_entry(pos->prev, FAT_HOLE | data_blk);
+	} else {
+		set_FAT_entry(pos->prev, data_blk);
+	}
+	pos->next = data_blk;
+	pos->next_num = pos->blk_num;
+	pos->cur = data_blk;
+}
 
-	// if this file is currently empty, we must allocate the first data block (if we have bytes to write)
-	if (curr_data_blk_idx == FAT_EOC && count > 0) {
-		struct FAT_node* curr = FAT_nodes.start;
-		int curr_fat_blk_idx = find_next_empty_entry(superblk.num_data_blocks);
+// returns -1 if there is no space left on disk
+// otherwise, makes sure the block under the cursor belongs to this file only and
+// returns its index. A block is allocated past the end of the chain or in a hole
+// (*fresh is then set), and a block shared with a clone is copied (unless keep_data
+// is false).
+int chain_prepare_write(struct chain_pos *pos, bool keep_data, bool *fresh) {
+	*fresh = false;
+	if (pos->cur == FAT_EOC || pos->cur == FAT_HOLE) {
+		// New block goes between prev and next, possibly with holes on either side
+		int gap_before = pos->blk_num - pos->prev_num - 1;
+		int gap_after = (pos->cur == FAT_HOLE) ? pos->next_num - pos->blk_num - 1 : 0;
+		if (gap_before > UINT16_MAX) {
+			return -1;
+		}
+		if ((gap_before > 0 || gap_after > 0) && sparse_enable() == -1) {
+			return -1;
+		}
 
-		if (curr_fat_blk_idx == -1) {
+		int new_data_blk = find_next_empty_entry(superblk.num_data_blocks);
+		if (new_data_blk == -1) {
 			return -1;
 		}
+		if (pos->cur == FAT_HOLE) {
+			if (gap_after > 0) {
+				hole_set(new_data_blk, gap_after);
+				set_FAT_entry(new_data_blk, FAT_HOLE | pos->next);
+			} else {
+				set_FAT_entry(new_data_blk, pos->next);
+			}
+		}
+		chain_link(pos, new_data_blk);
+		*fresh = true;
+		return new_data_blk;
+	}
 
-		rootdir_arr[root_dir_idx].first_data_block_index = curr_fat_blk_idx;
-		return curr_fat_blk_idx; 
+	if (!data_blk_shared(pos->cur)) {
+		return pos->cur;
 	}
-		
-	// Locate appropriate FAT node
-	int FAT_block_num = rootdir_arr[root_dir_idx].first_data_block_index / FB_ENTRIES_PER_BLOCK;
-	struct FAT_node* curr = FAT_nodes.start;
-	for (int i = 0; i < superblk.num_blocks_FAT; i++) {
-		if (i == FAT_block_num) {
-			break;
+
+	// Copy-on-write: the copy takes over the rest of the chain, which stays shared
+	int new_data_blk = find_next_empty_entry(superblk.num_data_blocks);
+	if (new_data_blk == -1) {
+		return -1;
+	}
+	if (keep_data) {
+		char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+		if (read_data_block(pos->cur, bounce_buf) == -1 || write_data_block(new_data_blk, bounce_buf) == -1) {
+			fprintf(stderr, "Could not copy shared data block\n");
+			set_FAT_entry(new_data_blk, 0);
+			return -1;
 		}
-		curr = curr->next;
 	}
+	uint16_t entry = get_FAT_entry(pos->cur);
+	if (FAT_IS_HOLE(entry)) {
+		hole_set(new_data_blk, hole_get(pos->cur));
+	}
+	set_FAT_entry(new_data_blk, entry);
+	refcnt_put(pos->cur);
+	chain_link(pos, new_data_blk);
+	return new_data_blk;
+}
 
-	// Go through entries of FAT block to find data blk index
-	for (int i = 0 ; i < num_iterations ; ++i) {
-		next_data_blk_idx = curr->entries[curr_data_blk_idx % FB_ENTRIES_PER_BLOCK];
-		if (next_data_blk_idx == FAT_EOC) {
-			break;
+// frees every entry of the FAT chain starting at data_blk (blocks still shared
+// with a clone only lose a reference)
+void chain_free(int data_blk) {
+	if (data_blk == FAT_EOC) {
+		return;
+	}
+	while (1) {
+		uint16_t entry = get_FAT_entry(data_blk);
+		if (data_blk_shared(data_blk)) {
+			refcnt_put(data_blk);
+		} else {
+			if (FAT_IS_HOLE(entry)) {
+				hole_set(data_blk, 0);
+			}
+			set_FAT_entry(data_blk, 0);
 		}
-		//next_data_blk_idx = next_data_blk_idx % FB_ENTRIES_PER_BLOCK;
-		if (curr_data_blk_idx % FB_ENTRIES_PER_BLOCK > next_data_blk_idx % FB_ENTRIES_PER_BLOCK) {
-			// Assuming in-order FAT entries
-			curr = curr->next;
+		if (!FAT_IS_LINK(entry)) {
+			break;
 		}
-		curr_data_blk_idx = next_data_blk_idx;
+		data_blk = FAT_NEXT(entry);
 	}
-	return curr_data_blk_idx;
 }
 
-// returns -1 if there are no more open FAT entries
-// otherwise, returns index of the new block allocated for fd.
-int allocate_new_data_block(int fd, int current_last_data_blk) {
-	// Locate appropriate FAT node
-	int FAT_block_num_last_entry = current_last_data_blk / FB_ENTRIES_PER_BLOCK;
-	struct FAT_node* curr = FAT_nodes.start;
+// returns true if a file has an open file descriptor
+bool file_is_open(int rootdir_idx) {
+	return open_files[rootdir_idx] != NULL;
+}
 
-	int curr_fat_blk_idx = find_next_empty_entry(superblk.num_data_blocks);
+// releases the fd table, closing every file descriptor
+static void fd_table_reset(void) {
+	free(fd_table);
+	fd_table = NULL;
+	fd_table_size = 0;
+	fd_free_head = -1;
+	fd_num_used = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		free(open_files[i]);
+		open_files[i] = NULL;
+	}
+}
 
-	if (curr_fat_blk_idx == -1) {
+// returns -1 if the fd table cannot grow any further
+// otherwise, doubles the size of the fd table and stacks the new entries as free
+static int fd_table_grow(void) {
+	int new_size = (fd_table_size == 0) ? FD_TABLE_MIN_SIZE : 2 * fd_table_size;
+	if (new_size > FS_OPEN_MAX_COUNT) {
+		new_size = FS_OPEN_MAX_COUNT;
+	}
+	if (new_size <= fd_table_size) {
 		return -1;
 	}
-
-	curr = FAT_nodes.start;
-	for (int i = 0; i < FAT_block_num_last_entry; i++) {
-		if (i == FAT_block_num_last_entry) {
-			break;
-		}
-		curr = curr->next;
+	struct fd_entry *new_table = realloc(fd_table, new_size * sizeof(struct fd_entry));
+	if (new_table == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	// Stacked from the end so that the lowest descriptors are handed out first
+	for (int i = new_size - 1; i >= fd_table_size; i--) {
+		new_table[i].used = 0;
+		new_table[i].next_free = fd_free_head;
+		fd_free_head = i;
 	}
-	curr->entries[current_last_data_blk % FB_ENTRIES_PER_BLOCK] = curr_fat_blk_idx;
-	return curr_fat_blk_idx;
+	fd_table = new_table;
+	fd_table_size = new_size;
+	return 0;
 }
 
-// returns FAT node pointer indicating next FAT node location
-struct FAT_node* get_next_FAT_node(int current_data_blk) {
-	int FAT_block_num_last_entry = current_data_blk / FB_ENTRIES_PER_BLOCK;
-	int i = 0;
-	struct FAT_node* curr = FAT_nodes.start;
-	while(i != FAT_block_num_last_entry) {
-		curr = curr->next;
-		i++;
+// compresses a file, packs its tail and shares its blocks (failures only leave
+// the file less compact)
+void file_pack(int rootdir_idx) {
+	if (compress_pack(rootdir_idx) == -1) {
+		fprintf(stderr, "Could not compress file\n");
+	}
+	if (tail_pack(rootdir_idx) == -1) {
+		fprintf(stderr, "Could not pack tail of file\n");
+	}
+	if (dedup_pack(rootdir_idx) == -1) {
+		fprintf(stderr, "Could not deduplicate file\n");
 	}
-	return curr;
 }
 
-// returns index of next data block after current_data_blk in file
-int get_next_data_blk(int current_data_blk) {
-	return get_next_FAT_node(current_data_blk)->entries[current_data_blk % FB_ENTRIES_PER_BLOCK];
+// records that a root directory entry was modified
+void dirent_changed(int rootdir_idx) {
+	journal_note_dirent(rootdir_idx);
 }
 
-// returns FAT node pointer indicaing location of specified data block
-struct FAT_node* traverse_FAT_until_data_blk(int data_blk) {
-	int node_num = data_blk / FB_ENTRIES_PER_BLOCK;
+// returns number of milliseconds elapsed since start
+long elapsed_ms(const struct timespec *start) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// returns -1 if there is no run of count free data blocks at the end of the disk
+// otherwise, marks the run as reserved and returns the index of its first data block
+int reserve_data_blocks(int count) {
+	int run_end = superblk.num_data_blocks;
+
+	// Look for the highest run of free entries that is long enough
+	for (int i = superblk.num_data_blocks - 1; i > 0; i--) {
+		if (get_FAT_entry(i) != 0) {
+			run_end = i;
+			continue;
+		}
+		if (run_end - i == count) {
+			for (int j = i; j < run_end; j++) {
+				set_FAT_entry(j, FAT_RESERVED);
+			}
+			return i;
+		}
+	}
+	return -1;
+}
+
+// returns -1 if FAT blocks, root directory or reference counts could not be written back in place
+int write_metadata(void) {
+	TP_SCOPE(TP_WRITE_METADATA, -1, 0, 0);
+	int writeret;
+
+	// New checksums of the FAT and root directory must be durable before the
+	// blocks are overwritten
+	if (csum_store_metadata() == -1) {
+		return -1;
+	}
+
 	struct FAT_node* curr = FAT_nodes.start;
-	for (int i = 0; i < node_num; i++) {
+	for (int8_t i = 1; i <= superblk.num_blocks_FAT; i++) {
+		writeret = block_write(i, curr->entries);
+		if (writeret == -1) {
+			fprintf(stderr, "Could not write to disk (FAT block)\n");
+			return -1;
+		}
 		curr = curr->next;
 	}
-	return curr;
+
+	writeret = block_write(superblk.root_block_index, &rootdir_arr);
+	if (writeret == -1) {
+		fprintf(stderr, "Could not write to disk (root directory)\n");
+		return -1;
+	}
+	if (refcnt_store() == -1 || hole_store() == -1) {
+		return -1;
+	}
+	return inline_store();
 }
 
-// inserts FAT_EOC into entry following writing operation
-void insert_FAT_EOC(int data_blk_to_write) {
-	struct FAT_node* curr = traverse_FAT_until_data_blk(data_blk_to_write);
-	curr->entries[data_blk_to_write % FB_ENTRIES_PER_BLOCK] = FAT_EOC;
+// returns -1 if superblock could not be written back
+int write_superblock(void) {
+	if (block_write(0, &superblk) == -1) {
+		fprintf(stderr, "Could not write to disk (superblock)\n");
+		return -1;
+	}
+	return 0;
 }
 
 int fs_mount(const char *diskname)
 {
+	return fs_mount_flags(diskname, 0);
+}
+
+int fs_mount_flags(const char *diskname, unsigned int flags)
+{
+	tp_mount_hook();
+	TP_SCOPE(TP_FS_MOUNT, -1, 0, flags);
+	if ((flags & ~(FS_MOUNT_DIRECT | FS_MOUNT_RDONLY | FS_MOUNT_DISCARD | FS_MOUNT_RAM))
+			|| ((flags & FS_MOUNT_RDONLY) && (flags & (FS_MOUNT_DIRECT | FS_MOUNT_DISCARD | FS_MOUNT_RAM)))
+			|| ((flags & FS_MOUNT_RAM) && (flags & FS_MOUNT_DIRECT))) {
+		return -1;
+	}
+
 	// Check if virtual disk cannot be opened or if no valid file system can be located
-	if (block_disk_open(diskname) == -1) {
+	int openret;
+	if (flags & FS_MOUNT_RDONLY) {
+		openret = block_disk_open_mapped(diskname);
+	} else if (flags & FS_MOUNT_DIRECT) {
+		openret = block_disk_open_direct(diskname);
+	} else if (flags & FS_MOUNT_RAM) {
+		openret = block_disk_open_ram(diskname, 0);
+	} else {
+		openret = block_disk_open(diskname);
+	}
+	if (openret == -1) {
 		return -1;
 	}
+	FS_rdonly = flags & FS_MOUNT_RDONLY;
 
 	// Store superblock info
 	int readret = block_read(0, &superblk);
@@ -203,24 +522,57 @@ int fs_mount(const char *diskname)
 		return -1;
 	}
 	
+	// Open the other backing files of a striped disk
+	if (stripe_load() == -1) {
+		block_disk_close();
+		return -1;
+	}
+
 	// Check that superblock has correct number of blocks on disk
 	int blkcount = block_disk_count();
 	if (blkcount != superblk.num_blocks_on_disk) {
 		return -1;
 	}
 
+	// Refuse images using on-disk features this version does not understand
+	if (superblk.features & ~FS_FEATURES_SUPPORTED) {
+		fprintf(stderr, "Unsupported file system features (0x%x)\n", superblk.features);
+		block_disk_close();
+		return -1;
+	}
+
+	// Load block checksums, to verify the metadata loaded next
+	if ((superblk.features & FS_FEATURE_CSUM) && csum_load() == -1) {
+		return -1;
+	}
+
 	// Load FAT blocks
 	for (int8_t i = 1; i <= superblk.num_blocks_FAT; i++) {		
-		struct FAT_node* new_FAT_node = (struct FAT_node*)malloc(sizeof(struct FAT_node));
+		struct FAT_node* new_FAT_node = malloc(sizeof(struct FAT_node));
 		if (new_FAT_node == NULL) {
 			fprintf(stderr, "Malloc failed");
 			return -1;
 		}
-		readret = block_read(i, new_FAT_node->entries);
+		if (FS_rdonly) {
+			// Entries are used in place, shared with every process mapping the disk
+			new_FAT_node->entries = (uint16_t *)block_map(i, 1);
+			readret = (new_FAT_node->entries == NULL) ? -1 : 0;
+		} else {
+			// Entries are read straight into a buffer aligned for direct I/O
+			new_FAT_node->entries = block_alloc(1);
+			if (new_FAT_node->entries == NULL) {
+				fprintf(stderr, "Malloc failed");
+				return -1;
+			}
+			readret = block_read(i, new_FAT_node->entries);
+		}
 		if (readret == -1) {
 			fprintf(stderr, "Could not read from disk (FAT block)\n");
 			return -1;
 		}
+		if (csum_verify_metadata(i, new_FAT_node->entries) == -1) {
+			return -1;
+		}
 		if (i == 1) {
 			// Setup new FAT node structure
 			new_FAT_node->next = NULL;
@@ -243,57 +595,97 @@ int fs_mount(const char *diskname)
 		fprintf(stderr, "Could not read from disk (root directory)\n");
 		return -1;
 	}
+	if (csum_verify_metadata(superblk.root_block_index, &rootdir_arr) == -1) {
+		return -1;
+	}
 
-	// Initialize the fd table
-	for (int i = 0 ; i < FS_OPEN_MAX_COUNT ; ++i) {
-		fd_table[i].used = 0;
-		fd_table[i].offset = 0;
+	// Load reference counts of blocks shared between clones
+	if ((superblk.features & FS_FEATURE_CLONE) && refcnt_load() == -1) {
+		return -1;
 	}
 
+	// Load hole lengths of sparse files
+	if ((superblk.features & FS_FEATURE_SPARSE) && hole_load() == -1) {
+		return -1;
+	}
+
+	// Load inline data extending root directory entries
+	if ((superblk.features & FS_FEATURE_INLINE) && inline_load() == -1) {
+		return -1;
+	}
+
+	// Replay metadata changes committed to the journal since the last clean unmount
+	if ((superblk.features & FS_FEATURE_JOURNAL) && journal_load() == -1) {
+		fprintf(stderr, "Could not replay journal\n");
+		return -1;
+	}
+
+	// Allocation keeps the count of free data blocks from now on
+	num_free_data_blocks = 0;
+	for (int i = 1; i < superblk.num_data_blocks; i++) {
+		if (get_FAT_entry(i) == 0) {
+			num_free_data_blocks++;
+		}
+	}
+	delalloc_reserved = 0;
+
+	// Note the blocks freed from now on, to punch them out of the disk file
+	if ((flags & FS_MOUNT_DISCARD) && discard_load() == -1) {
+		return -1;
+	}
+
+	// Start with no fd table, it is allocated by the first fs_open()
+	fd_table_reset();
+
 	FS_mounted = true;
 	return 0;
 }
 
+void *fs_buffer_alloc(size_t size) {
+	return block_alloc((size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
 int fs_umount(void) {
-	// Check if there are any open fd's
-	int all_fd_closed = 1;
-	for (int i = 0 ; i < FS_OPEN_MAX_COUNT ; ++i) {
-		if (fd_table[i].used == 1) {
-			all_fd_closed = 0;
-			break;
-		}
-	}
-	
+	TP_SCOPE(TP_FS_UMOUNT, -1, 0, 0);
 	// Check if no FS is mounted, if disk cannot be closed, or if there are still open file descriptors
-	if (!FS_mounted || block_disk_count() == -1 || !all_fd_closed) {
+	if (!FS_mounted || block_disk_count() == -1 || fd_num_used > 0) {
 		return -1;
 	}
 
-	// Write out FAT blocks to disk
-	int writeret;
-	struct FAT_node* curr = FAT_nodes.start;
-	for (int8_t i = 1; i <= superblk.num_blocks_FAT; i++) {		
-		writeret = block_write(i, curr->entries);
-		if (writeret == -1) {
-			fprintf(stderr, "Could not write to disk (FAT block)\n");
+	// Write out FAT blocks and root directory to disk (nothing changed on a read-only mount)
+	if (FS_rdonly) {
+		journal_unload();
+	} else if (superblk.features & FS_FEATURE_JOURNAL) {
+		// Checkpointing writes the metadata in place and empties the journal
+		if (journal_checkpoint() == -1) {
 			return -1;
 		}
-		curr = curr->next;
-	}
-
-	// Write out root directory to disk
-	writeret = block_write(superblk.root_block_index, &rootdir_arr);
-	if (writeret == -1) {
-		fprintf(stderr, "Could not write to disk (root directory)\n");
+		journal_unload();
+	} else if (write_metadata() == -1) {
 		return -1;
 	}
+	// Blocks freed since the last batch are punched now that the FAT is written
+	discard_flush();
+	discard_unload();
+	refcnt_unload();
+	hole_unload();
+	inline_unload();
+	compress_unload();
+	csum_unload();
+	dedup_unload();
+	fetch_unload();
 
 	// Free the allocated data for FAT nodes
+	struct FAT_node* curr;
 	for (int8_t i = 0; i < superblk.num_blocks_FAT; i++) {
 		curr = FAT_nodes.start;
 		FAT_nodes.start = FAT_nodes.start->next;
+		if (!FS_rdonly) {
+			free(curr->entries);
+		}
 		free(curr);
 	}
+	fd_table_reset();
 	
 	// Close the currently open virtual disk
 	if (block_disk_close() == -1) {
@@ -301,15 +693,22 @@ int fs_umount(void) {
 	}
 
 	FS_mounted = false;
+	FS_rdonly = false;
 	return 0;
 }
 
 int fs_info(void) {
+	TP_SCOPE(TP_FS_INFO, -1, 0, 0);
 	// Check if no virtual disk is open
 	if (block_disk_count() == -1) {
 		return -1;
 	}
 
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
 	printf("FS Info:\n");
 	printf("total_blk_count=%d\n", superblk.num_blocks_on_disk);
 	printf("fat_blk_count=%d\n", superblk.num_blocks_FAT);
@@ -349,10 +748,196 @@ int fs_info(void) {
 		}
 	}
 	printf("rdir_free_ratio=%d/128\n", num_rdir_free);
+
+	// Optional features are only listed when they are enabled
+	if (superblk.features & FS_FEATURE_JOURNAL) {
+		printf("journal_blk=%d\n", superblk.data_block_start_index + superblk.journal_start);
+		printf("journal_blk_count=%d\n", superblk.journal_blocks);
+	}
+	if (superblk.features & FS_FEATURE_CLONE) {
+		int num_shared = 0;
+		for (int i = 0; i < superblk.num_data_blocks; i++) {
+			if (data_blk_shared(i)) {
+				num_shared++;
+			}
+		}
+		printf("refcnt_blk=%d\n", superblk.data_block_start_index + superblk.refcnt_start);
+		printf("shared_blk_count=%d\n", num_shared);
+	}
+	if (superblk.features & FS_FEATURE_SPARSE) {
+		printf("hole_blk=%d\n", superblk.data_block_start_index + superblk.hole_start);
+	}
+	if (superblk.features & FS_FEATURE_TAIL) {
+		int num_tail_blocks = 0;
+		for (int i = 1; i < superblk.num_data_blocks; i++) {
+			if (get_FAT_entry(i) == FAT_TAIL) {
+				num_tail_blocks++;
+			}
+		}
+		printf("tail_blk_count=%d\n", num_tail_blocks);
+	}
+	if (superblk.features & FS_FEATURE_INLINE) {
+		int num_inline = 0;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (rootdir_arr[i].filename[0] != '\0' && file_is_inline(i)) {
+				num_inline++;
+			}
+		}
+		printf("rdir_version=%d\n", superblk.rdir_version);
+		printf("rdir_ext_blk=%d\n", superblk.data_block_start_index + superblk.rdir_ext_start);
+		printf("inline_file_count=%d\n", num_inline);
+	}
+	if (superblk.features & FS_FEATURE_COMPRESS) {
+		int num_compressed = 0;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (rootdir_arr[i].filename[0] != '\0' && file_is_compressed(i)) {
+				num_compressed++;
+			}
+		}
+		printf("compressed_file_count=%d\n", num_compressed);
+	}
+	if (superblk.features & FS_FEATURE_CSUM) {
+		printf("csum_blk=%d\n", superblk.data_block_start_index + superblk.csum_start);
+	}
+	if (superblk.features & FS_FEATURE_DEDUP) {
+		// Blocks of all files, against the blocks they actually take
+		int num_logical = 0;
+		for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+			if (rootdir_arr[i].filename[0] == '\0') {
+				continue;
+			}
+			uint16_t data_blk = rootdir_arr[i].first_data_block_index;
+			for (int j = 0; FAT_IS_LINK(data_blk) && j < superblk.num_data_blocks; j++) {
+				num_logical++;
+				data_blk = FAT_NEXT(get_FAT_entry(data_blk));
+			}
+		}
+		int num_physical = num_logical;
+		for (int i = 0; i < superblk.num_data_blocks; i++) {
+			num_physical -= refcnt_get(i);
+		}
+		printf("dedup_ratio=%.2f\n", num_physical > 0 ? (double)num_logical / num_physical : 1.0);
+	}
+	return 0;
+}
+
+int fs_enable(unsigned int feature) {
+	TP_SCOPE(TP_FS_ENABLE, -1, 0, 0);
+	// Check if no FS is mounted or if it is mounted read-only
+	if (!FS_mounted || FS_rdonly) {
+		return -1;
+	}
+
+	// Nothing to do if feature is already on
+	if (superblk.features & feature) {
+		return 0;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	switch (feature) {
+	case FS_FEATURE_JOURNAL:
+		if (journal_format() == -1) {
+			return -1;
+		}
+		break;
+	case FS_FEATURE_CLONE:
+		if (refcnt_format() == -1) {
+			return -1;
+		}
+		break;
+	case FS_FEATURE_SPARSE:
+		if (hole_format() == -1) {
+			return -1;
+		}
+		break;
+	case FS_FEATURE_TAIL:
+		// Packed blocks are allocated as needed, nothing to reserve
+		break;
+	case FS_FEATURE_INLINE:
+		if (inline_format() == -1) {
+			return -1;
+		}
+		break;
+	case FS_FEATURE_COMPRESS:
+		// Compressed files are marked in the root directory, nothing to reserve
+		break;
+	case FS_FEATURE_CSUM:
+		if (csum_format() == -1) {
+			return -1;
+		}
+		break;
+	case FS_FEATURE_DEDUP:
+		// Shared blocks are counted like those of clones
+		if (fs_enable(FS_FEATURE_CLONE) == -1) {
+			return -1;
+		}
+		break;
+	default:
+		return -1;
+	}
+
+	// Make reserved areas durable before the superblock starts pointing at them
+	if (write_metadata() == -1 || block_disk_sync() == -1) {
+		return -1;
+	}
+	superblk.features |= feature;
+	if (write_superblock() == -1) {
+		return -1;
+	}
+	return block_disk_sync();
+}
+
+int fs_sync(void) {
+	TP_SCOPE(TP_FS_SYNC, -1, 0, 0);
+	// Check if no FS is mounted
+	if (!FS_mounted) {
+		return -1;
+	}
+
+	// Nothing can have changed on a read-only mount
+	if (FS_rdonly) {
+		return 0;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	if (superblk.features & FS_FEATURE_JOURNAL) {
+		if (journal_commit() == -1) {
+			return -1;
+		}
+	} else if (write_metadata() == -1 || block_disk_sync() == -1) {
+		return -1;
+	}
+	discard_flush();
+	return 0;
+}
+
+int fs_persist(const char *diskname) {
+	TP_SCOPE(TP_FS_PERSIST, -1, 0, 0);
+	// Check if no FS is mounted or if it is mounted read-only
+	if (!FS_mounted || FS_rdonly) {
+		return -1;
+	}
+
+	// The disk in memory gets every change first, as a disk file does on fs_sync()
+	if (fs_sync() == -1) {
+		return -1;
+	}
+	if (block_disk_persist(diskname) == -1) {
+		return -1;
+	}
 	return 0;
 }
 
 int fs_create(const char *filename) {
+	TP_SCOPE(TP_FS_CREATE, -1, 0, 0);
 	// Count number of non-empty filenames in root directory
 	int num_rdir_files = 0;
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
@@ -365,8 +950,8 @@ int fs_create(const char *filename) {
 		}
 	}
 	
-	// Check if no FS mounted, if filename is invalid, if if given filename is too long, or if root directory alrady has the max # of files
-	if (!FS_mounted || &filename[0] == NULL || strlen(filename) >= FS_FILENAME_LEN || num_rdir_files >= FS_FILE_MAX_COUNT) {
+	// Check if no FS mounted (or mounted read-only), if filename is invalid, if if given filename is too long, or if root directory alrady has the max # of files
+	if (!FS_mounted || FS_rdonly || &filename[0] == NULL || strlen(filename) >= FS_FILENAME_LEN || num_rdir_files >= FS_FILE_MAX_COUNT) {
 		return -1;
 	}
 
@@ -376,89 +961,72 @@ int fs_create(const char *filename) {
 		empty_entry_idx++;
 	}
 
-	// Allocate space to store new filename string (2 bytes)
-	int8_t *new_filename;
-	new_filename = (int8_t*)strndup(filename, FS_FILENAME_LEN);
-	
 	// Create new & empty file with given filename at empty entry in root directory
-	memcpy((int8_t*)&rootdir_arr[empty_entry_idx].filename, new_filename, FS_FILENAME_LEN);
+	memset(rootdir_arr[empty_entry_idx].filename, 0, FS_FILENAME_LEN);
+	memcpy(rootdir_arr[empty_entry_idx].filename, filename, strlen(filename));
 	rootdir_arr[empty_entry_idx].file_size = 0;
 	rootdir_arr[empty_entry_idx].first_data_block_index = FAT_EOC;
-	
+	rootdir_arr[empty_entry_idx].lead_hole = 0;
+	rootdir_arr[empty_entry_idx].tail_block = 0;
+	rootdir_arr[empty_entry_idx].tail_offset = 0;
+	rootdir_arr[empty_entry_idx].flags = 0;
+	if (superblk.features & FS_FEATURE_INLINE) {
+		inline_set(empty_entry_idx, true);
+	}
+	dirent_changed(empty_entry_idx);
+
+	journal_maybe_commit();
 	return 0;
 }
 
 int fs_delete(const char *filename) {
+	TP_SCOPE(TP_FS_DELETE, -1, 0, 0);
 	int filename_exists = 0;
-	int filename_rootdir_idx;
+	int filename_rootdir_idx = -1;
 	// Check if filename to delete already exists in root directory
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
 		if (!(strcmp((char*)&rootdir_arr[i].filename, filename))) { 
 			filename_exists = 1;
 			filename_rootdir_idx = i;
-			rootdir_arr[i].filename[0] = '\0';
 			break;
 		}
 	}
 	
-	// Check if no FS is mounted, if filename is invalid, or if filename does not exist in root directory
-	if (!FS_mounted || &filename[0] == NULL || strlen(filename) >= FS_FILENAME_LEN || !filename_exists) {
+	// Check if no FS is mounted (or mounted read-only), if filename is invalid, or if filename does not exist in root directory
+	if (!FS_mounted || FS_rdonly || &filename[0] == NULL || strlen(filename) >= FS_FILENAME_LEN || !filename_exists) {
 		return -1;
 	}
 
-	int fd;
-	for (int i = 0 ; i < FS_OPEN_MAX_COUNT ; ++i) {
-		if (fd_table[i].root_dir_index == filename_rootdir_idx) {
-			fd = i;
-			break;
-		}
-	}
-
-	// Check if filename is currently opened
-	if (fd_table[fd].used) {
+	// Check if filename is currently opened (the file is left untouched then)
+	if (file_is_open(filename_rootdir_idx)) {
 		return -1;
 	}
 
-	// For stored files that are not empty, calculate FAT block entry of index to delete from
-	if (rootdir_arr[filename_rootdir_idx].first_data_block_index != FAT_EOC) {
-		int FAT_block_num = rootdir_arr[filename_rootdir_idx].first_data_block_index / FB_ENTRIES_PER_BLOCK;
-		int delete_FAT_inx = rootdir_arr[filename_rootdir_idx].first_data_block_index % FB_ENTRIES_PER_BLOCK;
-		
-		// Locate appropriate FAT node
-		struct FAT_node* curr = FAT_nodes.start;
-		for (int i = 0; i < superblk.num_blocks_FAT; i++) {
-			if (i == FAT_block_num) {
-				break;
-			}
-			curr = curr->next;
-		}
+	rootdir_arr[filename_rootdir_idx].filename[0] = '\0';
+	chain_free(rootdir_arr[filename_rootdir_idx].first_data_block_index);
+	tail_release(filename_rootdir_idx);
+	inline_set(filename_rootdir_idx, false);
+	compress_forget(filename_rootdir_idx);
+	rootdir_arr[filename_rootdir_idx].flags = 0;
+	dirent_changed(filename_rootdir_idx);
 
-		// Go through entries of FAT block to delete from
-		int delete_FAT_next_inx;
-		while(1) {
-			delete_FAT_next_inx = curr->entries[delete_FAT_inx];
-			curr->entries[delete_FAT_inx] = 0;
-			if (delete_FAT_next_inx == FAT_EOC) {
-				break;
-			}
-			delete_FAT_next_inx = delete_FAT_next_inx % FB_ENTRIES_PER_BLOCK;
-			if (delete_FAT_inx > delete_FAT_next_inx) {
-				// Assuming in-order FAT entries
-				curr = curr->next;
-			}
-			delete_FAT_inx = delete_FAT_next_inx;
-		}
-	}
+	journal_maybe_commit();
 	return 0;
 }
 
 int fs_ls(void)
 {
+	TP_SCOPE(TP_FS_LS, -1, 0, 0);
 	// Check if no FS is mounted
 	if (!FS_mounted) {
 		return -1;
 	}
 
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
 	// Iterate through root directory and files with their names and sizes
 	printf("FS Ls:\n");
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
@@ -473,8 +1041,71 @@ int fs_ls(void)
 	return 0;
 }
 
+// fills a public root directory entry from a slot of the root directory
+static void fill_dirent(int rootdir_idx, struct fs_dirent *entry) {
+	memcpy(entry->filename, rootdir_arr[rootdir_idx].filename, FS_FILENAME_LEN);
+	entry->filename[FS_FILENAME_LEN - 1] = '\0';
+	entry->size = rootdir_arr[rootdir_idx].file_size;
+	uint16_t data_blk = rootdir_arr[rootdir_idx].first_data_block_index;
+	entry->first_data_block = FAT_IS_LINK(data_blk) ? data_blk : -1;
+	entry->slot = rootdir_idx;
+}
+
+int fs_readdir(int *cursor, struct fs_dirent *entry)
+{
+	TP_SCOPE(TP_FS_READDIR, -1, cursor ? *cursor : 0, 0);
+	// Check if no FS is mounted or if arguments are invalid
+	if (!FS_mounted || cursor == NULL || entry == NULL) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	// Resume from the slot after the last file returned
+	for (int i = (*cursor < 0) ? 0 : *cursor; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0') {
+			fill_dirent(i, entry);
+			*cursor = i + 1;
+			return 1;
+		}
+	}
+	*cursor = FS_FILE_MAX_COUNT;
+	return 0;
+}
+
+int fs_stat_many(struct fs_dirent *entries, int max_entries)
+{
+	TP_SCOPE(TP_FS_STAT_MANY, -1, 0, max_entries);
+	// Check if no FS is mounted or if entries is NULL
+	if (!FS_mounted || entries == NULL) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	// One pass over the root directory, counting the files that do not fit
+	int num_files = 0;
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] == '\0') {
+			continue;
+		}
+		if (num_files < max_entries) {
+			fill_dirent(i, &entries[num_files]);
+		}
+		num_files++;
+	}
+	return num_files;
+}
+
 int fs_open(const char *filename)
 {
+	TP_SCOPE(TP_FS_OPEN, -1, 0, 0);
 	int filename_exists = 0;
 	int filename_rootdir_inx;
 	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
@@ -491,29 +1122,40 @@ int fs_open(const char *filename)
 		return -1;
 	}
 
-	// Find first open FD, and also check if the FD table is already full
-	int next_open_fd_index;
-	for (int i = 0 ; i < FS_OPEN_MAX_COUNT ; ++i) {
-		if (!fd_table[i].used) {
-			next_open_fd_index = i;
-			break;
-		}
-		if (i == FS_OPEN_MAX_COUNT - 1) {
+	// Take a free FD, growing the FD table if it is full
+	if (fd_free_head == -1 && fd_table_grow() == -1) {
+		return -1;
+	}
+
+	// Share the open file object of the file's other descriptors, if any
+	struct open_file *file = open_files[filename_rootdir_inx];
+	if (file == NULL) {
+		file = calloc(1, sizeof(struct open_file));
+		if (file == NULL) {
+			fprintf(stderr, "Malloc failed");
 			return -1;
 		}
+		file->rootdir_idx = filename_rootdir_inx;
+		open_files[filename_rootdir_inx] = file;
 	}
+	file->refcnt++;
+
+	int next_open_fd_index = fd_free_head;
+	fd_free_head = fd_table[next_open_fd_index].next_free;
 
 	fd_table[next_open_fd_index].used = 1;
-	fd_table[next_open_fd_index].root_dir_index = filename_rootdir_inx;
+	fd_table[next_open_fd_index].file = file;
 	fd_table[next_open_fd_index].offset = 0;
+	fd_num_used++;
 	
 	return next_open_fd_index;
 }
 
 int fs_close(int fd)
 {
+	TP_SCOPE(TP_FS_CLOSE, fd, 0, 0);
 	// Check if no FS is mounted or if FD is out of bounds
-	if (!FS_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	if (!FS_mounted || fd < 0 || fd >= fd_table_size) {
 		return -1;
 	}
 
@@ -522,15 +1164,39 @@ int fs_close(int fd)
 		return -1;
 	}
 
+	struct open_file *file = fd_table[fd].file;
+	int rootdir_idx = file->rootdir_idx;
 	fd_table[fd].used = 0;
+	fd_table[fd].next_free = fd_free_head;
+	fd_free_head = fd;
+	fd_num_used--;
+
+	// The open file object goes with the last descriptor, once the data it
+	// holds is written out
+	int ret = 0;
+	if (--file->refcnt == 0) {
+		if (delalloc_flush(file) == -1) {
+			ret = -1;
+		}
+		open_files[rootdir_idx] = NULL;
+		free(file);
+	}
 
-	return 0;
+	// Files are packed once nobody has them open (and left as they are on a read-only mount)
+	if (file_is_open(rootdir_idx) || FS_rdonly) {
+		return ret;
+	}
+	file_pack(rootdir_idx);
+	journal_maybe_commit();
+
+	return ret;
 }
 
 int fs_stat(int fd)
 {
+	TP_SCOPE(TP_FS_STAT, fd, 0, 0);
 	// Check if no FS is mounted or if FD is out of bounds
-	if (!FS_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	if (!FS_mounted || fd < 0 || fd >= fd_table_size) {
 		return -1;
 	}
 
@@ -539,18 +1205,21 @@ int fs_stat(int fd)
 		return -1;
 	}
 
-	return (rootdir_arr[fd_table[fd].root_dir_index].file_size);
+	// The file ends past its blocks while it holds appended data
+	return delalloc_size(fd_table[fd].file);
 }
 
 int fs_lseek(int fd, size_t offset)
 {
+	TP_SCOPE(TP_FS_LSEEK, fd, offset, 0);
 	// Check if no FS is mounted or if FD is out of bounds
-	if (!FS_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	if (!FS_mounted || fd < 0 || fd >= fd_table_size) {
 		return -1;
 	}
 
-	// Check if FD not currently open or if offset > current file size
-	if (!fd_table[fd].used || (fd_table[fd].used && offset > fs_stat(fd))) {
+	// Check if FD not currently open or if offset cannot be stored as a file size
+	// (seeking past the end of the file is allowed, writing there leaves a hole)
+	if (!fd_table[fd].used || offset > UINT32_MAX) {
 		return -1;
 	}
 
@@ -559,144 +1228,202 @@ int fs_lseek(int fd, size_t offset)
 	return 0;
 }
 
-int fs_write(int fd, void *buf, size_t count) {
-	// Check if no FS is mounted or if FD is out of bounds
-	if (!FS_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+// returns the offset of fd recorded by tracepoints (0 if fd is out of bounds)
+static inline int64_t tp_fd_offset(int fd) {
+	return (fd >= 0 && fd < fd_table_size) ? (int64_t)fd_table[fd].offset : 0;
+}
+
+// returns -1 if there is no space left on disk
+// otherwise, clears the bytes past the end of the file in its last block
+int zero_past_eof(int rootdir_idx) {
+	size_t file_size = rootdir_arr[rootdir_idx].file_size;
+	struct chain_pos pos;
+	bool fresh;
+
+	if (file_size % BLOCK_SIZE == 0) {
+		return 0;
+	}
+	if (chain_seek_for_write(&pos, rootdir_idx, file_size / BLOCK_SIZE) == -1) {
 		return -1;
 	}
+	if (pos.cur == FAT_EOC || pos.cur == FAT_HOLE) {
+		return 0;
+	}
 
-	// Check if FD is not currently open or if buf is NULL
-	if (!fd_table[fd].used || buf == NULL) {
+	int data_blk = chain_prepare_write(&pos, true, &fresh);
+	if (data_blk == -1) {
 		return -1;
-	}	
+	}
+	char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+	if (read_data_block(data_blk, bounce_buf) == -1) {
+		return -1;
+	}
+	memset(bounce_buf + file_size % BLOCK_SIZE, 0, BLOCK_SIZE - file_size % BLOCK_SIZE);
+	return write_data_block(data_blk, bounce_buf);
+}
 
-	int rootdir_idx = fd_table[fd].root_dir_index;
-	size_t total_num_blocks = (rootdir_arr[rootdir_idx].file_size / (BLOCK_SIZE + 1)) + 1;
-	size_t blocks_left = total_num_blocks - (fd_table[fd].offset / BLOCK_SIZE);
+// returns -1 if data could not be read from or written to disk
+// otherwise, writes count bytes at the offset of fd to the blocks of the file,
+// allocating those it is missing, and returns how many were written (fewer
+// than count if space ran out)
+static int write_blocks(int fd, const char *buf, size_t count) {
+	int rootdir_idx = fd_table[fd].file->rootdir_idx;
 	size_t total_bytes_written = 0;
-	size_t bytes_remaining = count;
-	int data_blk_offset = superblk.data_block_start_index;
-	int data_blk_to_write = superblk.data_block_start_index + return_data_block(fd, count);
-	int data_blk_to_write_offset_considered;
-	int old_offset = fd_table[fd].offset;	
+	struct chain_pos pos;
 
-	// Keep writing as long as there are no more bytes to write
-	while (1) {
-		if (!bytes_remaining) {
+	// Writing past the end of the file leaves a gap that must read back as zeros
+	if (fd_table[fd].offset > rootdir_arr[rootdir_idx].file_size && zero_past_eof(rootdir_idx) == -1) {
+		return 0;
+	}
+
+	// Locate the block holding the offset
+	if (chain_seek_for_write(&pos, rootdir_idx, fd_table[fd].offset / BLOCK_SIZE) == -1) {
+		return 0;
+	}
+
+	// Keep writing as long as there are bytes left to write
+	while (total_bytes_written < count) {
+		size_t offset_distance = fd_table[fd].offset % BLOCK_SIZE;
+		size_t num_bytes_writing = BLOCK_SIZE - offset_distance;
+		if (num_bytes_writing > count - total_bytes_written) {
+			num_bytes_writing = count - total_bytes_written;
+		}
+
+		// Get a block of our own, either existing or newly allocated
+		bool fresh;
+		int data_blk_to_write = chain_prepare_write(&pos, num_bytes_writing != BLOCK_SIZE, &fresh);
+		if (data_blk_to_write == -1) {
+			// No more empty FAT blocks available - stop writing
 			break;
 		}
 
-		// Create a bounce buffer that stores entire data block
-		char bounce_buf[BLOCK_SIZE];
-		if (!(data_blk_to_write >= superblk.data_block_start_index + superblk.num_data_blocks)) {
-			// Data block allocated, read block
-			int readret = block_read(data_blk_to_write, &bounce_buf);
-			if (readret == -1) {
+		int writeret;
+		if (num_bytes_writing == BLOCK_SIZE) {
+			// Whole block is replaced, write straight from the caller's buffer
+			writeret = write_data_block(data_blk_to_write, buf + total_bytes_written);
+		} else {
+			// Create a bounce buffer that stores entire data block
+			char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+			if (fresh) {
+				memset(bounce_buf, 0, BLOCK_SIZE);
+			} else if (read_data_block(data_blk_to_write, bounce_buf) == -1) {
 				fprintf(stderr, "Could not read from disk when creating bounce buffer (fs_write)\n");
 				return -1;
 			}
+			memcpy(bounce_buf + offset_distance, buf + total_bytes_written, num_bytes_writing);
+			writeret = write_data_block(data_blk_to_write, bounce_buf);
+		}
+		if (writeret == -1) {
+			fprintf(stderr, "Could not write to disk (fs_write)\n");
+			return -1;
 		}
 
-		size_t offset_distance = fd_table[fd].offset % BLOCK_SIZE;
-		void* writing_dest = bounce_buf + offset_distance;
-		void* writing_src = buf + total_bytes_written;
-		size_t num_bytes_writing;
-
-		// Check if currently on last available data block of underlying disk
-		if (data_blk_to_write + 1 >= superblk.num_blocks_on_disk) {
-			num_bytes_writing = BLOCK_SIZE - offset_distance;
-			total_bytes_written += num_bytes_writing;
-			bytes_remaining = 0;
-
-			// Write to disk
-			memcpy(writing_dest, writing_src, num_bytes_writing);
-			block_write(data_blk_to_write, &bounce_buf);
-
-			data_blk_to_write -= data_blk_offset;
-
-			insert_FAT_EOC(data_blk_to_write);
-
-			data_blk_to_write += data_blk_offset;
-			fd_table[fd].offset += num_bytes_writing;
-		}
-
-		// Check if there is another block to write to after this one
-		else if ((bytes_remaining + offset_distance) > BLOCK_SIZE) {
-			num_bytes_writing = BLOCK_SIZE - offset_distance;
-			total_bytes_written += num_bytes_writing;
-			bytes_remaining -= num_bytes_writing;
-
-			// Write to disk
-			memcpy(writing_dest, writing_src, num_bytes_writing);
-			block_write(data_blk_to_write, &bounce_buf);
-
-			data_blk_to_write_offset_considered = data_blk_to_write - data_blk_offset;
-
-			if (blocks_left == 1) {
-				insert_FAT_EOC(data_blk_to_write_offset_considered);
-				
-				// Attempt to get another empty FAT data block if extension of allocated space inside filesystem is required
-				int new_data_block = allocate_new_data_block(fd, data_blk_to_write_offset_considered);
-				if (new_data_block == -1) {
-					// No more empty FAT blocks available - stop writing
-					fd_table[fd].offset += num_bytes_writing;
-					int new_bytes_written = total_bytes_written - rootdir_arr[fd_table[fd].root_dir_index].file_size;
-					if (new_bytes_written > 0) {
-						rootdir_arr[fd_table[fd].root_dir_index].file_size += (new_bytes_written + old_offset);
-					}
-					return total_bytes_written;
-				}
-				
-				// New FAT block allocation was successful - continue writing
-				data_blk_to_write = new_data_block + data_blk_offset;
-			} else {
-				int last_data_block = data_blk_to_write;
-				data_blk_to_write = get_next_data_blk(data_blk_to_write_offset_considered);
-				struct FAT_node* curr = traverse_FAT_until_data_blk(data_blk_to_write_offset_considered);
-				curr->entries[(last_data_block - data_blk_offset) % FB_ENTRIES_PER_BLOCK] = data_blk_to_write;
-				data_blk_to_write += data_blk_offset;
+		// Update write status variables in fd table
+		total_bytes_written += num_bytes_writing;
+		fd_table[fd].offset += num_bytes_writing;
+		chain_advance(&pos);
+	}
+	
+	// Extend the file if writing went past its end
+	if (fd_table[fd].offset > rootdir_arr[rootdir_idx].file_size) {
+		rootdir_arr[rootdir_idx].file_size = fd_table[fd].offset;
+		dirent_changed(rootdir_idx);
+	}
+	return total_bytes_written;
+}
+
+int fs_write(int fd, void *buf, size_t count) {
+	TP_SCOPE(TP_FS_WRITE, fd, tp_fd_offset(fd), count);
+	// Check if no FS is mounted or if FD is out of bounds
+	if (!FS_mounted || fd < 0 || fd >= fd_table_size) {
+		return -1;
+	}
+
+	// Check if FD is not currently open, if buf is NULL, or if the FS is mounted read-only
+	if (!fd_table[fd].used || buf == NULL || FS_rdonly) {
+		return -1;
+	}	
+
+	struct open_file *file = fd_table[fd].file;
+	int rootdir_idx = file->rootdir_idx;
+
+	if (count == 0) {
+		return 0;
+	}
+
+	// Tiny files are written in their inline data, without any data block I/O
+	if (file_is_inline(rootdir_idx)) {
+		if (fd_table[fd].offset + count <= INLINE_MAX) {
+			inline_write(rootdir_idx, fd_table[fd].offset, buf, count);
+			fd_table[fd].offset += count;
+			if (fd_table[fd].offset > rootdir_arr[rootdir_idx].file_size) {
+				rootdir_arr[rootdir_idx].file_size = fd_table[fd].offset;
 			}
+			journal_maybe_commit();
+			return count;
 		}
-		
-		// Only need current block to finish writing
-		else {
-			num_bytes_writing = bytes_remaining;
-			total_bytes_written += num_bytes_writing;
-			bytes_remaining = 0;
-
-			// Write to disk
-			memcpy(writing_dest, writing_src, num_bytes_writing);
-			block_write(data_blk_to_write, &bounce_buf);
+		// File outgrows its inline data and moves to a data block
+		if (inline_migrate(rootdir_idx) == -1) {
+			return 0;
+		}
+	}
 
-			data_blk_to_write -= data_blk_offset;
-			
-			insert_FAT_EOC(data_blk_to_write);
+	// A compressed file goes back to plain blocks, and a packed tail to a block
+	// of its own, before the file changes
+	if (compress_unpack(rootdir_idx) == -1 || tail_unpack(rootdir_idx) == -1) {
+		return 0;
+	}
 
-			data_blk_to_write += data_blk_offset;
+	// Data appended past the last block of the file is held in memory, and only
+	// what lands in blocks the file has is written now
+	size_t count_now;
+	if (delalloc_prepare(file, fd_table[fd].offset, count, &count_now) == -1) {
+		return 0;
+	}
+	int total_bytes_written = (count_now > 0) ? write_blocks(fd, buf, count_now) : 0;
+	if (total_bytes_written == -1 || (size_t)total_bytes_written < count_now) {
+		journal_maybe_commit();
+		return total_bytes_written;
+	}
+	if (count_now < count) {
+		int ret = delalloc_write(file, fd_table[fd].offset, (char *)buf + count_now, count - count_now);
+		if (ret == -1) {
+			return -1;
 		}
+		fd_table[fd].offset += ret;
+		total_bytes_written += ret;
 
-		// Update write status variables in fd table
-		fd_table[fd].offset += num_bytes_writing;
-		
-		// Decrement # of blocks left UNLESS we have already hit the final one, then keep it at 1
-		if (blocks_left > 1) {
-			blocks_left -= 1;
+		// What could not be held is written as usual
+		if ((size_t)total_bytes_written < count) {
+			ret = write_blocks(fd, (char *)buf + total_bytes_written, count - total_bytes_written);
+			if (ret == -1) {
+				return -1;
+			}
+			total_bytes_written += ret;
 		}
 	}
-	
-	// Update fd table once writing is finished
-	int new_bytes_written = total_bytes_written - rootdir_arr[fd_table[fd].root_dir_index].file_size;
-	if (new_bytes_written > 0) {
-		rootdir_arr[fd_table[fd].root_dir_index].file_size += (new_bytes_written + old_offset);
-	}
-	
+
+	journal_maybe_commit();
 	return total_bytes_written;
 }
 
+// returns the number of data blocks (at most max_blks) listed in blks, those
+// from the cursor on up to the next hole or the end of the chain, and moves the
+// cursor past them
+static int chain_collect(struct chain_pos *pos, uint16_t *blks, int max_blks) {
+	int num_blks = 0;
+	while (num_blks < max_blks && pos->cur != FAT_HOLE && pos->cur != FAT_EOC) {
+		blks[num_blks++] = pos->cur;
+		chain_advance(pos);
+	}
+	return num_blks;
+}
+
 int fs_read(int fd, void *buf, size_t count)
 {
+	TP_SCOPE(TP_FS_READ, fd, tp_fd_offset(fd), count);
 	// Check if no FS is mounted or if FD is out of bounds
-	if (!FS_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT) {
+	if (!FS_mounted || fd < 0 || fd >= fd_table_size) {
 		return -1;
 	}
 
@@ -705,65 +1432,230 @@ int fs_read(int fd, void *buf, size_t count)
 		return -1;
 	}
 
-	int rootdir_idx = fd_table[fd].root_dir_index;
-	size_t total_num_blocks = (rootdir_arr[rootdir_idx].file_size / (BLOCK_SIZE + 1)) + 1;
-	size_t blocks_left_to_read = total_num_blocks - (fd_table[fd].offset / BLOCK_SIZE);
+	// Data held by the file gets its blocks first
+	if (delalloc_flush(fd_table[fd].file) == -1) {
+		return -1;
+	}
+
+	int rootdir_idx = fd_table[fd].file->rootdir_idx;
+	size_t file_size = rootdir_arr[rootdir_idx].file_size;
 	size_t total_bytes_read = 0;
-	size_t bytes_remaining = count;
-	int data_blk_to_read = superblk.data_block_start_index + return_data_block(fd, count);	
-	int data_blk_offset = superblk.data_block_start_index;
+	struct chain_pos pos;
 
-	// Go through all data blocks until there are no more data blocks to read
-	while (1) {
-		if (!blocks_left_to_read || !bytes_remaining) {
-			break;
-		}
-		
-		// Create a bounce buffer that stores entire data block
-		char bounce_buf[BLOCK_SIZE];
-		int readret = block_read(data_blk_to_read, &bounce_buf);
-		if (readret == -1) {
-			fprintf(stderr, "Could not read from disk when creating bounce buffer (fs_read)\n");
+	// Never read past the end of the file
+	if (fd_table[fd].offset >= file_size) {
+		return 0;
+	}
+	if (count > file_size - fd_table[fd].offset) {
+		count = file_size - fd_table[fd].offset;
+	}
+
+	// Contents of tiny files are already in memory
+	if (file_is_inline(rootdir_idx)) {
+		inline_read(rootdir_idx, fd_table[fd].offset, buf, count);
+		fd_table[fd].offset += count;
+		return count;
+	}
+
+	// Compressed files only decompress the chunks being read
+	if (file_is_compressed(rootdir_idx)) {
+		if (compress_read(rootdir_idx, fd_table[fd].offset, buf, count) == -1) {
 			return -1;
 		}
+		fd_table[fd].offset += count;
+		return count;
+	}
 
+	// Go through data blocks until there are no more bytes to read
+	chain_seek(&pos, rootdir_idx, fd_table[fd].offset / BLOCK_SIZE);
+	while (total_bytes_read < count) {
 		size_t offset_distance = fd_table[fd].offset % BLOCK_SIZE;
-		void* reading_dest = buf + total_bytes_read;
-		void* reading_src = bounce_buf + offset_distance;
-		size_t num_bytes_reading;
-
-		// Check if need to read more bytes than what is left in blocks allocated for file,
-		// or if reading will stop in the same data block that the file ends in
-		if ((blocks_left_to_read == 1 && (bytes_remaining + offset_distance) > BLOCK_SIZE)
-				|| (blocks_left_to_read == 1 && (rootdir_arr[rootdir_idx].file_size % BLOCK_SIZE) != 0 && (bytes_remaining + offset_distance) > (rootdir_arr[rootdir_idx].file_size % BLOCK_SIZE))) {
-			num_bytes_reading = rootdir_arr[rootdir_idx].file_size % BLOCK_SIZE;
-			bytes_remaining = 0;
-		}
-
-		// Otherwise, check if reading more data requires reading from another data block
-		else if ((bytes_remaining + offset_distance) > BLOCK_SIZE) {
-			// Read the entire block
-			num_bytes_reading = BLOCK_SIZE - offset_distance;
-			bytes_remaining -= num_bytes_reading;
-			
-			// Locate next data block index from FAT
-			data_blk_to_read = get_next_data_blk(data_blk_to_read - data_blk_offset);
-			data_blk_to_read += data_blk_offset;
-		
-		// Otherwise, read the remaining bytes from the current block to finish reading
-		} else {
-			num_bytes_reading = bytes_remaining % (BLOCK_SIZE + 1);
-			bytes_remaining = 0;
+		size_t num_bytes_reading = BLOCK_SIZE - offset_distance;
+		if (num_bytes_reading > count - total_bytes_read) {
+			num_bytes_reading = count - total_bytes_read;
 		}
 
-		// Read from disk
-		memcpy(reading_dest, reading_src, num_bytes_reading);
-		total_bytes_read += num_bytes_reading;
+		if (pos.cur == FAT_EOC && file_has_tail(rootdir_idx) && pos.blk_num == (int)(file_size / BLOCK_SIZE)) {
+			// Last partial block is packed with the tails of other files
+			if (tail_read(rootdir_idx, offset_distance, buf + total_bytes_read, num_bytes_reading) == -1) {
+				return -1;
+			}
+		} else if (pos.cur == FAT_HOLE || pos.cur == FAT_EOC) {
+			// Holes are not allocated on disk and read back as zeros
+			memset(buf + total_bytes_read, 0, num_bytes_reading);
+		} else if (offset_distance == 0 && count - total_bytes_read >= 2 * BLOCK_SIZE && fetch_threads != 0) {
+			// Blocks of the whole blocks needed are listed first and fetched together
+			uint16_t blks[FETCH_BATCH_BLOCKS];
+			size_t max_blks = (count - total_bytes_read) / BLOCK_SIZE;
+			int num_blks = chain_collect(&pos, blks, (max_blks < FETCH_BATCH_BLOCKS) ? max_blks : FETCH_BATCH_BLOCKS);
+			if (fetch_data_blocks(blks, num_blks, buf + total_bytes_read) == -1) {
+				fprintf(stderr, "Could not read from disk (fs_read)\n");
+				return -1;
+			}
+			total_bytes_read += (size_t)num_blks * BLOCK_SIZE;
+			fd_table[fd].offset += (size_t)num_blks * BLOCK_SIZE;
+			continue;
+		} else if (num_bytes_reading == BLOCK_SIZE) {
+			// Whole block is needed, read straight into the caller's buffer
+			if (read_data_block(pos.cur, buf + total_bytes_read) == -1) {
+				fprintf(stderr, "Could not read from disk (fs_read)\n");
+				return -1;
+			}
+		} else {
+			// Create a bounce buffer that stores entire data block
+			char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+			if (read_data_block(pos.cur, bounce_buf) == -1) {
+				fprintf(stderr, "Could not read from disk when creating bounce buffer (fs_read)\n");
+				return -1;
+			}
+			memcpy(buf + total_bytes_read, bounce_buf + offset_distance, num_bytes_reading);
+		}
 
 		// Update read status variables
+		total_bytes_read += num_bytes_reading;
 		fd_table[fd].offset += num_bytes_reading;
-		blocks_left_to_read -= 1;
+		chain_advance(&pos);
 	}
 
 	return total_bytes_read;
-}
\ No newline at end of file
+}
+
+// Blocks copied at a time by fs_sendfile() when going through memory
+#define SENDFILE_BUF_BLOCKS 16
+
+// returns -1 if buf could not be written whole to a host file descriptor
+static int host_write(int out_fd, const void *buf, size_t len) {
+	const char *p = buf;
+	while (len > 0) {
+		ssize_t ret = write(out_fd, p, len);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			perror("write");
+			return -1;
+		}
+		p += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+// returns -1 if the file could not be read or written out
+// otherwise, copies count bytes of a file from offset on through memory
+static int sendfile_buffered(int fd, int out_fd, size_t offset, size_t count) {
+	char *buf = block_alloc(SENDFILE_BUF_BLOCKS);
+	if (buf == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	size_t saved_offset = fd_table[fd].offset;
+	fd_table[fd].offset = offset;
+	size_t total_bytes_sent = 0;
+	int ret = 0;
+	while (total_bytes_sent < count) {
+		size_t len = count - total_bytes_sent;
+		if (len > SENDFILE_BUF_BLOCKS * BLOCK_SIZE) {
+			len = SENDFILE_BUF_BLOCKS * BLOCK_SIZE;
+		}
+		if (fs_read(fd, buf, len) != (int)len || host_write(out_fd, buf, len) == -1) {
+			ret = -1;
+			break;
+		}
+		total_bytes_sent += len;
+	}
+	fd_table[fd].offset = saved_offset;
+	free(buf);
+	return (ret == -1) ? -1 : (int)total_bytes_sent;
+}
+
+int fs_sendfile(int fd, int out_fd, size_t offset, size_t count)
+{
+	TP_SCOPE(TP_FS_SENDFILE, fd, offset, count);
+	// Check if no FS is mounted or if FDs are out of bounds
+	if (!FS_mounted || fd < 0 || fd >= fd_table_size || out_fd < 0) {
+		return -1;
+	}
+
+	// Check if FD is not currently open
+	if (!fd_table[fd].used) {
+		return -1;
+	}
+
+	// Data held by the file gets its blocks first
+	if (delalloc_flush(fd_table[fd].file) == -1) {
+		return -1;
+	}
+
+	int rootdir_idx = fd_table[fd].file->rootdir_idx;
+	size_t file_size = rootdir_arr[rootdir_idx].file_size;
+
+	// Never copy past the end of the file
+	if (offset >= file_size) {
+		return 0;
+	}
+	if (count > file_size - offset) {
+		count = file_size - offset;
+	}
+
+	// Data that is not stored as is, or that must be verified, goes through memory
+	if (file_is_inline(rootdir_idx) || file_is_compressed(rootdir_idx) || (superblk.features & FS_FEATURE_CSUM)) {
+		return sendfile_buffered(fd, out_fd, offset, count);
+	}
+
+	// Gather consecutive data blocks into runs of disk bytes copied by the kernel
+	size_t run_start = 0;
+	size_t run_len = 0;
+	size_t total_bytes_sent = 0;
+	struct chain_pos pos;
+	chain_seek(&pos, rootdir_idx, offset / BLOCK_SIZE);
+	while (total_bytes_sent < count) {
+		size_t offset_distance = offset % BLOCK_SIZE;
+		size_t num_bytes_sending = BLOCK_SIZE - offset_distance;
+		if (num_bytes_sending > count - total_bytes_sent) {
+			num_bytes_sending = count - total_bytes_sent;
+		}
+
+		if (pos.cur != FAT_HOLE && pos.cur != FAT_EOC) {
+			size_t disk_pos = (size_t)(superblk.data_block_start_index + pos.cur) * BLOCK_SIZE + offset_distance;
+			if (run_len > 0 && run_start + run_len != disk_pos) {
+				if (block_copy_out(run_start / BLOCK_SIZE, run_start % BLOCK_SIZE, run_len, out_fd) == -1) {
+					return -1;
+				}
+				run_len = 0;
+			}
+			if (run_len == 0) {
+				run_start = disk_pos;
+			}
+			run_len += num_bytes_sending;
+		} else {
+			if (run_len > 0) {
+				if (block_copy_out(run_start / BLOCK_SIZE, run_start % BLOCK_SIZE, run_len, out_fd) == -1) {
+					return -1;
+				}
+				run_len = 0;
+			}
+			// Packed tails are read from their shared block, holes are zeros
+			char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+			if (pos.cur == FAT_EOC && file_has_tail(rootdir_idx) && pos.blk_num == (int)(file_size / BLOCK_SIZE)) {
+				if (tail_read(rootdir_idx, offset_distance, bounce_buf, num_bytes_sending) == -1) {
+					return -1;
+				}
+			} else {
+				memset(bounce_buf, 0, num_bytes_sending);
+			}
+			if (host_write(out_fd, bounce_buf, num_bytes_sending) == -1) {
+				return -1;
+			}
+		}
+
+		total_bytes_sent += num_bytes_sending;
+		offset += num_bytes_sending;
+		chain_advance(&pos);
+	}
+	if (run_len > 0 && block_copy_out(run_start / BLOCK_SIZE, run_start % BLOCK_SIZE, run_len, out_fd) == -1) {
+		return -1;
+	}
+
+	return total_bytes_sent;
+}
@@ -1,10 +1,6 @@
 #ifndef _FS_H
 #define _FS_H
 
-/**
- * WARNING: YOU ARE NOT ALLOWED TO MODIFY THIS FILE!
- */
-
 #include <stddef.h> /* for size_t definition */
 
 /** Maximum filename length (including the NULL character) */
@@ -13,8 +9,20 @@
 /** Maximum number of files in the root directory */
 #define FS_FILE_MAX_COUNT 128
 
-/** Maximum number of open files */
-#define FS_OPEN_MAX_COUNT 32
+/** Maximum number of open file descriptors */
+#define FS_OPEN_MAX_COUNT 65536
+
+/** Optional on-disk features that can be turned on with fs_enable() */
+#define FS_FEATURE_JOURNAL 0x00000001
+#define FS_FEATURE_CLONE 0x00000002
+#define FS_FEATURE_SPARSE 0x00000004
+#define FS_FEATURE_TAIL 0x00000008
+#define FS_FEATURE_INLINE 0x00000010
+#define FS_FEATURE_COMPRESS 0x00000020
+#define FS_FEATURE_CSUM 0x00000040
+#define FS_FEATURE_DEDUP 0x00000080
+/** Disk striped over several backing files, set by fs_stripe() */
+#define FS_FEATURE_STRIPE 0x00000100
 
 /**
  * fs_mount - Mount a file system
@@ -29,6 +37,62 @@
  */
 int fs_mount(const char *diskname);
 
+/** Flags of fs_mount_flags() */
+#define FS_MOUNT_DIRECT 0x00000001
+#define FS_MOUNT_RDONLY 0x00000002
+#define FS_MOUNT_DISCARD 0x00000004
+#define FS_MOUNT_RAM 0x00000008
+
+/**
+ * fs_mount_flags - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @flags: %FS_MOUNT_* values or'ed together
+ *
+ * Same as fs_mount(), with options. With %FS_MOUNT_DIRECT, the virtual disk file
+ * is accessed with direct I/O (O_DIRECT): blocks bypass the host page cache, so
+ * large transfers neither cache data twice nor evict other data from memory.
+ * Every buffer of the library is aligned for direct I/O, and so are parts of
+ * the buffers given to fs_read() and fs_write() that map to whole blocks of
+ * the file when they come from fs_buffer_alloc(); other parts are copied
+ * through an aligned buffer.
+ *
+ * With %FS_MOUNT_RDONLY, the file system is mounted read-only: the virtual disk
+ * file is opened read-only and mapped in memory with a shared mapping, and the
+ * FAT and other on-disk tables are used in place in the mapping instead of
+ * being read into memory of their own. Any number of processes can mount the
+ * same disk this way at once, sharing a single copy of its metadata and data
+ * in the host page cache. Calls that would modify the file system fail,
+ * fs_sync() has nothing to do, and fs_umount() writes nothing back. The disk
+ * must not be mounted read-write meanwhile.
+ *
+ * With %FS_MOUNT_DISCARD, data blocks freed by any call (fs_delete(),
+ * fs_defrag(), ...) are punched out of the virtual disk file, so that it only
+ * takes host space for the blocks in use. Freed blocks are punched in batches,
+ * by fs_sync() and by fs_umount(), once the changes freeing them are durable.
+ *
+ * With %FS_MOUNT_RAM, the virtual disk file is read into memory at once, and
+ * the file system then runs on that copy without any host file I/O: the disk
+ * file is left as it is, and changes are lost on fs_umount() (or a crash),
+ * unless fs_persist() saves them, e.g. to keep the result of a temporary file
+ * system. With %FS_MOUNT_DISCARD as well, freed blocks give their memory back.
+ *
+ * Return: -1 if @flags are invalid (%FS_MOUNT_RDONLY cannot be combined with
+ * other flags, nor %FS_MOUNT_RAM with %FS_MOUNT_DIRECT), if virtual disk file
+ * @diskname cannot be opened (or does not support direct I/O, or cannot be
+ * read into memory), if no valid file system can be located, or if it is
+ * mounted read-only while its journal holds changes to replay. 0 otherwise.
+ */
+int fs_mount_flags(const char *diskname, unsigned int flags);
+
+/**
+ * fs_buffer_alloc - Allocate a buffer suited to direct I/O
+ * @size: Size of the buffer in bytes
+ *
+ * Return: NULL if the allocation fails, otherwise a buffer of at least @size
+ * bytes aligned on the block size, to be released with free().
+ */
+void *fs_buffer_alloc(size_t size);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -49,6 +113,224 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_enable - Enable an optional on-disk feature
+ * @feature: One of the %FS_FEATURE_* values
+ *
+ * Turn on @feature for the currently mounted file system and record it in the
+ * superblock. Features that need an on-disk area (e.g. the metadata journal)
+ * reserve it from the free data blocks at the end of the disk, so they are
+ * best enabled right after the disk is created with fs_make.x. Enabling a
+ * feature that is already on does nothing.
+ *
+ * %FS_FEATURE_JOURNAL reserves a write-ahead log for FAT and root directory
+ * changes. Changes from many operations are batched and committed to the log
+ * with a single sequential write and one flush (group commit), and committed
+ * changes are replayed by fs_mount() after a crash.
+ *
+ * %FS_FEATURE_SPARSE reserves the table of hole lengths of sparse files. It is
+ * turned on by the first fs_write() that leaves a hole.
+ *
+ * %FS_FEATURE_TAIL packs the last partial block of files (up to half a block)
+ * together with those of other files when they are closed.
+ *
+ * %FS_FEATURE_INLINE extends root directory entries with a small inline data
+ * area. Files created from then on keep their contents there, without any data
+ * block, until they outgrow it.
+ *
+ * %FS_FEATURE_COMPRESS allows files to be stored compressed, see
+ * fs_set_compression(). It is turned on by the first call to that function.
+ *
+ * %FS_FEATURE_CSUM reserves a table of CRC32C checksums of the blocks of the
+ * disk. Data blocks are verified whenever they are read, and the FAT and root
+ * directory when the file system is mounted.
+ *
+ * %FS_FEATURE_DEDUP makes files share the blocks they have in common with other
+ * files, from their end on, once nobody has them open. It turns on
+ * %FS_FEATURE_CLONE as well, for reference counts.
+ *
+ * Return: -1 if no FS is currently mounted, if @feature is unknown, or if the
+ * area needed by @feature cannot be reserved. 0 otherwise.
+ */
+int fs_enable(unsigned int feature);
+
+/**
+ * fs_sync - Make metadata changes durable
+ *
+ * Flush the FAT and root directory changes made so far to the disk. When the
+ * journal is enabled, the pending changes are committed to the journal;
+ * otherwise the FAT and root directory are written back in place.
+ *
+ * Return: -1 if no FS is currently mounted or if writing to the disk fails. 0
+ * otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_persist - Save a file system mounted in memory to a virtual disk file
+ * @diskname: Name of the virtual disk file to write, or NULL for the one that
+ * was mounted
+ *
+ * Make the changes of a file system mounted with %FS_MOUNT_RAM durable in
+ * memory as fs_sync() does, then write the whole disk to @diskname,
+ * atomically: it is written under a temporary name next to @diskname, flushed
+ * to stable storage, and renamed over @diskname, so that a crash leaves either
+ * the previous file or the new one. Blocks of zeros are left as holes. The
+ * file system stays mounted in memory.
+ *
+ * Return: -1 if no FS is currently mounted, if it was not mounted with
+ * %FS_MOUNT_RAM, or if writing the file fails. 0 otherwise.
+ */
+int fs_persist(const char *diskname);
+
+/**
+ * fs_discard - Punch free blocks out of the virtual disk file
+ *
+ * Make changes durable as fs_sync() does, then deallocate every free data
+ * block in the virtual disk file, which keeps its size: the host only keeps
+ * space for the blocks in use. Mounting with %FS_MOUNT_DISCARD does the same
+ * for blocks as they are freed.
+ *
+ * Return: -1 if no FS is currently mounted, if it is mounted read-only, or if
+ * the host file system cannot deallocate parts of files. Otherwise return the
+ * number of free data blocks punched.
+ */
+int fs_discard(void);
+
+/**
+ * fs_copy_disk - Copy a virtual disk file, skipping its holes
+ * @diskname: Name of the virtual disk file to copy
+ * @copy_name: Name of the copy (overwritten if it exists)
+ *
+ * Copy virtual disk file @diskname, mounted or not, to @copy_name. Only the
+ * parts of @diskname that hold data are read and written: blocks punched by
+ * fs_discard() or %FS_MOUNT_DISCARD, and those never written, remain holes in
+ * the copy. If a file system is mounted read-write, its changes are first made
+ * durable as fs_sync() does, so that a copy of the mounted disk is complete.
+ * The backing files of a disk striped by fs_stripe() are copied along, to
+ * backing files of the copy. The changes of a disk mounted with %FS_MOUNT_RAM
+ * are only in the copy once fs_persist() saved them to the disk file.
+ *
+ * Return: -1 if either file cannot be opened, if @diskname holds no valid file
+ * system, or if the copy fails. Otherwise
+ * return the number of blocks of data copied.
+ */
+int fs_copy_disk(const char *diskname, const char *copy_name);
+
+/**
+ * fs_stripe - Copy a virtual disk, striping it over several backing files
+ * @diskname: Name of the virtual disk file to copy
+ * @striped_name: Name of the copy (overwritten if it exists, as are its
+ * backing files)
+ * @num_stripes: Number of backing files of the copy (at most 16)
+ * @stripe_unit: Number of consecutive blocks of the copy held by a backing
+ * file in turn
+ *
+ * Copy virtual disk @diskname, mounted or not and striped or not, as
+ * fs_copy_disk() does, laying out the copy over @num_stripes backing files:
+ * @striped_name itself, which holds the superblock, then @striped_name with a
+ * suffix of ".1", ".2", ... Stripe units of @stripe_unit blocks go to each file
+ * in turn, and the layout is recorded in the superblock of the copy
+ * (%FS_FEATURE_STRIPE), which fs_mount() then opens with all its backing
+ * files. Backing files can be put on different host devices (e.g. with
+ * symbolic links) to add up their bandwidth: large reads and writes go to
+ * every file they span at the same time. A single backing file makes a disk
+ * that is not striped.
+ *
+ * A striped disk cannot be mounted with %FS_MOUNT_RDONLY or %FS_MOUNT_RAM,
+ * its blocks not being in a single file to map or to load.
+ *
+ * Return: -1 if the layout is invalid, if @striped_name is @diskname, if
+ * @diskname holds no valid file system, or if the copy fails. Otherwise return
+ * the number of blocks of data copied.
+ */
+int fs_stripe(const char *diskname, const char *striped_name, int num_stripes, int stripe_unit);
+
+/** Fragmentation of the data blocks, as reported by fs_frag_report() */
+struct fs_frag_report {
+	/* Number of files holding at least one data block */
+	int num_files;
+	/* Number of files whose blocks are not all consecutive on disk */
+	int num_fragmented_files;
+	/* Number of runs of consecutive blocks, over all files */
+	int num_file_extents;
+	/* Number of free data blocks, of runs of free blocks and longest run */
+	int num_free_blocks;
+	int num_free_extents;
+	int largest_free_extent;
+};
+
+/**
+ * fs_frag_report - Measure fragmentation
+ * @report: Filled with the fragmentation of the mounted file system
+ *
+ * Return: -1 if no FS is currently mounted or if @report is NULL. 0 otherwise.
+ */
+int fs_frag_report(struct fs_frag_report *report);
+
+/**
+ * fs_defrag - Defragment the file system
+ * @time_budget_ms: Time after which to stop (in milliseconds), 0 for no limit
+ *
+ * Move data blocks so that the blocks of every file are consecutive, files
+ * being packed at the start of the data blocks and the free space gathered at
+ * the end. Files and blocks that are already in place are not moved. Files
+ * may stay open while the file system is defragmented.
+ *
+ * When @time_budget_ms runs out, fs_defrag() stops after the block being
+ * moved, and a later call picks up where it left off. Calling fs_defrag()
+ * until it returns 0 defragments the file system incrementally.
+ *
+ * Return: -1 if no FS is currently mounted, or if reading or writing a block
+ * fails, or if there is no free block left to move blocks around. Otherwise
+ * return the number of blocks moved (0 once the file system is defragmented).
+ */
+int fs_defrag(unsigned int time_budget_ms);
+
+/** Flags for fs_check() */
+#define FS_CHECK_REPAIR 0x00000001
+
+/** Problems found by fs_check() */
+struct fs_check_report {
+	/* Number of problems found, and how many of them were repaired */
+	int num_errors;
+	int num_repaired;
+	/* Chains running into a block already visited by the same file */
+	int num_loops;
+	/* Chains reaching invalid FAT entries, free or reserved blocks */
+	int num_bad_links;
+	/* Blocks reached by more files than their reference count allows */
+	int num_cross_linked;
+	/* Allocated blocks reached by no file */
+	int num_leaked;
+	/* Files whose size does not match the length of their chain */
+	int num_bad_sizes;
+	/* Blocks in use whose content does not match their checksum */
+	int num_bad_csums;
+};
+
+/**
+ * fs_check - Check the consistency of the file system
+ * @flags: %FS_CHECK_REPAIR to fix the problems found
+ * @report: Filled with the problems found (may be NULL)
+ *
+ * Validate the geometry recorded in the superblock, walk the FAT chain of
+ * every file with a visited bitmap to find loops, invalid links and blocks
+ * cross-linked between files, check file sizes against chain lengths, and
+ * find allocated blocks that no file reaches (leaks). Every problem is
+ * printed. Chains are walked by several threads at once.
+ *
+ * With %FS_CHECK_REPAIR, chains are cut before a loop or an invalid link,
+ * chains are cut or sizes lowered so that both agree, cross-linked blocks
+ * become shared copy-on-write between the files (see fs_clone()), and leaked
+ * blocks are freed. A broken superblock is never repaired.
+ *
+ * Return: -1 if no FS is currently mounted or if the check could not run.
+ * Otherwise return the number of problems left unrepaired (0 if the file
+ * system is consistent).
+ */
+int fs_check(unsigned int flags, struct fs_check_report *report);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -77,6 +359,64 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content as file @src, without
+ * copying any data: both files share the data blocks of @src. A shared block
+ * is only duplicated when one of the files modifies it. Deleting one of the
+ * files leaves the other one untouched. String @dst must follow the same rules
+ * as for fs_create().
+ *
+ * Return: -1 if no FS is currently mounted, if there is no file named @src, if
+ * @dst cannot be created (see fs_create()), if the reference count table
+ * cannot be reserved, or if a block of @src is already shared by too many
+ * files. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
+/**
+ * fs_set_compression - Turn compression of a file on or off
+ * @filename: File name
+ * @on: Non-zero to store the file compressed, zero to store it plainly
+ *
+ * A file with compression on is compressed whenever nobody has it open: right
+ * away, or when its last file descriptor is closed. Its data is compressed in
+ * chunks of a few blocks, and a chunk index lets fs_read() decompress only the
+ * chunks it reads. fs_write() turns the file back into plain blocks first. A
+ * file is left plain if compressing it would save no block, or if it has
+ * holes. Turning compression off stores the file plainly right away.
+ *
+ * Return: -1 if no FS is currently mounted, if there is no file named
+ * @filename, or if there is not enough space left to store the file. 0
+ * otherwise.
+ */
+int fs_set_compression(const char *filename, int on);
+
+/**
+ * fs_import - Copy host files into the file system
+ * @host_filenames: Paths of the host files to copy
+ * @num_files: Number of entries in @host_filenames
+ *
+ * Create one file per host file, named after the last component of its path
+ * (see fs_create() for the rules), and copy the contents of the host file into
+ * it. All the files are imported within the current mount: their blocks are
+ * allocated up front, their data is read and written by several threads in
+ * large batches, and the metadata of all of them is flushed once at the end,
+ * as with fs_sync().
+ *
+ * A host file that cannot be read or whose file cannot be created is skipped.
+ * If the disk runs out of space, files only keep the data that fits, as with
+ * fs_write().
+ *
+ * Return: -1 if no FS is currently mounted, if @host_filenames is NULL, or if
+ * the metadata cannot be flushed. Otherwise return the number of files
+ * imported.
+ */
+int fs_import(const char **host_filenames, int num_files);
+
 /**
  * fs_ls - List files on file system
  *
@@ -86,6 +426,47 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/** Root directory entry, as returned by fs_readdir() and fs_stat_many() */
+struct fs_dirent {
+	/* NULL-terminated file name */
+	char filename[FS_FILENAME_LEN];
+	/* Size of the file in bytes */
+	size_t size;
+	/* First data block of the file (-1 if it has none) */
+	int first_data_block;
+	/* Slot of the file in the root directory */
+	int slot;
+};
+
+/**
+ * fs_readdir - Iterate over the files of the root directory
+ * @cursor: Position of the iteration, to be set to 0 before the first call
+ * @entry: Filled with the next file
+ *
+ * Fill @entry with the first file found at or after slot *@cursor of the root
+ * directory, and move *@cursor past it. Calling fs_readdir() until it returns
+ * 0 lists every file once, without opening any of them. Files created or
+ * deleted during the iteration may or may not be listed.
+ *
+ * Return: -1 if no FS is currently mounted, or if @cursor or @entry is NULL. 0
+ * if there is no file left, 1 otherwise.
+ */
+int fs_readdir(int *cursor, struct fs_dirent *entry);
+
+/**
+ * fs_stat_many - Get the status of every file
+ * @entries: Array filled with one entry per file, in root directory order
+ * @max_entries: Number of entries that fit in @entries
+ *
+ * Fill @entries with the files of the root directory in a single pass over it
+ * (at most %FS_FILE_MAX_COUNT of them), without opening any file.
+ *
+ * Return: -1 if no FS is currently mounted, or if @entries is NULL. Otherwise
+ * return the number of files, which is larger than @max_entries if @entries
+ * was too small to hold them all.
+ */
+int fs_stat_many(struct fs_dirent *entries, int max_entries);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -95,12 +476,13 @@ int fs_ls(void);
  * that is used subsequently to access the contents of the file. The file offset
  * of the file descriptor is set to 0 initially (beginning of the file). If the
  * same file is opened multiple files, fs_open() must return distinct file
- * descriptors. A maximum of %FS_OPEN_MAX_COUNT files can be open
- * simultaneously.
+ * descriptors. A maximum of %FS_OPEN_MAX_COUNT file descriptors can be open
+ * simultaneously; the table holding them grows as needed, and opening or
+ * closing a file takes constant time however many are open.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to open, or if there are already
- * %FS_OPEN_MAX_COUNT files currently open. Otherwise, return the file
+ * %FS_OPEN_MAX_COUNT file descriptors open. Otherwise, return the file
  * descriptor.
  */
 int fs_open(const char *filename);
@@ -137,9 +519,12 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * @offset may be larger than the current file size. Writing there leaves a
+ * hole: the blocks in between are not allocated and read back as zeros.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the largest file size. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
@@ -186,4 +571,56 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_sendfile - Copy part of a file to a host file descriptor
+ * @fd: File descriptor
+ * @out_fd: Host file descriptor to write to (file, socket or pipe)
+ * @offset: Offset in the file of the first byte to copy
+ * @count: Number of bytes to copy
+ *
+ * Copy @count bytes of the file referenced by file descriptor @fd, from
+ * @offset on, to host file descriptor @out_fd at its current offset. Runs of
+ * consecutive data blocks are copied by the kernel straight from the virtual
+ * disk file, without going through user memory. Holes, packed tails, inline and
+ * compressed files, and disks with block checksums (which must be verified) go
+ * through a buffer instead.
+ *
+ * As with fs_read(), fewer than @count bytes are copied if the file ends
+ * earlier. The file offset of @fd is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @out_fd is invalid, or
+ * if the copy fails. Otherwise return the number of bytes copied.
+ */
+int fs_sendfile(int fd, int out_fd, size_t offset, size_t count);
+
+/**
+ * fs_tracepoints_enable - Turn tracepoints on or off
+ * @on: Whether to record events
+ *
+ * While tracepoints are on, the entry and exit of every call above, of every
+ * block read and write, and of a few internal steps are recorded with a
+ * timestamp, the file descriptor, the file offset or block, and the byte or
+ * block count, in a ring buffer per thread holding the most recent events.
+ * Tracepoints are also turned on at mount if environment variable
+ * FS_TRACEPOINTS names a file, which events are then dumped to when the
+ * program exits.
+ *
+ * Return: -1 if libfs was built without tracepoints. 0 otherwise.
+ */
+int fs_tracepoints_enable(int on);
+
+/**
+ * fs_tracepoints_dump - Save recorded events
+ * @filename: Name of the file to write (overwritten if it exists)
+ *
+ * Write the events currently held by the ring buffers of all threads to
+ * @filename, which fs_tracedump.x converts to Chrome trace JSON. Threads should
+ * not be calling the API meanwhile, or their latest events may be left out.
+ *
+ * Return: -1 if libfs was built without tracepoints or if @filename cannot be
+ * written. Otherwise return the number of events written.
+ */
+int fs_tracepoints_dump(const char *filename);
+
 #endif /* _FS_H */
@@ -0,0 +1,88 @@
+#ifndef _FS_CLIENT_H
+#define _FS_CLIENT_H
+
+/*
+ * Client of fs_server.x, which keeps a disk mounted and serves the file API to
+ * local programs over a Unix domain socket.
+ *
+ * fs_client_*() calls mirror the fs.h calls of the same name and return the
+ * same results, computed by the server on its mounted disk, or -1 if the
+ * server cannot be reached. Each waits for its response. To pipeline requests
+ * instead, send them with fs_client_submit() and collect their responses, in
+ * the same order, with fs_client_receive().
+ */
+
+#include <stddef.h>
+
+#include "fs.h"
+#include "fs_proto.h"
+
+struct fs_client;
+
+/**
+ * fs_client_connect - Connect to a file system server
+ * @socket_path: Path of the server's Unix domain socket
+ *
+ * Return: NULL if the server cannot be reached or speaks another version of
+ * the protocol. Otherwise the connection, to be closed with
+ * fs_client_disconnect().
+ */
+struct fs_client *fs_client_connect(const char *socket_path);
+
+/**
+ * fs_client_disconnect - Close a connection
+ * @client: Connection
+ *
+ * File descriptors still open through @client are closed by the server.
+ */
+void fs_client_disconnect(struct fs_client *client);
+
+/**
+ * fs_client_submit - Send a request without waiting for its response
+ * @client: Connection
+ * @op: One of the %FS_OP_* values
+ * @fd: File descriptor, for requests on a file descriptor
+ * @arg: Offset of %FS_OP_LSEEK, count of %FS_OP_READ, or number of entries of
+ * %FS_OP_STAT_MANY
+ * @data: Data following the request (see fs_proto.h), NULL if none
+ * @data_len: Length of @data
+ *
+ * Return: -1 if the request cannot be sent. 0 otherwise.
+ */
+int fs_client_submit(struct fs_client *client, int op, int fd, size_t arg, const void *data, size_t data_len);
+
+/**
+ * fs_client_receive - Wait for the response to the oldest request submitted
+ * @client: Connection
+ * @buf: Buffer receiving the data of the response, NULL if none is expected
+ * @buf_len: Length of @buf
+ *
+ * Return: -1 if the response cannot be received or its data does not fit in
+ * @buf. Otherwise the result of the request.
+ */
+int fs_client_receive(struct fs_client *client, void *buf, size_t buf_len);
+
+int fs_client_create(struct fs_client *client, const char *filename);
+int fs_client_delete(struct fs_client *client, const char *filename);
+int fs_client_clone(struct fs_client *client, const char *src, const char *dst);
+int fs_client_open(struct fs_client *client, const char *filename);
+int fs_client_close(struct fs_client *client, int fd);
+int fs_client_stat(struct fs_client *client, int fd);
+int fs_client_lseek(struct fs_client *client, int fd, size_t offset);
+int fs_client_write(struct fs_client *client, int fd, const void *buf, size_t count);
+int fs_client_read(struct fs_client *client, int fd, void *buf, size_t count);
+int fs_client_sync(struct fs_client *client);
+int fs_client_stat_many(struct fs_client *client, struct fs_dirent *entries, int max_entries);
+
+/**
+ * fs_client_shutdown - Stop the server
+ * @client: Connection
+ *
+ * The server unmounts its disk and exits.
+ *
+ * Return: -1 if the server cannot be reached or cannot unmount the disk. 0
+ * otherwise.
+ */
+int fs_client_shutdown(struct fs_client *client);
+
+#endif /* _FS_CLIENT_H */
@@ -0,0 +1,324 @@
+#ifndef _FS_INTERNAL_H
+#define _FS_INTERNAL_H
+
+/*
+ * Definitions shared between the translation units of libfs. Nothing in here
+ * is part of the public API exposed by fs.h.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "tracepoint.h"
+
+#define SB_PADDING_LEN 4050
+#define SB_EXPECTED_SIG 6000536558536704837
+#define FB_ENTRIES_PER_BLOCK 2048
+#define RD_PADDING_LEN 3
+#define FAT_EOC 0xFFFF
+#define FAT_RESERVED 0xFFFE
+// Marks a data block holding packed tails of files
+#define FAT_TAIL 0xFFFD
+// Flag on a FAT entry telling that a hole (unallocated blocks reading back as
+// zeros, length kept in the hole table) comes before the next block
+#define FAT_HOLE 0x8000
+#define FAT_IS_HOLE(entry) (((entry) & 0xE000) == FAT_HOLE)
+#define FAT_NEXT(entry) ((entry) & ~FAT_HOLE)
+#define FAT_IS_LINK(entry) (((entry) & 0x6000) == 0 && FAT_NEXT(entry) != 0)
+// Root directory entry format extended with an inline data area
+#define RDIR_VERSION_INLINE 2
+// Size of the inline data area of a root directory entry
+#define INLINE_MAX 96
+// Flags of a root directory entry
+#define DIRENT_INLINE 0x01
+// Compression is on for the file (DIRENT_COMPRESS), and its chain currently
+// holds a compressed stream (DIRENT_COMPRESSED)
+#define DIRENT_COMPRESS 0x02
+#define DIRENT_COMPRESSED 0x04
+// Amount of file data compressed as a unit
+#define COMPRESS_CHUNK (4 * BLOCK_SIZE)
+// Alignment of buffers read from or written to disk, which direct I/O requires
+#define BLOCK_ALIGNED __attribute__((aligned(BLOCK_SIZE)))
+
+// Features this version of libfs knows how to mount
+#define FS_FEATURES_SUPPORTED (FS_FEATURE_JOURNAL | FS_FEATURE_CLONE | FS_FEATURE_SPARSE | FS_FEATURE_TAIL | FS_FEATURE_INLINE \
+		| FS_FEATURE_COMPRESS | FS_FEATURE_CSUM | FS_FEATURE_DEDUP | FS_FEATURE_STRIPE)
+
+struct __attribute__ ((__packed__)) superblock {
+	int64_t signature;
+	int16_t num_blocks_on_disk;
+	int16_t root_block_index;
+	int16_t data_block_start_index;
+	int16_t num_data_blocks;
+	int8_t num_blocks_FAT;
+	// Optional features (zero on images created by fs_make.x)
+	uint32_t features;
+	uint16_t journal_start;
+	uint16_t journal_blocks;
+	uint16_t refcnt_start;
+	uint16_t refcnt_blocks;
+	uint16_t hole_start;
+	uint16_t hole_blocks;
+	// Format of root directory entries (0 for the plain 32-byte entries), and
+	// area holding the inline data extending each entry
+	uint8_t rdir_version;
+	uint16_t rdir_ext_start;
+	uint16_t rdir_ext_blocks;
+	uint16_t csum_start;
+	uint16_t csum_blocks;
+	// Number of backing files the disk is striped over, and number of
+	// consecutive blocks each holds in turn
+	uint16_t stripe_count;
+	uint16_t stripe_unit;
+	int8_t padding[SB_PADDING_LEN];
+};
+_Static_assert(sizeof(struct superblock) == BLOCK_SIZE, "superblock must fill one block");
+
+struct __attribute__ ((__packed__)) FAT_node {
+	// FB_ENTRIES_PER_BLOCK entries of a FAT block, in a buffer of their own, or in
+	// place in the disk mapping of a read-only mount
+	uint16_t *entries;
+	struct FAT_node* next;
+};
+
+struct __attribute__ ((__packed__)) FAT_section {
+	struct FAT_node* start;
+	struct FAT_node* end;
+};
+
+struct __attribute__ ((__packed__)) root_directory {
+	int8_t filename[FS_FILENAME_LEN];
+	uint32_t file_size;
+	uint16_t first_data_block_index;
+	// Number of unallocated blocks before the first data block
+	uint16_t lead_hole;
+	// Packed block holding the last partial block of the file (0 if none) and
+	// offset of that tail in the block
+	uint16_t tail_block;
+	uint16_t tail_offset;
+	// DIRENT_* flags
+	uint8_t flags;
+	int8_t padding[RD_PADDING_LEN];
+};
+
+struct __attribute__ ((__packed__)) fd_entry {
+	int used;
+	// File the descriptor is open on, shared with its other descriptors
+	struct open_file *file;
+	size_t offset;
+	// Next free entry of the table (-1 for none), while the entry is free
+	int next_free;
+};
+
+// Position of a walk along the FAT chain of a file
+struct chain_pos {
+	int rootdir_idx;
+	// Block number within the file
+	int blk_num;
+	// Last allocated block before blk_num (-1 if there is none) and its number
+	int prev;
+	int prev_num;
+	// First allocated block from blk_num on (FAT_EOC if there is none) and its number
+	int next;
+	int next_num;
+	// Data block holding blk_num (FAT_HOLE in a hole, FAT_EOC past the end of the chain)
+	int cur;
+};
+
+// State of a file shared by every file descriptor open on it, allocated by the
+// first fs_open() of the file and released by its last fs_close()
+struct open_file {
+	int rootdir_idx;
+	// Number of file descriptors open on the file
+	int refcnt;
+	// Position reached by the last chain_seek() along the file, for the next one
+	// to resume from. It holds while no FAT entry or hole length changed since
+	// (chain_gen is still seek_gen) and the file starts where it did.
+	struct chain_pos seek_pos;
+	bool seek_valid;
+	uint32_t seek_gen;
+	uint16_t seek_first;
+	uint16_t seek_lead_hole;
+	// Data appended past the last block of the file and not given blocks yet
+	// (see delalloc.c): buffer of da_cap blocks holding da_len bytes from block
+	// da_blk of the file on, and number of free blocks reserved for it
+	char *da_buf;
+	int da_cap;
+	size_t da_len;
+	int da_blk;
+	int da_reserved;
+};
+
+extern struct superblock superblk;
+extern struct FAT_section FAT_nodes;
+extern struct root_directory rootdir_arr[FS_FILE_MAX_COUNT];
+// Table of file descriptors, grown as more are open at once
+extern struct fd_entry *fd_table;
+extern int fd_table_size;
+extern bool FS_mounted;
+// Mounted with FS_MOUNT_RDONLY, on a disk mapped in memory
+extern bool FS_rdonly;
+// Bumped by every change of a FAT entry or hole length
+extern uint32_t chain_gen;
+// Open file objects of the files having descriptors open (NULL for the others)
+extern struct open_file *open_files[FS_FILE_MAX_COUNT];
+// Number of free data blocks, and data block find_next_empty_entry() looks at
+// first (0 to start from the beginning of the FAT)
+extern int num_free_data_blocks;
+extern int alloc_hint;
+
+/* fs.c */
+struct FAT_node* traverse_FAT_until_data_blk(int data_blk);
+uint16_t get_FAT_entry(int data_blk);
+void set_FAT_entry(int data_blk, uint16_t value);
+void dirent_changed(int rootdir_idx);
+long elapsed_ms(const struct timespec *start);
+int find_next_empty_entry(int num_data_blocks);
+int read_data_block(int data_blk, void *buf);
+int write_data_block(int data_blk, const void *buf);
+void *load_data_blocks(int data_blk, int num_blocks);
+void unload_data_blocks(void *buf);
+int read_data_blocks(int data_blk, int num_blocks, void *buf);
+int store_data_blocks(int data_blk, int num_blocks, const void *buf);
+void chain_start(struct chain_pos *pos, int rootdir_idx);
+void chain_advance(struct chain_pos *pos);
+void chain_seek(struct chain_pos *pos, int rootdir_idx, int blk_num);
+int chain_seek_for_write(struct chain_pos *pos, int rootdir_idx, int blk_num);
+int chain_prepare_write(struct chain_pos *pos, bool keep_data, bool *fresh);
+int zero_past_eof(int rootdir_idx);
+void chain_free(int data_blk);
+bool file_is_open(int rootdir_idx);
+void file_pack(int rootdir_idx);
+int reserve_data_blocks(int count);
+int write_metadata(void);
+int write_superblock(void);
+
+/* journal.c */
+int journal_format(void);
+int journal_load(void);
+void journal_unload(void);
+void journal_note_FAT(int data_blk);
+void journal_note_dirent(int rootdir_idx);
+void journal_note_refcnt(int data_blk);
+void journal_note_hole(int data_blk);
+void journal_note_csum(int data_blk);
+void journal_note_free(int data_blk);
+void journal_note_alloc(int data_blk);
+bool journal_block_freed(int data_blk);
+bool journal_block_fresh(int data_blk);
+int journal_log_csum(int data_blk, int count);
+int journal_commit_freed(void);
+int journal_commit(void);
+void journal_maybe_commit(void);
+int journal_checkpoint(void);
+
+/* clone.c */
+int refcnt_format(void);
+int refcnt_load(void);
+int refcnt_store(void);
+void refcnt_unload(void);
+uint8_t refcnt_get(int data_blk);
+void refcnt_set(int data_blk, uint8_t value);
+bool data_blk_shared(int data_blk);
+void refcnt_put(int data_blk);
+
+/* sparse.c */
+int hole_format(void);
+int hole_load(void);
+int hole_store(void);
+void hole_unload(void);
+uint16_t hole_get(int data_blk);
+void hole_set(int data_blk, uint16_t len);
+int sparse_enable(void);
+
+/* tail.c */
+bool file_has_tail(int rootdir_idx);
+int tail_read(int rootdir_idx, size_t offset, void *buf, size_t count);
+int tail_pack(int rootdir_idx);
+int tail_unpack(int rootdir_idx);
+void tail_release(int rootdir_idx);
+void tail_forget(int data_blk);
+
+/* inline.c */
+int inline_format(void);
+int inline_load(void);
+int inline_store(void);
+void inline_unload(void);
+bool file_is_inline(int rootdir_idx);
+void *inline_data(int rootdir_idx);
+void inline_read(int rootdir_idx, size_t offset, void *buf, size_t count);
+void inline_write(int rootdir_idx, size_t offset, const void *buf, size_t count);
+void inline_set(int rootdir_idx, bool on);
+int inline_migrate(int rootdir_idx);
+
+/* lz.c */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t dst_cap);
+long lz_decompress(const void *src, size_t len, void *dst, size_t dst_cap);
+
+/* compress.c */
+bool file_is_compressed(int rootdir_idx);
+int compress_read(int rootdir_idx, size_t offset, void *buf, size_t count);
+int compress_pack(int rootdir_idx);
+int compress_unpack(int rootdir_idx);
+int compress_stored_blocks(int rootdir_idx);
+void compress_forget(int rootdir_idx);
+void compress_unload(void);
+
+/* csum.c */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_impl_name(void);
+int csum_format(void);
+int csum_load(void);
+void csum_unload(void);
+int csum_store_metadata(void);
+int csum_verify_metadata(int blk, const void *buf);
+bool csum_match(int data_blk, uint32_t crc);
+int csum_verify(int data_blk, const void *buf);
+int csum_update(int data_blk, int count, const void *buf);
+uint32_t csum_get(int data_blk);
+void csum_set(int data_blk, uint32_t crc);
+uint32_t csum_get_prev(int data_blk);
+void csum_set_prev(int data_blk, uint32_t crc);
+
+/* dedup.c */
+int dedup_pack(int rootdir_idx);
+void dedup_unload(void);
+
+/* fetch.c */
+// Largest number of blocks fetched at once
+#define FETCH_BATCH_BLOCKS 1024
+// Threads reading the blocks of large reads (-1 for the default)
+extern int fetch_threads;
+int fetch_data_blocks(const uint16_t *blks, int count, void *buf);
+void fetch_unload(void);
+
+/* delalloc.c */
+// Largest amount of data held by a file, in blocks (0 turns delayed allocation off)
+extern int delalloc_max_blocks;
+// Free blocks reserved for data held by open files
+extern int delalloc_reserved;
+int delalloc_prepare(struct open_file *file, size_t offset, size_t count, size_t *count_now);
+int delalloc_write(struct open_file *file, size_t offset, const void *buf, size_t count);
+size_t delalloc_size(struct open_file *file);
+int delalloc_flush(struct open_file *file);
+int delalloc_flush_all(void);
+bool delalloc_holds_after(int data_blk);
+
+/* discard.c */
+// Freed blocks noted before they are punched (1 punches them right away)
+extern int discard_batch_blocks;
+int discard_load(void);
+void discard_unload(void);
+void discard_note_free(int data_blk);
+void discard_maybe_flush(void);
+int discard_flush(void);
+
+/* stripe.c */
+int stripe_layout(const char *diskname, int *num_stripes, int *stripe_unit);
+int stripe_load(void);
+
+#endif /* _FS_INTERNAL_H */
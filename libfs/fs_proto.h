@@ -0,0 +1,81 @@
+#ifndef _FS_PROTO_H
+#define _FS_PROTO_H
+
+/*
+ * Protocol between fs_server.x and the clients of fs_client.h, over a Unix
+ * domain stream socket.
+ *
+ * A client sends requests, each a struct fs_proto_request followed by
+ * data_len bytes of data, and the server answers every request in the order
+ * it was received with a struct fs_proto_response followed by data_len bytes
+ * of data. Clients need not wait for a response before sending the next
+ * requests (pipelining). Integers are in host byte order, since both ends run
+ * on the same host.
+ *
+ * Requests and the fs.h calls they map to:
+ *
+ *   op                   fd     arg        data            response data
+ *   FS_OP_HELLO
+ *   FS_OP_CREATE                           filename\0
+ *   FS_OP_DELETE                           filename\0
+ *   FS_OP_CLONE                            src\0dst\0
+ *   FS_OP_OPEN                             filename\0
+ *   FS_OP_CLOSE          fd
+ *   FS_OP_STAT           fd
+ *   FS_OP_LSEEK          fd     offset
+ *   FS_OP_WRITE          fd                bytes to write
+ *   FS_OP_READ           fd     count                      bytes read
+ *   FS_OP_SYNC
+ *   FS_OP_STAT_MANY             entries                    struct fs_dirent[]
+ *   FS_OP_SHUTDOWN
+ *
+ * The result of the call is the response's ret (FS_PROTO_VERSION for
+ * FS_OP_HELLO, which clients send first). FS_OP_STAT_MANY answers with as
+ * many of the ret entries as fit in the number asked for. File descriptors are those of
+ * the server, and are closed by the server when their client disconnects.
+ * FS_OP_SHUTDOWN makes the server unmount the disk and exit once it has
+ * answered.
+ */
+
+#include <stdint.h>
+
+/** Version of the protocol, answered to FS_OP_HELLO */
+#define FS_PROTO_VERSION 1
+
+/** Largest data accepted with a request or sent with a response */
+#define FS_PROTO_MAX_DATA (16 * 1024 * 1024)
+
+enum fs_proto_op {
+	FS_OP_HELLO,
+	FS_OP_CREATE,
+	FS_OP_DELETE,
+	FS_OP_CLONE,
+	FS_OP_OPEN,
+	FS_OP_CLOSE,
+	FS_OP_STAT,
+	FS_OP_LSEEK,
+	FS_OP_WRITE,
+	FS_OP_READ,
+	FS_OP_SYNC,
+	FS_OP_STAT_MANY,
+	FS_OP_SHUTDOWN,
+	FS_OP_COUNT
+};
+
+struct __attribute__ ((__packed__)) fs_proto_request {
+	/* Chosen by the client, echoed in the response */
+	uint32_t id;
+	uint8_t op;
+	uint8_t padding[3];
+	int32_t fd;
+	uint64_t arg;
+	uint32_t data_len;
+};
+
+struct __attribute__ ((__packed__)) fs_proto_response {
+	uint32_t id;
+	int32_t ret;
+	uint32_t data_len;
+};
+
+#endif /* _FS_PROTO_H */
@@ -0,0 +1,108 @@
+#ifndef _FS_TRACE_H
+#define _FS_TRACE_H
+
+/*
+ * Recording shim for the fs.h API.
+ *
+ * A program including this header instead of fs.h has its calls to the file
+ * API below go through trace_fs_*() wrappers, which call the real functions
+ * and log every call, with its arguments, result, start time and duration, to
+ * a trace file. Traces are replayed against a disk with fs_replay.x.
+ *
+ * Recording starts with fs_trace_start(), or on the first call if environment
+ * variable FS_TRACE names the trace file.
+ */
+
+#include "fs.h"
+
+/** Version of the trace format, recorded in the first line of traces */
+#define FS_TRACE_VERSION 1
+
+/**
+ * fs_trace_start - Start recording calls
+ * @trace_filename: Name of the trace file to create (overwritten if it exists)
+ *
+ * Return: -1 if the trace file cannot be created or if calls are already being
+ * recorded. 0 otherwise.
+ */
+int fs_trace_start(const char *trace_filename);
+
+/**
+ * fs_trace_stop - Stop recording calls
+ *
+ * Flush and close the trace file. Recording also stops when the program exits.
+ *
+ * Return: -1 if no calls are being recorded or if the trace file cannot be
+ * written. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+int trace_fs_mount(const char *diskname);
+int trace_fs_mount_flags(const char *diskname, unsigned int flags);
+void *trace_fs_buffer_alloc(size_t size);
+int trace_fs_umount(void);
+int trace_fs_info(void);
+int trace_fs_enable(unsigned int feature);
+int trace_fs_sync(void);
+int trace_fs_persist(const char *diskname);
+int trace_fs_discard(void);
+int trace_fs_copy_disk(const char *diskname, const char *copy_name);
+int trace_fs_stripe(const char *diskname, const char *striped_name, int num_stripes, int stripe_unit);
+int trace_fs_frag_report(struct fs_frag_report *report);
+int trace_fs_defrag(unsigned int time_budget_ms);
+int trace_fs_check(unsigned int flags, struct fs_check_report *report);
+int trace_fs_create(const char *filename);
+int trace_fs_delete(const char *filename);
+int trace_fs_clone(const char *src, const char *dst);
+int trace_fs_set_compression(const char *filename, int on);
+int trace_fs_import(const char **host_filenames, int num_files);
+int trace_fs_ls(void);
+int trace_fs_readdir(int *cursor, struct fs_dirent *entry);
+int trace_fs_stat_many(struct fs_dirent *entries, int max_entries);
+int trace_fs_open(const char *filename);
+int trace_fs_close(int fd);
+int trace_fs_stat(int fd);
+int trace_fs_lseek(int fd, size_t offset);
+int trace_fs_write(int fd, void *buf, size_t count);
+int trace_fs_read(int fd, void *buf, size_t count);
+int trace_fs_sendfile(int fd, int out_fd, size_t offset, size_t count);
+int trace_fs_tracepoints_enable(int on);
+int trace_fs_tracepoints_dump(const char *filename);
+
+/* Every call of fs.h is redirected (checked when libfs is built) */
+#ifndef FS_TRACE_NO_REDIRECT
+#define fs_mount trace_fs_mount
+#define fs_mount_flags trace_fs_mount_flags
+#define fs_buffer_alloc trace_fs_buffer_alloc
+#define fs_umount trace_fs_umount
+#define fs_info trace_fs_info
+#define fs_enable trace_fs_enable
+#define fs_sync trace_fs_sync
+#define fs_persist trace_fs_persist
+#define fs_discard trace_fs_discard
+#define fs_copy_disk trace_fs_copy_disk
+#define fs_stripe trace_fs_stripe
+/* Function-like, struct fs_frag_report keeping its name */
+#define fs_frag_report(report) trace_fs_frag_report(report)
+#define fs_defrag trace_fs_defrag
+#define fs_check trace_fs_check
+#define fs_create trace_fs_create
+#define fs_delete trace_fs_delete
+#define fs_clone trace_fs_clone
+#define fs_set_compression trace_fs_set_compression
+#define fs_import trace_fs_import
+#define fs_ls trace_fs_ls
+#define fs_readdir trace_fs_readdir
+#define fs_stat_many trace_fs_stat_many
+#define fs_open trace_fs_open
+#define fs_close trace_fs_close
+#define fs_stat trace_fs_stat
+#define fs_lseek trace_fs_lseek
+#define fs_write trace_fs_write
+#define fs_read trace_fs_read
+#define fs_sendfile trace_fs_sendfile
+#define fs_tracepoints_enable trace_fs_tracepoints_enable
+#define fs_tracepoints_dump trace_fs_tracepoints_dump
+#endif
+
+#endif /* _FS_TRACE_H */
@@ -0,0 +1,374 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Bulk import of host files.
+ *
+ * fs_import() copies many host files with one mount, instead of one mount,
+ * FAT load and metadata flush per file. Files are created and all of their
+ * blocks are allocated up front by the calling thread, each file in a single
+ * run of free blocks when there is one long enough. The data is then copied by
+ * a few worker threads taking batches of IMPORT_BATCH_BLOCKS blocks in turn:
+ * a worker reads a batch from the host file and writes each run of consecutive
+ * blocks with a single write. Workers touch neither the FAT nor the root
+ * directory, only the data blocks allocated to their batch, and compute the
+ * checksums of those blocks when the disk has them.
+ *
+ * Once every batch is written, the data is flushed, and the metadata of all
+ * the files after it, with a single fs_sync(). Tiny files that fit inline are
+ * written by the calling thread, and files are then packed like on fs_close().
+ */
+
+#define IMPORT_MAX_THREADS 8
+// Blocks read from a host file and written to disk at a time
+#define IMPORT_BATCH_BLOCKS 256
+
+// A host file being imported
+struct import_file {
+	int host_fd;
+	int rootdir_idx;
+	size_t size;
+	// Data blocks allocated to the file, in file order
+	uint16_t *blocks;
+	int num_blocks;
+	bool failed;
+};
+
+// A batch of blocks of a file, copied by one worker
+struct import_batch {
+	struct import_file *file;
+	int first;
+	int count;
+};
+
+static struct {
+	struct import_batch *batches;
+	int num_batches;
+	// Next batch for a worker to take
+	int next_batch;
+	// Checksum of each data block written (NULL if the disk has no checksums)
+	uint32_t *crcs;
+} import;
+
+// returns the number of blocks allocated to a file (fewer than num_blocks if
+// the disk is full), in a single run of free blocks if there is one long enough
+static int import_alloc(uint16_t *blocks, int num_blocks) {
+	int run_start = 1;
+	for (int i = 1; i < superblk.num_data_blocks && num_blocks > 0; i++) {
+		if (get_FAT_entry(i) != 0) {
+			run_start = i + 1;
+			continue;
+		}
+		if (i - run_start + 1 == num_blocks) {
+			for (int j = 0; j < num_blocks; j++) {
+				blocks[j] = run_start + j;
+			}
+			return num_blocks;
+		}
+	}
+
+	// Otherwise take free blocks wherever they are
+	int count = 0;
+	for (int i = 1; i < superblk.num_data_blocks && count < num_blocks; i++) {
+		if (get_FAT_entry(i) == 0) {
+			blocks[count++] = i;
+		}
+	}
+	return count;
+}
+
+// returns -1 if the host file could not be read or the disk written
+// otherwise, copies a batch of blocks of a file from the host file to disk
+static int import_copy_batch(const struct import_batch *batch, char *buf) {
+	struct import_file *file = batch->file;
+	size_t offset = (size_t)batch->first * BLOCK_SIZE;
+	size_t len = (size_t)batch->count * BLOCK_SIZE;
+	if (len > file->size - offset) {
+		len = file->size - offset;
+	}
+
+	// Read the whole batch, the end of the last block reading back as zeros
+	size_t done = 0;
+	while (done < len) {
+		ssize_t ret = pread(file->host_fd, buf + done, len - done, offset + done);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		if (ret < 0) {
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			break;
+		}
+		done += ret;
+	}
+	memset(buf + done, 0, (size_t)batch->count * BLOCK_SIZE - done);
+
+	// One write per run of consecutive blocks
+	const uint16_t *blocks = file->blocks + batch->first;
+	int run = 0;
+	for (int i = 1; i <= batch->count; i++) {
+		if (i < batch->count && blocks[i] == blocks[i - 1] + 1) {
+			continue;
+		}
+		if (store_data_blocks(blocks[run], i - run, buf + (size_t)run * BLOCK_SIZE) == -1) {
+			return -1;
+		}
+		run = i;
+	}
+	if (import.crcs != NULL) {
+		for (int i = 0; i < batch->count; i++) {
+			import.crcs[blocks[i]] = crc32c(0, buf + (size_t)i * BLOCK_SIZE, BLOCK_SIZE);
+		}
+	}
+	return 0;
+}
+
+static void *import_worker(void *arg) {
+	(void)arg;
+	char *buf = block_alloc(IMPORT_BATCH_BLOCKS);
+	while (1) {
+		int i = __atomic_fetch_add(&import.next_batch, 1, __ATOMIC_RELAXED);
+		if (i >= import.num_batches) {
+			break;
+		}
+		struct import_batch *batch = &import.batches[i];
+		if (buf == NULL || import_copy_batch(batch, buf) == -1) {
+			// A file failing in one batch fails as a whole
+			__atomic_store_n(&batch->file->failed, true, __ATOMIC_RELAXED);
+		}
+	}
+	free(buf);
+	return NULL;
+}
+
+// copies every batch on a few threads
+static void import_run_workers(void) {
+	long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_threads < 1) {
+		num_threads = 1;
+	} else if (num_threads > IMPORT_MAX_THREADS) {
+		num_threads = IMPORT_MAX_THREADS;
+	}
+	if (num_threads > import.num_batches) {
+		num_threads = import.num_batches;
+	}
+
+	pthread_t threads[IMPORT_MAX_THREADS];
+	bool started[IMPORT_MAX_THREADS] = { false };
+	import.next_batch = 0;
+	for (long i = 0; i < num_threads; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, import_worker, NULL) == 0);
+	}
+	for (long i = 0; i < num_threads; i++) {
+		if (started[i]) {
+			pthread_join(threads[i], NULL);
+		}
+	}
+
+	// Finish the work inline if a thread could not be started
+	import_worker(NULL);
+}
+
+// returns -1 if the host file cannot be imported
+// otherwise, opens the host file and creates the file named after it
+static int import_open(const char *host_filename, struct import_file *file) {
+	const char *filename = strrchr(host_filename, '/');
+	filename = (filename == NULL) ? host_filename : filename + 1;
+
+	file->host_fd = open(host_filename, O_RDONLY);
+	if (file->host_fd < 0) {
+		perror("open");
+		return -1;
+	}
+	struct stat st;
+	if (fstat(file->host_fd, &st) || !S_ISREG(st.st_mode)) {
+		fprintf(stderr, "Not a regular file: %s\n", host_filename);
+		return -1;
+	}
+	if (fs_create(filename) == -1) {
+		fprintf(stderr, "Cannot create file '%s'\n", filename);
+		return -1;
+	}
+	file->rootdir_idx = 0;
+	while (strcmp((char*)&rootdir_arr[file->rootdir_idx].filename, filename)) {
+		file->rootdir_idx++;
+	}
+	file->size = st.st_size;
+	return 0;
+}
+
+// returns -1 if the blocks of a file could not be allocated
+// otherwise, allocates them all and links them in the FAT
+static int import_prepare(struct import_file *file) {
+	// Tiny files stay inline, their data is copied along with the metadata
+	if (file_is_inline(file->rootdir_idx) && file->size <= INLINE_MAX) {
+		return 0;
+	}
+	inline_set(file->rootdir_idx, false);
+
+	size_t num_blocks = (file->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (num_blocks > (size_t)superblk.num_data_blocks) {
+		num_blocks = superblk.num_data_blocks;
+	}
+	file->blocks = malloc((num_blocks + 1) * sizeof(uint16_t));
+	if (file->blocks == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	file->num_blocks = import_alloc(file->blocks, num_blocks);
+
+	// As with fs_write(), a full disk only keeps what fits
+	if ((size_t)file->num_blocks * BLOCK_SIZE < file->size) {
+		file->size = (size_t)file->num_blocks * BLOCK_SIZE;
+	}
+	for (int i = 0; i < file->num_blocks; i++) {
+		set_FAT_entry(file->blocks[i], (i + 1 < file->num_blocks) ? file->blocks[i + 1] : FAT_EOC);
+	}
+	struct root_directory *dirent = &rootdir_arr[file->rootdir_idx];
+	dirent->first_data_block_index = (file->num_blocks > 0) ? file->blocks[0] : FAT_EOC;
+	dirent->file_size = file->size;
+	dirent_changed(file->rootdir_idx);
+	return 0;
+}
+
+// returns -1 if a tiny file could not be read from the host
+// otherwise, copies it into its inline data
+static int import_inline(struct import_file *file) {
+	char buf[INLINE_MAX];
+	if (pread(file->host_fd, buf, file->size, 0) != (ssize_t)file->size) {
+		perror("pread");
+		return -1;
+	}
+	inline_write(file->rootdir_idx, 0, buf, file->size);
+	rootdir_arr[file->rootdir_idx].file_size = file->size;
+	return 0;
+}
+
+int fs_import(const char **host_filenames, int num_files)
+{
+	TP_SCOPE(TP_FS_IMPORT, -1, 0, num_files);
+	// Check if no FS is mounted (or mounted read-only) or if the list of files is invalid
+	if (!FS_mounted || FS_rdonly || host_filenames == NULL || num_files < 0) {
+		return -1;
+	}
+
+	// Data held by open files gets its blocks first
+	if (delalloc_flush_all() == -1) {
+		return -1;
+	}
+
+	// Blocks freed by uncommitted changes are taken as well, so they are made
+	// reusable now: once files are created, nothing may be committed until
+	// their data is durable
+	if (journal_commit_freed() == -1) {
+		return -1;
+	}
+
+	struct import_file *files = calloc(num_files + 1, sizeof(struct import_file));
+	if (files == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+
+	// Create the files, then allocate all their blocks before any data is
+	// copied (nothing is committed from then on until the data is durable)
+	for (int i = 0; i < num_files; i++) {
+		files[i].host_fd = -1;
+		files[i].rootdir_idx = -1;
+		files[i].failed = (import_open(host_filenames[i], &files[i]) == -1);
+	}
+	int num_batches = 0;
+	for (int i = 0; i < num_files; i++) {
+		if (files[i].failed || import_prepare(&files[i]) == -1) {
+			files[i].failed = true;
+			continue;
+		}
+		num_batches += (files[i].num_blocks + IMPORT_BATCH_BLOCKS - 1) / IMPORT_BATCH_BLOCKS;
+	}
+
+	import.batches = malloc((num_batches + 1) * sizeof(struct import_batch));
+	if (superblk.features & FS_FEATURE_CSUM) {
+		import.crcs = malloc(superblk.num_data_blocks * sizeof(uint32_t));
+	}
+	if (import.batches == NULL || ((superblk.features & FS_FEATURE_CSUM) && import.crcs == NULL)) {
+		fprintf(stderr, "Malloc failed");
+		for (int i = 0; i < num_files; i++) {
+			files[i].failed = true;
+		}
+		num_batches = 0;
+	}
+	import.num_batches = 0;
+	for (int i = 0; i < num_files && num_batches > 0; i++) {
+		if (files[i].failed) {
+			continue;
+		}
+		for (int first = 0; first < files[i].num_blocks; first += IMPORT_BATCH_BLOCKS) {
+			struct import_batch *batch = &import.batches[import.num_batches++];
+			batch->file = &files[i];
+			batch->first = first;
+			batch->count = files[i].num_blocks - first;
+			if (batch->count > IMPORT_BATCH_BLOCKS) {
+				batch->count = IMPORT_BATCH_BLOCKS;
+			}
+		}
+	}
+	import_run_workers();
+
+	// Data must be durable before the metadata pointing at it
+	int ret = block_disk_sync();
+
+	// Files are done, or removed if any part of them could not be copied
+	int num_imported = 0;
+	for (int i = 0; i < num_files; i++) {
+		struct import_file *file = &files[i];
+		if (!file->failed && file_is_inline(file->rootdir_idx) && import_inline(file) == -1) {
+			file->failed = true;
+		}
+		if (file->failed) {
+			if (file->rootdir_idx != -1) {
+				fs_delete((char*)&rootdir_arr[file->rootdir_idx].filename);
+			}
+		} else {
+			for (int j = 0; import.crcs != NULL && j < file->num_blocks; j++) {
+				csum_set(file->blocks[j], import.crcs[file->blocks[j]]);
+			}
+			num_imported++;
+		}
+		if (file->host_fd >= 0) {
+			close(file->host_fd);
+		}
+	}
+
+	// Metadata of every file goes out with a single flush, once files are packed
+	for (int i = 0; i < num_files && ret == 0; i++) {
+		if (!files[i].failed) {
+			file_pack(files[i].rootdir_idx);
+		}
+	}
+	if (ret == 0) {
+		ret = fs_sync();
+	}
+
+	for (int i = 0; i < num_files; i++) {
+		free(files[i].blocks);
+	}
+	free(files);
+	free(import.batches);
+	free(import.crcs);
+	memset(&import, 0, sizeof(import));
+	return (ret == -1) ? -1 : num_imported;
+}
@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Inline data for tiny files.
+ *
+ * With version RDIR_VERSION_INLINE of the root directory format, every root
+ * directory entry is extended with INLINE_MAX bytes of inline data. The 32-byte
+ * head of the entries stays in the root directory block, so that plain images
+ * keep their layout; the extensions are kept in an area reserved at the end of
+ * the disk, in root directory order, and are loaded at mount time along with
+ * the root directory.
+ *
+ * A file flagged with DIRENT_INLINE has no data block: its contents are the
+ * first file_size bytes of its inline data, and the rest of the inline data is
+ * kept zeroed. Reading or writing such a file never touches a data block. Files
+ * are created inline once the feature is on, and are moved to a data block by
+ * the first write that does not fit.
+ */
+
+// Inline data of every root directory entry (NULL if the disk has no area)
+static uint8_t (*inline_area)[INLINE_MAX];
+
+int inline_format(void) {
+	int num_blocks = (FS_FILE_MAX_COUNT * INLINE_MAX + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start = reserve_data_blocks(num_blocks);
+	if (start == -1) {
+		fprintf(stderr, "Not enough free space at the end of the disk for inline data\n");
+		return -1;
+	}
+	superblk.rdir_version = RDIR_VERSION_INLINE;
+	superblk.rdir_ext_start = start;
+	superblk.rdir_ext_blocks = num_blocks;
+
+	inline_area = block_alloc(num_blocks);
+	if (inline_area == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	memset(inline_area, 0, (size_t)num_blocks * BLOCK_SIZE);
+
+	// Flags were padding in plain entries
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].flags != 0) {
+			rootdir_arr[i].flags = 0;
+			dirent_changed(i);
+		}
+	}
+	return inline_store();
+}
+
+int inline_load(void) {
+	if (superblk.rdir_version != RDIR_VERSION_INLINE) {
+		fprintf(stderr, "Unsupported root directory version (%d)\n", superblk.rdir_version);
+		return -1;
+	}
+	inline_area = load_data_blocks(superblk.rdir_ext_start, superblk.rdir_ext_blocks);
+	if (inline_area == NULL) {
+		fprintf(stderr, "Could not read from disk (inline data)\n");
+		return -1;
+	}
+	return 0;
+}
+
+int inline_store(void) {
+	if (inline_area == NULL) {
+		return 0;
+	}
+	if (store_data_blocks(superblk.rdir_ext_start, superblk.rdir_ext_blocks, inline_area) == -1) {
+		fprintf(stderr, "Could not write to disk (inline data)\n");
+		return -1;
+	}
+	return 0;
+}
+
+void inline_unload(void) {
+	unload_data_blocks(inline_area);
+	inline_area = NULL;
+}
+
+bool file_is_inline(int rootdir_idx) {
+	return inline_area != NULL && (rootdir_arr[rootdir_idx].flags & DIRENT_INLINE);
+}
+
+void *inline_data(int rootdir_idx) {
+	return inline_area[rootdir_idx];
+}
+
+void inline_read(int rootdir_idx, size_t offset, void *buf, size_t count) {
+	memcpy(buf, inline_area[rootdir_idx] + offset, count);
+}
+
+void inline_write(int rootdir_idx, size_t offset, const void *buf, size_t count) {
+	memcpy(inline_area[rootdir_idx] + offset, buf, count);
+	dirent_changed(rootdir_idx);
+}
+
+// makes a root directory entry inline or not (if the disk has inline data),
+// with zeroed inline data
+void inline_set(int rootdir_idx, bool on) {
+	if (inline_area == NULL) {
+		return;
+	}
+	memset(inline_area[rootdir_idx], 0, INLINE_MAX);
+	rootdir_arr[rootdir_idx].flags &= ~DIRENT_INLINE;
+	if (on) {
+		rootdir_arr[rootdir_idx].flags |= DIRENT_INLINE;
+	}
+	dirent_changed(rootdir_idx);
+}
+
+// returns -1 if no data block is left for the contents of the file
+// otherwise, moves the contents of an inline file to a data block of its own
+int inline_migrate(int rootdir_idx) {
+	if (!file_is_inline(rootdir_idx)) {
+		return 0;
+	}
+
+	uint32_t file_size = rootdir_arr[rootdir_idx].file_size;
+	if (file_size > 0) {
+		char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+		memset(bounce_buf, 0, BLOCK_SIZE);
+		memcpy(bounce_buf, inline_area[rootdir_idx], file_size);
+
+		struct chain_pos pos;
+		bool fresh;
+		if (chain_seek_for_write(&pos, rootdir_idx, 0) == -1) {
+			return -1;
+		}
+		int data_blk = chain_prepare_write(&pos, false, &fresh);
+		if (data_blk == -1) {
+			return -1;
+		}
+		if (write_data_block(data_blk, bounce_buf) == -1) {
+			fprintf(stderr, "Could not write to disk (inline data)\n");
+			return -1;
+		}
+	}
+	inline_set(rootdir_idx, false);
+	return 0;
+}
@@ -0,0 +1,721 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Write-ahead journal for FAT and root directory changes.
+ *
+ * The journal area is a run of data blocks reserved at the end of the disk by
+ * fs_enable(). Its first block holds a header, the remaining blocks form a log
+ * of transactions written one after the other. Changes are not written to the
+ * log as they happen: each FAT entry or root directory entry that is modified
+ * is only flagged as dirty, and the current value of every dirty entry is
+ * committed at once as a single transaction (group commit). A transaction is
+ * one sequential write followed by one flush of the disk. Reference counts of
+ * blocks shared between clones, hole lengths of sparse files and block
+ * checksums are journaled the same way as FAT entries, and the inline data of
+ * tiny files along with their root directory entries.
+ *
+ * The FAT and root directory are only written back in place when the journal
+ * is checkpointed, i.e. when the log is full or when the file system is
+ * unmounted. After a crash, fs_mount() replays the committed transactions.
+ */
+
+#define JOURNAL_MAGIC 0x4C4E524A
+#define JOURNAL_TXN_MAGIC 0x4E58544A
+#define JOURNAL_MIN_BLOCKS 4
+#define JOURNAL_MAX_BLOCKS 64
+// Commit once this many entries are dirty...
+#define JOURNAL_GROUP_RECORDS 1024
+// ...or once the oldest uncommitted change is this old (in ms)
+#define JOURNAL_COMMIT_INTERVAL 100
+
+#define JOURNAL_RECORD_FAT 1
+#define JOURNAL_RECORD_DIRENT 2
+#define JOURNAL_RECORD_REFCNT 3
+#define JOURNAL_RECORD_HOLE 4
+#define JOURNAL_RECORD_INLINE 5
+#define JOURNAL_RECORD_CSUM 6
+
+// What is dirty about a data block
+#define JOURNAL_DIRTY_FAT 0x1
+#define JOURNAL_DIRTY_REFCNT 0x2
+#define JOURNAL_DIRTY_HOLE 0x4
+#define JOURNAL_DIRTY_CSUM 0x8
+// Freed by an uncommitted change: a crash would bring the old chain back, so
+// the block must not be given out again before the next commit
+#define JOURNAL_DIRTY_FREED 0x10
+// Allocated by an uncommitted change: a crash would leave it free, so nothing
+// needs to be logged before it is written
+#define JOURNAL_DIRTY_ALLOC 0x20
+
+struct __attribute__ ((__packed__)) journal_header {
+	uint32_t magic;
+	// Sequence number of the transaction expected right after the header
+	uint32_t sequence;
+	int8_t padding[BLOCK_SIZE - 8];
+};
+
+struct __attribute__ ((__packed__)) journal_txn {
+	uint32_t magic;
+	uint32_t sequence;
+	uint32_t num_records;
+	// Number of bytes of records following this header
+	uint32_t length;
+	// Number of log blocks used by the transaction (including this header)
+	uint32_t num_blocks;
+	// Checksum of the records, so that a torn transaction is never replayed
+	uint32_t checksum;
+};
+
+struct __attribute__ ((__packed__)) journal_FAT_record {
+	uint8_t type;
+	uint16_t data_blk;
+	uint16_t value;
+};
+
+struct __attribute__ ((__packed__)) journal_refcnt_record {
+	uint8_t type;
+	uint16_t data_blk;
+	uint8_t value;
+};
+
+struct __attribute__ ((__packed__)) journal_hole_record {
+	uint8_t type;
+	uint16_t data_blk;
+	uint16_t len;
+};
+
+struct __attribute__ ((__packed__)) journal_csum_record {
+	uint8_t type;
+	uint16_t data_blk;
+	uint32_t crc;
+	uint32_t prev;
+};
+
+struct __attribute__ ((__packed__)) journal_dirent_record {
+	uint8_t type;
+	uint8_t rootdir_idx;
+	struct root_directory entry;
+};
+
+struct __attribute__ ((__packed__)) journal_inline_record {
+	uint8_t type;
+	uint8_t rootdir_idx;
+	uint8_t data[INLINE_MAX];
+};
+
+static struct {
+	bool active;
+	// Sequence number of the next transaction to commit
+	uint32_t sequence;
+	// Next unused log block (relative to the start of the journal area)
+	int next_block;
+	// Data blocks with a dirty FAT entry or reference count, as flags per data
+	// block and as a list
+	uint8_t *FAT_dirty;
+	uint16_t *FAT_pending;
+	int num_FAT_pending;
+	// Number of data blocks freed since the last commit
+	int num_freed;
+	// Dirty root directory entries
+	uint8_t dirent_dirty[FS_FILE_MAX_COUNT];
+	int num_dirent_pending;
+	// Time of the oldest uncommitted change
+	struct timespec oldest_pending;
+} journal;
+
+// returns block index on disk of block blk of journal area
+static size_t journal_disk_block(int blk) {
+	return superblk.data_block_start_index + superblk.journal_start + blk;
+}
+
+// returns FNV-1a hash of len bytes at buf
+static uint32_t journal_checksum(const uint8_t *buf, size_t len) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= buf[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// returns -1 if the in-memory state of the journal cannot be allocated
+static int journal_activate(uint32_t sequence) {
+	journal.FAT_dirty = calloc(superblk.num_data_blocks, sizeof(uint8_t));
+	journal.FAT_pending = malloc(superblk.num_data_blocks * sizeof(uint16_t));
+	if (journal.FAT_dirty == NULL || journal.FAT_pending == NULL) {
+		fprintf(stderr, "Malloc failed");
+		free(journal.FAT_dirty);
+		free(journal.FAT_pending);
+		return -1;
+	}
+	journal.num_FAT_pending = 0;
+	journal.num_freed = 0;
+	memset(journal.dirent_dirty, 0, sizeof(journal.dirent_dirty));
+	journal.num_dirent_pending = 0;
+	journal.sequence = sequence;
+	journal.next_block = 1;
+	journal.active = true;
+	return 0;
+}
+
+// forgets about every pending change (they have been made durable)
+static void journal_clear_pending(void) {
+	for (int i = 0; i < journal.num_FAT_pending; i++) {
+		journal.FAT_dirty[journal.FAT_pending[i]] = 0;
+	}
+	journal.num_FAT_pending = 0;
+	journal.num_freed = 0;
+	memset(journal.dirent_dirty, 0, sizeof(journal.dirent_dirty));
+	journal.num_dirent_pending = 0;
+}
+
+// returns -1 if the journal header could not be written
+static int journal_write_header(void) {
+	struct journal_header header BLOCK_ALIGNED;
+	memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC;
+	header.sequence = journal.sequence;
+	if (block_write(journal_disk_block(0), &header) == -1) {
+		fprintf(stderr, "Could not write to disk (journal header)\n");
+		return -1;
+	}
+	return 0;
+}
+
+// applies the records of a transaction to the in-memory FAT and root directory
+// returns -1 if the records are malformed
+static int journal_apply(const uint8_t *records, const struct journal_txn *txn) {
+	size_t pos = 0;
+	for (uint32_t i = 0; i < txn->num_records; i++) {
+		if (pos >= txn->length) {
+			return -1;
+		}
+		if (records[pos] == JOURNAL_RECORD_FAT) {
+			struct journal_FAT_record rec;
+			if (pos + sizeof(rec) > txn->length) {
+				return -1;
+			}
+			memcpy(&rec, records + pos, sizeof(rec));
+			if (rec.data_blk >= superblk.num_data_blocks) {
+				return -1;
+			}
+			traverse_FAT_until_data_blk(rec.data_blk)->entries[rec.data_blk % FB_ENTRIES_PER_BLOCK] = rec.value;
+			pos += sizeof(rec);
+		} else if (records[pos] == JOURNAL_RECORD_REFCNT) {
+			struct journal_refcnt_record rec;
+			if (pos + sizeof(rec) > txn->length) {
+				return -1;
+			}
+			memcpy(&rec, records + pos, sizeof(rec));
+			if (rec.data_blk >= superblk.num_data_blocks || !(superblk.features & FS_FEATURE_CLONE)) {
+				return -1;
+			}
+			refcnt_set(rec.data_blk, rec.value);
+			pos += sizeof(rec);
+		} else if (records[pos] == JOURNAL_RECORD_HOLE) {
+			struct journal_hole_record rec;
+			if (pos + sizeof(rec) > txn->length) {
+				return -1;
+			}
+			memcpy(&rec, records + pos, sizeof(rec));
+			if (rec.data_blk >= superblk.num_data_blocks || !(superblk.features & FS_FEATURE_SPARSE)) {
+				return -1;
+			}
+			hole_set(rec.data_blk, rec.len);
+			pos += sizeof(rec);
+		} else if (records[pos] == JOURNAL_RECORD_CSUM) {
+			struct journal_csum_record rec;
+			if (pos + sizeof(rec) > txn->length) {
+				return -1;
+			}
+			memcpy(&rec, records + pos, sizeof(rec));
+			if (rec.data_blk >= superblk.num_data_blocks || !(superblk.features & FS_FEATURE_CSUM)) {
+				return -1;
+			}
+			csum_set(rec.data_blk, rec.crc);
+			csum_set_prev(rec.data_blk, rec.prev);
+			pos += sizeof(rec);
+		} else if (records[pos] == JOURNAL_RECORD_DIRENT) {
+			struct journal_dirent_record rec;
+			if (pos + sizeof(rec) > txn->length) {
+				return -1;
+			}
+			memcpy(&rec, records + pos, sizeof(rec));
+			if (rec.rootdir_idx >= FS_FILE_MAX_COUNT) {
+				return -1;
+			}
+			rootdir_arr[rec.rootdir_idx] = rec.entry;
+			pos += sizeof(rec);
+		} else if (records[pos] == JOURNAL_RECORD_INLINE) {
+			struct journal_inline_record rec;
+			if (pos + sizeof(rec) > txn->length) {
+				return -1;
+			}
+			memcpy(&rec, records + pos, sizeof(rec));
+			if (rec.rootdir_idx >= FS_FILE_MAX_COUNT || !(superblk.features & FS_FEATURE_INLINE)) {
+				return -1;
+			}
+			memcpy(inline_data(rec.rootdir_idx), rec.data, INLINE_MAX);
+			pos += sizeof(rec);
+		} else {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// returns the number of log blocks taken by the largest group of changes, the
+// one with every entry of the FAT and of the root directory dirty
+static int journal_max_group_blocks(void) {
+	size_t length = (size_t)superblk.num_data_blocks * (sizeof(struct journal_FAT_record)
+			+ sizeof(struct journal_refcnt_record) + sizeof(struct journal_hole_record)
+			+ sizeof(struct journal_csum_record))
+			+ FS_FILE_MAX_COUNT * (sizeof(struct journal_dirent_record) + sizeof(struct journal_inline_record));
+	return (sizeof(struct journal_txn) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// returns the number of blocks of a journal whose log holds any group of changes
+static int journal_size(void) {
+	// Size the journal after the disk, within reasonable bounds
+	int num_blocks = superblk.num_data_blocks / 64;
+	if (num_blocks < JOURNAL_MIN_BLOCKS) {
+		num_blocks = JOURNAL_MIN_BLOCKS;
+	} else if (num_blocks > JOURNAL_MAX_BLOCKS) {
+		num_blocks = JOURNAL_MAX_BLOCKS;
+	}
+	if (num_blocks < 1 + journal_max_group_blocks()) {
+		num_blocks = 1 + journal_max_group_blocks();
+	}
+	return num_blocks;
+}
+
+// returns -1 if the header and first log block of the journal could not be written
+static int journal_write_empty(void) {
+	// Blocks taken from the free space may contain anything, so clear the first log block
+	char empty_blk[BLOCK_SIZE] BLOCK_ALIGNED;
+	memset(empty_blk, 0, BLOCK_SIZE);
+	return (journal_write_header() == -1 || block_write(journal_disk_block(1), empty_blk) == -1) ? -1 : 0;
+}
+
+// returns -1 if the journal could not be moved
+// otherwise, moves the empty journal of a disk formatted with a log too small
+// for the largest group of changes to a larger area
+static int journal_grow(void) {
+	int old_start = superblk.journal_start;
+	int old_blocks = superblk.journal_blocks;
+
+	// The area in use stays out of the way until the superblock no longer
+	// points to it (it may have been freed by a move cut short by a crash)
+	for (int i = old_start; i < old_start + old_blocks; i++) {
+		if (get_FAT_entry(i) == 0) {
+			set_FAT_entry(i, FAT_RESERVED);
+		}
+	}
+	int num_blocks = journal_size();
+	int start = reserve_data_blocks(num_blocks);
+	if (start == -1) {
+		return -1;
+	}
+	for (int i = old_start; i < old_start + old_blocks; i++) {
+		set_FAT_entry(i, 0);
+	}
+
+	// The new journal is ready before the superblock points to it
+	superblk.journal_start = start;
+	superblk.journal_blocks = num_blocks;
+	if (journal_write_empty() == -1 || block_disk_sync() == -1
+			|| write_metadata() == -1 || write_superblock() == -1 || block_disk_sync() == -1) {
+		superblk.journal_start = old_start;
+		superblk.journal_blocks = old_blocks;
+		return -1;
+	}
+	journal_clear_pending();
+	return 0;
+}
+
+int journal_format(void) {
+	int num_blocks = journal_size();
+
+	int start = reserve_data_blocks(num_blocks);
+	if (start == -1) {
+		fprintf(stderr, "Not enough free space at the end of the disk for the journal\n");
+		return -1;
+	}
+	superblk.journal_start = start;
+	superblk.journal_blocks = num_blocks;
+
+	if (journal_activate(1) == -1) {
+		return -1;
+	}
+	if (journal_write_empty() == -1) {
+		journal_unload();
+		return -1;
+	}
+	return 0;
+}
+
+int journal_load(void) {
+	struct journal_header header BLOCK_ALIGNED;
+	if (block_read(journal_disk_block(0), &header) == -1 || header.magic != JOURNAL_MAGIC) {
+		fprintf(stderr, "Could not read from disk (journal header)\n");
+		return -1;
+	}
+
+	// Read the whole log with a single sequential read
+	int num_log_blocks = superblk.journal_blocks - 1;
+	uint8_t *log = block_alloc(num_log_blocks);
+	if (log == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	if (block_read_many(journal_disk_block(1), num_log_blocks, log) == -1) {
+		fprintf(stderr, "Could not read from disk (journal)\n");
+		free(log);
+		return -1;
+	}
+
+	// Replay transactions in order, up to the first one that is missing or torn
+	uint32_t sequence = header.sequence;
+	int pos = 0;
+	while (pos < num_log_blocks) {
+		struct journal_txn txn;
+		memcpy(&txn, log + (size_t)pos * BLOCK_SIZE, sizeof(txn));
+		if (txn.magic != JOURNAL_TXN_MAGIC || txn.sequence != sequence || txn.num_blocks == 0
+				|| txn.num_blocks > (uint32_t)(num_log_blocks - pos)
+				|| sizeof(txn) + txn.length > (size_t)txn.num_blocks * BLOCK_SIZE) {
+			break;
+		}
+		const uint8_t *records = log + (size_t)pos * BLOCK_SIZE + sizeof(txn);
+		if (journal_checksum(records, txn.length) != txn.checksum) {
+			break;
+		}
+		// Metadata of a read-only mount is the disk itself, it cannot be replayed into
+		if (FS_rdonly) {
+			fprintf(stderr, "Journal holds changes to replay, mount the disk read-write first\n");
+			free(log);
+			return -1;
+		}
+		if (journal_apply(records, &txn) == -1) {
+			break;
+		}
+		sequence++;
+		pos += txn.num_blocks;
+	}
+	free(log);
+
+	// Nothing is logged on a read-only mount
+	if (FS_rdonly) {
+		return 0;
+	}
+	if (journal_activate(sequence) == -1) {
+		return -1;
+	}
+
+	// Anything replayed is written back in place right away, leaving an empty journal
+	if (sequence != header.sequence && journal_checkpoint() == -1) {
+		return -1;
+	}
+
+	// Disks formatted with a smaller log get one holding any group of changes
+	if (superblk.journal_blocks - 1 < journal_max_group_blocks() && journal_grow() == -1) {
+		fprintf(stderr, "Not enough free space to enlarge the journal, some changes will only be durable at unmount\n");
+	}
+	return 0;
+}
+
+void journal_unload(void) {
+	free(journal.FAT_dirty);
+	free(journal.FAT_pending);
+	journal.FAT_dirty = NULL;
+	journal.FAT_pending = NULL;
+	journal.active = false;
+}
+
+// flags part of the metadata of a data block as dirty
+static void journal_note_data_blk(int data_blk, uint8_t what) {
+	if (!journal.active || (journal.FAT_dirty[data_blk] & what)) {
+		return;
+	}
+	if (journal.num_FAT_pending + journal.num_dirent_pending == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &journal.oldest_pending);
+	}
+	if (!journal.FAT_dirty[data_blk]) {
+		journal.FAT_pending[journal.num_FAT_pending++] = data_blk;
+	}
+	journal.FAT_dirty[data_blk] |= what;
+}
+
+void journal_note_FAT(int data_blk) {
+	journal_note_data_blk(data_blk, JOURNAL_DIRTY_FAT);
+}
+
+void journal_note_refcnt(int data_blk) {
+	journal_note_data_blk(data_blk, JOURNAL_DIRTY_REFCNT);
+}
+
+void journal_note_hole(int data_blk) {
+	journal_note_data_blk(data_blk, JOURNAL_DIRTY_HOLE);
+}
+
+void journal_note_csum(int data_blk) {
+	journal_note_data_blk(data_blk, JOURNAL_DIRTY_CSUM);
+}
+
+void journal_note_free(int data_blk) {
+	if (journal.active && !(journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_FREED)) {
+		journal_note_data_blk(data_blk, JOURNAL_DIRTY_FREED);
+		journal.num_freed++;
+	}
+}
+
+void journal_note_alloc(int data_blk) {
+	journal_note_data_blk(data_blk, JOURNAL_DIRTY_ALLOC);
+}
+
+// returns whether a free data block must wait for the next commit to be reused
+bool journal_block_freed(int data_blk) {
+	return journal.active && (journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_FREED);
+}
+
+// returns whether a data block was allocated since the last commit
+bool journal_block_fresh(int data_blk) {
+	return journal.active && (journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_ALLOC);
+}
+
+// returns -1 if the blocks freed since the last commit could not be made reusable
+int journal_commit_freed(void) {
+	return (journal.active && journal.num_freed > 0) ? journal_commit() : 0;
+}
+
+void journal_note_dirent(int rootdir_idx) {
+	if (!journal.active || journal.dirent_dirty[rootdir_idx]) {
+		return;
+	}
+	if (journal.num_FAT_pending + journal.num_dirent_pending == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &journal.oldest_pending);
+	}
+	journal.dirent_dirty[rootdir_idx] = 1;
+	journal.num_dirent_pending++;
+}
+
+// stores the checksum record of a data block at dst
+static void journal_csum_record(int data_blk, uint8_t *dst) {
+	struct journal_csum_record rec;
+	rec.type = JOURNAL_RECORD_CSUM;
+	rec.data_blk = data_blk;
+	rec.crc = csum_get(data_blk);
+	rec.prev = csum_get_prev(data_blk);
+	memcpy(dst, &rec, sizeof(rec));
+}
+
+// returns -1 if the transaction could not be written to the log
+// otherwise, writes the num_records records of buf (length bytes, after room
+// for the transaction header) to the next num_blocks log blocks, then frees buf
+static int journal_write_txn(uint8_t *buf, int num_records, size_t length, int num_blocks) {
+	struct journal_txn txn;
+	txn.magic = JOURNAL_TXN_MAGIC;
+	txn.sequence = journal.sequence;
+	txn.num_records = num_records;
+	txn.length = length;
+	txn.num_blocks = num_blocks;
+	txn.checksum = journal_checksum(buf + sizeof(txn), length);
+	memcpy(buf, &txn, sizeof(txn));
+
+	int ret = block_write_many(journal_disk_block(journal.next_block), num_blocks, buf);
+	free(buf);
+	if (ret == -1 || block_disk_sync() == -1) {
+		fprintf(stderr, "Could not write to disk (journal)\n");
+		return -1;
+	}
+	journal.sequence++;
+	journal.next_block += num_blocks;
+	return 0;
+}
+
+int journal_commit(void) {
+	TP_SCOPE(TP_JOURNAL_COMMIT, -1, 0, 0);
+	if (!journal.active || journal.num_FAT_pending + journal.num_dirent_pending == 0) {
+		return 0;
+	}
+
+	size_t length = journal.num_dirent_pending * sizeof(struct journal_dirent_record);
+	int num_records = journal.num_dirent_pending;
+	for (int i = 0; i < journal.num_FAT_pending; i++) {
+		uint8_t what = journal.FAT_dirty[journal.FAT_pending[i]];
+		if (what & JOURNAL_DIRTY_FAT) {
+			length += sizeof(struct journal_FAT_record);
+			num_records++;
+		}
+		if (what & JOURNAL_DIRTY_REFCNT) {
+			length += sizeof(struct journal_refcnt_record);
+			num_records++;
+		}
+		if (what & JOURNAL_DIRTY_HOLE) {
+			length += sizeof(struct journal_hole_record);
+			num_records++;
+		}
+		if (what & JOURNAL_DIRTY_CSUM) {
+			length += sizeof(struct journal_csum_record);
+			num_records++;
+		}
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (journal.dirent_dirty[i] && file_is_inline(i)) {
+			length += sizeof(struct journal_inline_record);
+			num_records++;
+		}
+	}
+	int num_blocks = (sizeof(struct journal_txn) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// Room is kept for any group (see below), only a log that could not be
+	// enlarged may run short. The changes are then left pending: writing them
+	// in place now could tear them.
+	if (journal.next_block + num_blocks > superblk.journal_blocks) {
+		return -1;
+	}
+
+	uint8_t *buf = block_alloc(num_blocks);
+	if (buf == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	memset(buf, 0, (size_t)num_blocks * BLOCK_SIZE);
+
+	// Log the current value of every dirty entry
+	uint8_t *records = buf + sizeof(struct journal_txn);
+	size_t pos = 0;
+	for (int i = 0; i < journal.num_FAT_pending; i++) {
+		int data_blk = journal.FAT_pending[i];
+		if (journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_FAT) {
+			struct journal_FAT_record rec;
+			rec.type = JOURNAL_RECORD_FAT;
+			rec.data_blk = data_blk;
+			rec.value = get_FAT_entry(data_blk);
+			memcpy(records + pos, &rec, sizeof(rec));
+			pos += sizeof(rec);
+		}
+		if (journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_REFCNT) {
+			struct journal_refcnt_record rec;
+			rec.type = JOURNAL_RECORD_REFCNT;
+			rec.data_blk = data_blk;
+			rec.value = refcnt_get(data_blk);
+			memcpy(records + pos, &rec, sizeof(rec));
+			pos += sizeof(rec);
+		}
+		if (journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_HOLE) {
+			struct journal_hole_record rec;
+			rec.type = JOURNAL_RECORD_HOLE;
+			rec.data_blk = data_blk;
+			rec.len = hole_get(data_blk);
+			memcpy(records + pos, &rec, sizeof(rec));
+			pos += sizeof(rec);
+		}
+		if (journal.FAT_dirty[data_blk] & JOURNAL_DIRTY_CSUM) {
+			journal_csum_record(data_blk, records + pos);
+			pos += sizeof(struct journal_csum_record);
+		}
+	}
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (!journal.dirent_dirty[i]) {
+			continue;
+		}
+		struct journal_dirent_record rec;
+		rec.type = JOURNAL_RECORD_DIRENT;
+		rec.rootdir_idx = i;
+		rec.entry = rootdir_arr[i];
+		memcpy(records + pos, &rec, sizeof(rec));
+		pos += sizeof(rec);
+
+		if (file_is_inline(i)) {
+			struct journal_inline_record inline_rec;
+			inline_rec.type = JOURNAL_RECORD_INLINE;
+			inline_rec.rootdir_idx = i;
+			memcpy(inline_rec.data, inline_data(i), INLINE_MAX);
+			memcpy(records + pos, &inline_rec, sizeof(inline_rec));
+			pos += sizeof(inline_rec);
+		}
+	}
+
+	// One sequential write and one flush for the whole group of changes
+	if (journal_write_txn(buf, num_records, length, num_blocks) == -1) {
+		return -1;
+	}
+	journal_clear_pending();
+
+	// Once the log is too short for the largest group, everything it holds is
+	// written in place and it starts over. Nothing is pending now, so what is
+	// written in place is only what the log holds, and a crash meanwhile is
+	// repaired by replaying the log.
+	if (journal.next_block + journal_max_group_blocks() > superblk.journal_blocks) {
+		return journal_checkpoint();
+	}
+	return 0;
+}
+
+int journal_log_csum(int data_blk, int count) {
+	if (!journal.active) {
+		return 0;
+	}
+	size_t length = count * sizeof(struct journal_csum_record);
+	int num_blocks = (sizeof(struct journal_txn) + length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+	// The log keeps room for the largest group after this transaction,
+	// otherwise the checksums go out with everything pending
+	if (journal.next_block + num_blocks + journal_max_group_blocks() > superblk.journal_blocks) {
+		return journal_commit();
+	}
+
+	uint8_t *buf = block_alloc(num_blocks);
+	if (buf == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	memset(buf, 0, (size_t)num_blocks * BLOCK_SIZE);
+	for (int i = 0; i < count; i++) {
+		journal_csum_record(data_blk + i, buf + sizeof(struct journal_txn) + i * sizeof(struct journal_csum_record));
+	}
+
+	// The checksums stay pending, and are logged again with the next group
+	return journal_write_txn(buf, count, length, num_blocks);
+}
+
+void journal_maybe_commit(void) {
+	if (journal.active && journal.num_FAT_pending + journal.num_dirent_pending > 0
+			&& (journal.num_FAT_pending + journal.num_dirent_pending >= JOURNAL_GROUP_RECORDS
+			|| elapsed_ms(&journal.oldest_pending) >= JOURNAL_COMMIT_INTERVAL)) {
+		if (journal_commit() == -1) {
+			fprintf(stderr, "Could not commit journal\n");
+		}
+	}
+
+	// Freed blocks may be punched once nothing is left to commit
+	if (!journal.active || journal.num_FAT_pending + journal.num_dirent_pending == 0) {
+		discard_maybe_flush();
+	}
+}
+
+int journal_checkpoint(void) {
+	if (!journal.active) {
+		return -1;
+	}
+
+	// Metadata must be durable in place before the log can be discarded
+	if (write_metadata() == -1 || block_disk_sync() == -1) {
+		return -1;
+	}
+	if (journal_write_header() == -1 || block_disk_sync() == -1) {
+		return -1;
+	}
+	journal.next_block = 1;
+	journal_clear_pending();
+	return 0;
+}
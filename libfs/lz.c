@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "fs_internal.h"
+
+/*
+ * LZ codec used to compress file chunks.
+ *
+ * The format follows LZ4 blocks: a sequence of literal runs each followed by
+ * a match. A sequence starts with a token whose high nibble is the number of
+ * literals and low nibble the length of the match minus LZ_MIN_MATCH, a nibble
+ * of 15 being continued by extra bytes (added up until one is below 255). The
+ * literals follow, then the 16-bit little-endian offset of the match back
+ * from the current position. The last sequence has literals only.
+ *
+ * Matches are found with a single hash table of recent positions, which keeps
+ * compression fast at the cost of some ratio.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+static uint32_t lz_hash(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// returns false if there is no room left for a length of len in dst
+static bool lz_put_length(uint8_t *dst, size_t dst_cap, size_t *out, size_t len) {
+	while (len >= 255) {
+		if (*out >= dst_cap) {
+			return false;
+		}
+		dst[(*out)++] = 255;
+		len -= 255;
+	}
+	if (*out >= dst_cap) {
+		return false;
+	}
+	dst[(*out)++] = len;
+	return true;
+}
+
+// returns false if there is no room left in dst for the sequence
+static bool lz_put_sequence(uint8_t *dst, size_t dst_cap, size_t *out,
+		const uint8_t *literals, size_t num_literals, size_t offset, size_t match_len) {
+	if (*out >= dst_cap) {
+		return false;
+	}
+	size_t token = *out;
+	dst[(*out)++] = ((num_literals < 15 ? num_literals : 15) << 4);
+	if (num_literals >= 15 && !lz_put_length(dst, dst_cap, out, num_literals - 15)) {
+		return false;
+	}
+	if (*out + num_literals > dst_cap) {
+		return false;
+	}
+	memcpy(dst + *out, literals, num_literals);
+	*out += num_literals;
+
+	// Last sequence has no match
+	if (match_len == 0) {
+		return true;
+	}
+	if (*out + 2 > dst_cap) {
+		return false;
+	}
+	dst[(*out)++] = offset & 0xFF;
+	dst[(*out)++] = offset >> 8;
+	match_len -= LZ_MIN_MATCH;
+	dst[token] |= (match_len < 15 ? match_len : 15);
+	return match_len < 15 || lz_put_length(dst, dst_cap, out, match_len - 15);
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t dst_cap) {
+	const uint8_t *in = src;
+	uint8_t *out_buf = dst;
+	uint32_t table[1 << LZ_HASH_BITS];
+	size_t anchor = 0;
+	size_t out = 0;
+
+	memset(table, 0, sizeof(table));
+	size_t i = 0;
+	while (i + LZ_MIN_MATCH <= len) {
+		uint32_t hash = lz_hash(in + i);
+		size_t candidate = table[hash];
+		table[hash] = i;
+		if (candidate >= i || i - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, in + i, LZ_MIN_MATCH)) {
+			i++;
+			continue;
+		}
+
+		size_t match_len = LZ_MIN_MATCH;
+		while (i + match_len < len && in[candidate + match_len] == in[i + match_len]) {
+			match_len++;
+		}
+		if (!lz_put_sequence(out_buf, dst_cap, &out, in + anchor, i - anchor, i - candidate, match_len)) {
+			return 0;
+		}
+		i += match_len;
+		anchor = i;
+	}
+	if (!lz_put_sequence(out_buf, dst_cap, &out, in + anchor, len - anchor, 0, 0)) {
+		return 0;
+	}
+	return out;
+}
+
+// returns false if the length of a run could not be read completely
+static bool lz_get_length(const uint8_t *src, size_t len, size_t *in, size_t *run) {
+	uint8_t byte;
+	do {
+		if (*in >= len) {
+			return false;
+		}
+		byte = src[(*in)++];
+		*run += byte;
+	} while (byte == 255);
+	return true;
+}
+
+long lz_decompress(const void *src, size_t len, void *dst, size_t dst_cap) {
+	const uint8_t *in_buf = src;
+	uint8_t *out_buf = dst;
+	size_t in = 0;
+	size_t out = 0;
+
+	while (in < len) {
+		uint8_t token = in_buf[in++];
+		size_t num_literals = token >> 4;
+		if (num_literals == 15 && !lz_get_length(in_buf, len, &in, &num_literals)) {
+			return -1;
+		}
+		if (num_literals > len - in || num_literals > dst_cap - out) {
+			return -1;
+		}
+		memcpy(out_buf + out, in_buf + in, num_literals);
+		in += num_literals;
+		out += num_literals;
+		if (in == len) {
+			break;
+		}
+
+		if (len - in < 2) {
+			return -1;
+		}
+		size_t offset = in_buf[in] | (in_buf[in + 1] << 8);
+		in += 2;
+		size_t match_len = token & 0xF;
+		if (match_len == 15 && !lz_get_length(in_buf, len, &in, &match_len)) {
+			return -1;
+		}
+		match_len += LZ_MIN_MATCH;
+		if (offset == 0 || offset > out || match_len > dst_cap - out) {
+			return -1;
+		}
+		// Matches may overlap the bytes they produce
+		for (size_t j = 0; j < match_len; j++) {
+			out_buf[out + j] = out_buf[out - offset + j];
+		}
+		out += match_len;
+	}
+	return out;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Sparse files.
+ *
+ * Seeking past the end of a file and writing there leaves a hole: the blocks
+ * in between are not allocated and read back as zeros. A FAT entry flagged
+ * with FAT_HOLE links to the next allocated block of the file, and the number
+ * of unallocated blocks in between is kept in a table reserved at the end of
+ * the disk, holding one length per data block. A hole at the very beginning of
+ * a file is kept in its root directory entry instead.
+ *
+ * The table is reserved the first time a hole is created, so that disks
+ * without sparse files keep the layout of fs_make.x.
+ */
+
+// Hole lengths (NULL if the disk has no table)
+static uint16_t *hole_table;
+
+int hole_format(void) {
+	int num_blocks = (superblk.num_data_blocks * sizeof(uint16_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	int start = reserve_data_blocks(num_blocks);
+	if (start == -1) {
+		fprintf(stderr, "Not enough free space at the end of the disk for hole lengths\n");
+		return -1;
+	}
+	superblk.hole_start = start;
+	superblk.hole_blocks = num_blocks;
+
+	hole_table = block_alloc(num_blocks);
+	if (hole_table == NULL) {
+		fprintf(stderr, "Malloc failed");
+		return -1;
+	}
+	memset(hole_table, 0, (size_t)num_blocks * BLOCK_SIZE);
+	return hole_store();
+}
+
+int hole_load(void) {
+	hole_table = load_data_blocks(superblk.hole_start, superblk.hole_blocks);
+	if (hole_table == NULL) {
+		fprintf(stderr, "Could not read from disk (hole lengths)\n");
+		return -1;
+	}
+	return 0;
+}
+
+int hole_store(void) {
+	if (hole_table == NULL) {
+		return 0;
+	}
+	if (store_data_blocks(superblk.hole_start, superblk.hole_blocks, hole_table) == -1) {
+		fprintf(stderr, "Could not write to disk (hole lengths)\n");
+		return -1;
+	}
+	return 0;
+}
+
+void hole_unload(void) {
+	unload_data_blocks(hole_table);
+	hole_table = NULL;
+}
+
+uint16_t hole_get(int data_blk) {
+	if (hole_table == NULL || data_blk < 0 || data_blk >= superblk.num_data_blocks) {
+		return 0;
+	}
+	return hole_table[data_blk];
+}
+
+void hole_set(int data_blk, uint16_t len) {
+	if (hole_table == NULL || hole_table[data_blk] == len) {
+		return;
+	}
+	hole_table[data_blk] = len;
+	journal_note_hole(data_blk);
+	chain_gen++;
+}
+
+// returns -1 if the hole table could not be reserved
+int sparse_enable(void) {
+	if (superblk.features & FS_FEATURE_SPARSE) {
+		return 0;
+	}
+	return fs_enable(FS_FEATURE_SPARSE);
+}
@@ -0,0 +1,130 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Disks striped over several backing files.
+ *
+ * A single disk file caps the bandwidth of the disk at that of one file on one
+ * host device. fs_stripe() copies a disk to one whose blocks are spread over
+ * several backing files, possibly on different devices, a stripe unit of
+ * consecutive blocks in each file in turn (see block_disk_stripe()), and
+ * records the layout in its superblock with FS_FEATURE_STRIPE. The superblock
+ * stays at the start of the first file, named after the disk, so fs_mount()
+ * reads it as for any disk and then opens the other files before reading
+ * anything else. Reads and writes of runs of blocks spanning several stripe
+ * units are split by the disk layer into one transfer per file, all of them
+ * outstanding at once.
+ *
+ * Nothing above the disk layer knows about the layout: block numbers, the FAT
+ * and the superblock fields other than the layout are the same as on the disk
+ * that was copied. Copying a disk with a single backing file turns striping
+ * off.
+ */
+
+// returns -1 if the disk file cannot be read or holds no file system
+// otherwise, reads the superblock of an unmounted or synced disk
+static int stripe_read_superblock(const char *diskname, struct superblock *sb) {
+	int fd = open(diskname, O_RDONLY);
+	if (fd == -1) {
+		perror("open");
+		return -1;
+	}
+	ssize_t ret = pread(fd, sb, sizeof(*sb), 0);
+	close(fd);
+	if (ret != sizeof(*sb) || sb->signature != SB_EXPECTED_SIG) {
+		fprintf(stderr, "No file system on disk '%s'\n", diskname);
+		return -1;
+	}
+	return 0;
+}
+
+// returns -1 if the disk file cannot be read or holds no file system
+// otherwise, sets the number of backing files of a disk and its stripe unit
+int stripe_layout(const char *diskname, int *num_stripes, int *stripe_unit) {
+	struct superblock sb;
+	if (stripe_read_superblock(diskname, &sb) == -1) {
+		return -1;
+	}
+	*num_stripes = 1;
+	*stripe_unit = 1;
+	if (sb.features & FS_FEATURE_STRIPE) {
+		*num_stripes = sb.stripe_count;
+		*stripe_unit = sb.stripe_unit;
+	}
+	return 0;
+}
+
+// returns -1 if the backing files of the mounted disk cannot be opened
+// otherwise, has blocks read from and written to every backing file
+int stripe_load(void) {
+	if (!(superblk.features & FS_FEATURE_STRIPE)) {
+		return 0;
+	}
+	return block_disk_stripe(superblk.stripe_count, superblk.stripe_unit);
+}
+
+int fs_stripe(const char *diskname, const char *striped_name, int num_stripes, int stripe_unit) {
+	TP_SCOPE(TP_FS_STRIPE, -1, 0, num_stripes);
+	struct superblock sb;
+	int cur_stripes, cur_unit;
+
+	if (num_stripes < 1 || num_stripes > BLOCK_STRIPES_MAX || stripe_unit < 1 || stripe_unit > UINT16_MAX) {
+		fprintf(stderr, "Invalid layout (%d stripes of %d blocks)\n", num_stripes, stripe_unit);
+		return -1;
+	}
+	if (strcmp(diskname, striped_name) == 0) {
+		fprintf(stderr, "Cannot stripe a disk onto itself\n");
+		return -1;
+	}
+
+	// A mounted disk is copied with its changes so far
+	if (FS_mounted && !FS_rdonly && fs_sync() == -1) {
+		return -1;
+	}
+	if (stripe_read_superblock(diskname, &sb) == -1) {
+		return -1;
+	}
+	cur_stripes = 1;
+	cur_unit = 1;
+	if (sb.features & FS_FEATURE_STRIPE) {
+		cur_stripes = sb.stripe_count;
+		cur_unit = sb.stripe_unit;
+	}
+
+	int copied = block_disk_copy(diskname, cur_stripes, cur_unit, striped_name, num_stripes, stripe_unit);
+	if (copied == -1) {
+		return -1;
+	}
+
+	// Record the new layout in the superblock of the copy
+	sb.features &= ~FS_FEATURE_STRIPE;
+	sb.stripe_count = 0;
+	sb.stripe_unit = 0;
+	if (num_stripes > 1) {
+		sb.features |= FS_FEATURE_STRIPE;
+		sb.stripe_count = num_stripes;
+		sb.stripe_unit = stripe_unit;
+	}
+	int fd = open(striped_name, O_WRONLY);
+	if (fd == -1) {
+		perror("open");
+		return -1;
+	}
+	ssize_t ret = pwrite(fd, &sb, sizeof(sb), 0);
+	if (ret != sizeof(sb) || fdatasync(fd) == -1) {
+		perror("pwrite");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	return copied;
+}
@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fs_internal.h"
+
+/*
+ * Tail packing.
+ *
+ * The last partial block of a file (the whole file, for a file smaller than a
+ * block) is its tail. When the last descriptor of a file is closed, a tail of
+ * at most TAIL_MAX bytes is moved out of its own data block into a packed
+ * block shared with the tails of other files, and the data block is freed.
+ * The root directory entry records the packed block and the offset of the
+ * tail in it; its length follows from the file size. Packed blocks are marked
+ * with FAT_TAIL in the FAT.
+ *
+ * Which parts of a packed block are in use is found from the root directory
+ * entries pointing at it, so no other table is needed. A packed block is freed
+ * when the last tail leaves it. Before a file with a packed tail is written
+ * to, the tail is moved back into a block of its own.
+ *
+ * The last packed block read is cached, so that reading many small files
+ * packed together reads each packed block once.
+ */
+
+// Tails no longer than this are packed
+#define TAIL_MAX (BLOCK_SIZE / 2)
+
+// Last packed block read (block 0 if none)
+static struct {
+	int data_blk;
+	char data[BLOCK_SIZE] BLOCK_ALIGNED;
+} tail_cache;
+
+// returns contents of packed block data_blk (NULL if reading failed)
+static char *tail_block_get(int data_blk) {
+	if (tail_cache.data_blk != data_blk) {
+		if (read_data_block(data_blk, tail_cache.data) == -1) {
+			tail_cache.data_blk = 0;
+			return NULL;
+		}
+		tail_cache.data_blk = data_blk;
+	}
+	return tail_cache.data;
+}
+
+void tail_forget(int data_blk) {
+	if (tail_cache.data_blk == data_blk) {
+		tail_cache.data_blk = 0;
+	}
+}
+
+bool file_has_tail(int rootdir_idx) {
+	return rootdir_arr[rootdir_idx].tail_block != 0;
+}
+
+// returns length of the tail of a file
+static uint32_t tail_len(int rootdir_idx) {
+	return rootdir_arr[rootdir_idx].file_size % BLOCK_SIZE;
+}
+
+int tail_read(int rootdir_idx, size_t offset, void *buf, size_t count) {
+	char *data = tail_block_get(rootdir_arr[rootdir_idx].tail_block);
+	if (data == NULL) {
+		fprintf(stderr, "Could not read from disk (packed tail)\n");
+		return -1;
+	}
+	memcpy(buf, data + rootdir_arr[rootdir_idx].tail_offset + offset, count);
+	return 0;
+}
+
+// returns -1 if a tail of len bytes fits in no packed block and no block is free
+// otherwise, returns the packed block the tail goes to and sets *offset
+static int tail_find_space(uint32_t len, uint16_t *offset) {
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		int data_blk = rootdir_arr[i].tail_block;
+		if (rootdir_arr[i].filename[0] == '\0' || data_blk == 0) {
+			continue;
+		}
+
+		// Look for the first gap long enough between the tails of this block
+		uint32_t gap_start = 0;
+		while (gap_start + len <= BLOCK_SIZE) {
+			uint32_t gap_end = gap_start + len;
+			for (int j = 0; j < FS_FILE_MAX_COUNT; j++) {
+				if (rootdir_arr[j].filename[0] == '\0' || rootdir_arr[j].tail_block != data_blk) {
+					continue;
+				}
+				uint32_t start = rootdir_arr[j].tail_offset;
+				uint32_t end = start + tail_len(j);
+				if (start < gap_end && end > gap_start) {
+					gap_end = 0;
+					gap_start = end;
+					break;
+				}
+			}
+			if (gap_end != 0) {
+				*offset = gap_start;
+				return data_blk;
+			}
+		}
+	}
+
+	// Start a new packed block
+	int data_blk = find_next_empty_entry(superblk.num_data_blocks);
+	if (data_blk == -1) {
+		return -1;
+	}
+	set_FAT_entry(data_blk, FAT_TAIL);
+	// Whatever the block held before is not read back (it may be discarded)
+	tail_cache.data_blk = data_blk;
+	memset(tail_cache.data, 0, BLOCK_SIZE);
+	*offset = 0;
+	return data_blk;
+}
+
+void tail_release(int rootdir_idx) {
+	int data_blk = rootdir_arr[rootdir_idx].tail_block;
+	if (data_blk == 0) {
+		return;
+	}
+	rootdir_arr[rootdir_idx].tail_block = 0;
+	rootdir_arr[rootdir_idx].tail_offset = 0;
+	dirent_changed(rootdir_idx);
+
+	for (int i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		if (rootdir_arr[i].filename[0] != '\0' && rootdir_arr[i].tail_block == data_blk) {
+			return;
+		}
+	}
+	set_FAT_entry(data_blk, 0);
+	tail_forget(data_blk);
+}
+
+int tail_pack(int rootdir_idx) {
+	struct root_directory *entry = &rootdir_arr[rootdir_idx];
+	uint32_t len = tail_len(rootdir_idx);
+	if (!(superblk.features & FS_FEATURE_TAIL) || entry->tail_block != 0 || len == 0 || len > TAIL_MAX
+			|| file_is_compressed(rootdir_idx)) {
+		return 0;
+	}
+
+	// Only a last block that belongs to this file alone can be given up
+	struct chain_pos pos;
+	chain_seek(&pos, rootdir_idx, entry->file_size / BLOCK_SIZE);
+	if (pos.cur == FAT_EOC || pos.cur == FAT_HOLE || data_blk_shared(pos.cur) || get_FAT_entry(pos.cur) != FAT_EOC) {
+		return 0;
+	}
+
+	char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+	if (read_data_block(pos.cur, bounce_buf) == -1) {
+		return -1;
+	}
+	uint16_t offset;
+	int packed_blk = tail_find_space(len, &offset);
+	if (packed_blk == -1) {
+		return -1;
+	}
+	char *data = tail_block_get(packed_blk);
+	if (data == NULL) {
+		return -1;
+	}
+	memcpy(data + offset, bounce_buf, len);
+	if (write_data_block(packed_blk, data) == -1) {
+		fprintf(stderr, "Could not write to disk (packed tail)\n");
+		tail_forget(packed_blk);
+		return -1;
+	}
+
+	// File now ends at the block before its tail
+	if (pos.prev == -1) {
+		entry->first_data_block_index = FAT_EOC;
+		entry->lead_hole = 0;
+	} else {
+		if (FAT_IS_HOLE(get_FAT_entry(pos.prev))) {
+			hole_set(pos.prev, 0);
+		}
+		set_FAT_entry(pos.prev, FAT_EOC);
+	}
+	set_FAT_entry(pos.cur, 0);
+	entry->tail_block = packed_blk;
+	entry->tail_offset = offset;
+	dirent_changed(rootdir_idx);
+	return 0;
+}
+
+int tail_unpack(int rootdir_idx) {
+	if (!file_has_tail(rootdir_idx)) {
+		return 0;
+	}
+
+	char bounce_buf[BLOCK_SIZE] BLOCK_ALIGNED;
+	memset(bounce_buf, 0, BLOCK_SIZE);
+	if (tail_read(rootdir_idx, 0, bounce_buf, tail_len(rootdir_idx)) == -1) {
+		return -1;
+	}
+
+	struct chain_pos pos;
+	bool fresh;
+	if (chain_seek_for_write(&pos, rootdir_idx, rootdir_arr[rootdir_idx].file_size / BLOCK_SIZE) == -1) {
+		return -1;
+	}
+	int data_blk = chain_prepare_write(&pos, false, &fresh);
+	if (data_blk == -1) {
+		return -1;
+	}
+	if (write_data_block(data_blk, bounce_buf) == -1) {
+		fprintf(stderr, "Could not write to disk (unpacked tail)\n");
+		return -1;
+	}
+	tail_release(rootdir_idx);
+	return 0;
+}
@@ -0,0 +1,362 @@
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define FS_TRACE_NO_REDIRECT
+#include "fs_trace.h"
+
+/*
+ * Recording of fs.h calls into a trace.
+ *
+ * A trace is a text file. Its first line is "# fs trace <version>", and every
+ * other line is one call, in the order calls returned, with tab-separated
+ * fields:
+ *
+ *   <start (us)> <thread> <duration (us)> <result> <operation> [<argument>...]
+ *
+ * The start time is counted from the start of the recording, and threads are
+ * numbered from 1 in the order they first call the API. Operations and their
+ * arguments are:
+ *
+ *   MOUNT <diskname> [<flags>], BUFFER_ALLOC <size>, UMOUNT, INFO,
+ *   ENABLE <feature>, SYNC, PERSIST [<diskname>], DISCARD,
+ *   COPY_DISK <diskname> <copy_name>,
+ *   STRIPE <diskname> <striped_name> <stripes> <stripe unit>, FRAG_REPORT,
+ *   DEFRAG <time budget (ms)>, CHECK <flags>, CREATE <filename>,
+ *   DELETE <filename>, CLONE <src> <dst>, SET_COMPRESSION <filename> <on>,
+ *   IMPORT <number of files>, LS, READDIR <cursor>, STAT_MANY <max entries>,
+ *   OPEN <filename>, CLOSE <fd>, STAT <fd>, SEEK <fd> <offset>,
+ *   WRITE <fd> <count>, READ <fd> <count>,
+ *   SENDFILE <fd> <count> <offset> <out_fd>, TRACEPOINTS_ENABLE <on>,
+ *   TRACEPOINTS_DUMP <filename>
+ *
+ * There is one per call of fs.h. Flags and features are in hexadecimal, and
+ * MOUNT has flags for fs_mount_flags() only. The result of BUFFER_ALLOC is 0,
+ * or -1 if the allocation failed, and READDIR records the cursor it was called
+ * with. Only sizes are recorded, never data. Lines are written under a lock,
+ * so that threads can share a trace.
+ */
+
+static struct {
+	FILE *file;
+	struct timespec start;
+	int num_threads;
+	pthread_mutex_t lock;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+static __thread int trace_thread_id;
+
+// returns microseconds elapsed since the recording started
+static long trace_now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - trace.start.tv_sec) * 1000000L + (now.tv_nsec - trace.start.tv_nsec) / 1000;
+}
+
+static void trace_atexit(void) {
+	fs_trace_stop();
+}
+
+// starts recording to the file named by FS_TRACE, if set
+static void trace_env_start(void) {
+	const char *trace_filename = getenv("FS_TRACE");
+	if (trace_filename != NULL && trace_filename[0] != '\0') {
+		fs_trace_start(trace_filename);
+	}
+}
+
+int fs_trace_start(const char *trace_filename) {
+	static bool atexit_registered;
+	pthread_mutex_lock(&trace.lock);
+	if (trace.file != NULL || trace_filename == NULL) {
+		pthread_mutex_unlock(&trace.lock);
+		return -1;
+	}
+	FILE *file = fopen(trace_filename, "w");
+	if (file == NULL) {
+		perror("fopen");
+		pthread_mutex_unlock(&trace.lock);
+		return -1;
+	}
+	fprintf(file, "# fs trace %d\n", FS_TRACE_VERSION);
+	clock_gettime(CLOCK_MONOTONIC, &trace.start);
+	// Calls check for a trace file without taking the lock
+	__atomic_store_n(&trace.file, file, __ATOMIC_RELEASE);
+	if (!atexit_registered) {
+		atexit(trace_atexit);
+		atexit_registered = true;
+	}
+	pthread_mutex_unlock(&trace.lock);
+	return 0;
+}
+
+int fs_trace_stop(void) {
+	pthread_mutex_lock(&trace.lock);
+	if (trace.file == NULL) {
+		pthread_mutex_unlock(&trace.lock);
+		return -1;
+	}
+	int ret = fclose(trace.file);
+	__atomic_store_n(&trace.file, NULL, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&trace.lock);
+	return (ret == 0) ? 0 : -1;
+}
+
+// returns the start time of a call (-1 if calls are not being recorded)
+static long trace_begin(void) {
+	pthread_once(&trace_env_once, trace_env_start);
+	if (__atomic_load_n(&trace.file, __ATOMIC_ACQUIRE) == NULL) {
+		return -1;
+	}
+	return trace_now_us();
+}
+
+// records a call that started at start and returned ret
+static void trace_end(long start, int ret, const char *fmt, ...) {
+	if (start == -1) {
+		return;
+	}
+	long duration = trace_now_us() - start;
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace.file == NULL) {
+		pthread_mutex_unlock(&trace.lock);
+		return;
+	}
+	if (trace_thread_id == 0) {
+		trace_thread_id = ++trace.num_threads;
+	}
+	fprintf(trace.file, "%ld\t%d\t%ld\t%d\t", start, trace_thread_id, duration, ret);
+	va_list args;
+	va_start(args, fmt);
+	vfprintf(trace.file, fmt, args);
+	va_end(args);
+	fputc('\n', trace.file);
+	pthread_mutex_unlock(&trace.lock);
+}
+
+int trace_fs_mount(const char *diskname) {
+	long start = trace_begin();
+	int ret = fs_mount(diskname);
+	trace_end(start, ret, "MOUNT\t%s", diskname ? diskname : "");
+	return ret;
+}
+
+int trace_fs_mount_flags(const char *diskname, unsigned int flags) {
+	long start = trace_begin();
+	int ret = fs_mount_flags(diskname, flags);
+	trace_end(start, ret, "MOUNT\t%s\t%#x", diskname ? diskname : "", flags);
+	return ret;
+}
+
+void *trace_fs_buffer_alloc(size_t size) {
+	long start = trace_begin();
+	void *buf = fs_buffer_alloc(size);
+	trace_end(start, buf ? 0 : -1, "BUFFER_ALLOC\t%zu", size);
+	return buf;
+}
+
+int trace_fs_umount(void) {
+	long start = trace_begin();
+	int ret = fs_umount();
+	trace_end(start, ret, "UMOUNT");
+	return ret;
+}
+
+int trace_fs_info(void) {
+	long start = trace_begin();
+	int ret = fs_info();
+	trace_end(start, ret, "INFO");
+	return ret;
+}
+
+int trace_fs_enable(unsigned int feature) {
+	long start = trace_begin();
+	int ret = fs_enable(feature);
+	trace_end(start, ret, "ENABLE\t%#x", feature);
+	return ret;
+}
+
+int trace_fs_sync(void) {
+	long start = trace_begin();
+	int ret = fs_sync();
+	trace_end(start, ret, "SYNC");
+	return ret;
+}
+
+int trace_fs_persist(const char *diskname) {
+	long start = trace_begin();
+	int ret = fs_persist(diskname);
+	if (diskname == NULL) {
+		trace_end(start, ret, "PERSIST");
+	} else {
+		trace_end(start, ret, "PERSIST\t%s", diskname);
+	}
+	return ret;
+}
+
+int trace_fs_discard(void) {
+	long start = trace_begin();
+	int ret = fs_discard();
+	trace_end(start, ret, "DISCARD");
+	return ret;
+}
+
+int trace_fs_copy_disk(const char *diskname, const char *copy_name) {
+	long start = trace_begin();
+	int ret = fs_copy_disk(diskname, copy_name);
+	trace_end(start, ret, "COPY_DISK\t%s\t%s", diskname ? diskname : "", copy_name ? copy_name : "");
+	return ret;
+}
+
+int trace_fs_stripe(const char *diskname, const char *striped_name, int num_stripes, int stripe_unit) {
+	long start = trace_begin();
+	int ret = fs_stripe(diskname, striped_name, num_stripes, stripe_unit);
+	trace_end(start, ret, "STRIPE\t%s\t%s\t%d\t%d", diskname ? diskname : "", striped_name ? striped_name : "", num_stripes, stripe_unit);
+	return ret;
+}
+
+int trace_fs_frag_report(struct fs_frag_report *report) {
+	long start = trace_begin();
+	int ret = fs_frag_report(report);
+	trace_end(start, ret, "FRAG_REPORT");
+	return ret;
+}
+
+int trace_fs_defrag(unsigned int time_budget_ms) {
+	long start = trace_begin();
+	int ret = fs_defrag(time_budget_ms);
+	trace_end(start, ret, "DEFRAG\t%u", time_budget_ms);
+	return ret;
+}
+
+int trace_fs_check(unsigned int flags, struct fs_check_report *report) {
+	long start = trace_begin();
+	int ret = fs_check(flags, report);
+	trace_end(start, ret, "CHECK\t%#x", flags);
+	return ret;
+}
+
+int trace_fs_create(const char *filename) {
+	long start = trace_begin();
+	int ret = fs_create(filename);
+	trace_end(start, ret, "CREATE\t%s", filename ? filename : "");
+	return ret;
+}
+
+int trace_fs_delete(const char *filename) {
+	long start = trace_begin();
+	int ret = fs_delete(filename);
+	trace_end(start, ret, "DELETE\t%s", filename ? filename : "");
+	return ret;
+}
+
+int trace_fs_clone(const char *src, const char *dst) {
+	long start = trace_begin();
+	int ret = fs_clone(src, dst);
+	trace_end(start, ret, "CLONE\t%s\t%s", src ? src : "", dst ? dst : "");
+	return ret;
+}
+
+int trace_fs_set_compression(const char *filename, int on) {
+	long start = trace_begin();
+	int ret = fs_set_compression(filename, on);
+	trace_end(start, ret, "SET_COMPRESSION\t%s\t%d", filename ? filename : "", on);
+	return ret;
+}
+
+int trace_fs_import(const char **host_filenames, int num_files) {
+	long start = trace_begin();
+	int ret = fs_import(host_filenames, num_files);
+	trace_end(start, ret, "IMPORT\t%d", num_files);
+	return ret;
+}
+
+int trace_fs_ls(void) {
+	long start = trace_begin();
+	int ret = fs_ls();
+	trace_end(start, ret, "LS");
+	return ret;
+}
+
+int trace_fs_readdir(int *cursor, struct fs_dirent *entry) {
+	int cursor_before = cursor ? *cursor : -1;
+	long start = trace_begin();
+	int ret = fs_readdir(cursor, entry);
+	trace_end(start, ret, "READDIR\t%d", cursor_before);
+	return ret;
+}
+
+int trace_fs_stat_many(struct fs_dirent *entries, int max_entries) {
+	long start = trace_begin();
+	int ret = fs_stat_many(entries, max_entries);
+	trace_end(start, ret, "STAT_MANY\t%d", max_entries);
+	return ret;
+}
+
+int trace_fs_open(const char *filename) {
+	long start = trace_begin();
+	int ret = fs_open(filename);
+	trace_end(start, ret, "OPEN\t%s", filename ? filename : "");
+	return ret;
+}
+
+int trace_fs_close(int fd) {
+	long start = trace_begin();
+	int ret = fs_close(fd);
+	trace_end(start, ret, "CLOSE\t%d", fd);
+	return ret;
+}
+
+int trace_fs_stat(int fd) {
+	long start = trace_begin();
+	int ret = fs_stat(fd);
+	trace_end(start, ret, "STAT\t%d", fd);
+	return ret;
+}
+
+int trace_fs_lseek(int fd, size_t offset) {
+	long start = trace_begin();
+	int ret = fs_lseek(fd, offset);
+	trace_end(start, ret, "SEEK\t%d\t%zu", fd, offset);
+	return ret;
+}
+
+int trace_fs_write(int fd, void *buf, size_t count) {
+	long start = trace_begin();
+	int ret = fs_write(fd, buf, count);
+	trace_end(start, ret, "WRITE\t%d\t%zu", fd, count);
+	return ret;
+}
+
+int trace_fs_read(int fd, void *buf, size_t count) {
+	long start = trace_begin();
+	int ret = fs_read(fd, buf, count);
+	trace_end(start, ret, "READ\t%d\t%zu", fd, count);
+	return ret;
+}
+
+int trace_fs_sendfile(int fd, int out_fd, size_t offset, size_t count) {
+	long start = trace_begin();
+	int ret = fs_sendfile(fd, out_fd, offset, count);
+	trace_end(start, ret, "SENDFILE\t%d\t%zu\t%zu\t%d", fd, count, offset, out_fd);
+	return ret;
+}
+
+int trace_fs_tracepoints_enable(int on) {
+	long start = trace_begin();
+	int ret = fs_tracepoints_enable(on);
+	trace_end(start, ret, "TRACEPOINTS_ENABLE\t%d", on);
+	return ret;
+}
+
+int trace_fs_tracepoints_dump(const char *filename) {
+	long start = trace_begin();
+	int ret = fs_tracepoints_dump(filename);
+	trace_end(start, ret, "TRACEPOINTS_DUMP\t%s", filename ? filename : "");
+	return ret;
+}
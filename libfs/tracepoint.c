@@ -0,0 +1,175 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "tracepoint.h"
+
+/*
+ * Recording of tracepoint events into per-thread ring buffers.
+ *
+ * Each thread records into its own ring, found through a thread-local pointer,
+ * so recording is a clock read and a 32-byte store. The ring's head counts the
+ * events ever recorded; it is published with a release store after the event
+ * is written, and a dump reads it with an acquire load and copies the last
+ * TP_RING_EVENTS events before it.
+ *
+ * Rings are pushed on a global list with a compare-and-swap the first time
+ * their thread records, and are never freed: a thread that exits leaves its
+ * events behind to be dumped.
+ */
+
+// Events kept per thread (2 MiB)
+#define TP_RING_EVENTS 65536
+
+#define TP_NAME(id, name) name,
+static const char *tp_names[TP_NUM_EVENTS] = {
+	TP_EVENTS(TP_NAME)
+};
+#undef TP_NAME
+
+const char *tp_event_name(unsigned int id) {
+	return (id < TP_NUM_EVENTS) ? tp_names[id] : NULL;
+}
+
+#if FS_TRACEPOINTS
+
+struct tp_ring {
+	struct tp_ring *next;
+	uint32_t thread;
+	uint64_t head;
+	struct tp_event events[TP_RING_EVENTS];
+};
+
+bool tp_enabled;
+
+static struct tp_ring *tp_rings;
+static uint32_t tp_num_threads;
+static __thread struct tp_ring *tp_ring_self;
+static __thread bool tp_ring_failed;
+
+static pthread_once_t tp_env_once = PTHREAD_ONCE_INIT;
+static const char *tp_env_filename;
+
+// returns the ring of the calling thread, allocating it on first use (NULL if
+// it cannot be allocated)
+static struct tp_ring *tp_ring_get(void) {
+	if (tp_ring_self != NULL || tp_ring_failed) {
+		return tp_ring_self;
+	}
+	struct tp_ring *ring = malloc(sizeof(struct tp_ring));
+	if (ring == NULL) {
+		// Events of this thread are dropped rather than failing calls
+		tp_ring_failed = true;
+		return NULL;
+	}
+	ring->thread = __atomic_add_fetch(&tp_num_threads, 1, __ATOMIC_RELAXED);
+	ring->head = 0;
+	ring->next = __atomic_load_n(&tp_rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&tp_rings, &ring->next, ring, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+	tp_ring_self = ring;
+	return ring;
+}
+
+void tp_record(enum tp_id id, int phase, int fd, int64_t arg, int64_t count) {
+	struct tp_ring *ring = tp_ring_get();
+	if (ring == NULL) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	struct tp_event *event = &ring->events[ring->head % TP_RING_EVENTS];
+	event->time_ns = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	event->id = id;
+	event->phase = phase;
+	event->padding = 0;
+	event->fd = fd;
+	event->arg = arg;
+	event->count = count;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+static void tp_atexit(void) {
+	fs_tracepoints_dump(tp_env_filename);
+}
+
+// turns tracepoints on if FS_TRACEPOINTS names a file to dump events to
+static void tp_env_start(void) {
+	tp_env_filename = getenv("FS_TRACEPOINTS");
+	if (tp_env_filename != NULL && tp_env_filename[0] != '\0') {
+		fs_tracepoints_enable(1);
+		atexit(tp_atexit);
+	}
+}
+
+void tp_mount_hook(void) {
+	pthread_once(&tp_env_once, tp_env_start);
+}
+
+int fs_tracepoints_enable(int on) {
+	__atomic_store_n(&tp_enabled, on != 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+int fs_tracepoints_dump(const char *filename) {
+	if (filename == NULL) {
+		return -1;
+	}
+	FILE *file = fopen(filename, "w");
+	if (file == NULL) {
+		perror("fopen");
+		return -1;
+	}
+
+	// Header is rewritten once the events are counted
+	struct tp_dump_header header = { .version = TP_DUMP_VERSION };
+	memcpy(header.magic, TP_DUMP_MAGIC, sizeof(header.magic));
+	bool failed = fwrite(&header, sizeof(header), 1, file) != 1;
+
+	for (struct tp_ring *ring = __atomic_load_n(&tp_rings, __ATOMIC_ACQUIRE); ring != NULL && !failed; ring = ring->next) {
+		uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		uint64_t first = (head > TP_RING_EVENTS) ? head - TP_RING_EVENTS : 0;
+		for (uint64_t i = first; i < head; i++) {
+			struct tp_dump_event dump_event = {
+				.thread = ring->thread,
+				.event = ring->events[i % TP_RING_EVENTS],
+			};
+			if (fwrite(&dump_event, sizeof(dump_event), 1, file) != 1) {
+				failed = true;
+				break;
+			}
+			header.num_events++;
+		}
+		header.num_threads++;
+	}
+
+	if (!failed) {
+		failed = fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1;
+	}
+	if (fclose(file) != 0 || failed) {
+		fprintf(stderr, "fs_tracepoints_dump: cannot write %s\n", filename);
+		return -1;
+	}
+	return header.num_events;
+}
+
+#else
+
+void tp_mount_hook(void) {
+}
+
+int fs_tracepoints_enable(int on) {
+	(void)on;
+	return -1;
+}
+
+int fs_tracepoints_dump(const char *filename) {
+	(void)filename;
+	return -1;
+}
+
+#endif /* FS_TRACEPOINTS */
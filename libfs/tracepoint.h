@@ -0,0 +1,162 @@
+#ifndef _TRACEPOINT_H
+#define _TRACEPOINT_H
+
+/*
+ * Tracepoints at the entry and exit of fs.h calls, of block I/O and of a few
+ * internal steps worth seeing on a timeline (free block search, chain walks,
+ * journal commits).
+ *
+ * Tracepoints are compiled in unless libfs is built with FS_TRACEPOINTS=0
+ * (make TRACEPOINTS=0), and record nothing until fs_tracepoints_enable() turns
+ * them on. A disabled tracepoint costs a relaxed load and a predicted branch.
+ *
+ * An enabled tracepoint appends a struct tp_event to a ring buffer owned by the
+ * calling thread, so that recording takes no lock: the ring is allocated and
+ * linked into a global list the first time the thread records, and only that
+ * thread ever writes it. Once a ring is full, new events overwrite the oldest.
+ * fs_tracepoints_dump() copies the rings to a file which fs_tracedump.x turns
+ * into Chrome trace JSON.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifndef FS_TRACEPOINTS
+#define FS_TRACEPOINTS 1
+#endif
+
+// Events, with the name they get on the timeline
+#define TP_EVENTS(X) \
+	X(TP_FS_MOUNT, "fs_mount") \
+	X(TP_FS_UMOUNT, "fs_umount") \
+	X(TP_FS_INFO, "fs_info") \
+	X(TP_FS_ENABLE, "fs_enable") \
+	X(TP_FS_SYNC, "fs_sync") \
+	X(TP_FS_PERSIST, "fs_persist") \
+	X(TP_FS_DISCARD, "fs_discard") \
+	X(TP_FS_COPY_DISK, "fs_copy_disk") \
+	X(TP_FS_STRIPE, "fs_stripe") \
+	X(TP_FS_FRAG_REPORT, "fs_frag_report") \
+	X(TP_FS_DEFRAG, "fs_defrag") \
+	X(TP_FS_CHECK, "fs_check") \
+	X(TP_FS_CREATE, "fs_create") \
+	X(TP_FS_DELETE, "fs_delete") \
+	X(TP_FS_CLONE, "fs_clone") \
+	X(TP_FS_SET_COMPRESSION, "fs_set_compression") \
+	X(TP_FS_IMPORT, "fs_import") \
+	X(TP_FS_READDIR, "fs_readdir") \
+	X(TP_FS_STAT_MANY, "fs_stat_many") \
+	X(TP_FS_LS, "fs_ls") \
+	X(TP_FS_OPEN, "fs_open") \
+	X(TP_FS_CLOSE, "fs_close") \
+	X(TP_FS_STAT, "fs_stat") \
+	X(TP_FS_LSEEK, "fs_lseek") \
+	X(TP_FS_WRITE, "fs_write") \
+	X(TP_FS_READ, "fs_read") \
+	X(TP_FS_SENDFILE, "fs_sendfile") \
+	X(TP_BLOCK_READ, "block_read") \
+	X(TP_BLOCK_WRITE, "block_write") \
+	X(TP_BLOCK_READ_MANY, "block_read_many") \
+	X(TP_BLOCK_WRITE_MANY, "block_write_many") \
+	X(TP_BLOCK_DISCARD, "block_discard") \
+	X(TP_FIND_EMPTY_ENTRY, "find_next_empty_entry") \
+	X(TP_CHAIN_SEEK, "chain_seek") \
+	X(TP_CHAIN_SEEK_FOR_WRITE, "chain_seek_for_write") \
+	X(TP_DELALLOC_COMMIT, "delalloc_commit") \
+	X(TP_WRITE_METADATA, "write_metadata") \
+	X(TP_JOURNAL_COMMIT, "journal_commit")
+
+#define TP_ENUM(id, name) id,
+enum tp_id {
+	TP_EVENTS(TP_ENUM)
+	TP_NUM_EVENTS
+};
+#undef TP_ENUM
+
+#define TP_PHASE_BEGIN 'B'
+#define TP_PHASE_END 'E'
+
+// One recorded event. @fd is -1 for events not about an open file, @arg is the
+// file offset of fs.h calls on a file descriptor and the first block of block
+// I/O, @count is the byte count of reads and writes and the block count of
+// multi-block I/O.
+struct tp_event {
+	uint64_t time_ns;
+	uint16_t id;
+	uint8_t phase;
+	uint8_t padding;
+	int32_t fd;
+	int64_t arg;
+	int64_t count;
+};
+_Static_assert(sizeof(struct tp_event) == 32, "tracepoint events are 32 bytes");
+
+// Header of files written by fs_tracepoints_dump(), followed by one struct
+// tp_dump_event per event, grouped by thread, oldest first within a thread
+#define TP_DUMP_MAGIC "FSTP"
+#define TP_DUMP_VERSION 1
+
+struct tp_dump_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t num_events;
+	uint32_t num_threads;
+};
+
+struct tp_dump_event {
+	uint32_t thread;
+	uint32_t padding;
+	struct tp_event event;
+};
+
+// returns the name of an event (NULL if @id is unknown)
+const char *tp_event_name(unsigned int id);
+
+// Turns tracepoints on the first time a file system is mounted, if environment
+// variable FS_TRACEPOINTS asks for it
+void tp_mount_hook(void);
+
+#if FS_TRACEPOINTS
+
+extern bool tp_enabled;
+
+void tp_record(enum tp_id id, int phase, int fd, int64_t arg, int64_t count);
+
+// Pair of events recorded by TP_SCOPE()
+struct tp_scope {
+	bool on;
+	enum tp_id id;
+	int fd;
+	int64_t arg;
+	int64_t count;
+};
+
+static inline void tp_scope_begin(struct tp_scope *scope, enum tp_id id, int fd, int64_t arg, int64_t count) {
+	scope->id = id;
+	scope->fd = fd;
+	scope->arg = arg;
+	scope->count = count;
+	tp_record(id, TP_PHASE_BEGIN, fd, arg, count);
+}
+
+static inline void tp_scope_end(struct tp_scope *scope) {
+	if (__builtin_expect(scope->on, 0)) {
+		tp_record(scope->id, TP_PHASE_END, scope->fd, scope->arg, scope->count);
+	}
+}
+
+// Records the entry of the enclosing function now and its exit when it returns,
+// whichever return it takes. Arguments are only evaluated if tracepoints are on.
+#define TP_SCOPE(id, fd, arg, count) \
+	struct tp_scope tp_scope __attribute__((cleanup(tp_scope_end))) = \
+		{ .on = __builtin_expect(__atomic_load_n(&tp_enabled, __ATOMIC_RELAXED), 0) }; \
+	if (tp_scope.on) \
+		tp_scope_begin(&tp_scope, (id), (fd), (arg), (count))
+
+#else
+
+#define TP_SCOPE(id, fd, arg, count) do { } while (0)
+
+#endif /* FS_TRACEPOINTS */
+
+#endif /* _TRACEPOINT_H */